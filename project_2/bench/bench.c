@@ -0,0 +1,355 @@
+/**
+ * @file bench.c
+ * @brief Micro-benchmarks of the sample kernels and of the filters using
+ *        them, at every kernel level supported by the processor.
+ *
+ * Usage: ./pnm_bench [image ...]
+ *
+ * Kernels are timed on synthetic buffers; filters on the given images,
+ * loaded again before each run, on one thread; geometric filters on
+ * synthetic 8192 x 8192 images, applied again and again to the same image.
+ * Filters are then timed at the best level with 2, 4... threads, up to one
+ * per processor.
+ *
+ * @author Pavlov Aleksandr (s2400691)
+ * @date 24.03.2025
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pnm.h"
+#include "filter.h"
+#include "kernel.h"
+
+/* ======= Constants ======= */
+
+#define SAMPLE_COUNT (16u << 20)
+#define REPEATS 8
+#define GEOMETRY_SIZE 8192u
+
+/* ======= Static Function Prototypes ======= */
+
+/**
+ * @brief Retrieves the time of a monotonic clock.
+ *
+ * @return
+ *     Time in seconds
+ */
+static double now(void);
+
+/**
+ * @brief Prints the throughput of a run.
+ *
+ * @param name Name of what was run.
+ * @param level Kernel level used.
+ * @param bytes Number of bytes processed by a repeat.
+ * @param seconds Time taken by all the repeats.
+ */
+static void report(
+   const char *name,
+   KernelLevel level,
+   size_t bytes,
+   double seconds
+);
+
+/**
+ * @brief Times the kernels at the current level.
+ *
+ * @param buffer Pointer to 4 * SAMPLE_COUNT samples.
+ */
+static void bench_kernels(uint8_t *buffer);
+
+/**
+ * @brief Times the filters at the current level on an image.
+ *
+ * @param filename Path to the image.
+ * @param threads Number of threads, set with pnm_set_threads.
+ *
+ * @return
+ *     0: Success
+ *    -1: Image cannot be loaded
+ */
+static int bench_filters(const char *filename, unsigned int threads);
+
+/**
+ * @brief Times the geometric filters at the current level on synthetic
+ *        GEOMETRY_SIZE x GEOMETRY_SIZE PGM and PPM images.
+ *
+ * @param threads Number of threads, set with pnm_set_threads.
+ *
+ * @return
+ *     0: Success
+ *    -1: Not enough memory
+ */
+static int bench_geometry(unsigned int threads);
+
+/**
+ * @brief Applies the turnaround filter, with the signature of the others.
+ *
+ * @param image Pointer to a PNM image.
+ * @param parameter Unused.
+ *
+ * @return
+ *     See turnaround
+ */
+static int turn(PNM *image, const char *parameter);
+
+/**
+ * @brief Applies the negative filter, with the signature of the others.
+ *
+ * @param image Pointer to a PNM image.
+ * @param parameter Unused.
+ *
+ * @return
+ *     See negative
+ */
+static int negate(PNM *image, const char *parameter);
+
+/* ======= Main ======= */
+
+int main(int argc, char **argv) {
+   uint8_t *buffer = pnm_alloc(4 * (size_t)SAMPLE_COUNT);
+   if (buffer == NULL) {
+      fprintf(stderr, "Not enough memory\n");
+      return EXIT_FAILURE;
+   }
+   uint32_t seed = 12345;
+   for (size_t i = 0; i < 4 * (size_t)SAMPLE_COUNT; ++i) {
+      seed = seed * 1103515245 + 12345;
+      buffer[i] = seed >> 24;
+   }
+
+   unsigned int processors = pnm_get_threads();
+   KernelLevel best = kernel_best_level();
+   for (int level = KERNEL_SCALAR; level <= (int)best; ++level) {
+      kernel_set_level(level);
+      bench_kernels(buffer);
+      if (bench_geometry(1) != 0) {
+         fprintf(stderr, "Not enough memory\n");
+         pnm_free(buffer);
+         return EXIT_FAILURE;
+      }
+      for (int i = 1; i < argc; ++i) {
+         if (bench_filters(argv[i], 1) != 0) {
+            fprintf(stderr, "Cannot load %s\n", argv[i]);
+            pnm_free(buffer);
+            return EXIT_FAILURE;
+         }
+      }
+   }
+   for (unsigned int threads = 2; threads <= processors; threads *= 2) {
+      if (bench_geometry(threads) != 0) {
+         fprintf(stderr, "Not enough memory\n");
+         pnm_free(buffer);
+         return EXIT_FAILURE;
+      }
+      for (int i = 1; i < argc; ++i) {
+         if (bench_filters(argv[i], threads) != 0) {
+            fprintf(stderr, "Cannot load %s\n", argv[i]);
+            pnm_free(buffer);
+            return EXIT_FAILURE;
+         }
+      }
+   }
+
+   pnm_free(buffer);
+   return EXIT_SUCCESS;
+}
+
+/* ======= Static Functions ======= */
+
+static double now(void) {
+   struct timespec time;
+   clock_gettime(CLOCK_MONOTONIC, &time);
+   return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void report(
+   const char *name,
+   KernelLevel level,
+   size_t bytes,
+   double seconds
+) {
+   printf(
+      "%-28s %-7s %8.3f GB/s\n",
+      name,
+      kernel_level_name(level),
+      (double)bytes * REPEATS / seconds / 1e9
+   );
+}
+
+static void bench_kernels(uint8_t *buffer) {
+   KernelLevel level = kernel_get_level();
+   uint8_t *r = buffer;
+   uint8_t *g = buffer + SAMPLE_COUNT;
+   uint8_t *b = buffer + 2 * (size_t)SAMPLE_COUNT;
+   uint8_t *out = buffer + 3 * (size_t)SAMPLE_COUNT;
+
+   double start = now();
+   for (int i = 0; i < REPEATS; ++i) kernel_negate8(r, SAMPLE_COUNT, 255);
+   report("kernel_negate8", level, SAMPLE_COUNT, now() - start);
+
+   start = now();
+   for (int i = 0; i < REPEATS; ++i) {
+      kernel_keep_channel8(r, SAMPLE_COUNT / 3, i % 3);
+   }
+   report("kernel_keep_channel8", level, SAMPLE_COUNT, now() - start);
+
+   for (int mode = 1; mode <= 2; ++mode) {
+      start = now();
+      for (int i = 0; i < REPEATS; ++i) {
+         kernel_grey8(r, g, b, out, SAMPLE_COUNT, mode, 255);
+      }
+      report(
+         mode == 1 ? "kernel_grey8 (mode 1)" : "kernel_grey8 (mode 2)",
+         level,
+         3 * (size_t)SAMPLE_COUNT,
+         now() - start
+      );
+   }
+
+   start = now();
+   for (int i = 0; i < REPEATS; ++i) {
+      kernel_threshold8(g, out, SAMPLE_COUNT, 128);
+   }
+   report("kernel_threshold8", level, SAMPLE_COUNT, now() - start);
+}
+
+static int bench_filters(const char *filename, unsigned int threads) {
+   static const struct {
+      const char *name;
+      int (*filter)(PNM *image, const char *parameter);
+      const char *parameter;
+   } filters[] = {
+      {"retournement", turn, NULL},
+      {"negatif", negate, NULL},
+      {"monochrome", monochrome, "r"},
+      {"gris", fifty_shades_of_grey, "2"},
+      {"NB", black_and_white, "128"}
+   };
+   KernelLevel level = kernel_get_level();
+   pnm_set_threads(threads);
+
+   for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); ++f) {
+      double seconds = 0;
+      size_t bytes = 0;
+      int status = FILTER_SUCCESS;
+      for (int i = 0; i < REPEATS && status == FILTER_SUCCESS; ++i) {
+         PNM *image = NULL;
+         if (load_pnm(&image, filename) != PNM_SUCCESS) return -1;
+         bytes = (size_t)get_width(image) * get_height(image) *
+            get_channels(image);
+         double start = now();
+         status = filters[f].filter(image, filters[f].parameter);
+         seconds += now() - start;
+         free_pnm(&image);
+      }
+      // Filters not meant for the format are skipped.
+      if (status != FILTER_SUCCESS) continue;
+
+      char name[64];
+      const char *base = strrchr(filename, '/');
+      snprintf(
+         name,
+         sizeof(name),
+         "%s %s x%u",
+         filters[f].name,
+         base != NULL ? base + 1 : filename,
+         threads
+      );
+      report(name, level, bytes, seconds);
+   }
+   return 0;
+}
+
+static int bench_geometry(unsigned int threads) {
+   static const struct {
+      const char *name;
+      int (*filter)(PNM *image);
+   } filters[] = {
+      {"transposition", transpose},
+      {"rotation90", rotate90},
+      {"rotation270", rotate270},
+      {"miroir_h", flip_h},
+      {"miroir_v", flip_v},
+      {"retournement", turnaround}
+   };
+   static const FormatPNM formats[] = {FORMAT_PGM, FORMAT_PPM};
+   KernelLevel level = kernel_get_level();
+   pnm_set_threads(threads);
+
+   for (size_t k = 0; k < sizeof(formats) / sizeof(formats[0]); ++k) {
+      PNM *image = NULL;
+      if (create_pnm(
+         &image,
+         formats[k],
+         GEOMETRY_SIZE,
+         GEOMETRY_SIZE,
+         PPM_MAX_VALUE
+      ) != PNM_SUCCESS || set_storage(image, STORAGE_8) != PNM_SUCCESS) {
+         free_pnm(&image);
+         return -1;
+      }
+      size_t row_size = get_row_size(image);
+      for (unsigned int y = 0; y < GEOMETRY_SIZE; ++y) {
+         uint8_t *row = get_row(image, y);
+         for (size_t i = 0; i < row_size; ++i) row[i] = (uint8_t)(y + i);
+      }
+
+      for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); ++f) {
+         int status = FILTER_SUCCESS;
+         double start = now();
+         for (int i = 0; i < REPEATS && status == FILTER_SUCCESS; ++i) {
+            status = filters[f].filter(image);
+         }
+         double seconds = now() - start;
+         if (status != FILTER_SUCCESS) {
+            free_pnm(&image);
+            return -1;
+         }
+
+         char name[64];
+         snprintf(
+            name,
+            sizeof(name),
+            "%s 8k %s x%u",
+            filters[f].name,
+            formats[k] == FORMAT_PGM ? "pgm" : "ppm",
+            threads
+         );
+         report(name, level, row_size * GEOMETRY_SIZE, seconds);
+      }
+
+      // Layout conversions belong to libpnm, whatever the kernel level.
+      if (formats[k] == FORMAT_PPM) {
+         double start = now();
+         for (int i = 0; i < REPEATS; ++i) {
+            if (set_layout(image, LAYOUT_PLANAR) != PNM_SUCCESS
+               || set_layout(image, LAYOUT_INTERLEAVED) != PNM_SUCCESS) {
+               free_pnm(&image);
+               return -1;
+            }
+         }
+         char name[64];
+         snprintf(name, sizeof(name), "set_layout 8k ppm x%u", threads);
+         report(name, level, 2 * row_size * GEOMETRY_SIZE, now() - start);
+      }
+      free_pnm(&image);
+   }
+   return 0;
+}
+
+static int negate(PNM *image, const char *parameter) {
+   (void)parameter;
+   return negative(image);
+}
+
+static int turn(PNM *image, const char *parameter) {
+   (void)parameter;
+   return turnaround(image);
+}
@@ -6,426 +6,5244 @@
  * @date 24.03.2025
 */
 
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
 #include <ctype.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "pnm.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PNM_X86 1
+#include <immintrin.h>
+#endif
+
 /* ======= Constants ======= */
 
 #define INVALID_FILENAME_CHARACTERS "\\:*?\"<>|"
 
+#define PAM_KEYWORD_SIZE 16
+#define PAM_ALPHA_SUFFIX "_ALPHA"
+
+#define SCANNER_BUFFER_SIZE 65536
+#define PROBE_BUFFER_SIZE 4096
+#define PROBE_MIN_THREADS 4
+#define WRITER_BUFFER_SIZE 65536
+
+#define PARALLEL_MIN_BODY_SIZE (1 << 20)
+#define PARALLEL_MIN_CHUNK_SIZE (1 << 18)
+#define PARALLEL_MIN_BAND_SIZE (1 << 18)
+#define ASCII_CHUNK_SIZE (1 << 23)
+
+/**
+ * @brief Two-digit decimal representations of 0 to 99.
+ */
+static const char DIGIT_PAIRS[] =
+   "00010203040506070809"
+   "10111213141516171819"
+   "20212223242526272829"
+   "30313233343536373839"
+   "40414243444546474849"
+   "50515253545556575859"
+   "60616263646566676869"
+   "70717273747576777879"
+   "80818283848586878889"
+   "90919293949596979899";
+
+/**
+ * @brief Lookup table of the characters accepted by isspace in the C locale.
+ */
+static const unsigned char SPACE_TABLE[UCHAR_MAX + 1] = {
+   [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1
+};
+
+/**
+ * @brief Number of threads set by pnm_set_threads, 0 for the default.
+ */
+static unsigned int thread_count = 0;
+
+/**
+ * @brief Allocator set by pnm_set_allocator, malloc and free when its
+ * functions are NULL.
+ */
+static PNMAllocator allocator = {NULL, NULL, NULL};
+
+/**
+ * @brief Instructions used to convert rows of three channels between
+ * layouts: 0 for none, 1 for SSE2, 2 for AVX2.
+ */
+static int layout_level = 0;
+static pthread_once_t layout_once = PTHREAD_ONCE_INIT;
+
 /* ======= Structures ======= */
 
+/**
+ * @brief Pixel buffer shared by an image and its views.
+ *
+ * An image only gets a share when its first view is created: the share then
+ * takes over its pixel data or file mapping, which is released with the
+ * last reference.
+ */
+typedef struct Share_t {
+   void *block;
+   PNMAllocator block_allocator;
+   void *mapping;
+   size_t mapping_size;
+   unsigned int references;
+   pthread_mutex_t lock;
+   PNMAllocator allocator;
+} Share;
+
 struct PNM_t {
    FormatPNM format;
+   EncodingPNM encoding;
    unsigned int width;
    unsigned int height;
    uint16_t max_value;
-   uint16_t *data;
+   unsigned int channels;
+   char tuple_type[PAM_TUPLE_TYPE_SIZE];
+   StoragePNM storage;
+   size_t stride;
+   void *data;
+   void *mapping;
+   size_t mapping_size;
+   char *path;
+   off_t body_offset;
+   int status;
+   Share *share;
+   LayoutPNM layout;
+   // Allocators of the structure and its path, and of the pixel data, as
+   // they were when they were allocated.
+   PNMAllocator allocator;
+   PNMAllocator data_allocator;
+};
+
+/**
+ * @brief Block-buffered reader used to tokenize PNM files.
+ *
+ * The scanner owns the read position of its file: once it is in use, the
+ * file must only be read through the scanner. A scanner without a file reads
+ * directly from a memory block that it does not own.
+ */
+typedef struct Scanner_t {
+   FILE *file;
+   unsigned char *buffer;
+   size_t capacity;
+   size_t position;
+   size_t length;
+} Scanner;
+
+/**
+ * @brief Block-buffered writer used to encode PNM files.
+ *
+ * A writer without a file formats into a memory block that it does not own
+ * and fails once the block is full.
+ */
+typedef struct Writer_t {
+   FILE *file;
+   char *buffer;
+   size_t length;
+   size_t capacity;
+} Writer;
+
+/**
+ * @brief Samples of an ASCII body shared by the threads decoding it.
+ *
+ * Threads sharing a byte of bit-packed rows would race, so PBM samples are
+ * decoded on bytes first, then packed into bits.
+ */
+typedef struct DecodeJob_t {
+   size_t row_count;
+   size_t stride;
+   size_t data_count;
+   uint16_t max_value;
+   StoragePNM storage;
+   void *data;
+   void *bits;
+   size_t bits_stride;
+} DecodeJob;
+
+/**
+ * @brief Range of an ASCII body decoded by one thread.
+ *
+ * Counting sets count, and code to 1 when the range holds anything else
+ * than signed decimal numbers. Decoding stores the samples of the range from
+ * index first on and sets code to -1 on an invalid sample.
+ */
+typedef struct DecodeTask_t {
+   const DecodeJob *job;
+   const unsigned char *begin;
+   const unsigned char *end;
+   size_t first;
+   size_t count;
+   int code;
+} DecodeTask;
+
+/**
+ * @brief Band of rows of an image encoded in ASCII by one thread.
+ */
+typedef struct EncodeTask_t {
+   PNM band;
+   Writer writer;
+   int code;
+} EncodeTask;
+
+/**
+ * @brief List of files shared by the threads of pnm_probe_batch.
+ *
+ * Each thread takes the next file to probe under the lock.
+ */
+typedef struct ProbeJob_t {
+   const char *const *filenames;
+   PNMInfo *infos;
+   int *codes;
+   size_t count;
+   size_t next;
+   pthread_mutex_t lock;
+} ProbeJob;
+
+struct PNMReader_t {
+   FILE *file;
+   Scanner scanner;
+   PNM header;
+   unsigned int row;
+};
+
+struct PNMFrameReader_t {
+   FILE *file;
+   Scanner scanner;
+   PNM *image;
+};
+
+struct PNMWriter_t {
+   FILE *file;
+   Writer writer;
+   PNM header;
+   unsigned int row;
+};
+
+/**
+ * @brief Header of a block allocated by a pool.
+ *
+ * The header records the size of the block and links the blocks kept by the
+ * pool. The union keeps the memory that follows it on a PNM_ALIGNMENT
+ * boundary.
+ */
+typedef union PoolBlock_t {
+   struct {
+      size_t size;
+      union PoolBlock_t *next;
+   } header;
+   unsigned char alignment[PNM_ALIGNMENT];
+} PoolBlock;
+
+/**
+ * @brief Pool of blocks, kept most recently released first.
+ */
+struct PNMPool_t {
+   size_t capacity;
+   PoolBlock *blocks;
+   PNMPoolStats stats;
+   pthread_mutex_t lock;
+};
+
+/**
+ * @brief Threads of the library, kept waiting for bands of work between
+ * calls to pnm_parallel_for.
+ *
+ * Bands of the running job are taken in turn under the lock, by the workers
+ * and by the thread that posted the job, which waits for the last of them to
+ * finish. next_band equals band_count while no job is posted. Workers return
+ * once stopping is set, to be joined by pnm_stop_threads.
+ */
+typedef struct WorkerPool_t {
+   pthread_mutex_t lock;
+   pthread_cond_t posted;
+   pthread_cond_t finished;
+   pthread_t threads[PNM_MAX_THREADS];
+   unsigned int worker_count;
+   int busy;
+   int stopping;
+   int stopped_at_exit;
+   PNMBandRoutine routine;
+   void *context;
+   size_t item_count;
+   unsigned int band_count;
+   unsigned int next_band;
+   unsigned int done_count;
+   int status;
+} WorkerPool;
+
+/**
+ * @brief Tasks run by run_tasks, one per band.
+ */
+typedef struct TaskList_t {
+   void *(*routine)(void *);
+   unsigned char *tasks;
+   size_t task_size;
+} TaskList;
+
+/**
+ * @brief Thread pool of the library, started on first use.
+ */
+static WorkerPool workers = {
+   .lock = PTHREAD_MUTEX_INITIALIZER,
+   .posted = PTHREAD_COND_INITIALIZER,
+   .finished = PTHREAD_COND_INITIALIZER
 };
 
 /* ======= Internal Function Prototypes ======= */
 
 /**
- * @brief Reads the header of a PNM file.
+ * @brief Initializes a scanner on an open file.
  *
+ * @param scanner Pointer to the scanner to initialize.
  * @param file Pointer to the file to read from.
- * @param format Pointer to store the format of the PNM file.
- * @param width Pointer to store the width of the image.
- * @param height Pointer to store the height of the image.
- * @param max_value Pointer to store the maximum pixel value.
+ * @param capacity Size of the buffer of the scanner in bytes.
  *
- * @pre file != NULL, format != NULL, width != NULL, height != NULL,
- *      max_value != NULL
+ * @pre scanner != NULL, file != NULL, 0 < capacity
  *
  * @return
  *     0 on success
- *    -1 magic string is invalid
- *    -2 width or height is invalid
- *    -3 max_value is invalid
+ *    -1 on memory allocation failure
  */
-static int read_header(
-   FILE *file,
-   FormatPNM *format,
-   unsigned int *width,
-   unsigned int *height,
-   uint16_t *max_value
+static int scanner_init(Scanner *scanner, FILE *file, size_t capacity);
+
+/**
+ * @brief Initializes a scanner on a block of memory.
+ *
+ * @param scanner Pointer to the scanner to initialize.
+ * @param bytes Pointer to the memory to read from.
+ * @param size Size of the memory block in bytes.
+ *
+ * @pre scanner != NULL, bytes != NULL
+ */
+static void scanner_init_memory(
+   Scanner *scanner,
+   const void *bytes,
+   size_t size
 );
 
 /**
- * @brief Reads the pixel data from a PNM file.
+ * @brief Releases the buffer of a scanner. The file is left open.
  *
- * @param file Pointer to the file to read from.
- * @param max_value Maximum pixel value allowed.
- * @param data_count Number of pixels to read.
- * @param data Pointer to the buffer to store the pixel data.
+ * @param scanner Pointer to the scanner.
+ *
+ * @pre scanner != NULL
+ */
+static void scanner_release(Scanner *scanner);
+
+/**
+ * @brief Refills the buffer of a scanner once it has been consumed.
+ *
+ * @param scanner Pointer to the scanner.
  *
- * @pre file != NULL, data != NULL
+ * @pre scanner != NULL
  *
  * @return
- *     0 on success
- *    -1 if pixel data is invalid
+ *     Number of bytes available in the buffer, 0 at end of file
  */
-static int read_data(
-   FILE *file,
-   uint16_t max_value,
-   size_t data_count,
-   uint16_t *data
-);
+static size_t scanner_fill(Scanner *scanner);
 
 /**
- * @brief Writes the header of a PNM file.
+ * @brief Returns the next character without consuming it.
  *
- * @param file Pointer to the file to write to.
- * @param image Pointer to the PNM image structure.
+ * @param scanner Pointer to the scanner.
  *
- * @pre file != NULL, image != NULL
+ * @pre scanner != NULL
+ *
+ * @return
+ *     Next character as an unsigned char, EOF at end of file
+ */
+static int scanner_peek(Scanner *scanner);
+
+/**
+ * @brief Reads bytes from a scanner, draining its buffer first.
+ *
+ * @param scanner Pointer to the scanner.
+ * @param bytes Pointer to the destination buffer.
+ * @param count Number of bytes to read.
+ *
+ * @pre scanner != NULL, bytes != NULL
+ *
+ * @return
+ *     Number of bytes read
+ */
+static size_t scanner_read(Scanner *scanner, void *bytes, size_t count);
+
+/**
+ * @brief Skips bytes of a scanner.
+ *
+ * Bytes past the buffer are skipped by seeking the file, or by reading them
+ * when the file cannot seek.
+ *
+ * @param scanner Pointer to the scanner.
+ * @param count Number of bytes to skip.
+ *
+ * @pre scanner != NULL
  *
  * @return
  *     0 on success
- *    -1 on error
+ *    -1 at end of file
  */
-static int write_header(FILE *file, PNM *image);
+static int scanner_skip(Scanner *scanner, size_t count);
 
 /**
- * @brief Writes the pixel data to a PNM file.
+ * @brief Computes the number of bytes left to read by a scanner, buffered
+ *        bytes included.
  *
- * @param file Pointer to the file to write to.
- * @param image Pointer to the PNM image structure.
+ * Sizes past SIZE_MAX are reported as SIZE_MAX.
  *
- * @pre file != NULL, image != NULL
+ * @param scanner Pointer to the scanner.
+ * @param size Pointer to store the number of bytes left.
+ *
+ * @pre scanner != NULL, scanner reads a file, size != NULL
  *
  * @return
  *     0 on success
- *    -1 on error
+ *    -1 if the file is not a regular file or its position is unknown
  */
-static int write_data(FILE *file, PNM *image);
+static int scanner_rest_size(Scanner *scanner, size_t *size);
 
 /**
- * @brief Checks if a filename contains invalid characters.
+ * @brief Probes the files of a ProbeJob until none is left.
  *
- * @param filename Pointer to the filename string.
+ * @param argument Pointer to the ProbeJob.
  *
- * @pre filename != NULL
+ * @return
+ *     NULL
+ */
+static void *probe_files(void *argument);
+
+/**
+ * @brief Allocates a PNM image structure without pixel data.
  *
  * @return
- *     0 valid
- *     1 invalid characters are found
+ *     Pointer to the new image
+ *     NULL on memory allocation failure
  */
-static int check_invalid_characters(const char *filename);
+static PNM *new_pnm(void);
 
 /**
- * @brief Determines the PNM format based on the file extension.
+ * @brief Releases the pixel data of a PNM image.
  *
- * @param filename Pointer to the filename string.
- * @param format Pointer to store the determined format.
+ * Drops the reference of the image to its share if it has one, unmaps the
+ * file mapping of the image if it has one, frees the data otherwise. Pixel
+ * data still to be decoded is forgotten.
  *
- * @pre filename != NULL, format != NULL
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ */
+static void release_data(PNM *image);
+
+/**
+ * @brief Decodes the pixel data of an image loaded by load_pnm_lazy.
+ *
+ * Nothing is done once the pixel data is decoded or its decoding failed.
+ * Otherwise the file is opened again at the offset of the pixel data, and
+ * the outcome becomes the status of the image.
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     PNM_SUCCESS if the pixel data is decoded
+ *     PNM_INVALID_FILENAME if the file cannot be opened again
+ *     LOAD_PNM_MEMORY_ERROR on memory allocation failure
+ *     LOAD_PNM_DECODE_ERROR on decode error
+ */
+static int load_data(PNM *image);
+
+/**
+ * @brief Prepares the pixel data of an image to be addressed by rows of
+ *        whole pixels.
+ *
+ * Pending pixel data is decoded and planar pixel data is interleaved.
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     PNM_SUCCESS on success
+ *     PNM_INVALID_FILENAME, LOAD_PNM_MEMORY_ERROR or LOAD_PNM_DECODE_ERROR
+ *     if the pixel data cannot be decoded or converted
+ */
+static int load_rows(PNM *image);
+
+/**
+ * @brief Copies the pixel data of an image in another layout.
+ *
+ * @param image Pointer to the PNM image, with STORAGE_8 or STORAGE_16 pixel
+ *              data in the other layout.
+ * @param layout Layout of the copy.
+ * @param data Pointer to store the copy, allocated with pnm_alloc.
+ * @param stride Pointer to store the stride of the copy.
+ *
+ * @pre image != NULL, data != NULL, stride != NULL
  *
  * @return
  *     0 on success
- *    -2 file extension is invalid
+ *    -1 on memory allocation failure
  */
-static int file_extension_to_format(const char *filename, FormatPNM *format);
+static int copy_layout(
+   const PNM *image,
+   LayoutPNM layout,
+   void **data,
+   size_t *stride
+);
 
 /**
- * @brief Converts a magic string to a PNM format.
+ * @brief Converts the pixel data of an image to another storage.
  *
- * @param magic_string Pointer to the magic string.
- * @param format Pointer to store the determined format.
+ * @param image Pointer to the PNM image, with pixel data ready for load_rows
+ *              in another storage.
+ * @param storage Storage of the new pixel data.
+ * @param packed 1 for packed rows, 0 for rows padded to pnm_row_stride.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     PNM_SUCCESS on success
+ *     PNM_INVALID_FILENAME, LOAD_PNM_MEMORY_ERROR or LOAD_PNM_DECODE_ERROR
+ *     if the pixel data cannot be decoded or converted
+ */
+static int convert_storage(PNM *image, StoragePNM storage, int packed);
+
+/**
+ * @brief Removes the padding between the rows of the pixel data of an image.
+ *
+ * Pixel data that belongs to the image alone is packed in place, pixel data
+ * still shared with views or mapped from a file is copied.
  *
- * @pre magic_string != NULL, format != NULL
+ * @param image Pointer to the PNM image, with interleaved pixel data.
+ *
+ * @pre image != NULL
  *
  * @return
  *     0 on success
- *    -1 magic string is invalid
+ *    -1 on memory allocation failure
  */
-static int magic_str_to_format(const char *magic_str, FormatPNM *format);
+static int pack_rows(PNM *image);
 
 /**
- * @brief Converts a PNM format to its corresponding magic string.
+ * @brief Moves the pixel data of an image into a new share.
  *
- * @param format The PNM format.
- * @param magic_str Pointer to store the corresponding magic string.
+ * @param image Pointer to the PNM image, without a share.
  *
- * @pre magic_str != NULL
+ * @pre image != NULL
  *
  * @return
  *     0 on success
- *    -1 format is invalid
+ *    -1 on memory allocation failure
  */
-static int format_to_magic_str(FormatPNM format, const char **magic_str);
+static int create_share(PNM *image);
 
 /**
- * @brief Skips comments and whitespace in a PNM file.
+ * @brief Drops one reference to a share, releasing it with the last one.
  *
- * @param file Pointer to the file to read from.
+ * @param share Pointer to the share.
  *
- * @pre file != NULL
+ * @pre share != NULL
  */
-static void skip_comments(FILE *file);
+static void release_share(Share *share);
 
 /**
- * @brief Reads an unsigned integer from a PNM file.
+ * @brief Decodes a whole PNM image from an open file.
  *
+ * @param image Pointer to store the decoded PNM image.
  * @param file Pointer to the file to read from.
- * @param value Pointer to store the read value.
+ * @param expected_format Pointer to the format given by the file extension,
+ *                        NULL to accept any format.
+ *
+ * @pre image != NULL, file != NULL
+ *
+ * @return
+ *     PNM_SUCCESS on success
+ *     LOAD_PNM_MEMORY_ERROR on memory allocation failure
+ *     LOAD_PNM_DECODE_ERROR on decode error
+ */
+static int decode_file(
+   PNM **image,
+   FILE *file,
+   const FormatPNM *expected_format
+);
+
+/**
+ * @brief Decodes a whole PNM image from a scanner.
+ *
+ * @param image Pointer to store the decoded PNM image.
+ * @param scanner Pointer to the scanner to read from.
+ * @param expected_format Pointer to the format given by the file extension,
+ *                        NULL to accept any format.
+ *
+ * @pre image != NULL, scanner != NULL
+ *
+ * @return
+ *     PNM_SUCCESS on success
+ *     LOAD_PNM_MEMORY_ERROR on memory allocation failure
+ *     LOAD_PNM_DECODE_ERROR on decode error
+ */
+static int decode_pnm(
+   PNM **image,
+   Scanner *scanner,
+   const FormatPNM *expected_format
+);
+
+/**
+ * @brief Allocates and reads the pixel data that follows a PNM header.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param header Pointer to the header of the image, whose storage is used.
+ * @param data Pointer to store the allocated pixel data.
+ *
+ * @pre scanner != NULL, header != NULL, data != NULL
+ *
+ * @return
+ *     PNM_SUCCESS on success
+ *     LOAD_PNM_MEMORY_ERROR on memory allocation failure
+ *     LOAD_PNM_DECODE_ERROR on decode error
+ */
+static int decode_data(Scanner *scanner, const PNM *header, void **data);
+
+/**
+ * @brief Decodes a rectangular region of a PNM image from a scanner.
+ *
+ * @param image Pointer to store the decoded region.
+ * @param scanner Pointer to the scanner to read from.
+ * @param expected_format Format given by the file extension.
+ * @param x Column of the left edge of the region.
+ * @param y Row of the top edge of the region.
+ * @param width Width of the region.
+ * @param height Height of the region.
+ *
+ * @pre image != NULL, scanner != NULL
+ *
+ * @return
+ *     PNM_SUCCESS on success
+ *     LOAD_PNM_MEMORY_ERROR on memory allocation failure
+ *     LOAD_PNM_DECODE_ERROR on decode error
+ *     -4 if the region is not inside the image
+ */
+static int decode_region(
+   PNM **image,
+   Scanner *scanner,
+   FormatPNM expected_format,
+   unsigned int x,
+   unsigned int y,
+   unsigned int width,
+   unsigned int height
+);
+
+/**
+ * @brief Builds a PNM image on top of a private mapping of its file.
+ *
+ * Raw bit-packed and 8-bit samples are used in place, as packed rows that
+ * start wherever the file puts them; they are only read, so the pages of
+ * the mapping stay shared with the page cache until a filter writes them.
+ * 16-bit samples, big-endian in the file, and ASCII images are decoded into
+ * new padded rows.
+ *
+ * @param image Pointer to store the PNM image.
+ * @param scanner Pointer to a scanner reading the mapping.
+ * @param expected_format Format given by the file extension.
+ * @param mapping Pointer to the mapping of the file.
+ * @param mapping_size Size of the mapping.
+ *
+ * @pre image != NULL, scanner != NULL, mapping != NULL
+ *
+ * @return
+ *     PNM_SUCCESS on success
+ *     LOAD_PNM_MEMORY_ERROR on memory allocation failure
+ *     LOAD_PNM_DECODE_ERROR on decode error
+ */
+static int map_pnm(
+   PNM **image,
+   Scanner *scanner,
+   FormatPNM expected_format,
+   void *mapping,
+   size_t mapping_size
+);
+
+/**
+ * @brief Reads the header of a PNM file.
+ *
+ * For raw encodings the single whitespace character that ends the header
+ * is consumed, so that the scanner is positioned on the first data byte.
+ * The header gets the default storage of its format and no pixel data.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param header Pointer to store the properties of the image.
  *
- * @pre file != NULL, value != NULL
+ * @pre scanner != NULL, header != NULL
  *
  * @return
  *     0 on success
- *    -1 on error
+ *    -1 magic string is invalid
+ *    -2 width, height or depth is invalid
+ *    -3 max_value is invalid
  */
-static int read_unsigned_int(FILE *file, unsigned int *value);
+static int read_header(Scanner *scanner, PNM *header);
 
 /**
- * @brief Reads an unsigned integer using fscanf.
+ * @brief Reads the fields that follow the magic string of a PAM header.
  *
- * @param file Pointer to the file to read from.
- * @param value Pointer to store the read value.
+ * Fields may come in any order and TUPLTYPE lines are joined with a space.
+ * The end of the ENDHDR line is consumed, so that the scanner is positioned
+ * on the first data byte.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param header Pointer to store the properties of the image.
  *
- * @pre file != NULL, value != NULL
+ * @pre scanner != NULL, header != NULL
  *
  * @return
  *     0 on success
- *    -1 if the value is invalid
- *    -2 if the value is out of range
+ *    -2 a field is missing or invalid
+ *    -3 max_value is invalid
  */
-static int fscanf_unsigned_int(FILE *file, unsigned int *value);
+static int read_pam_header(Scanner *scanner, PNM *header);
 
-/* ======= External Functions ======= */
+/**
+ * @brief Reads the value of a TUPLTYPE line of a PAM header.
+ *
+ * The value is the rest of the line, without its surrounding whitespace. It
+ * is appended to the tuple type read so far, after a space.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param tuple_type Buffer of PAM_TUPLE_TYPE_SIZE characters.
+ * @param length Pointer to the length of the tuple type, updated.
+ *
+ * @pre scanner != NULL, tuple_type != NULL, length != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 the tuple type does not fit in its buffer
+ */
+static int read_tuple_type(Scanner *scanner, char *tuple_type, size_t *length);
 
-FormatPNM get_format(PNM *image) {
-   if (image == NULL) return -1;
-   return image->format;
-}
+/**
+ * @brief Reads the pixel data from a PNM file.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param channels Number of samples per pixel.
+ * @param width Width of the image.
+ * @param height Number of rows to read.
+ * @param max_value Maximum pixel value allowed.
+ * @param storage Storage of the pixel data.
+ * @param stride Number of bytes from the start of a row of data to the next.
+ * @param data Pointer to the buffer to store the pixel data.
+ *
+ * @pre scanner != NULL, data != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 if pixel data is invalid
+ */
+static int read_data(
+   Scanner *scanner,
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   size_t stride,
+   void *data
+);
+
+/**
+ * @brief Reads the raw pixel data from a PNM file.
+ *
+ * When the storage matches the layout of the file, the whole data block is
+ * read with a single call to fread, then its rows are moved to their stride.
+ * Otherwise the rows are read and converted one at a time.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param format Format of the image.
+ * @param channels Number of samples per pixel.
+ * @param width Width of the image.
+ * @param height Number of rows to read.
+ * @param max_value Maximum pixel value allowed.
+ * @param storage Storage of the pixel data.
+ * @param stride Number of bytes from the start of a row of data to the next.
+ * @param data Pointer to the buffer to store the pixel data.
+ *
+ * @pre scanner != NULL, data != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 if pixel data is invalid
+ *    -2 on memory allocation failure
+ */
+static int read_raw_data(
+   Scanner *scanner,
+   FormatPNM format,
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   size_t stride,
+   void *data
+);
+
+/**
+ * @brief Moves packed rows at the start of a buffer to their stride.
+ *
+ * Rows are moved from the last one up, so that none is overwritten before
+ * it is moved.
+ *
+ * @param data Pointer to the buffer, holding height packed rows.
+ * @param row_size Size of one row in bytes.
+ * @param stride Number of bytes from the start of a row to the next.
+ * @param height Number of rows.
+ *
+ * @pre data != NULL, row_size <= stride, the buffer holds height strides
+ */
+static void spread_rows(
+   void *data,
+   size_t row_size,
+   size_t stride,
+   unsigned int height
+);
+
+/**
+ * @brief Reads a region of the ASCII pixel data of a PNM file.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param header Pointer to the header of the whole image.
+ * @param x Column of the left edge of the region.
+ * @param y Row of the top edge of the region.
+ * @param region Pointer to the region, whose pixel data is filled.
+ *
+ * @pre scanner != NULL, header != NULL, region != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 if pixel data is invalid
+ */
+static int read_region_data(
+   Scanner *scanner,
+   PNM *header,
+   unsigned int x,
+   unsigned int y,
+   PNM *region
+);
+
+/**
+ * @brief Reads a region of the raw pixel data of a PNM file.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param header Pointer to the header of the whole image.
+ * @param x Column of the left edge of the region.
+ * @param y Row of the top edge of the region.
+ * @param region Pointer to the region, whose pixel data is filled.
+ *
+ * @pre scanner != NULL, header != NULL, region != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 if pixel data is invalid
+ *    -2 on memory allocation failure
+ */
+static int read_region_raw_data(
+   Scanner *scanner,
+   PNM *header,
+   unsigned int x,
+   unsigned int y,
+   PNM *region
+);
+
+/**
+ * @brief Reads and checks ASCII samples without storing them.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param count Number of samples to skip.
+ * @param max_value Maximum pixel value allowed.
+ *
+ * @pre scanner != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 if a sample is invalid
+ */
+static int skip_samples(Scanner *scanner, size_t count, uint16_t max_value);
+
+/**
+ * @brief Reads ASCII pixel data, with several threads when it is large.
+ *
+ * Falls back to read_data when one thread is configured, when the body is
+ * small or is not backed by a regular file, and when it contains comments or
+ * malformed numbers, so that the result is always the one of read_data.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param channels Number of samples per pixel.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param max_value Maximum pixel value allowed.
+ * @param storage Storage of the pixel data.
+ * @param stride Number of bytes from the start of a row of data to the next.
+ * @param data Pointer to the buffer to store the pixel data.
+ *
+ * @pre scanner != NULL, data != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 if pixel data is invalid
+ *    -2 on memory allocation failure
+ */
+static int read_ascii_data(
+   Scanner *scanner,
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   size_t stride,
+   void *data
+);
+
+/**
+ * @brief Decodes an ASCII body held in memory with several threads, see
+ *        decode_range.
+ *
+ * @param body Pointer to the body.
+ * @param size Size of the body.
+ * @param channels Number of samples per pixel.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param max_value Maximum pixel value allowed.
+ * @param storage Storage of the pixel data.
+ * @param stride Number of bytes from the start of a row of data to the next.
+ * @param data Pointer to the buffer to store the pixel data.
+ *
+ * @pre body != NULL, data != NULL
+ *
+ * @return
+ *     0 on success
+ *     1 if the body must be decoded by read_data
+ *    -1 if pixel data is invalid
+ *    -2 on memory allocation failure
+ */
+static int decode_ascii_parallel(
+   const unsigned char *body,
+   size_t size,
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   size_t stride,
+   void *data
+);
+
+/**
+ * @brief Decodes an ASCII body read from a file with several threads, one
+ *        chunk of at most ASCII_CHUNK_SIZE bytes at a time.
+ *
+ * Chunks end after a newline, so that no sample or comment is split between
+ * two of them; a chunk holding comments is decoded by read_samples.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param rest_size Number of bytes left to read, see scanner_rest_size.
+ * @param channels Number of samples per pixel.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param max_value Maximum pixel value allowed.
+ * @param storage Storage of the pixel data.
+ * @param stride Number of bytes from the start of a row of data to the next.
+ * @param data Pointer to the buffer to store the pixel data.
+ *
+ * @pre scanner != NULL, data != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 if pixel data is invalid, or a line longer than a chunk holds a
+ *       comment
+ *    -2 on memory allocation failure
+ */
+static int read_ascii_chunks(
+   Scanner *scanner,
+   size_t rest_size,
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   size_t stride,
+   void *data
+);
+
+/**
+ * @brief Finds the end of a chunk of an ASCII body, after its last newline.
+ *
+ * A chunk without newline ends after its last whitespace, unless it holds a
+ * comment.
+ *
+ * @param chunk Pointer to the chunk.
+ * @param length Number of bytes in the chunk.
+ *
+ * @pre chunk != NULL
+ *
+ * @return
+ *     Number of bytes up to the end of the chunk
+ *     0 if the chunk cannot be split
+ */
+static size_t find_chunk_end(const unsigned char *chunk, size_t length);
+
+/**
+ * @brief Prepares a DecodeJob for the pixel data of an image.
+ *
+ * @param job Pointer to the job.
+ * @param channels Number of samples per pixel.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param max_value Maximum pixel value allowed.
+ * @param storage Storage of the pixel data.
+ * @param stride Number of bytes from the start of a row of data to the next.
+ * @param data Pointer to the buffer to store the pixel data.
+ *
+ * @pre job != NULL, data != NULL
+ *
+ * @return
+ *     0 on success
+ *    -2 on memory allocation failure
+ */
+static int decode_job_init(
+   DecodeJob *job,
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   size_t stride,
+   void *data
+);
+
+/**
+ * @brief Packs the samples of a DecodeJob into bits if they were decoded on
+ *        bytes, then releases the bytes.
+ *
+ * @param job Pointer to the job.
+ * @param code Outcome of the decoding, the bits being packed on 0 alone.
+ *
+ * @pre job != NULL
+ */
+static void decode_job_finish(DecodeJob *job, int code);
+
+/**
+ * @brief Decodes the samples of an ASCII body held in memory with several
+ *        threads, from sample first of a job on.
+ *
+ * The body is split into ranges that start on whitespace. The samples of
+ * each range are counted concurrently, which gives the index of the first
+ * sample of every range, then decoded concurrently. Samples past the end of
+ * the image are ignored.
+ *
+ * @param job Pointer to the job.
+ * @param body Pointer to the body.
+ * @param size Size of the body.
+ * @param first Index of the first sample of the body.
+ * @param count Pointer to store the number of samples decoded.
+ *
+ * @pre job != NULL, body != NULL, count != NULL, first < job->data_count
+ *
+ * @return
+ *     0 on success
+ *     1 if the body holds anything else than signed decimal numbers
+ *    -1 if a sample is invalid
+ */
+static int decode_range(
+   const DecodeJob *job,
+   const unsigned char *body,
+   size_t size,
+   size_t first,
+   size_t *count
+);
+
+/**
+ * @brief Decodes the samples of a job from a scanner one at a time, from
+ *        sample first on, until the end of the scanner or of the image.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param job Pointer to the job.
+ * @param first Index of the first sample to read.
+ * @param count Pointer to store the number of samples decoded.
+ *
+ * @pre scanner != NULL, job != NULL, count != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 if a sample is invalid
+ */
+static int read_samples(
+   Scanner *scanner,
+   const DecodeJob *job,
+   size_t first,
+   size_t *count
+);
+
+/**
+ * @brief Counts the samples of a range of an ASCII body.
+ *
+ * @param argument Pointer to the DecodeTask of the range.
+ *
+ * @return
+ *     NULL
+ */
+static void *count_samples(void *argument);
+
+/**
+ * @brief Decodes the samples of a range of an ASCII body.
+ *
+ * @param argument Pointer to the DecodeTask of the range.
+ *
+ * @return
+ *     NULL
+ */
+static void *decode_samples(void *argument);
+
+/**
+ * @brief Runs bands of items on the thread pool.
+ *
+ * The calling thread runs bands as well, so every band is run even when
+ * no worker could be started. While the pool runs a job, other jobs, such
+ * as jobs posted by the routine itself, run on their calling thread alone.
+ *
+ * @param routine Routine to run on each band.
+ * @param context Pointer given to the routine.
+ * @param count Number of items.
+ * @param bands Number of bands, between 2 and PNM_MAX_THREADS.
+ *
+ * @pre routine != NULL, bands <= count
+ *
+ * @return
+ *     0 if every band succeeds, the status of a failed band otherwise
+ */
+static int run_bands(
+   PNMBandRoutine routine,
+   void *context,
+   size_t count,
+   unsigned int bands
+);
+
+/**
+ * @brief Runs the bands of a job one after the other.
+ *
+ * @param routine Routine to run on each band.
+ * @param context Pointer given to the routine.
+ * @param count Number of items.
+ * @param bands Number of bands.
+ *
+ * @pre routine != NULL, bands <= count
+ *
+ * @return
+ *     0 if every band succeeds, the status of the first failed band
+ *     otherwise
+ */
+static int run_bands_serially(
+   PNMBandRoutine routine,
+   void *context,
+   size_t count,
+   unsigned int bands
+);
+
+/**
+ * @brief Runs a band of a job.
+ *
+ * Items are split as evenly as possible between the bands.
+ *
+ * @param routine Routine to run.
+ * @param context Pointer given to the routine.
+ * @param count Number of items.
+ * @param bands Number of bands.
+ * @param band Index of the band.
+ *
+ * @pre routine != NULL, band < bands
+ *
+ * @return
+ *     Status returned by the routine
+ */
+static int run_band(
+   PNMBandRoutine routine,
+   void *context,
+   size_t count,
+   unsigned int bands,
+   unsigned int band
+);
+
+/**
+ * @brief Runs the posted bands of the pool until none is left to take.
+ *
+ * @pre The lock of the pool is held
+ */
+static void take_bands(void);
+
+/**
+ * @brief Waits for bands of work until the pool stops.
+ *
+ * @param argument Unused.
+ *
+ * @return
+ *     NULL
+ */
+static void *pool_worker(void *argument);
+
+/**
+ * @brief Runs the tasks of a band.
+ *
+ * @param context Pointer to the TaskList.
+ * @param band Unused.
+ * @param first Index of the first task.
+ * @param end Index after the last task.
+ *
+ * @return
+ *     0
+ */
+static int run_task_band(
+   void *context,
+   unsigned int band,
+   size_t first,
+   size_t end
+);
+
+/**
+ * @brief Runs a routine on an array of tasks, one band per task.
+ *
+ * The tasks run concurrently on the thread pool, the first of them possibly
+ * on the calling thread.
+ *
+ * @param routine Routine to run.
+ * @param tasks Pointer to the first task.
+ * @param task_size Size of one task.
+ * @param count Number of tasks, at most PNM_MAX_THREADS.
+ *
+ * @pre routine != NULL, tasks != NULL
+ */
+static void run_tasks(
+   void *(*routine)(void *),
+   void *tasks,
+   size_t task_size,
+   unsigned int count
+);
+
+/**
+ * @brief Creates a frame reader on an open file.
+ *
+ * The reader takes ownership of the file, which is closed on failure.
+ *
+ * @param frames Pointer to store the frame reader.
+ * @param file Pointer to the file to read from.
+ *
+ * @pre frames != NULL, file != NULL
+ *
+ * @return
+ *     PNM_SUCCESS on success
+ *     LOAD_PNM_MEMORY_ERROR on memory allocation failure
+ */
+static int frames_open_file(PNMFrameReader **frames, FILE *file);
+
+/**
+ * @brief Allocates a block with an allocator, see pnm_alloc.
+ *
+ * @param with Pointer to the allocator, whose functions are NULL for malloc
+ *             and free.
+ * @param size Size of the block in bytes.
+ *
+ * @pre with != NULL
+ *
+ * @return
+ *     Pointer to the block
+ *     NULL : Memory allocation failure
+ */
+static void *allocate_with(const PNMAllocator *with, size_t size);
+
+/**
+ * @brief Releases a block with the allocator that allocated it.
+ *
+ * @param with Pointer to the allocator, whose functions are NULL for malloc
+ *             and free.
+ * @param block Pointer to the block, or NULL.
+ *
+ * @pre with != NULL
+ */
+static void release_with(const PNMAllocator *with, void *block);
+
+/**
+ * @brief Allocates a block from a pool, see PNMAllocator.
+ *
+ * @param context Pointer to the pool.
+ * @param size Size of the block in bytes.
+ *
+ * @return
+ *     Pointer to the block
+ *     NULL : Memory allocation failure
+ */
+static void *pool_allocate(void *context, size_t size);
+
+/**
+ * @brief Releases a block to a pool, see PNMAllocator.
+ *
+ * @param context Pointer to the pool.
+ * @param block Pointer to the block, or NULL.
+ */
+static void pool_release(void *context, void *block);
+
+/**
+ * @brief Opens a stream on a duplicate of a file descriptor.
+ *
+ * Closing the stream closes the duplicate and leaves fd open.
+ *
+ * @param fd File descriptor to duplicate.
+ * @param mode Mode of the stream, as for fdopen.
+ *
+ * @pre mode != NULL
+ *
+ * @return
+ *     Pointer to the stream
+ *     NULL on error
+ */
+static FILE *open_fd(int fd, const char *mode);
+
+/**
+ * @brief Encodes a whole PNM image to an open file.
+ *
+ * @param file Pointer to the file to write to.
+ * @param image Pointer to the PNM image structure.
+ *
+ * @pre file != NULL, image != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 on error
+ */
+static int encode_file(FILE *file, PNM *image);
+
+/**
+ * @brief Initializes a writer on an open file.
+ *
+ * @param writer Pointer to the writer to initialize.
+ * @param file Pointer to the file to write to.
+ *
+ * @pre writer != NULL, file != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 on memory allocation failure
+ */
+static int writer_init(Writer *writer, FILE *file);
+
+/**
+ * @brief Initializes a writer on a block of memory.
+ *
+ * @param writer Pointer to the writer to initialize.
+ * @param buffer Pointer to the memory to write to.
+ * @param capacity Size of the memory block in bytes.
+ *
+ * @pre writer != NULL, buffer != NULL
+ */
+static void writer_init_memory(Writer *writer, char *buffer, size_t capacity);
+
+/**
+ * @brief Releases the buffer of a writer without flushing it.
+ *
+ * @param writer Pointer to the writer.
+ *
+ * @pre writer != NULL
+ */
+static void writer_release(Writer *writer);
+
+/**
+ * @brief Writes the buffered bytes of a writer to its file.
+ *
+ * @param writer Pointer to the writer.
+ *
+ * @pre writer != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 on error
+ */
+static int writer_flush(Writer *writer);
+
+/**
+ * @brief Appends bytes to a writer.
+ *
+ * Blocks larger than the buffer are written to the file directly.
+ *
+ * @param writer Pointer to the writer.
+ * @param bytes Pointer to the bytes to write.
+ * @param count Number of bytes to write.
+ *
+ * @pre writer != NULL, bytes != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 on error
+ */
+static int writer_write(Writer *writer, const void *bytes, size_t count);
+
+/**
+ * @brief Appends the decimal form of an unsigned integer to a writer.
+ *
+ * Equivalent to "%u" followed by the separator character.
+ *
+ * @param writer Pointer to the writer.
+ * @param value Value to write.
+ * @param separator Character written after the value.
+ *
+ * @pre writer != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 on error
+ */
+static int writer_put_uint(Writer *writer, unsigned int value, char separator);
+
+/**
+ * @brief Converts raw big-endian 16-bit samples to host order in place.
+ *
+ * @param data Pointer to the samples.
+ * @param data_count Number of samples.
+ * @param max_value Maximum pixel value allowed.
+ *
+ * @pre data != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 if a sample exceeds max_value
+ */
+static int decode_big_endian(
+   uint16_t *data,
+   size_t data_count,
+   uint16_t max_value
+);
+
+/**
+ * @brief Writes the header of a PNM file.
+ *
+ * @param writer Pointer to the writer to write to.
+ * @param image Pointer to the PNM image structure.
+ *
+ * @pre writer != NULL, image != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 on error
+ */
+static int write_header(Writer *writer, PNM *image);
+
+/**
+ * @brief Writes the header of a PAM file.
+ *
+ * @param writer Pointer to the writer to write to.
+ * @param image Pointer to the PAM image structure.
+ *
+ * @pre writer != NULL, image != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 on error
+ */
+static int write_pam_header(Writer *writer, PNM *image);
+
+/**
+ * @brief Writes the pixel data to a PNM file.
+ *
+ * @param writer Pointer to the writer to write to.
+ * @param image Pointer to the PNM image structure.
+ *
+ * @pre writer != NULL, image != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 on error
+ */
+static int write_data(Writer *writer, PNM *image);
+
+/**
+ * @brief Writes the ASCII pixel data, with several threads when it is large.
+ *
+ * Bands of rows are formatted concurrently into memory writers by
+ * write_data, then appended to the writer in order, so the output is the
+ * one of write_data.
+ *
+ * @param writer Pointer to the writer to write to.
+ * @param image Pointer to the PNM image structure.
+ *
+ * @pre writer != NULL, image != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 on error
+ */
+static int write_ascii_data(Writer *writer, PNM *image);
+
+/**
+ * @brief Formats the band of an EncodeTask with write_data.
+ *
+ * @param argument Pointer to the EncodeTask.
+ *
+ * @return
+ *     NULL
+ */
+static void *encode_band(void *argument);
+
+/**
+ * @brief Writes the raw pixel data to a PNM file.
+ *
+ * @param writer Pointer to the writer to write to.
+ * @param image Pointer to the PNM image structure.
+ *
+ * @pre writer != NULL, image != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 on error
+ */
+static int write_raw_data(Writer *writer, PNM *image);
+
+/**
+ * @brief Checks that 8-bit samples do not exceed a maximum value.
+ *
+ * @param bytes Pointer to the samples.
+ * @param data_count Number of samples.
+ * @param max_value Maximum pixel value allowed.
+ *
+ * @pre bytes != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 if a sample exceeds max_value
+ */
+static int check_bytes(
+   const uint8_t *bytes,
+   size_t data_count,
+   uint16_t max_value
+);
+
+/**
+ * @brief Encodes one row of pixel data in the raw layout of its format.
+ *
+ * @param row Pointer to the row, in the storage of the image.
+ * @param image Pointer to the PNM image structure.
+ * @param output Pointer to the buffer to store the raw row.
+ *
+ * @pre row != NULL, image != NULL, output != NULL
+ */
+static void encode_raw_row(const void *row, PNM *image, uint8_t *output);
+
+/**
+ * @brief Computes the size in bytes of one row of pixel data.
+ *
+ * @param channels Number of samples per pixel.
+ * @param width Width of the image.
+ * @param storage Storage of the pixel data.
+ *
+ * @return
+ *     Size of one row
+ */
+static size_t storage_row_size(
+   unsigned int channels,
+   unsigned int width,
+   StoragePNM storage
+);
+
+/**
+ * @brief Reads one sample of a row.
+ *
+ * @param row Pointer to the row.
+ * @param storage Storage of the row.
+ * @param x Index of the sample in the row.
+ *
+ * @pre row != NULL
+ *
+ * @return
+ *     Value of the sample
+ */
+static uint16_t load_sample(const void *row, StoragePNM storage, size_t x);
+
+/**
+ * @brief Writes one sample of a row.
+ *
+ * In bit-packed rows, the bit of the sample is set when value is not 0.
+ *
+ * @param row Pointer to the row.
+ * @param storage Storage of the row.
+ * @param x Index of the sample in the row.
+ * @param value Value of the sample.
+ *
+ * @pre row != NULL
+ */
+static void store_sample(
+   void *row,
+   StoragePNM storage,
+   size_t x,
+   uint16_t value
+);
+
+/**
+ * @brief Copies the samples of an interleaved row into the same row of each
+ *        plane, in one pass over the row.
+ *
+ * @param row Pointer to the interleaved row.
+ * @param plane_row Pointer to the row of the first plane.
+ * @param plane_size Number of bytes from a plane to the next.
+ * @param storage Storage of the rows, STORAGE_8 or STORAGE_16.
+ * @param channels Number of samples per pixel.
+ * @param width Number of pixels in the row.
+ *
+ * @pre row != NULL, plane_row != NULL
+ */
+static void deinterleave_row(
+   const uint8_t *row,
+   uint8_t *plane_row,
+   size_t plane_size,
+   StoragePNM storage,
+   unsigned int channels,
+   unsigned int width
+);
+
+/**
+ * @brief Copies the same row of each plane into an interleaved row, in one
+ *        pass over the row.
+ *
+ * @param plane_row Pointer to the row of the first plane.
+ * @param plane_size Number of bytes from a plane to the next.
+ * @param row Pointer to the interleaved row.
+ * @param storage Storage of the rows, STORAGE_8 or STORAGE_16.
+ * @param channels Number of samples per pixel.
+ * @param width Number of pixels in the row.
+ *
+ * @pre plane_row != NULL, row != NULL
+ */
+static void interleave_row(
+   const uint8_t *plane_row,
+   size_t plane_size,
+   uint8_t *row,
+   StoragePNM storage,
+   unsigned int channels,
+   unsigned int width
+);
+
+/**
+ * @brief Selects the instructions used by the conversions of rows of three
+ *        channels, see layout_level.
+ */
+static void init_layout_level(void);
+
+#ifdef PNM_X86
+/**
+ * @brief Deinterleaves the first pixels of a row of three channels with
+ *        SSE2, 96 bytes at a time.
+ *
+ * Each block goes through layers of unpack instructions that pair its
+ * first and last three vectors, which sort the samples by channel.
+ *
+ * @param row Pointer to the interleaved row.
+ * @param plane_row Pointer to the row of the first plane.
+ * @param plane_size Number of bytes from a plane to the next.
+ * @param wide 1 for 16-bit samples, 0 for 8-bit samples.
+ * @param width Number of pixels in the row.
+ *
+ * @return
+ *     Number of pixels deinterleaved, the rest being left to the caller
+ */
+static unsigned int deinterleave3_sse2(
+   const uint8_t *row,
+   uint8_t *plane_row,
+   size_t plane_size,
+   int wide,
+   unsigned int width
+);
+
+/**
+ * @brief Interleaves the first pixels of a row of three channels with SSE2,
+ *        96 bytes at a time, reversing deinterleave3_sse2.
+ *
+ * @param plane_row Pointer to the row of the first plane.
+ * @param plane_size Number of bytes from a plane to the next.
+ * @param row Pointer to the interleaved row.
+ * @param wide 1 for 16-bit samples, 0 for 8-bit samples.
+ * @param width Number of pixels in the row.
+ *
+ * @return
+ *     Number of pixels interleaved, the rest being left to the caller
+ */
+static unsigned int interleave3_sse2(
+   const uint8_t *plane_row,
+   size_t plane_size,
+   uint8_t *row,
+   int wide,
+   unsigned int width
+);
+
+/**
+ * @brief Deinterleaves the first pixels of a row of three channels with
+ *        AVX2, 192 bytes at a time.
+ *
+ * The two lanes of each vector hold the same vector of two blocks of
+ * deinterleave3_sse2, which go through the same layers.
+ *
+ * @param row Pointer to the interleaved row.
+ * @param plane_row Pointer to the row of the first plane.
+ * @param plane_size Number of bytes from a plane to the next.
+ * @param wide 1 for 16-bit samples, 0 for 8-bit samples.
+ * @param width Number of pixels in the row.
+ *
+ * @return
+ *     Number of pixels deinterleaved, the rest being left to the caller
+ */
+static unsigned int deinterleave3_avx2(
+   const uint8_t *row,
+   uint8_t *plane_row,
+   size_t plane_size,
+   int wide,
+   unsigned int width
+);
+
+/**
+ * @brief Interleaves the first pixels of a row of three channels with AVX2,
+ *        192 bytes at a time, reversing deinterleave3_avx2.
+ *
+ * @param plane_row Pointer to the row of the first plane.
+ * @param plane_size Number of bytes from a plane to the next.
+ * @param row Pointer to the interleaved row.
+ * @param wide 1 for 16-bit samples, 0 for 8-bit samples.
+ * @param width Number of pixels in the row.
+ *
+ * @return
+ *     Number of pixels interleaved, the rest being left to the caller
+ */
+static unsigned int interleave3_avx2(
+   const uint8_t *plane_row,
+   size_t plane_size,
+   uint8_t *row,
+   int wide,
+   unsigned int width
+);
+#endif // PNM_X86
+
+/**
+ * @brief Computes the number of samples in one row of an image.
+ *
+ * @param channels Number of samples per pixel.
+ * @param width Width of the image.
+ *
+ * @return
+ *     Number of samples per row
+ */
+static size_t row_sample_count(unsigned int channels, unsigned int width);
+
+/**
+ * @brief Checks that the samples of an image can be addressed in memory.
+ *
+ * The 16-bit rows of the image, padded to their stride, must fit in a
+ * size_t. Every size derived from the dimensions of an image, in any storage,
+ * is then computed without overflow.
+ *
+ * @param channels Number of samples per pixel.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ *
+ * @return
+ *     0 if the samples can be addressed, -1 otherwise
+ */
+static int check_image_size(
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height
+);
+
+/**
+ * @brief Retrieves the number of samples per pixel of a format.
+ *
+ * @param format Format of the image, other than FORMAT_PAM.
+ *
+ * @return
+ *     Number of channels
+ */
+static unsigned int format_channels(FormatPNM format);
+
+/**
+ * @brief Retrieves the PAM tuple type equivalent to a format.
+ *
+ * @param format Format of the image, other than FORMAT_PAM.
+ *
+ * @return
+ *     Tuple type
+ */
+static const char *format_tuple_type(FormatPNM format);
+
+/**
+ * @brief Checks that a filename can be used to write an image of a format.
+ *
+ * @param filename Pointer to the filename string.
+ * @param format Format of the image to write.
+ *
+ * @pre filename != NULL
+ *
+ * @return
+ *     0 valid
+ *    -1 filename is invalid or does not match the format
+ */
+static int check_output_filename(const char *filename, FormatPNM format);
+
+/**
+ * @brief Checks if a filename contains invalid characters.
+ *
+ * @param filename Pointer to the filename string.
+ *
+ * @pre filename != NULL
+ *
+ * @return
+ *     0 valid
+ *     1 invalid characters are found
+ */
+static int check_invalid_characters(const char *filename);
+
+/**
+ * @brief Determines the PNM format based on the file extension.
+ *
+ * @param filename Pointer to the filename string.
+ * @param format Pointer to store the determined format.
+ *
+ * @pre filename != NULL, format != NULL
+ *
+ * @return
+ *     0 on success
+ *    -2 file extension is invalid
+ */
+static int file_extension_to_format(const char *filename, FormatPNM *format);
+
+/**
+ * @brief Converts a magic string to a PNM format and encoding.
+ *
+ * @param magic_string Pointer to the magic string.
+ * @param format Pointer to store the determined format.
+ * @param encoding Pointer to store the determined encoding.
+ *
+ * @pre magic_string != NULL, format != NULL, encoding != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 magic string is invalid
+ */
+static int magic_str_to_format(
+   const char *magic_str,
+   FormatPNM *format,
+   EncodingPNM *encoding
+);
+
+/**
+ * @brief Converts a PNM format and encoding to its magic string.
+ *
+ * @param format The PNM format.
+ * @param encoding The PNM encoding.
+ * @param magic_str Pointer to store the corresponding magic string.
+ *
+ * @pre magic_str != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 format is invalid
+ */
+static int format_to_magic_str(
+   FormatPNM format,
+   EncodingPNM encoding,
+   const char **magic_str
+);
+
+/**
+ * @brief Reads a token made of non-whitespace characters.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param token Buffer to store the token.
+ * @param size Size of the buffer.
+ *
+ * @pre scanner != NULL, token != NULL, 0 < size
+ *
+ * @return
+ *     0 on success
+ *    -1 no token or the token does not fit in the buffer
+ */
+static int read_token(Scanner *scanner, char *token, size_t size);
+
+/**
+ * @brief Skips comments and whitespace in a PNM file.
+ *
+ * Whitespace is recognized through SPACE_TABLE and comments are skipped with
+ * memchr, one buffer at a time.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ *
+ * @pre scanner != NULL
+ */
+static void skip_comments(Scanner *scanner);
+
+/**
+ * @brief Reads the magic string at the start of a PNM file.
+ *
+ * Reads at most two characters up to the next whitespace, like "%2s".
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param magic_str Buffer of three characters to store the magic string.
+ *
+ * @pre scanner != NULL, magic_str != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 at end of file
+ */
+static int read_magic_str(Scanner *scanner, char *magic_str);
+
+/**
+ * @brief Reads an unsigned integer from a PNM file.
+ *
+ * Accepts the same input as "%ld" followed by a range check: an optional
+ * sign followed by decimal digits, whose value must fit in an unsigned int.
+ *
+ * @param scanner Pointer to the scanner to read from.
+ * @param value Pointer to store the read value.
+ *
+ * @pre scanner != NULL, value != NULL
+ *
+ * @return
+ *     0 on success
+ *    -1 on error
+ */
+static int read_unsigned_int(Scanner *scanner, unsigned int *value);
+
+/* ======= External Functions ======= */
+
+void pnm_set_threads(unsigned int count) {
+   if (PNM_MAX_THREADS < count) count = PNM_MAX_THREADS;
+   thread_count = count;
+}
+
+void pnm_stop_threads(void) {
+   // The pool counts as busy while it stops, so that jobs posted meanwhile
+   // run on their calling thread.
+   pthread_mutex_lock(&workers.lock);
+   if (workers.busy || workers.worker_count == 0) {
+      pthread_mutex_unlock(&workers.lock);
+      return;
+   }
+   workers.busy = 1;
+   workers.stopping = 1;
+   unsigned int worker_count = workers.worker_count;
+   pthread_cond_broadcast(&workers.posted);
+   pthread_mutex_unlock(&workers.lock);
+
+   for (unsigned int i = 0; i < worker_count; ++i) {
+      pthread_join(workers.threads[i], NULL);
+   }
+
+   pthread_mutex_lock(&workers.lock);
+   workers.worker_count = 0;
+   workers.stopping = 0;
+   workers.busy = 0;
+   pthread_mutex_unlock(&workers.lock);
+}
+
+unsigned int pnm_get_threads(void) {
+   if (thread_count != 0) return thread_count;
+
+   const char *variable = getenv(PNM_THREADS_VARIABLE);
+   if (variable != NULL && '0' <= *variable && *variable <= '9') {
+      char *end;
+      unsigned long count = strtoul(variable, &end, 10);
+      if (*end == '\0' && 0 < count && count <= PNM_MAX_THREADS) return count;
+   }
+
+   long processors = sysconf(_SC_NPROCESSORS_ONLN);
+   if (processors < 1) return 1;
+   if (PNM_MAX_THREADS < processors) return PNM_MAX_THREADS;
+   return processors;
+}
+
+unsigned int pnm_parallel_bands(size_t count, size_t size) {
+   size_t bands = pnm_get_threads();
+   if (size / PARALLEL_MIN_BAND_SIZE < bands) {
+      bands = size / PARALLEL_MIN_BAND_SIZE;
+   }
+   if (count < bands) bands = count;
+   return bands < 1 ? 1 : bands;
+}
+
+int pnm_parallel_for(
+   size_t count,
+   unsigned int bands,
+   PNMBandRoutine routine,
+   void *context
+) {
+   if (routine == NULL || bands == 0 || PNM_MAX_THREADS < bands) return -4;
+   if (count == 0) return PNM_SUCCESS;
+   if (count < bands) return -4;
+   if (bands == 1) return routine(context, 0, 0, count);
+   return run_bands(routine, context, count, bands);
+}
+
+void pnm_set_allocator(const PNMAllocator *new_allocator) {
+   if (new_allocator == NULL || new_allocator->allocate == NULL
+      || new_allocator->release == NULL) {
+      allocator.allocate = NULL;
+      allocator.release = NULL;
+      allocator.context = NULL;
+      return;
+   }
+   allocator = *new_allocator;
+}
+
+void *pnm_alloc(size_t size) {
+   return allocate_with(&allocator, size);
+}
+
+void pnm_free(void *block) {
+   release_with(&allocator, block);
+}
+
+int pnm_pool_create(PNMPool **pool, size_t capacity) {
+   if (pool == NULL) return -4;
+
+   PNMPool *new_pool = malloc(sizeof(PNMPool));
+   if (new_pool == NULL) return LOAD_PNM_MEMORY_ERROR;
+   if (pthread_mutex_init(&new_pool->lock, NULL) != 0) {
+      free(new_pool);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   new_pool->capacity = capacity;
+   new_pool->blocks = NULL;
+   new_pool->stats.allocations = 0;
+   new_pool->stats.hits = 0;
+   new_pool->stats.cached_blocks = 0;
+   new_pool->stats.cached_size = 0;
+
+   *pool = new_pool;
+   return PNM_SUCCESS;
+}
+
+void pnm_pool_allocator(PNMPool *pool, PNMAllocator *pool_allocator) {
+   if (pool == NULL || pool_allocator == NULL) return;
+   pool_allocator->allocate = pool_allocate;
+   pool_allocator->release = pool_release;
+   pool_allocator->context = pool;
+}
+
+void pnm_pool_stats(PNMPool *pool, PNMPoolStats *stats) {
+   if (pool == NULL || stats == NULL) return;
+   pthread_mutex_lock(&pool->lock);
+   *stats = pool->stats;
+   pthread_mutex_unlock(&pool->lock);
+}
+
+void pnm_pool_destroy(PNMPool **pool) {
+   if (pool == NULL || *pool == NULL) return;
+   PoolBlock *block = (*pool)->blocks;
+   while (block != NULL) {
+      PoolBlock *next = block->header.next;
+      free(block);
+      block = next;
+   }
+   pthread_mutex_destroy(&(*pool)->lock);
+   free(*pool);
+   *pool = NULL;
+}
+
+FormatPNM get_format(PNM *image) {
+   if (image == NULL) return -1;
+   return image->format;
+}
+
+EncodingPNM get_encoding(PNM *image) {
+   if (image == NULL) return -1;
+   return image->encoding;
+}
+
+unsigned int get_width(PNM *image) {
+   if (image == NULL) return 0;
+   return image->width;
+}
+
+unsigned int get_height(PNM *image) {
+   if (image == NULL) return 0;
+   return image->height;
+}
+
+uint16_t get_max_value(PNM *image) {
+   if (image == NULL) return 0;
+   return image->max_value;
+}
+
+unsigned int get_channels(PNM *image) {
+   if (image == NULL) return 0;
+   return image->channels;
+}
+
+const char *get_tuple_type(PNM *image) {
+   if (image == NULL) return NULL;
+   return image->tuple_type;
+}
+
+int has_alpha(PNM *image) {
+   if (image == NULL || image->channels < 2) return 0;
+   size_t length = strlen(image->tuple_type);
+   size_t suffix_length = strlen(PAM_ALPHA_SUFFIX);
+   if (length <= suffix_length) return 0;
+   return !strcmp(image->tuple_type + length - suffix_length, PAM_ALPHA_SUFFIX);
+}
+
+StoragePNM get_storage(PNM *image) {
+   if (image == NULL) return -1;
+   return image->storage;
+}
+
+int get_status(PNM *image) {
+   if (image == NULL) return -4;
+   return image->status;
+}
+
+LayoutPNM get_layout(PNM *image) {
+   if (image == NULL) return -1;
+   return image->layout;
+}
+
+StoragePNM get_default_storage(FormatPNM format, uint16_t max_value) {
+   if (format == FORMAT_PBM) return STORAGE_BIT;
+   if (max_value <= UINT8_MAX) return STORAGE_8;
+   return STORAGE_16;
+}
+
+size_t get_row_size(PNM *image) {
+   if (image == NULL) return 0;
+   return storage_row_size(image->channels, image->width, image->storage);
+}
+
+size_t get_sample_count(PNM *image) {
+   if (image == NULL) return 0;
+   return row_sample_count(image->channels, image->width) * image->height;
+}
+
+size_t get_stride(PNM *image) {
+   if (image == NULL) return 0;
+   return image->stride;
+}
+
+size_t pnm_row_stride(size_t row_size) {
+   return (row_size + PNM_ALIGNMENT - 1) / PNM_ALIGNMENT * PNM_ALIGNMENT;
+}
+
+void *get_row(PNM *image, unsigned int y) {
+   if (image == NULL || load_rows(image) != PNM_SUCCESS) return NULL;
+   if (image->data == NULL || image->height <= y) return NULL;
+   return (uint8_t *)image->data + y * image->stride;
+}
+
+uint16_t *get_data(PNM *image) {
+   if (image == NULL || load_rows(image) != PNM_SUCCESS) return NULL;
+   // Other storages are converted straight into packed rows.
+   if (image->storage != STORAGE_16) {
+      if (convert_storage(image, STORAGE_16, 1) != PNM_SUCCESS) return NULL;
+   } else if (pack_rows(image) != 0) {
+      return NULL;
+   }
+   return image->data;
+}
+
+uint8_t *get_data8(PNM *image) {
+   if (image == NULL || image->storage != STORAGE_8) return NULL;
+   if (load_rows(image) != PNM_SUCCESS) return NULL;
+   return image->data;
+}
+
+uint16_t *get_data16(PNM *image) {
+   if (image == NULL || image->storage != STORAGE_16) return NULL;
+   if (load_rows(image) != PNM_SUCCESS) return NULL;
+   return image->data;
+}
+
+uint8_t *get_bits(PNM *image) {
+   if (image == NULL || image->storage != STORAGE_BIT) return NULL;
+   if (load_data(image) != PNM_SUCCESS) return NULL;
+   return image->data;
+}
+
+void *get_plane(PNM *image, unsigned int channel) {
+   if (image == NULL || image->channels <= channel) return NULL;
+   if (set_layout(image, LAYOUT_PLANAR) != PNM_SUCCESS) return NULL;
+   return (uint8_t *)image->data + (size_t)channel * image->height
+      * image->stride;
+}
+
+void set_pnm(
+   PNM *image,
+   FormatPNM format,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   uint16_t *data
+) {
+   set_pnm_storage(image, format, width, height, max_value, STORAGE_16, data);
+}
+
+void set_pnm_storage(
+   PNM *image,
+   FormatPNM format,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   void *data
+) {
+   if (image == NULL) return;
+   image->format = format;
+   if (format == FORMAT_PAM) {
+      image->encoding = ENCODING_RAW;
+   } else {
+      image->channels = format_channels(format);
+      strcpy(image->tuple_type, format_tuple_type(format));
+   }
+   image->width = width;
+   image->height = height;
+   image->max_value = max_value;
+   image->storage = storage;
+   image->stride = storage_row_size(image->channels, width, storage);
+   image->layout = LAYOUT_INTERLEAVED;
+   if (image->data != data || image->path != NULL) {
+      release_data(image);
+      image->data_allocator = allocator;
+   }
+   image->data = data;
+}
+
+int set_pam(
+   PNM *image,
+   unsigned int width,
+   unsigned int height,
+   unsigned int depth,
+   uint16_t max_value,
+   const char *tuple_type,
+   StoragePNM storage,
+   void *data
+) {
+   if (image == NULL || tuple_type == NULL) return -4;
+   if (depth == 0 || PAM_TUPLE_TYPE_SIZE <= strlen(tuple_type)) return -4;
+   if (check_image_size(depth, width, height) != 0) return -4;
+
+   image->channels = depth;
+   strcpy(image->tuple_type, tuple_type);
+   set_pnm_storage(
+      image,
+      FORMAT_PAM,
+      width,
+      height,
+      max_value,
+      storage,
+      data
+   );
+   return PNM_SUCCESS;
+}
+
+int set_storage(PNM *image, StoragePNM storage) {
+   if (image == NULL) return -4;
+   if (storage != STORAGE_BIT && storage != STORAGE_8
+      && storage != STORAGE_16) {
+      return -4;
+   }
+   if (image->storage == storage) return PNM_SUCCESS;
+   return convert_storage(image, storage, 0);
+}
+
+int set_stride(PNM *image, size_t stride) {
+   if (image == NULL || stride < get_row_size(image)) return -4;
+   image->stride = stride;
+   return PNM_SUCCESS;
+}
+
+int pnm_shrink_data(PNM *image) {
+   if (image == NULL) return -4;
+   if (image->data == NULL || image->share != NULL || image->mapping != NULL
+      || image->path != NULL) {
+      return PNM_SUCCESS;
+   }
+
+   size_t size = image->stride * image->height;
+   if (image->layout == LAYOUT_PLANAR) size *= image->channels;
+   if (size == 0) return PNM_SUCCESS;
+
+   void *block = pnm_alloc(size);
+   if (block == NULL) return LOAD_PNM_MEMORY_ERROR;
+   memcpy(block, image->data, size);
+   release_with(&image->data_allocator, image->data);
+   image->data = block;
+   image->data_allocator = allocator;
+   return PNM_SUCCESS;
+}
+
+int set_layout(PNM *image, LayoutPNM layout) {
+   if (image == NULL) return -4;
+   if (layout != LAYOUT_INTERLEAVED && layout != LAYOUT_PLANAR) return -4;
+   int code = load_data(image);
+   if (code != PNM_SUCCESS) return code;
+   if (image->storage == STORAGE_BIT || image->data == NULL) return -4;
+   if (image->layout == layout) return PNM_SUCCESS;
+
+   // A single channel is laid out the same way in both layouts.
+   if (image->channels == 1) {
+      image->layout = layout;
+      return PNM_SUCCESS;
+   }
+
+   void *data;
+   size_t stride;
+   if (copy_layout(image, layout, &data, &stride) != 0) {
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   release_data(image);
+   image->data = data;
+   image->data_allocator = allocator;
+   image->stride = stride;
+   image->layout = layout;
+   return PNM_SUCCESS;
+}
+
+void set_encoding(PNM *image, EncodingPNM encoding) {
+   if (image == NULL || image->format == FORMAT_PAM) return;
+   // The pending pixel data is decoded in the encoding of its file.
+   load_data(image);
+   image->encoding = encoding;
+}
+
+int create_pnm(
+   PNM **image,
+   FormatPNM format,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value
+) {
+   if (image == NULL || format == FORMAT_PAM) return -4;
+
+   unsigned int channels = format_channels(format);
+   if (check_image_size(channels, width, height) != 0) {
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   StoragePNM storage = get_default_storage(format, max_value);
+   size_t stride = pnm_row_stride(storage_row_size(channels, width, storage));
+   void *data = pnm_alloc(stride * height);
+   if (data == NULL) return LOAD_PNM_MEMORY_ERROR;
+
+   *image = new_pnm();
+   if (*image == NULL) {
+      pnm_free(data);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   set_pnm_storage(*image, format, width, height, max_value, storage, data);
+   (*image)->stride = stride;
+   return PNM_SUCCESS;
+}
+
+int create_pam(
+   PNM **image,
+   unsigned int width,
+   unsigned int height,
+   unsigned int depth,
+   uint16_t max_value,
+   const char *tuple_type
+) {
+   if (image == NULL || tuple_type == NULL) return -4;
+   if (depth == 0 || PAM_TUPLE_TYPE_SIZE <= strlen(tuple_type)) return -4;
+   if (check_image_size(depth, width, height) != 0) {
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+
+   StoragePNM storage = get_default_storage(FORMAT_PAM, max_value);
+   size_t stride = pnm_row_stride(storage_row_size(depth, width, storage));
+   void *data = pnm_alloc(stride * height);
+   if (data == NULL) return LOAD_PNM_MEMORY_ERROR;
+
+   *image = new_pnm();
+   if (*image == NULL) {
+      pnm_free(data);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   set_pam(*image, width, height, depth, max_value, tuple_type, storage, data);
+   (*image)->stride = stride;
+   return PNM_SUCCESS;
+}
+
+int pnm_view(
+   PNM **view,
+   PNM *parent,
+   unsigned int x,
+   unsigned int y,
+   unsigned int width,
+   unsigned int height
+) {
+   if (view == NULL || parent == NULL || width == 0 || height == 0) return -4;
+   int code = load_rows(parent);
+   if (code != PNM_SUCCESS) return code;
+   if (parent->data == NULL) return -4;
+   if (parent->width < width || parent->width - width < x) return -4;
+   if (parent->height < height || parent->height - height < y) return -4;
+   if (parent->storage == STORAGE_BIT && x % 8 != 0) return -4;
+
+   PNM *new_view = new_pnm();
+   if (new_view == NULL) return LOAD_PNM_MEMORY_ERROR;
+   if (parent->share == NULL && create_share(parent) != 0) {
+      pnm_free(new_view);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   pthread_mutex_lock(&parent->share->lock);
+   ++parent->share->references;
+   pthread_mutex_unlock(&parent->share->lock);
+
+   PNMAllocator view_allocator = new_view->allocator;
+   *new_view = *parent;
+   new_view->allocator = view_allocator;
+   new_view->width = width;
+   new_view->height = height;
+   new_view->data = (uint8_t *)parent->data + y * parent->stride
+      + storage_row_size(parent->channels, x, parent->storage);
+   *view = new_view;
+   return PNM_SUCCESS;
+}
+
+int pnm_is_shared(PNM *image) {
+   if (image == NULL || image->share == NULL) return 0;
+   pthread_mutex_lock(&image->share->lock);
+   int shared = 1 < image->share->references;
+   pthread_mutex_unlock(&image->share->lock);
+   return shared;
+}
+
+void free_pnm(PNM **image) {
+   if (image == NULL || *image == NULL) return;
+   release_data(*image);
+   release_with(&(*image)->allocator, *image);
+   *image = NULL;
+}
+
+int load_pnm(PNM **image, const char *filename) {
+   if (image == NULL || filename == NULL) return -4;
+
+   FormatPNM file_extension;
+   if (file_extension_to_format(filename, &file_extension) != 0) {
+      return PNM_INVALID_FILENAME;
+   }
+
+   FILE *file = fopen(filename, "rb");
+   if (file == NULL) return PNM_INVALID_FILENAME;
+
+   int code = decode_file(image, file, &file_extension);
+   if (fclose(file) != 0) {
+      if (code == PNM_SUCCESS) free_pnm(image);
+      return -4;
+   }
+   return code;
+}
+
+int load_pnm_lazy(PNM **image, const char *filename) {
+   if (image == NULL || filename == NULL) return -4;
+
+   FormatPNM file_extension;
+   if (file_extension_to_format(filename, &file_extension) != 0) {
+      return PNM_INVALID_FILENAME;
+   }
+
+   FILE *file = fopen(filename, "rb");
+   if (file == NULL) return PNM_INVALID_FILENAME;
+   // Only the header is read now, in one block without stdio buffering.
+   setvbuf(file, NULL, _IONBF, 0);
+
+   Scanner scanner;
+   if (scanner_init(&scanner, file, PROBE_BUFFER_SIZE) != 0) {
+      fclose(file);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+
+   int code = PNM_SUCCESS;
+   PNM header;
+   int header_code = read_header(&scanner, &header);
+   off_t offset = ftello(file);
+   if (header_code != 0 || offset < 0 || header.format != file_extension) {
+      code = LOAD_PNM_DECODE_ERROR;
+   }
+   header.body_offset = offset - (scanner.length - scanner.position);
+   scanner_release(&scanner);
+
+   if (fclose(file) != 0) return -4;
+   if (code != PNM_SUCCESS) return code;
+
+   size_t length = strlen(filename) + 1;
+   header.path = pnm_alloc(length);
+   if (header.path == NULL) return LOAD_PNM_MEMORY_ERROR;
+   memcpy(header.path, filename, length);
+   header.status = PNM_DECODE_PENDING;
+
+   *image = new_pnm();
+   if (*image == NULL) {
+      pnm_free(header.path);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   **image = header;
+   return PNM_SUCCESS;
+}
+
+int load_pnm_from_memory(PNM **image, const void *bytes, size_t size) {
+   if (image == NULL || bytes == NULL) return -4;
+
+   Scanner scanner;
+   scanner_init_memory(&scanner, bytes, size);
+   return decode_pnm(image, &scanner, NULL);
+}
+
+int load_pnm_from_fd(PNM **image, int fd) {
+   if (image == NULL) return -4;
+
+   FILE *file = open_fd(fd, "rb");
+   if (file == NULL) return PNM_INVALID_FILENAME;
+
+   int code = decode_file(image, file, NULL);
+   if (fclose(file) != 0) {
+      if (code == PNM_SUCCESS) free_pnm(image);
+      return -4;
+   }
+   return code;
+}
+
+int load_pnm_mmap(PNM **image, const char *filename) {
+   if (image == NULL || filename == NULL) return -4;
+
+   FormatPNM file_extension;
+   if (file_extension_to_format(filename, &file_extension) != 0) {
+      return PNM_INVALID_FILENAME;
+   }
+
+   int fd = open(filename, O_RDONLY);
+   if (fd == -1) return PNM_INVALID_FILENAME;
+
+   struct stat file_stat;
+   if (fstat(fd, &file_stat) != 0) {
+      close(fd);
+      return -4;
+   }
+   if (file_stat.st_size == 0) {
+      if (close(fd) != 0) return -4;
+      return LOAD_PNM_DECODE_ERROR;
+   }
+
+   size_t mapping_size = file_stat.st_size;
+   void *mapping = mmap(
+      NULL,
+      mapping_size,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE,
+      fd,
+      0
+   );
+   if (close(fd) != 0) {
+      if (mapping != MAP_FAILED) munmap(mapping, mapping_size);
+      return -4;
+   }
+   if (mapping == MAP_FAILED) return LOAD_PNM_MEMORY_ERROR;
+
+   Scanner scanner;
+   scanner_init_memory(&scanner, mapping, mapping_size);
+   int code = map_pnm(
+      image,
+      &scanner,
+      file_extension,
+      mapping,
+      mapping_size
+   );
+   if (code != PNM_SUCCESS || (*image)->mapping != mapping) {
+      munmap(mapping, mapping_size);
+   }
+   return code;
+}
+
+int load_pnm_region(
+   PNM **image,
+   const char *filename,
+   unsigned int x,
+   unsigned int y,
+   unsigned int width,
+   unsigned int height
+) {
+   if (image == NULL || filename == NULL) return -4;
+   if (width == 0 || height == 0) return -4;
+
+   FormatPNM file_extension;
+   if (file_extension_to_format(filename, &file_extension) != 0) {
+      return PNM_INVALID_FILENAME;
+   }
+
+   FILE *file = fopen(filename, "rb");
+   if (file == NULL) return PNM_INVALID_FILENAME;
+
+   Scanner scanner;
+   int code = LOAD_PNM_MEMORY_ERROR;
+   if (scanner_init(&scanner, file, SCANNER_BUFFER_SIZE) == 0) {
+      code = decode_region(
+         image,
+         &scanner,
+         file_extension,
+         x,
+         y,
+         width,
+         height
+      );
+      scanner_release(&scanner);
+   }
+
+   if (fclose(file) != 0) {
+      if (code == PNM_SUCCESS) free_pnm(image);
+      return -4;
+   }
+   return code;
+}
+
+int pnm_probe(const char *filename, PNMInfo *info) {
+   if (filename == NULL || info == NULL) return -4;
+
+   FILE *file = fopen(filename, "rb");
+   if (file == NULL) return PNM_INVALID_FILENAME;
+   // Headers are small: the scanner reads one block without stdio buffering.
+   setvbuf(file, NULL, _IONBF, 0);
+
+   Scanner scanner;
+   if (scanner_init(&scanner, file, PROBE_BUFFER_SIZE) != 0) {
+      fclose(file);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+
+   int code = PNM_SUCCESS;
+   PNM header;
+   int header_code = read_header(&scanner, &header);
+   off_t offset = ftello(file);
+   if (header_code != 0 || offset < 0) {
+      code = LOAD_PNM_DECODE_ERROR;
+   } else {
+      info->format = header.format;
+      info->encoding = header.encoding;
+      info->width = header.width;
+      info->height = header.height;
+      info->max_value = header.max_value;
+      info->channels = header.channels;
+      info->data_offset = offset - (scanner.length - scanner.position);
+   }
+   scanner_release(&scanner);
+
+   if (fclose(file) != 0) return -4;
+   return code;
+}
+
+int pnm_probe_batch(
+   const char *const *filenames,
+   size_t count,
+   PNMInfo *infos,
+   int *codes
+) {
+   if (filenames == NULL || infos == NULL || codes == NULL) return -4;
+
+   ProbeJob job;
+   job.filenames = filenames;
+   job.infos = infos;
+   job.codes = codes;
+   job.count = count;
+   job.next = 0;
+   if (count < 2 || pthread_mutex_init(&job.lock, NULL) != 0) {
+      for (size_t i = 0; i < count; ++i) {
+         codes[i] = pnm_probe(filenames[i], &infos[i]);
+      }
+      return PNM_SUCCESS;
+   }
+
+   // Probes mostly wait for the file system, so a few threads are used even
+   // on a single processor.
+   unsigned int threads = pnm_get_threads();
+   if (threads < PROBE_MIN_THREADS) threads = PROBE_MIN_THREADS;
+   if (count < threads) threads = count;
+
+   // A task size of 0 hands the same job to every thread.
+   run_tasks(probe_files, &job, 0, threads);
+
+   pthread_mutex_destroy(&job.lock);
+   return PNM_SUCCESS;
+}
+
+int write_pnm(PNM *image, const char *filename) {
+   if (image == NULL || filename == NULL) return -4;
+
+   if (check_output_filename(filename, image->format) != 0) {
+      return PNM_INVALID_FILENAME;
+   }
+   // Decoding first lets a lazily loaded image be written over its file.
+   if (load_data(image) != PNM_SUCCESS) {
+      return WRITE_PNM_FILE_MANIPULATION_ERROR;
+   }
+
+   FILE *file = fopen(filename, "wb");
+   if (file == NULL) return PNM_INVALID_FILENAME;
+
+   int code = encode_file(file, image);
+   if (fclose(file) != 0 || code != 0) {
+      return WRITE_PNM_FILE_MANIPULATION_ERROR;
+   }
+   return PNM_SUCCESS;
+}
+
+int write_pnm_to_memory(PNM *image, void **bytes, size_t *size) {
+   if (image == NULL || bytes == NULL || size == NULL) return -4;
+   if (load_data(image) != PNM_SUCCESS) {
+      return WRITE_PNM_FILE_MANIPULATION_ERROR;
+   }
+
+   char *buffer = NULL;
+   size_t length = 0;
+   FILE *file = open_memstream(&buffer, &length);
+   if (file == NULL) return WRITE_PNM_FILE_MANIPULATION_ERROR;
+
+   int code = encode_file(file, image);
+   if (fclose(file) != 0 || code != 0) {
+      free(buffer);
+      return WRITE_PNM_FILE_MANIPULATION_ERROR;
+   }
+   *bytes = buffer;
+   *size = length;
+   return PNM_SUCCESS;
+}
+
+int write_pnm_to_fd(PNM *image, int fd) {
+   if (image == NULL) return -4;
+   if (load_data(image) != PNM_SUCCESS) {
+      return WRITE_PNM_FILE_MANIPULATION_ERROR;
+   }
+
+   FILE *file = open_fd(fd, "wb");
+   if (file == NULL) return PNM_INVALID_FILENAME;
+
+   int code = encode_file(file, image);
+   if (fclose(file) != 0 || code != 0) {
+      return WRITE_PNM_FILE_MANIPULATION_ERROR;
+   }
+   return PNM_SUCCESS;
+}
+
+int pnm_reader_open(PNMReader **reader, const char *filename) {
+   if (reader == NULL || filename == NULL) return -4;
+
+   FormatPNM file_extension;
+   if (file_extension_to_format(filename, &file_extension) != 0) {
+      return PNM_INVALID_FILENAME;
+   }
+
+   PNMReader *new_reader = pnm_alloc(sizeof(PNMReader));
+   if (new_reader == NULL) return LOAD_PNM_MEMORY_ERROR;
+
+   new_reader->file = fopen(filename, "rb");
+   if (new_reader->file == NULL) {
+      pnm_free(new_reader);
+      return PNM_INVALID_FILENAME;
+   }
+   if (scanner_init(
+      &new_reader->scanner,
+      new_reader->file,
+      SCANNER_BUFFER_SIZE
+   ) != 0) {
+      fclose(new_reader->file);
+      pnm_free(new_reader);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+
+   PNM *header = &new_reader->header;
+   int header_code = read_header(&new_reader->scanner, header);
+   if (header_code != 0 || header->format != file_extension) {
+      pnm_reader_close(&new_reader);
+      return LOAD_PNM_DECODE_ERROR;
+   }
+   header->storage = STORAGE_16;
+   header->stride = get_row_size(header);
+   new_reader->row = 0;
+
+   *reader = new_reader;
+   return PNM_SUCCESS;
+}
+
+void pnm_reader_header(
+   PNMReader *reader,
+   FormatPNM *format,
+   EncodingPNM *encoding,
+   unsigned int *width,
+   unsigned int *height,
+   uint16_t *max_value
+) {
+   if (reader == NULL) return;
+   if (format != NULL) *format = reader->header.format;
+   if (encoding != NULL) *encoding = reader->header.encoding;
+   if (width != NULL) *width = reader->header.width;
+   if (height != NULL) *height = reader->header.height;
+   if (max_value != NULL) *max_value = reader->header.max_value;
+}
+
+unsigned int pnm_reader_channels(PNMReader *reader) {
+   if (reader == NULL) return 0;
+   return reader->header.channels;
+}
+
+int pnm_read_rows(
+   PNMReader *reader,
+   uint16_t *rows,
+   unsigned int count,
+   unsigned int *read_count
+) {
+   if (reader == NULL || rows == NULL || read_count == NULL) return -4;
+
+   PNM *header = &reader->header;
+   unsigned int remaining = header->height - reader->row;
+   if (remaining < count) count = remaining;
+   *read_count = 0;
+   if (count == 0) return PNM_SUCCESS;
+
+   int data_code;
+   if (header->encoding == ENCODING_RAW) {
+      data_code = read_raw_data(
+         &reader->scanner,
+         header->format,
+         header->channels,
+         header->width,
+         count,
+         header->max_value,
+         STORAGE_16,
+         header->stride,
+         rows
+      );
+   } else {
+      data_code = read_data(
+         &reader->scanner,
+         header->channels,
+         header->width,
+         count,
+         header->max_value,
+         STORAGE_16,
+         header->stride,
+         rows
+      );
+   }
+   if (data_code == -2) return LOAD_PNM_MEMORY_ERROR;
+   if (data_code != 0) return LOAD_PNM_DECODE_ERROR;
+
+   reader->row += count;
+   *read_count = count;
+   return PNM_SUCCESS;
+}
+
+void pnm_reader_close(PNMReader **reader) {
+   if (reader == NULL || *reader == NULL) return;
+   scanner_release(&(*reader)->scanner);
+   fclose((*reader)->file);
+   pnm_free(*reader);
+   *reader = NULL;
+}
+
+int pnm_frames_open(PNMFrameReader **frames, const char *filename) {
+   if (frames == NULL || filename == NULL) return -4;
+
+   FILE *file = fopen(filename, "rb");
+   if (file == NULL) return PNM_INVALID_FILENAME;
+   return frames_open_file(frames, file);
+}
+
+int pnm_frames_open_fd(PNMFrameReader **frames, int fd) {
+   if (frames == NULL) return -4;
+
+   FILE *file = open_fd(fd, "rb");
+   if (file == NULL) return PNM_INVALID_FILENAME;
+   return frames_open_file(frames, file);
+}
+
+int pnm_frames_next(PNMFrameReader *frames, PNM **image) {
+   if (frames == NULL || image == NULL) return -4;
+   *image = NULL;
+
+   Scanner *scanner = &frames->scanner;
+   skip_comments(scanner);
+   if (scanner_peek(scanner) == EOF) return PNM_END_OF_FRAMES;
+
+   PNM header;
+   if (read_header(scanner, &header) != 0) return LOAD_PNM_DECODE_ERROR;
+
+   PNM *frame = frames->image;
+   size_t size = header.stride * header.height;
+   void *data = frame->data;
+   if (data == NULL || frame->mapping != NULL || frame->share != NULL
+      || frame->stride * frame->height < size) {
+      data = pnm_alloc(size);
+      if (data == NULL) return LOAD_PNM_MEMORY_ERROR;
+   }
+
+   // The parallel decoder reads the whole rest of the file, which holds the
+   // next images, so ASCII images go through read_data.
+   int data_code;
+   if (header.encoding == ENCODING_RAW) {
+      data_code = read_raw_data(
+         scanner,
+         header.format,
+         header.channels,
+         header.width,
+         header.height,
+         header.max_value,
+         header.storage,
+         header.stride,
+         data
+      );
+   } else {
+      data_code = read_data(
+         scanner,
+         header.channels,
+         header.width,
+         header.height,
+         header.max_value,
+         header.storage,
+         header.stride,
+         data
+      );
+   }
+   if (data_code != 0) {
+      if (data != frame->data) pnm_free(data);
+      if (data_code == -2) return LOAD_PNM_MEMORY_ERROR;
+      return LOAD_PNM_DECODE_ERROR;
+   }
+
+   if (data != frame->data) {
+      release_data(frame);
+   } else {
+      header.data_allocator = frame->data_allocator;
+   }
+   header.data = data;
+   header.allocator = frame->allocator;
+   *frame = header;
+   *image = frame;
+   return PNM_SUCCESS;
+}
+
+void pnm_frames_close(PNMFrameReader **frames) {
+   if (frames == NULL || *frames == NULL) return;
+   free_pnm(&(*frames)->image);
+   scanner_release(&(*frames)->scanner);
+   fclose((*frames)->file);
+   pnm_free(*frames);
+   *frames = NULL;
+}
+
+int pnm_writer_open(
+   PNMWriter **writer,
+   const char *filename,
+   FormatPNM format,
+   EncodingPNM encoding,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value
+) {
+   if (writer == NULL || filename == NULL || format == FORMAT_PAM) return -4;
+   if (check_image_size(format_channels(format), width, height) != 0) {
+      return -4;
+   }
+
+   if (check_output_filename(filename, format) != 0) {
+      return PNM_INVALID_FILENAME;
+   }
+
+   PNMWriter *new_writer = pnm_alloc(sizeof(PNMWriter));
+   if (new_writer == NULL) return WRITE_PNM_FILE_MANIPULATION_ERROR;
+
+   PNM *header = &new_writer->header;
+   header->format = format;
+   header->encoding = encoding;
+   header->width = width;
+   header->height = height;
+   header->max_value = max_value;
+   header->channels = format_channels(format);
+   strcpy(header->tuple_type, format_tuple_type(format));
+   header->storage = STORAGE_16;
+   header->stride = get_row_size(header);
+   header->data = NULL;
+   header->mapping = NULL;
+   header->mapping_size = 0;
+   header->path = NULL;
+   header->body_offset = 0;
+   header->status = PNM_SUCCESS;
+   header->share = NULL;
+   header->layout = LAYOUT_INTERLEAVED;
+   header->allocator = allocator;
+   header->data_allocator = allocator;
+   new_writer->row = 0;
+
+   new_writer->file = fopen(filename, "wb");
+   if (new_writer->file == NULL) {
+      pnm_free(new_writer);
+      return PNM_INVALID_FILENAME;
+   }
+   if (writer_init(&new_writer->writer, new_writer->file) != 0) {
+      fclose(new_writer->file);
+      pnm_free(new_writer);
+      return WRITE_PNM_FILE_MANIPULATION_ERROR;
+   }
+   if (write_header(&new_writer->writer, header) != 0) {
+      writer_release(&new_writer->writer);
+      fclose(new_writer->file);
+      pnm_free(new_writer);
+      return WRITE_PNM_FILE_MANIPULATION_ERROR;
+   }
+
+   *writer = new_writer;
+   return PNM_SUCCESS;
+}
+
+int pnm_write_rows(
+   PNMWriter *writer,
+   const uint16_t *rows,
+   unsigned int count
+) {
+   if (writer == NULL || rows == NULL) return -4;
+   if (writer->header.height - writer->row < count) {
+      return WRITE_PNM_FILE_MANIPULATION_ERROR;
+   }
+
+   PNM batch = writer->header;
+   batch.height = count;
+   batch.data = (uint16_t *)rows;
+
+   int data_code;
+   if (batch.encoding == ENCODING_RAW) {
+      data_code = write_raw_data(&writer->writer, &batch);
+   } else {
+      data_code = write_ascii_data(&writer->writer, &batch);
+   }
+   if (data_code != 0) return WRITE_PNM_FILE_MANIPULATION_ERROR;
+
+   writer->row += count;
+   return PNM_SUCCESS;
+}
+
+int pnm_writer_close(PNMWriter **writer) {
+   if (writer == NULL || *writer == NULL) return -4;
+
+   int code = PNM_SUCCESS;
+   if ((*writer)->row != (*writer)->header.height) {
+      code = WRITE_PNM_FILE_MANIPULATION_ERROR;
+   }
+   if (writer_flush(&(*writer)->writer) != 0) {
+      code = WRITE_PNM_FILE_MANIPULATION_ERROR;
+   }
+   writer_release(&(*writer)->writer);
+   if (fclose((*writer)->file) != 0) code = WRITE_PNM_FILE_MANIPULATION_ERROR;
+   pnm_free(*writer);
+   *writer = NULL;
+   return code;
+}
+
+/* ======= Internal functions ======= */
+
+static int scanner_init(Scanner *scanner, FILE *file, size_t capacity) {
+   scanner->file = file;
+   scanner->capacity = capacity;
+   scanner->position = 0;
+   scanner->length = 0;
+   scanner->buffer = pnm_alloc(capacity);
+   if (scanner->buffer == NULL) return -1;
+   return 0;
+}
+
+static void scanner_init_memory(
+   Scanner *scanner,
+   const void *bytes,
+   size_t size
+) {
+   scanner->file = NULL;
+   scanner->buffer = (unsigned char *)bytes;
+   scanner->capacity = size;
+   scanner->position = 0;
+   scanner->length = size;
+}
+
+static void scanner_release(Scanner *scanner) {
+   if (scanner->file != NULL) pnm_free(scanner->buffer);
+   scanner->buffer = NULL;
+}
+
+static size_t scanner_fill(Scanner *scanner) {
+   if (scanner->file == NULL) return 0;
+   scanner->position = 0;
+   scanner->length = fread(
+      scanner->buffer,
+      1,
+      scanner->capacity,
+      scanner->file
+   );
+   return scanner->length;
+}
+
+static int scanner_peek(Scanner *scanner) {
+   if (scanner->position == scanner->length && scanner_fill(scanner) == 0) {
+      return EOF;
+   }
+   return scanner->buffer[scanner->position];
+}
+
+static size_t scanner_read(Scanner *scanner, void *bytes, size_t count) {
+   size_t buffered = scanner->length - scanner->position;
+   if (count <= buffered) {
+      memcpy(bytes, scanner->buffer + scanner->position, count);
+      scanner->position += count;
+      return count;
+   }
+   memcpy(bytes, scanner->buffer + scanner->position, buffered);
+   scanner->position = scanner->length;
+   if (scanner->file == NULL) return buffered;
+   return buffered + fread(
+      (unsigned char *)bytes + buffered,
+      1,
+      count - buffered,
+      scanner->file
+   );
+}
+
+static int scanner_skip(Scanner *scanner, size_t count) {
+   size_t buffered = scanner->length - scanner->position;
+   if (count <= buffered) {
+      scanner->position += count;
+      return 0;
+   }
+   count -= buffered;
+   scanner->position = scanner->length;
+   if (scanner->file == NULL) return -1;
+   if (fseeko(scanner->file, (off_t)count, SEEK_CUR) == 0) return 0;
+
+   while (0 < count) {
+      size_t length = scanner_fill(scanner);
+      if (length == 0) return -1;
+      if (count < length) length = count;
+      scanner->position = length;
+      count -= length;
+   }
+   return 0;
+}
+
+static int scanner_rest_size(Scanner *scanner, size_t *size) {
+   struct stat file_stat;
+   off_t offset = ftello(scanner->file);
+   if (offset < 0 || fstat(fileno(scanner->file), &file_stat) != 0) return -1;
+   if (!S_ISREG(file_stat.st_mode) || file_stat.st_size < offset) return -1;
+
+   // The buffered bytes come first, then everything after the file position.
+   size_t buffered = scanner->length - scanner->position;
+   uintmax_t left = (uintmax_t)(file_stat.st_size - offset);
+   *size = SIZE_MAX - buffered < left ? SIZE_MAX : buffered + (size_t)left;
+   return 0;
+}
+
+static void *probe_files(void *argument) {
+   ProbeJob *job = argument;
+   for (;;) {
+      pthread_mutex_lock(&job->lock);
+      size_t i = job->next;
+      if (i < job->count) ++job->next;
+      pthread_mutex_unlock(&job->lock);
+
+      if (job->count <= i) return NULL;
+      job->codes[i] = pnm_probe(job->filenames[i], &job->infos[i]);
+   }
+}
+
+static PNM *new_pnm(void) {
+   PNM *image = pnm_alloc(sizeof(PNM));
+   if (image == NULL) return NULL;
+   image->format = FORMAT_PBM;
+   image->encoding = ENCODING_ASCII;
+   image->width = 0;
+   image->height = 0;
+   image->max_value = 0;
+   image->channels = format_channels(FORMAT_PBM);
+   strcpy(image->tuple_type, format_tuple_type(FORMAT_PBM));
+   image->storage = STORAGE_16;
+   image->stride = 0;
+   image->data = NULL;
+   image->mapping = NULL;
+   image->mapping_size = 0;
+   image->path = NULL;
+   image->body_offset = 0;
+   image->status = PNM_SUCCESS;
+   image->share = NULL;
+   image->layout = LAYOUT_INTERLEAVED;
+   image->allocator = allocator;
+   image->data_allocator = allocator;
+   return image;
+}
+
+static void release_data(PNM *image) {
+   if (image->share != NULL) {
+      release_share(image->share);
+      image->share = NULL;
+   } else if (image->mapping != NULL) {
+      munmap(image->mapping, image->mapping_size);
+      image->mapping = NULL;
+      image->mapping_size = 0;
+   } else {
+      release_with(&image->data_allocator, image->data);
+   }
+   image->data = NULL;
+   release_with(&image->allocator, image->path);
+   image->path = NULL;
+   image->status = PNM_SUCCESS;
+}
+
+static int load_data(PNM *image) {
+   if (image->status != PNM_DECODE_PENDING) return image->status;
+
+   int code = PNM_INVALID_FILENAME;
+   FILE *file = fopen(image->path, "rb");
+   if (file != NULL) {
+      Scanner scanner;
+      if (fseeko(file, image->body_offset, SEEK_SET) != 0) {
+         code = LOAD_PNM_DECODE_ERROR;
+      } else if (scanner_init(&scanner, file, SCANNER_BUFFER_SIZE) != 0) {
+         code = LOAD_PNM_MEMORY_ERROR;
+      } else {
+         code = decode_data(&scanner, image, &image->data);
+         image->data_allocator = allocator;
+         scanner_release(&scanner);
+      }
+      fclose(file);
+   }
+
+   release_with(&image->allocator, image->path);
+   image->path = NULL;
+   image->status = code;
+   return code;
+}
+
+static int load_rows(PNM *image) {
+   int code = load_data(image);
+   if (code != PNM_SUCCESS || image->layout == LAYOUT_INTERLEAVED) {
+      return code;
+   }
+   return set_layout(image, LAYOUT_INTERLEAVED);
+}
+
+static int copy_layout(
+   const PNM *image,
+   LayoutPNM layout,
+   void **data,
+   size_t *stride
+) {
+   unsigned int width = image->width;
+   unsigned int height = image->height;
+   unsigned int channels = image->channels;
+   int planar = layout == LAYOUT_PLANAR;
+
+   size_t plane_row_size = storage_row_size(1, width, image->storage);
+   size_t new_stride = pnm_row_stride(
+      planar ? plane_row_size : plane_row_size * channels
+   );
+   size_t row_count = (size_t)height * (planar ? channels : 1);
+   if (row_count != 0 && SIZE_MAX / row_count < new_stride) return -1;
+   uint8_t *new_data = pnm_alloc(new_stride * row_count);
+   if (new_data == NULL && 0 < new_stride * row_count) return -1;
+
+   uint8_t *planes = planar ? new_data : image->data;
+   size_t plane_stride = planar ? new_stride : image->stride;
+   uint8_t *rows = planar ? image->data : new_data;
+   size_t row_stride = planar ? image->stride : new_stride;
+   size_t plane_size = height * plane_stride;
+   for (unsigned int y = 0; y < height; ++y) {
+      uint8_t *row = rows + y * row_stride;
+      uint8_t *plane_row = planes + y * plane_stride;
+      if (planar) {
+         deinterleave_row(
+            row,
+            plane_row,
+            plane_size,
+            image->storage,
+            channels,
+            width
+         );
+      } else {
+         interleave_row(
+            plane_row,
+            plane_size,
+            row,
+            image->storage,
+            channels,
+            width
+         );
+      }
+   }
+
+   *data = new_data;
+   *stride = new_stride;
+   return 0;
+}
+
+static int convert_storage(PNM *image, StoragePNM storage, int packed) {
+   int code = load_rows(image);
+   if (code != PNM_SUCCESS) return code;
+
+   size_t row_count = row_sample_count(image->channels, image->width);
+   size_t new_row_size = storage_row_size(
+      image->channels,
+      image->width,
+      storage
+   );
+   size_t new_stride = packed ? new_row_size : pnm_row_stride(new_row_size);
+
+   uint8_t *new_data = pnm_alloc(new_stride * image->height);
+   if (new_data == NULL && 0 < new_stride * image->height) {
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+
+   const uint8_t *data = image->data;
+   for (unsigned int y = 0; y < image->height; ++y) {
+      const uint8_t *row = data + y * image->stride;
+      uint8_t *new_row = new_data + y * new_stride;
+      if (storage == STORAGE_BIT) memset(new_row, 0, new_row_size);
+      for (size_t x = 0; x < row_count; ++x) {
+         store_sample(new_row, storage, x, load_sample(row, image->storage, x));
+      }
+   }
+
+   set_pnm_storage(
+      image,
+      image->format,
+      image->width,
+      image->height,
+      image->max_value,
+      storage,
+      new_data
+   );
+   image->stride = new_stride;
+   return PNM_SUCCESS;
+}
+
+static int pack_rows(PNM *image) {
+   size_t row_size = get_row_size(image);
+   if (image->stride == row_size || image->data == NULL) return 0;
+
+   uint8_t *data = image->data;
+   if (!pnm_is_shared(image) && image->mapping == NULL) {
+      // Each row moves towards the start of the block, past the rows
+      // already moved.
+      for (unsigned int y = 1; y < image->height; ++y) {
+         memmove(data + y * row_size, data + y * image->stride, row_size);
+      }
+   } else {
+      uint8_t *new_data = pnm_alloc(row_size * image->height);
+      if (new_data == NULL && 0 < row_size * image->height) return -1;
+      for (unsigned int y = 0; y < image->height; ++y) {
+         memcpy(new_data + y * row_size, data + y * image->stride, row_size);
+      }
+      set_pnm_storage(
+         image,
+         image->format,
+         image->width,
+         image->height,
+         image->max_value,
+         image->storage,
+         new_data
+      );
+   }
+   image->stride = row_size;
+   return 0;
+}
+
+static int create_share(PNM *image) {
+   Share *share = pnm_alloc(sizeof(Share));
+   if (share == NULL) return -1;
+   if (pthread_mutex_init(&share->lock, NULL) != 0) {
+      pnm_free(share);
+      return -1;
+   }
+   share->block = image->data;
+   share->block_allocator = image->data_allocator;
+   share->allocator = allocator;
+   share->mapping = image->mapping;
+   share->mapping_size = image->mapping_size;
+   share->references = 1;
+
+   image->mapping = NULL;
+   image->mapping_size = 0;
+   image->share = share;
+   return 0;
+}
+
+static void release_share(Share *share) {
+   pthread_mutex_lock(&share->lock);
+   unsigned int references = --share->references;
+   pthread_mutex_unlock(&share->lock);
+   if (references != 0) return;
+
+   if (share->mapping != NULL) {
+      munmap(share->mapping, share->mapping_size);
+   } else {
+      release_with(&share->block_allocator, share->block);
+   }
+   pthread_mutex_destroy(&share->lock);
+   release_with(&share->allocator, share);
+}
+
+static int decode_file(
+   PNM **image,
+   FILE *file,
+   const FormatPNM *expected_format
+) {
+   Scanner scanner;
+   if (scanner_init(&scanner, file, SCANNER_BUFFER_SIZE) != 0) {
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   int code = decode_pnm(image, &scanner, expected_format);
+   scanner_release(&scanner);
+   return code;
+}
+
+static int decode_pnm(
+   PNM **image,
+   Scanner *scanner,
+   const FormatPNM *expected_format
+) {
+   PNM header;
+   if (read_header(scanner, &header) != 0) return LOAD_PNM_DECODE_ERROR;
+   if (expected_format != NULL && *expected_format != header.format) {
+      return LOAD_PNM_DECODE_ERROR;
+   }
+
+   int data_code = decode_data(scanner, &header, &header.data);
+   if (data_code != PNM_SUCCESS) return data_code;
+
+   *image = new_pnm();
+   if (*image == NULL) {
+      pnm_free(header.data);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   **image = header;
+   return PNM_SUCCESS;
+}
+
+static int decode_data(Scanner *scanner, const PNM *header, void **data) {
+   void *new_data = pnm_alloc(header->stride * header->height);
+   if (new_data == NULL) return LOAD_PNM_MEMORY_ERROR;
+
+   int data_code;
+   if (header->encoding == ENCODING_RAW) {
+      data_code = read_raw_data(
+         scanner,
+         header->format,
+         header->channels,
+         header->width,
+         header->height,
+         header->max_value,
+         header->storage,
+         header->stride,
+         new_data
+      );
+   } else {
+      data_code = read_ascii_data(
+         scanner,
+         header->channels,
+         header->width,
+         header->height,
+         header->max_value,
+         header->storage,
+         header->stride,
+         new_data
+      );
+   }
+   if (data_code != 0) {
+      pnm_free(new_data);
+      if (data_code == -2) return LOAD_PNM_MEMORY_ERROR;
+      return LOAD_PNM_DECODE_ERROR;
+   }
+
+   *data = new_data;
+   return PNM_SUCCESS;
+}
+
+static int decode_region(
+   PNM **image,
+   Scanner *scanner,
+   FormatPNM expected_format,
+   unsigned int x,
+   unsigned int y,
+   unsigned int width,
+   unsigned int height
+) {
+   PNM header;
+   if (read_header(scanner, &header) != 0) return LOAD_PNM_DECODE_ERROR;
+   if (expected_format != header.format) return LOAD_PNM_DECODE_ERROR;
+   if (header.width < x || header.width - x < width) return -4;
+   if (header.height < y || header.height - y < height) return -4;
+
+   PNM region = header;
+   region.width = width;
+   region.height = height;
+   region.stride = pnm_row_stride(get_row_size(&region));
+   region.data = pnm_alloc(region.stride * height);
+   if (region.data == NULL) return LOAD_PNM_MEMORY_ERROR;
+
+   int data_code;
+   if (header.encoding == ENCODING_RAW) {
+      data_code = read_region_raw_data(scanner, &header, x, y, &region);
+   } else {
+      data_code = read_region_data(scanner, &header, x, y, &region);
+   }
+   if (data_code != 0) {
+      pnm_free(region.data);
+      if (data_code == -2) return LOAD_PNM_MEMORY_ERROR;
+      return LOAD_PNM_DECODE_ERROR;
+   }
+
+   *image = new_pnm();
+   if (*image == NULL) {
+      pnm_free(region.data);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   **image = region;
+   return PNM_SUCCESS;
+}
+
+static int map_pnm(
+   PNM **image,
+   Scanner *scanner,
+   FormatPNM expected_format,
+   void *mapping,
+   size_t mapping_size
+) {
+   PNM header;
+   if (read_header(scanner, &header) != 0) return LOAD_PNM_DECODE_ERROR;
+   if (expected_format != header.format) return LOAD_PNM_DECODE_ERROR;
+
+   // Converting 16-bit samples to host order in place would write every
+   // page of the mapping.
+   StoragePNM storage = header.storage;
+   int in_place = header.encoding == ENCODING_RAW && storage != STORAGE_16;
+
+   if (in_place) {
+      size_t data_count = row_sample_count(header.channels, header.width);
+      data_count *= header.height;
+      header.stride = get_row_size(&header);
+      size_t data_size = header.stride * header.height;
+
+      size_t offset = scanner->position;
+      if (mapping_size - offset < data_size) return LOAD_PNM_DECODE_ERROR;
+
+      unsigned char *bytes = (unsigned char *)mapping + offset;
+      if (storage == STORAGE_8
+         && check_bytes(bytes, data_count, header.max_value) != 0) {
+         return LOAD_PNM_DECODE_ERROR;
+      }
+      header.data = bytes;
+   } else {
+      int data_code = decode_data(scanner, &header, &header.data);
+      if (data_code != PNM_SUCCESS) return data_code;
+   }
+
+   *image = new_pnm();
+   if (*image == NULL) {
+      if (!in_place) pnm_free(header.data);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   **image = header;
+   if (in_place) {
+      (*image)->mapping = mapping;
+      (*image)->mapping_size = mapping_size;
+   }
+   return PNM_SUCCESS;
+}
+
+static int read_header(Scanner *scanner, PNM *header) {
+   skip_comments(scanner);
+
+   char magic_str[3];
+   if (read_magic_str(scanner, magic_str) != 0) return -1;
+   FormatPNM format;
+   if (magic_str_to_format(magic_str, &format, &header->encoding) != 0) {
+      return -1;
+   }
+   header->format = format;
+   header->data = NULL;
+   header->mapping = NULL;
+   header->mapping_size = 0;
+   header->path = NULL;
+   header->body_offset = 0;
+   header->status = PNM_SUCCESS;
+   header->share = NULL;
+   header->layout = LAYOUT_INTERLEAVED;
+   header->allocator = allocator;
+   header->data_allocator = allocator;
+
+   if (format == FORMAT_PAM) {
+      int pam_code = read_pam_header(scanner, header);
+      if (pam_code != 0) return pam_code;
+      if (check_image_size(header->channels, header->width, header->height)) {
+         return -2;
+      }
+      header->storage = get_default_storage(format, header->max_value);
+      header->stride = pnm_row_stride(get_row_size(header));
+      return 0;
+   }
+   header->channels = format_channels(format);
+   strcpy(header->tuple_type, format_tuple_type(format));
+
+   unsigned int width;
+   unsigned int height;
+   if (read_unsigned_int(scanner, &width) != 0) return -2;
+   if (read_unsigned_int(scanner, &height) != 0) return -2;
+   if (width == 0 || height == 0) return -2;
+   if (check_image_size(header->channels, width, height) != 0) return -2;
+   header->width = width;
+   header->height = height;
+
+   unsigned int max_value = PBM_MAX_VALUE;
+   if (format != FORMAT_PBM) {
+      // PGM files hold samples of up to 16 bits, as PPM files do.
+      if (read_unsigned_int(scanner, &max_value) != 0) return -3;
+      if (max_value == 0 || PPM_MAX_VALUE < max_value) return -3;
+   }
+   if (header->encoding == ENCODING_RAW) {
+      if (!isspace(scanner_peek(scanner))) {
+         return (format == FORMAT_PBM) ? -2 : -3;
+      }
+      ++scanner->position;
+   }
+   header->max_value = max_value;
+   header->storage = get_default_storage(format, max_value);
+   header->stride = pnm_row_stride(get_row_size(header));
+   return 0;
+}
+
+static int read_pam_header(Scanner *scanner, PNM *header) {
+   unsigned int width = 0;
+   unsigned int height = 0;
+   unsigned int depth = 0;
+   unsigned int max_value = 0;
+   size_t tuple_length = 0;
+   header->tuple_type[0] = '\0';
+
+   for (;;) {
+      char keyword[PAM_KEYWORD_SIZE];
+      skip_comments(scanner);
+      if (read_token(scanner, keyword, sizeof(keyword)) != 0) return -2;
+      if (!strcmp(keyword, "ENDHDR")) break;
+
+      int field_code;
+      if (!strcmp(keyword, "WIDTH")) {
+         field_code = read_unsigned_int(scanner, &width);
+      } else if (!strcmp(keyword, "HEIGHT")) {
+         field_code = read_unsigned_int(scanner, &height);
+      } else if (!strcmp(keyword, "DEPTH")) {
+         field_code = read_unsigned_int(scanner, &depth);
+      } else if (!strcmp(keyword, "MAXVAL")) {
+         field_code = read_unsigned_int(scanner, &max_value);
+      } else if (!strcmp(keyword, "TUPLTYPE")) {
+         field_code = read_tuple_type(
+            scanner,
+            header->tuple_type,
+            &tuple_length
+         );
+      } else {
+         field_code = -1;
+      }
+      if (field_code != 0) return -2;
+   }
+
+   // The raster starts right after the end of the ENDHDR line.
+   int c;
+   while ((c = scanner_peek(scanner)) != '\n') {
+      if (c == EOF || !isspace(c)) return -2;
+      ++scanner->position;
+   }
+   ++scanner->position;
+
+   if (width == 0 || height == 0 || depth == 0) return -2;
+   if (max_value == 0 || PAM_MAX_VALUE < max_value) return -3;
+   header->width = width;
+   header->height = height;
+   header->channels = depth;
+   header->max_value = max_value;
+   return 0;
+}
+
+static int read_tuple_type(Scanner *scanner, char *tuple_type, size_t *length) {
+   int c;
+   while ((c = scanner_peek(scanner)) == ' ' || c == '\t') {
+      ++scanner->position;
+   }
+
+   size_t start = *length;
+   size_t end = start;
+   if (0 < start) tuple_type[end++] = ' ';
+   while ((c = scanner_peek(scanner)) != EOF && c != '\n') {
+      if (PAM_TUPLE_TYPE_SIZE - 1 <= end) return -1;
+      tuple_type[end++] = c;
+      ++scanner->position;
+   }
+   // Trailing whitespace, and the separator of an empty line, are dropped.
+   while (start < end && isspace((unsigned char)tuple_type[end - 1])) --end;
+   tuple_type[end] = '\0';
+   *length = end;
+   return 0;
+}
+
+static int read_data(
+   Scanner *scanner,
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   size_t stride,
+   void *data
+) {
+   size_t row_count = row_sample_count(channels, width);
+   size_t row_size = storage_row_size(channels, width, storage);
+
+   for (unsigned int y = 0; y < height; ++y) {
+      uint8_t *row = (uint8_t *)data + y * stride;
+      if (storage == STORAGE_BIT) memset(row, 0, row_size);
+      for (size_t x = 0; x < row_count; ++x) {
+         unsigned int value;
+         if (read_unsigned_int(scanner, &value) != 0) return -1;
+         if (max_value < value) return -1;
+         store_sample(row, storage, x, value);
+      }
+   }
+   return 0;
+}
+
+static int read_raw_data(
+   Scanner *scanner,
+   FormatPNM format,
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   size_t stride,
+   void *data
+) {
+   StoragePNM raw_storage = get_default_storage(format, max_value);
+   size_t row_count = row_sample_count(channels, width);
+   size_t raw_row_size = storage_row_size(channels, width, raw_storage);
+
+   if (storage == raw_storage) {
+      size_t data_size = raw_row_size * height;
+      if (scanner_read(scanner, data, data_size) != data_size) return -1;
+      int code = 0;
+      if (storage == STORAGE_8) {
+         code = check_bytes(data, row_count * height, max_value);
+      } else if (storage == STORAGE_16) {
+         code = decode_big_endian(data, row_count * height, max_value);
+      }
+      if (code == 0 && raw_row_size < stride) {
+         spread_rows(data, raw_row_size, stride, height);
+      }
+      return code;
+   }
+
+   // The row buffer comes from pnm_alloc, so it is aligned for 16-bit samples.
+   uint8_t *raw_row = pnm_alloc(raw_row_size);
+   if (raw_row == NULL) return -2;
+
+   size_t row_size = storage_row_size(channels, width, storage);
+   for (unsigned int y = 0; y < height; ++y) {
+      uint8_t *row = (uint8_t *)data + y * stride;
+      int row_code = 0;
+      if (scanner_read(scanner, raw_row, raw_row_size) != raw_row_size) {
+         row_code = -1;
+      } else if (raw_storage == STORAGE_8) {
+         row_code = check_bytes(raw_row, row_count, max_value);
+      } else if (raw_storage == STORAGE_16) {
+         row_code = decode_big_endian(
+            (uint16_t *)raw_row,
+            row_count,
+            max_value
+         );
+      }
+      if (row_code != 0) {
+         pnm_free(raw_row);
+         return row_code;
+      }
+
+      if (storage == STORAGE_BIT) memset(row, 0, row_size);
+      for (size_t x = 0; x < row_count; ++x) {
+         store_sample(row, storage, x, load_sample(raw_row, raw_storage, x));
+      }
+   }
+   pnm_free(raw_row);
+   return 0;
+}
+
+static void spread_rows(
+   void *data,
+   size_t row_size,
+   size_t stride,
+   unsigned int height
+) {
+   for (unsigned int y = height; 1 < y; --y) {
+      uint8_t *row = (uint8_t *)data + (y - 1) * row_size;
+      memmove((uint8_t *)data + (y - 1) * stride, row, row_size);
+   }
+}
+
+static int read_region_data(
+   Scanner *scanner,
+   PNM *header,
+   unsigned int x,
+   unsigned int y,
+   PNM *region
+) {
+   size_t channels = header->channels;
+   size_t row_count = row_sample_count(header->channels, header->width);
+   size_t region_count = row_sample_count(region->channels, region->width);
+   size_t left = x * channels;
+   size_t right = row_count - left - region_count;
+   uint16_t max_value = header->max_value;
+
+   if (skip_samples(scanner, y * row_count, max_value) != 0) return -1;
+   for (unsigned int r = 0; r < region->height; ++r) {
+      if (skip_samples(scanner, left, max_value) != 0) return -1;
+      int row_code = read_data(
+         scanner,
+         region->channels,
+         region->width,
+         1,
+         max_value,
+         region->storage,
+         region->stride,
+         (uint8_t *)region->data + r * region->stride
+      );
+      if (row_code != 0) return -1;
+      if (r + 1 < region->height) {
+         if (skip_samples(scanner, right, max_value) != 0) return -1;
+      }
+   }
+   return 0;
+}
+
+static int read_region_raw_data(
+   Scanner *scanner,
+   PNM *header,
+   unsigned int x,
+   unsigned int y,
+   PNM *region
+) {
+   size_t raw_row_size = get_row_size(header);
+   size_t row_size = get_row_size(region);
+
+   // Bytes of each row of the file that hold the columns of the region.
+   size_t first;
+   size_t count;
+   if (header->storage == STORAGE_BIT) {
+      first = x / 8;
+      count = (x + region->width - 1) / 8 - first + 1;
+   } else {
+      size_t sample_size = (header->storage == STORAGE_8) ? 1 : 2;
+      first = row_sample_count(header->channels, x) * sample_size;
+      count = row_size;
+   }
+
+   uint8_t *bytes = NULL;
+   if (header->storage == STORAGE_BIT) {
+      bytes = pnm_alloc(count + 1);
+      if (bytes == NULL) return -2;
+      bytes[count] = 0;
+   }
+
+   int code = 0;
+   if (scanner_skip(scanner, y * raw_row_size) != 0) code = -1;
+   for (unsigned int r = 0; code == 0 && r < region->height; ++r) {
+      uint8_t *row = (uint8_t *)region->data + r * region->stride;
+      if (scanner_skip(scanner, first) != 0) {
+         code = -1;
+      } else if (bytes == NULL) {
+         code = read_raw_data(
+            scanner,
+            region->format,
+            region->channels,
+            region->width,
+            1,
+            region->max_value,
+            region->storage,
+            region->stride,
+            row
+         );
+      } else if (scanner_read(scanner, bytes, count) != count) {
+         code = -1;
+      } else {
+         // Bits are shifted so that the left column of the region becomes
+         // the most significant bit of the row.
+         unsigned int shift = x % 8;
+         for (size_t i = 0; i < row_size; ++i) {
+            row[i] = (uint8_t)(bytes[i] << shift | bytes[i + 1] >> (8 - shift));
+         }
+      }
+      if (code == 0 && r + 1 < region->height) {
+         if (scanner_skip(scanner, raw_row_size - first - count) != 0) {
+            code = -1;
+         }
+      }
+   }
+   pnm_free(bytes);
+   return code;
+}
+
+static int skip_samples(Scanner *scanner, size_t count, uint16_t max_value) {
+   for (size_t i = 0; i < count; ++i) {
+      unsigned int value;
+      if (read_unsigned_int(scanner, &value) != 0) return -1;
+      if (max_value < value) return -1;
+   }
+   return 0;
+}
+
+static int read_ascii_data(
+   Scanner *scanner,
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   size_t stride,
+   void *data
+) {
+   int code = 1;
+   if (scanner->file == NULL && 1 < pnm_get_threads()) {
+      code = decode_ascii_parallel(
+         scanner->buffer + scanner->position,
+         scanner->length - scanner->position,
+         channels,
+         width,
+         height,
+         max_value,
+         storage,
+         stride,
+         data
+      );
+   } else if (1 < pnm_get_threads()) {
+      size_t rest_size;
+      if (scanner_rest_size(scanner, &rest_size) == 0
+         && PARALLEL_MIN_BODY_SIZE <= rest_size) {
+         return read_ascii_chunks(
+            scanner,
+            rest_size,
+            channels,
+            width,
+            height,
+            max_value,
+            storage,
+            stride,
+            data
+         );
+      }
+   }
+   if (code != 1) return code;
+   return read_data(
+      scanner,
+      channels,
+      width,
+      height,
+      max_value,
+      storage,
+      stride,
+      data
+   );
+}
+
+static int decode_ascii_parallel(
+   const unsigned char *body,
+   size_t size,
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   size_t stride,
+   void *data
+) {
+   if (size < PARALLEL_MIN_BODY_SIZE) return 1;
+   if (row_sample_count(channels, width) * height == 0) return 1;
+
+   DecodeJob job;
+   if (decode_job_init(
+      &job,
+      channels,
+      width,
+      height,
+      max_value,
+      storage,
+      stride,
+      data
+   ) != 0) {
+      return -2;
+   }
+
+   size_t count;
+   int code = decode_range(&job, body, size, 0, &count);
+   if (code == 0 && count < job.data_count) code = -1;
+   decode_job_finish(&job, code);
+   return code;
+}
+
+static int read_ascii_chunks(
+   Scanner *scanner,
+   size_t rest_size,
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   size_t stride,
+   void *data
+) {
+   DecodeJob job;
+   int code = decode_job_init(
+      &job,
+      channels,
+      width,
+      height,
+      max_value,
+      storage,
+      stride,
+      data
+   );
+   if (code != 0) return code;
+
+   size_t capacity = rest_size < ASCII_CHUNK_SIZE ? rest_size : ASCII_CHUNK_SIZE;
+   unsigned char *chunk = pnm_alloc(capacity);
+   if (chunk == NULL) code = -2;
+
+   // The bytes after the end of a chunk start the next one.
+   size_t index = 0;
+   size_t kept = 0;
+   int last = 0;
+   while (code == 0 && !last && index < job.data_count) {
+      size_t length = kept;
+      length += scanner_read(scanner, chunk + kept, capacity - kept);
+      last = length < capacity;
+      size_t end = last ? length : find_chunk_end(chunk, length);
+      if (end == 0 && !last) {
+         code = -1;
+         break;
+      }
+
+      size_t count = 0;
+      code = decode_range(&job, chunk, end, index, &count);
+      if (code == 1) {
+         Scanner chunk_scanner;
+         scanner_init_memory(&chunk_scanner, chunk, end);
+         code = read_samples(&chunk_scanner, &job, index, &count);
+      }
+      index += count;
+      kept = length - end;
+      memmove(chunk, chunk + end, kept);
+   }
+   pnm_free(chunk);
+
+   if (code == 0 && index < job.data_count) code = -1;
+   decode_job_finish(&job, code);
+   return code;
+}
+
+static size_t find_chunk_end(const unsigned char *chunk, size_t length) {
+   size_t end = length;
+   while (0 < end && chunk[end - 1] != '\n') --end;
+   if (end != 0) return end;
+
+   // A comment runs to the end of its line, which is in another chunk.
+   if (memchr(chunk, '#', length) != NULL) return 0;
+   end = length;
+   while (0 < end && !SPACE_TABLE[chunk[end - 1]]) --end;
+   return end;
+}
+
+static int decode_job_init(
+   DecodeJob *job,
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   size_t stride,
+   void *data
+) {
+   job->row_count = row_sample_count(channels, width);
+   job->data_count = job->row_count * height;
+   job->max_value = max_value;
+   job->bits = NULL;
+   job->bits_stride = 0;
+   if (storage != STORAGE_BIT) {
+      job->storage = storage;
+      job->stride = stride;
+      job->data = data;
+      return 0;
+   }
+
+   job->storage = STORAGE_8;
+   job->stride = job->row_count;
+   job->data = pnm_alloc(job->data_count);
+   if (job->data == NULL && 0 < job->data_count) return -2;
+   job->bits = data;
+   job->bits_stride = stride;
+   return 0;
+}
+
+static void decode_job_finish(DecodeJob *job, int code) {
+   if (job->bits == NULL) return;
+
+   size_t row_size = (job->row_count + 7) / 8;
+   size_t height = job->row_count == 0 ? 0 : job->data_count / job->row_count;
+   for (size_t y = 0; code == 0 && y < height; ++y) {
+      const uint8_t *row = (const uint8_t *)job->data + y * job->row_count;
+      uint8_t *bit_row = (uint8_t *)job->bits + y * job->bits_stride;
+      memset(bit_row, 0, row_size);
+      for (size_t x = 0; x < job->row_count; ++x) {
+         if (row[x]) bit_row[x / 8] |= 0x80 >> (x % 8);
+      }
+   }
+   pnm_free(job->data);
+   job->data = NULL;
+}
+
+static int decode_range(
+   const DecodeJob *job,
+   const unsigned char *body,
+   size_t size,
+   size_t first,
+   size_t *count
+) {
+   unsigned int range_count = pnm_get_threads();
+   if (size / PARALLEL_MIN_CHUNK_SIZE < range_count) {
+      range_count = size / PARALLEL_MIN_CHUNK_SIZE;
+   }
+   if (range_count < 1) range_count = 1;
+
+   DecodeTask tasks[PNM_MAX_THREADS];
+   const unsigned char *end = body + size;
+   const unsigned char *begin = body;
+   for (unsigned int i = 0; i < range_count; ++i) {
+      const unsigned char *split = end;
+      if (i + 1 < range_count) {
+         split = body + size / range_count * (i + 1);
+         if (split < begin) split = begin;
+         while (split < end && !SPACE_TABLE[*split]) ++split;
+      }
+      tasks[i].job = job;
+      tasks[i].begin = begin;
+      tasks[i].end = split;
+      begin = split;
+   }
+
+   run_tasks(count_samples, tasks, sizeof(DecodeTask), range_count);
+
+   size_t index = first;
+   for (unsigned int i = 0; i < range_count; ++i) {
+      if (tasks[i].code != 0) return 1;
+      tasks[i].first = index;
+      index += tasks[i].count;
+   }
+   *count = index - first;
+   if (job->data_count - first < *count) *count = job->data_count - first;
+
+   // Ranges made only of samples past the end of the image are skipped.
+   while (0 < range_count && job->data_count <= tasks[range_count - 1].first) {
+      --range_count;
+   }
+   run_tasks(decode_samples, tasks, sizeof(DecodeTask), range_count);
+
+   for (unsigned int i = 0; i < range_count; ++i) {
+      if (tasks[i].code != 0) return -1;
+   }
+   return 0;
+}
+
+static int read_samples(
+   Scanner *scanner,
+   const DecodeJob *job,
+   size_t first,
+   size_t *count
+) {
+   size_t index = first;
+   size_t x = index % job->row_count;
+   uint8_t *row = (uint8_t *)job->data + index / job->row_count * job->stride;
+
+   int code = 0;
+   while (index < job->data_count) {
+      skip_comments(scanner);
+      if (scanner_peek(scanner) == EOF) break;
+
+      unsigned int value;
+      if (read_unsigned_int(scanner, &value) != 0 || job->max_value < value) {
+         code = -1;
+         break;
+      }
+      store_sample(row, job->storage, x, value);
+      ++index;
+      if (++x == job->row_count) {
+         x = 0;
+         row += job->stride;
+      }
+   }
+   *count = index - first;
+   return code;
+}
+
+static void *count_samples(void *argument) {
+   DecodeTask *task = argument;
+   const unsigned char *position = task->begin;
+   const unsigned char *end = task->end;
+
+   task->count = 0;
+   task->code = 0;
+   while (position < end) {
+      while (position < end && SPACE_TABLE[*position]) ++position;
+      if (position == end) break;
+
+      if (*position == '+' || *position == '-') ++position;
+      if (position == end || !isdigit(*position)) {
+         task->code = 1;
+         return NULL;
+      }
+      while (position < end && isdigit(*position)) ++position;
+      if (position < end && !SPACE_TABLE[*position]) {
+         task->code = 1;
+         return NULL;
+      }
+      ++task->count;
+   }
+   return NULL;
+}
+
+static void *decode_samples(void *argument) {
+   DecodeTask *task = argument;
+   const DecodeJob *job = task->job;
+   const unsigned char *position = task->begin;
+   const unsigned char *end = task->end;
+
+   size_t index = task->first;
+   size_t y = index / job->row_count;
+   size_t x = index % job->row_count;
+   uint8_t *row = (uint8_t *)job->data + y * job->stride;
+
+   task->code = 0;
+   while (index < job->data_count) {
+      while (position < end && SPACE_TABLE[*position]) ++position;
+      if (position == end) break;
+
+      int negative = 0;
+      if (*position == '+' || *position == '-') {
+         negative = (*position == '-');
+         ++position;
+      }
+      uint64_t value = 0;
+      while (position < end && isdigit(*position)) {
+         if (value <= UINT_MAX) value = value * 10 + (*position - '0');
+         ++position;
+      }
+      if (job->max_value < value || (negative && value != 0)) {
+         task->code = -1;
+         return NULL;
+      }
+
+      store_sample(row, job->storage, x, (uint16_t)value);
+      ++index;
+      if (++x == job->row_count) {
+         x = 0;
+         row += job->stride;
+      }
+   }
+   return NULL;
+}
+
+static int run_bands(
+   PNMBandRoutine routine,
+   void *context,
+   size_t count,
+   unsigned int bands
+) {
+   pthread_mutex_lock(&workers.lock);
+   if (workers.busy) {
+      pthread_mutex_unlock(&workers.lock);
+      return run_bands_serially(routine, context, count, bands);
+   }
+   workers.busy = 1;
+
+   // The calling thread takes a band itself, so bands - 1 workers suffice.
+   while (workers.worker_count < bands - 1) {
+      pthread_t *thread = &workers.threads[workers.worker_count];
+      if (pthread_create(thread, NULL, pool_worker, NULL) != 0) break;
+      ++workers.worker_count;
+   }
+   if (0 < workers.worker_count && !workers.stopped_at_exit) {
+      workers.stopped_at_exit = atexit(pnm_stop_threads) == 0;
+   }
+
+   workers.routine = routine;
+   workers.context = context;
+   workers.item_count = count;
+   workers.band_count = bands;
+   workers.next_band = 0;
+   workers.done_count = 0;
+   workers.status = 0;
+   pthread_cond_broadcast(&workers.posted);
+
+   take_bands();
+   while (workers.done_count < bands) {
+      pthread_cond_wait(&workers.finished, &workers.lock);
+   }
+   int status = workers.status;
+   workers.busy = 0;
+   pthread_mutex_unlock(&workers.lock);
+   return status;
+}
+
+static void take_bands(void) {
+   while (workers.next_band < workers.band_count) {
+      unsigned int band = workers.next_band++;
+      PNMBandRoutine routine = workers.routine;
+      void *context = workers.context;
+      size_t count = workers.item_count;
+      unsigned int bands = workers.band_count;
+      pthread_mutex_unlock(&workers.lock);
+
+      int status = run_band(routine, context, count, bands, band);
+
+      pthread_mutex_lock(&workers.lock);
+      if (status != 0 && workers.status == 0) workers.status = status;
+      if (++workers.done_count == workers.band_count) {
+         pthread_cond_signal(&workers.finished);
+      }
+   }
+}
+
+static int run_bands_serially(
+   PNMBandRoutine routine,
+   void *context,
+   size_t count,
+   unsigned int bands
+) {
+   int status = 0;
+   for (unsigned int band = 0; band < bands; ++band) {
+      int band_status = run_band(routine, context, count, bands, band);
+      if (status == 0) status = band_status;
+   }
+   return status;
+}
+
+static int run_band(
+   PNMBandRoutine routine,
+   void *context,
+   size_t count,
+   unsigned int bands,
+   unsigned int band
+) {
+   size_t first = count / bands * band + count % bands * band / bands;
+   size_t end = count / bands * (band + 1)
+              + count % bands * (band + 1) / bands;
+   return routine(context, band, first, end);
+}
+
+static void *pool_worker(void *argument) {
+   (void)argument;
+
+   pthread_mutex_lock(&workers.lock);
+   while (!workers.stopping) {
+      if (workers.next_band == workers.band_count) {
+         pthread_cond_wait(&workers.posted, &workers.lock);
+      } else {
+         take_bands();
+      }
+   }
+   pthread_mutex_unlock(&workers.lock);
+   return NULL;
+}
+
+static int run_task_band(
+   void *context,
+   unsigned int band,
+   size_t first,
+   size_t end
+) {
+   (void)band;
+   TaskList *list = context;
+   for (size_t i = first; i < end; ++i) {
+      list->routine(list->tasks + i * list->task_size);
+   }
+   return 0;
+}
+
+static void run_tasks(
+   void *(*routine)(void *),
+   void *tasks,
+   size_t task_size,
+   unsigned int count
+) {
+   TaskList list = {routine, tasks, task_size};
+   if (count < 2) {
+      run_task_band(&list, 0, 0, count);
+   } else {
+      run_bands(run_task_band, &list, count, count);
+   }
+}
+
+static int decode_big_endian(
+   uint16_t *data,
+   size_t data_count,
+   uint16_t max_value
+) {
+   const uint8_t *bytes = (const uint8_t *)data;
+   for (size_t i = 0; i < data_count; ++i) {
+      uint16_t value = (uint16_t)(bytes[2 * i] << 8 | bytes[2 * i + 1]);
+      if (max_value < value) return -1;
+      data[i] = value;
+   }
+   return 0;
+}
+
+static int frames_open_file(PNMFrameReader **frames, FILE *file) {
+   PNMFrameReader *new_frames = pnm_alloc(sizeof(PNMFrameReader));
+   if (new_frames == NULL) {
+      fclose(file);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   new_frames->file = file;
+   new_frames->image = new_pnm();
+   if (new_frames->image == NULL) {
+      fclose(file);
+      pnm_free(new_frames);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+   if (scanner_init(&new_frames->scanner, file, SCANNER_BUFFER_SIZE) != 0) {
+      free_pnm(&new_frames->image);
+      fclose(file);
+      pnm_free(new_frames);
+      return LOAD_PNM_MEMORY_ERROR;
+   }
+
+   *frames = new_frames;
+   return PNM_SUCCESS;
+}
+
+static void *allocate_with(const PNMAllocator *with, size_t size) {
+   if (with->allocate == NULL) {
+      void *block;
+      if (posix_memalign(&block, PNM_ALIGNMENT, size) != 0) return NULL;
+      return block;
+   }
+   return with->allocate(with->context, size);
+}
+
+static void release_with(const PNMAllocator *with, void *block) {
+   if (with->release == NULL) {
+      free(block);
+   } else {
+      with->release(with->context, block);
+   }
+}
+
+static void *pool_allocate(void *context, size_t size) {
+   PNMPool *pool = context;
+
+   pthread_mutex_lock(&pool->lock);
+   ++pool->stats.allocations;
+   PoolBlock **link = &pool->blocks;
+   while (*link != NULL && (*link)->header.size != size) {
+      link = &(*link)->header.next;
+   }
+   PoolBlock *block = *link;
+   if (block != NULL) {
+      *link = block->header.next;
+      ++pool->stats.hits;
+      --pool->stats.cached_blocks;
+      pool->stats.cached_size -= size;
+   }
+   pthread_mutex_unlock(&pool->lock);
+
+   if (block == NULL) {
+      if (SIZE_MAX - sizeof(PoolBlock) < size) return NULL;
+      void *memory;
+      if (posix_memalign(&memory, PNM_ALIGNMENT, sizeof(PoolBlock) + size)) {
+         return NULL;
+      }
+      block = memory;
+      block->header.size = size;
+   }
+   return block + 1;
+}
+
+static void pool_release(void *context, void *pointer) {
+   if (pointer == NULL) return;
+   PNMPool *pool = context;
+   PoolBlock *block = (PoolBlock *)pointer - 1;
+   size_t size = block->header.size;
+   if (pool->capacity < size) {
+      free(block);
+      return;
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   // The least recently released blocks, at the end of the list, make room
+   // for the new one.
+   while (pool->capacity - pool->stats.cached_size < size) {
+      PoolBlock **link = &pool->blocks;
+      while ((*link)->header.next != NULL) link = &(*link)->header.next;
+      --pool->stats.cached_blocks;
+      pool->stats.cached_size -= (*link)->header.size;
+      free(*link);
+      *link = NULL;
+   }
+   block->header.next = pool->blocks;
+   pool->blocks = block;
+   ++pool->stats.cached_blocks;
+   pool->stats.cached_size += size;
+   pthread_mutex_unlock(&pool->lock);
+}
+
+static FILE *open_fd(int fd, const char *mode) {
+   int copy = dup(fd);
+   if (copy == -1) return NULL;
+   FILE *file = fdopen(copy, mode);
+   if (file == NULL) close(copy);
+   return file;
+}
+
+static int encode_file(FILE *file, PNM *image) {
+   // Planar pixel data is written from an interleaved copy, which leaves the
+   // image as it is.
+   if (image->layout == LAYOUT_PLANAR && 1 < image->channels) {
+      PNM interleaved = *image;
+      interleaved.layout = LAYOUT_INTERLEAVED;
+      if (copy_layout(
+         image,
+         LAYOUT_INTERLEAVED,
+         &interleaved.data,
+         &interleaved.stride
+      ) != 0) {
+         return -1;
+      }
+      int code = encode_file(file, &interleaved);
+      pnm_free(interleaved.data);
+      return code;
+   }
 
-unsigned int get_width(PNM *image) {
-   if (image == NULL) return 0;
-   return image->width;
+   Writer writer;
+   if (writer_init(&writer, file) != 0) return -1;
+
+   int code = write_header(&writer, image);
+   if (code == 0 && image->encoding == ENCODING_RAW) {
+      code = write_raw_data(&writer, image);
+   } else if (code == 0) {
+      code = write_ascii_data(&writer, image);
+   }
+   if (code == 0) code = writer_flush(&writer);
+   writer_release(&writer);
+   return code;
 }
 
-unsigned int get_height(PNM *image) {
-   if (image == NULL) return 0;
-   return image->height;
+static int writer_init(Writer *writer, FILE *file) {
+   writer->file = file;
+   writer->length = 0;
+   writer->capacity = WRITER_BUFFER_SIZE;
+   writer->buffer = pnm_alloc(WRITER_BUFFER_SIZE);
+   if (writer->buffer == NULL) return -1;
+   return 0;
 }
 
-uint16_t get_max_value(PNM *image) {
-   if (image == NULL) return 0;
-   return image->max_value;
+static void writer_init_memory(Writer *writer, char *buffer, size_t capacity) {
+   writer->file = NULL;
+   writer->buffer = buffer;
+   writer->length = 0;
+   writer->capacity = capacity;
 }
 
-uint16_t *get_data(PNM *image) {
-   if (image == NULL) return NULL;
-   return image->data;
+static void writer_release(Writer *writer) {
+   pnm_free(writer->buffer);
+   writer->buffer = NULL;
 }
 
-void set_pnm(
-   PNM *image,
-   FormatPNM format,
-   unsigned int width,
-   unsigned int height,
-   uint16_t max_value,
-   uint16_t *data
-) {
-   if (image == NULL) return;
-   image->format = format;
-   image->width = width;
-   image->height = height;
-   image->max_value = max_value;
-   image->data = data;
+static int writer_flush(Writer *writer) {
+   if (writer->file == NULL) return -1;
+   size_t length = writer->length;
+   writer->length = 0;
+   if (fwrite(writer->buffer, 1, length, writer->file) != length) return -1;
+   return 0;
 }
 
-void free_pnm(PNM **image) {
-   if (image == NULL || *image == NULL) return;
-   free((*image)->data);
-   free(*image);
-   *image = NULL;
+static int writer_write(Writer *writer, const void *bytes, size_t count) {
+   if (writer->capacity - writer->length < count) {
+      if (writer_flush(writer) != 0) return -1;
+      if (writer->capacity < count) {
+         if (fwrite(bytes, 1, count, writer->file) != count) return -1;
+         return 0;
+      }
+   }
+   memcpy(writer->buffer + writer->length, bytes, count);
+   writer->length += count;
+   return 0;
 }
 
-int load_pnm(PNM **image, const char *filename) {
-   if (image == NULL || filename == NULL) return -4;
+static int writer_put_uint(Writer *writer, unsigned int value, char separator) {
+   // Ten digits and the separator always fit in the space reserved here.
+   if (writer->capacity - writer->length < 11) {
+      if (writer_flush(writer) != 0) return -1;
+   }
 
-   FormatPNM file_extension;
-   if (file_extension_to_format(filename, &file_extension) != 0) {
-      return PNM_INVALID_FILENAME;
+   char digits[10];
+   char *end = digits + sizeof(digits);
+   char *start = end;
+   while (100 <= value) {
+      unsigned int pair = value % 100;
+      value /= 100;
+      start -= 2;
+      memcpy(start, &DIGIT_PAIRS[2 * pair], 2);
+   }
+   if (10 <= value) {
+      start -= 2;
+      memcpy(start, &DIGIT_PAIRS[2 * value], 2);
+   } else {
+      *--start = '0' + value;
    }
 
-   FILE *file = fopen(filename, "r");
-   if (file == NULL) return PNM_INVALID_FILENAME;
+   size_t count = end - start;
+   char *output = writer->buffer + writer->length;
+   memcpy(output, start, count);
+   output[count] = separator;
+   writer->length += count + 1;
+   return 0;
+}
 
-   FormatPNM format;
-   unsigned int width;
-   unsigned int height;
-   uint16_t max_value;
+static int write_header(Writer *writer, PNM *image) {
+   FormatPNM format = image->format;
+   if (format == FORMAT_PAM) return write_pam_header(writer, image);
 
-   if (read_header(file, &format, &width, &height, &max_value) != 0) {
-      if (fclose(file) != 0) return -4;
-      return LOAD_PNM_DECODE_ERROR;
-   }
+   unsigned int width = image->width;
+   unsigned int height = image->height;
+   uint16_t max_value = image->max_value;
 
-   if (file_extension != format) {
-      if (fclose(file) != 0) return -4;
-      return LOAD_PNM_DECODE_ERROR;
+   const char *magic_str = NULL;
+   if (format_to_magic_str(format, image->encoding, &magic_str) != 0) {
+      return -1;
    }
-
-   size_t data_count = width * height;
-   if (format == FORMAT_PPM) data_count *= 3;
-
-   uint16_t *data = malloc(data_count * sizeof(uint16_t));
-   if (data == NULL) {
-      if (fclose(file) != 0) return -4;
-      return LOAD_PNM_MEMORY_ERROR;
+   if (writer_write(writer, magic_str, strlen(magic_str)) != 0) return -1;
+   if (writer_write(writer, "\n", 1) != 0) return -1;
+   if (writer_put_uint(writer, width, ' ') != 0) return -1;
+   if (writer_put_uint(writer, height, '\n') != 0) return -1;
+   if (format != FORMAT_PBM) {
+      if (writer_put_uint(writer, max_value, '\n') != 0) return -1;
    }
+   return 0;
+}
 
-   if (read_data(file, max_value, data_count, data) != 0) {
-      free(data);
-      if (fclose(file) != 0) return -4;
-      return LOAD_PNM_DECODE_ERROR;
+static int write_pam_header(Writer *writer, PNM *image) {
+   const char *fields[] = { "P7\nWIDTH ", "HEIGHT ", "DEPTH ", "MAXVAL " };
+   unsigned int values[] = {
+      image->width,
+      image->height,
+      image->channels,
+      image->max_value
+   };
+   for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+      if (writer_write(writer, fields[i], strlen(fields[i])) != 0) return -1;
+      if (writer_put_uint(writer, values[i], '\n') != 0) return -1;
    }
 
-   *image = malloc(sizeof(PNM));
-   if (*image == NULL) {
-      free(data);
-      if (fclose(file) != 0) return -4;
-      return LOAD_PNM_MEMORY_ERROR;
+   const char *tuple_type = image->tuple_type;
+   if (tuple_type[0] != '\0') {
+      if (writer_write(writer, "TUPLTYPE ", 9) != 0) return -1;
+      if (writer_write(writer, tuple_type, strlen(tuple_type)) != 0) return -1;
+      if (writer_write(writer, "\n", 1) != 0) return -1;
    }
+   return writer_write(writer, "ENDHDR\n", 7);
+}
 
-   set_pnm(*image, format, width, height, max_value, data);
+static int write_data(Writer *writer, PNM *image) {
+   size_t row_count = row_sample_count(image->channels, image->width);
+   StoragePNM storage = image->storage;
+   const uint8_t *data = image->data;
 
-   if (fclose(file) != 0) {
-      free_pnm(image);
-      return -4;
+   for (unsigned int y = 0; y < image->height; ++y) {
+      const uint8_t *row = data + y * image->stride;
+      for (size_t x = 0; x < row_count; ++x) {
+         uint16_t value = load_sample(row, storage, x);
+         if (writer_put_uint(writer, value, ' ') != 0) return -1;
+      }
+      if (writer_write(writer, "\n", 1) != 0) return -1;
    }
-   return PNM_SUCCESS;
+   return 0;
 }
 
-int write_pnm(PNM *image, const char *filename) {
-   if (image == NULL || filename == NULL) return -4;
+static int write_ascii_data(Writer *writer, PNM *image) {
+   unsigned int count = pnm_get_threads();
+   size_t row_count = row_sample_count(image->channels, image->width);
 
-   if (check_invalid_characters(filename) != 0) {
-      return PNM_INVALID_FILENAME;
+   // Every sample takes at most the digits of the largest sample of its
+   // storage, which may exceed the maximum value, and a separator, and every
+   // row ends with a newline.
+   size_t sample_size = 2;
+   if (image->storage == STORAGE_8) {
+      sample_size = 4;
+   } else if (image->storage == STORAGE_16) {
+      sample_size = 6;
    }
+   // Rows too long to bound, or to buffer once per thread, are written by
+   // the serial encoder.
+   if (count < 2 || (SIZE_MAX / 2 - 11) / count / sample_size < row_count) {
+      return write_data(writer, image);
+   }
+   size_t row_bound = row_count * sample_size + 1;
+   size_t min_height = (PARALLEL_MIN_BODY_SIZE + row_bound - 1) / row_bound;
+   if (image->height < min_height) return write_data(writer, image);
 
-   FormatPNM file_extension;
-   if (file_extension_to_format(filename, &file_extension) != 0) {
-      return PNM_INVALID_FILENAME;
+   unsigned int band_height = 1;
+   if (row_bound < PARALLEL_MIN_BODY_SIZE) {
+      band_height = PARALLEL_MIN_BODY_SIZE / row_bound;
    }
-   if (image->format != file_extension) return PNM_INVALID_FILENAME;
+   // writer_put_uint wants room for ten digits and a separator, even for the
+   // last sample of a band.
+   size_t capacity = row_bound * band_height + 11;
 
-   FILE *file = fopen(filename, "w");
-   if (file == NULL) return PNM_INVALID_FILENAME;
+   EncodeTask tasks[PNM_MAX_THREADS];
+   char *buffers = pnm_alloc(capacity * count);
+   if (buffers == NULL) return write_data(writer, image);
 
-   if (write_header(file, image) != 0) {
-      if (fclose(file) != 0) return WRITE_PNM_FILE_MANIPULATION_ERROR;
-      return WRITE_PNM_FILE_MANIPULATION_ERROR;
-   }
+   int code = 0;
+   unsigned int y = 0;
+   while (code == 0 && y < image->height) {
+      // One round formats up to count bands, then appends them in order.
+      unsigned int round_count = 0;
+      while (round_count < count && y < image->height) {
+         EncodeTask *task = &tasks[round_count++];
+         task->band = *image;
+         task->band.height = image->height - y;
+         if (band_height < task->band.height) task->band.height = band_height;
+         task->band.data = (uint8_t *)image->data + y * image->stride;
+         task->band.mapping = NULL;
+         writer_init_memory(
+            &task->writer,
+            buffers + (round_count - 1) * capacity,
+            capacity
+         );
+         y += task->band.height;
+      }
 
-   if (write_data(file, image) != 0) {
-      if (fclose(file) != 0) return WRITE_PNM_FILE_MANIPULATION_ERROR;
-      return WRITE_PNM_FILE_MANIPULATION_ERROR;
-   }
+      run_tasks(encode_band, tasks, sizeof(EncodeTask), round_count);
 
-   if (fclose(file) != 0) return WRITE_PNM_FILE_MANIPULATION_ERROR;
-   return PNM_SUCCESS;
+      for (unsigned int i = 0; code == 0 && i < round_count; ++i) {
+         code = tasks[i].code;
+         if (code == 0) {
+            code = writer_write(
+               writer,
+               tasks[i].writer.buffer,
+               tasks[i].writer.length
+            );
+         }
+      }
+   }
+   pnm_free(buffers);
+   return code;
 }
 
-/* ======= Internal functions ======= */
-
-static int read_header(
-   FILE *file,
-   FormatPNM *format,
-   unsigned int *width,
-   unsigned int *height,
-   uint16_t *max_value
-) {
-   skip_comments(file);
+static void *encode_band(void *argument) {
+   EncodeTask *task = argument;
+   task->code = write_data(&task->writer, &task->band);
+   return NULL;
+}
 
-   char magic_str[3];
-   if (fscanf(file, "%2s", magic_str) != 1) return -1;
-   if (magic_str_to_format(magic_str, format) != 0) return -1;
+static int write_raw_data(Writer *writer, PNM *image) {
+   FormatPNM format = image->format;
+   unsigned int width = image->width;
+   unsigned int height = image->height;
+   const uint8_t *data = image->data;
 
-   if (read_unsigned_int(file, width) != 0) return -2;
-   if (read_unsigned_int(file, height) != 0) return -2;
-   if (width == 0 || height == 0) return -2;
+   StoragePNM raw_storage = get_default_storage(format, image->max_value);
+   size_t raw_row_size = storage_row_size(
+      image->channels,
+      width,
+      raw_storage
+   );
 
-   if (*format == FORMAT_PBM) {
-      *max_value = PBM_MAX_VALUE;
+   // 8-bit samples, and bit-packed rows without padding bits, are already
+   // laid out like the file, and written in one block when the rows are
+   // packed.
+   if (image->storage == raw_storage && (raw_storage == STORAGE_8
+      || (raw_storage == STORAGE_BIT && width % 8 == 0))) {
+      if (image->stride == raw_row_size) {
+         return writer_write(writer, data, raw_row_size * height);
+      }
+      for (unsigned int y = 0; y < height; ++y) {
+         const uint8_t *row = data + y * image->stride;
+         if (writer_write(writer, row, raw_row_size) != 0) return -1;
+      }
       return 0;
    }
 
-   unsigned int new_max_value;
-   if (read_unsigned_int(file, &new_max_value) != 0) return -3;
+   uint8_t *raw_row = pnm_alloc(raw_row_size);
+   if (raw_row == NULL) return -1;
 
-   switch (*format) {
-      case FORMAT_PGM:
-         if (PGM_MAX_VALUE < new_max_value) return -3;
-         break;
-      case FORMAT_PPM:
-         if (PPM_MAX_VALUE < new_max_value) return -3;
-         break;
-      default:
-         return -3;
+   for (unsigned int y = 0; y < height; ++y) {
+      encode_raw_row(data + y * image->stride, image, raw_row);
+      if (writer_write(writer, raw_row, raw_row_size) != 0) {
+         pnm_free(raw_row);
+         return -1;
+      }
    }
-   *max_value = new_max_value;
+   pnm_free(raw_row);
    return 0;
 }
 
-static int read_data(
-   FILE *file,
-   uint16_t max_value,
+static int check_bytes(
+   const uint8_t *bytes,
    size_t data_count,
-   uint16_t *data
+   uint16_t max_value
 ) {
+   if (UINT8_MAX <= max_value) return 0;
    for (size_t i = 0; i < data_count; ++i) {
-      unsigned int value;
-      if (read_unsigned_int(file, &value) != 0) return -1;
-      if (max_value < value) return -1;
-      data[i] = value;
+      if (max_value < bytes[i]) return -1;
    }
    return 0;
 }
 
-static int write_header(FILE *file, PNM *image) {
+static void encode_raw_row(const void *row, PNM *image, uint8_t *output) {
    FormatPNM format = image->format;
    unsigned int width = image->width;
-   unsigned int height = image->height;
-   uint16_t max_value = image->max_value;
+   StoragePNM storage = image->storage;
+   size_t row_count = row_sample_count(image->channels, width);
 
-   const char *magic_str = NULL;
-   if (format_to_magic_str(format, &magic_str) != 0) return -1;
-   if (fprintf(file, "%s\n", magic_str) < 0) return -1;
-   if (fprintf(file, "%u %u\n", width, height) < 0) return -1;
-   if (format != FORMAT_PBM) {
-      if (fprintf(file, "%u\n", max_value) < 0) return -1;
+   if (format == FORMAT_PBM) {
+      size_t raw_row_size = (width + 7) / 8;
+      if (storage == STORAGE_BIT) {
+         memcpy(output, row, raw_row_size);
+         if (width % 8 != 0) {
+            output[raw_row_size - 1] &= (uint8_t)(0xFF00 >> (width % 8));
+         }
+         return;
+      }
+      memset(output, 0, raw_row_size);
+      for (unsigned int x = 0; x < width; ++x) {
+         if (load_sample(row, storage, x)) output[x / 8] |= 0x80 >> (x % 8);
+      }
+   } else if (image->max_value <= UINT8_MAX) {
+      for (size_t x = 0; x < row_count; ++x) {
+         output[x] = load_sample(row, storage, x);
+      }
+   } else {
+      for (size_t x = 0; x < row_count; ++x) {
+         uint16_t value = load_sample(row, storage, x);
+         output[2 * x] = value >> 8;
+         output[2 * x + 1] = value & 0xFF;
+      }
    }
-   return 0;
 }
 
-static int write_data(FILE *file, PNM *image) {
-   FormatPNM format = image->format;
-   unsigned int width = image->width;
-   unsigned int height = image->height;
-   uint16_t *data = image->data;
+static size_t storage_row_size(
+   unsigned int channels,
+   unsigned int width,
+   StoragePNM storage
+) {
+   size_t row_count = row_sample_count(channels, width);
+   switch (storage) {
+      case STORAGE_BIT:
+         return (row_count + 7) / 8;
+      case STORAGE_8:
+         return row_count;
+      default:
+         return row_count * sizeof(uint16_t);
+   }
+}
+
+static uint16_t load_sample(const void *row, StoragePNM storage, size_t x) {
+   switch (storage) {
+      case STORAGE_BIT:
+         return (((const uint8_t *)row)[x / 8] >> (7 - x % 8)) & 1;
+      case STORAGE_8:
+         return ((const uint8_t *)row)[x];
+      default:
+         return ((const uint16_t *)row)[x];
+   }
+}
 
-   if (format == FORMAT_PPM) {
-      width *= 3;
+static void store_sample(
+   void *row,
+   StoragePNM storage,
+   size_t x,
+   uint16_t value
+) {
+   switch (storage) {
+      case STORAGE_BIT: {
+         uint8_t *byte = (uint8_t *)row + x / 8;
+         uint8_t mask = 0x80 >> (x % 8);
+         *byte = value ? (*byte | mask) : (*byte & ~mask);
+         break;
+      }
+      case STORAGE_8:
+         ((uint8_t *)row)[x] = (uint8_t)value;
+         break;
+      default:
+         ((uint16_t *)row)[x] = value;
+         break;
    }
+}
 
-   for (unsigned int y = 0; y < height; ++y) {
-      for (unsigned int x = 0; x < width; ++x) {
-         size_t i = y * width + x;
-         if (fprintf(file, "%u ", data[i]) < 0) return -1;
+static void deinterleave_row(
+   const uint8_t *row,
+   uint8_t *plane_row,
+   size_t plane_size,
+   StoragePNM storage,
+   unsigned int channels,
+   unsigned int width
+) {
+   int wide = storage != STORAGE_8;
+   unsigned int x = 0;
+#ifdef PNM_X86
+   if (channels == 3) {
+      pthread_once(&layout_once, init_layout_level);
+      if (layout_level == 2) {
+         x = deinterleave3_avx2(row, plane_row, plane_size, wide, width);
+      } else if (layout_level == 1) {
+         x = deinterleave3_sse2(row, plane_row, plane_size, wide, width);
+      }
+   }
+#endif
+   if (!wide) {
+      for (; x < width; ++x) {
+         const uint8_t *pixel = row + (size_t)x * channels;
+         for (unsigned int c = 0; c < channels; ++c) {
+            plane_row[c * plane_size + x] = pixel[c];
+         }
+      }
+   } else {
+      for (; x < width; ++x) {
+         const uint16_t *pixel = (const uint16_t *)row + (size_t)x * channels;
+         for (unsigned int c = 0; c < channels; ++c) {
+            ((uint16_t *)(plane_row + c * plane_size))[x] = pixel[c];
+         }
+      }
+   }
+}
+
+static void interleave_row(
+   const uint8_t *plane_row,
+   size_t plane_size,
+   uint8_t *row,
+   StoragePNM storage,
+   unsigned int channels,
+   unsigned int width
+) {
+   int wide = storage != STORAGE_8;
+   unsigned int x = 0;
+#ifdef PNM_X86
+   if (channels == 3) {
+      pthread_once(&layout_once, init_layout_level);
+      if (layout_level == 2) {
+         x = interleave3_avx2(plane_row, plane_size, row, wide, width);
+      } else if (layout_level == 1) {
+         x = interleave3_sse2(plane_row, plane_size, row, wide, width);
+      }
+   }
+#endif
+   if (!wide) {
+      for (; x < width; ++x) {
+         uint8_t *pixel = row + (size_t)x * channels;
+         for (unsigned int c = 0; c < channels; ++c) {
+            pixel[c] = plane_row[c * plane_size + x];
+         }
+      }
+   } else {
+      for (; x < width; ++x) {
+         uint16_t *pixel = (uint16_t *)row + (size_t)x * channels;
+         for (unsigned int c = 0; c < channels; ++c) {
+            pixel[c] = ((const uint16_t *)(plane_row + c * plane_size))[x];
+         }
+      }
+   }
+}
+
+static void init_layout_level(void) {
+#ifdef PNM_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2")) {
+      layout_level = 2;
+   } else if (__builtin_cpu_supports("sse2")) {
+      layout_level = 1;
+   }
+#endif
+}
+
+#ifdef PNM_X86
+__attribute__((target("sse2")))
+static unsigned int deinterleave3_sse2(
+   const uint8_t *row,
+   uint8_t *plane_row,
+   size_t plane_size,
+   int wide,
+   unsigned int width
+) {
+   // A block is 32 pixels of 8-bit samples, 16 pixels of 16-bit samples;
+   // sorting 16 samples per vector takes one more layer than sorting 8.
+   unsigned int block = wide ? 16 : 32;
+   int layers = wide ? 4 : 5;
+   unsigned int x = 0;
+   for (; block <= width - x; x += block) {
+      const uint8_t *pixels = row + ((size_t)3 * x << wide);
+      __m128i v[6], u[6];
+      for (int k = 0; k < 6; ++k) {
+         v[k] = _mm_loadu_si128((const __m128i *)(pixels + 16 * k));
+      }
+      for (int layer = 0; layer < layers; ++layer) {
+         for (int k = 0; k < 3; ++k) {
+            if (wide) {
+               u[2 * k] = _mm_unpacklo_epi16(v[k], v[k + 3]);
+               u[2 * k + 1] = _mm_unpackhi_epi16(v[k], v[k + 3]);
+            } else {
+               u[2 * k] = _mm_unpacklo_epi8(v[k], v[k + 3]);
+               u[2 * k + 1] = _mm_unpackhi_epi8(v[k], v[k + 3]);
+            }
+         }
+         for (int k = 0; k < 6; ++k) v[k] = u[k];
+      }
+      for (int c = 0; c < 3; ++c) {
+         uint8_t *plane = plane_row + c * plane_size + ((size_t)x << wide);
+         _mm_storeu_si128((__m128i *)plane, v[2 * c]);
+         _mm_storeu_si128((__m128i *)(plane + 16), v[2 * c + 1]);
+      }
+   }
+   return x;
+}
+
+__attribute__((target("sse2")))
+static unsigned int interleave3_sse2(
+   const uint8_t *plane_row,
+   size_t plane_size,
+   uint8_t *row,
+   int wide,
+   unsigned int width
+) {
+   // Each layer undoes one of deinterleave3_sse2: the even samples of two
+   // vectors go back to the first three vectors, the odd ones to the last
+   // three. 16-bit samples are sign-extended to stay exact through the
+   // signed saturation of _mm_packs_epi32.
+   unsigned int block = wide ? 16 : 32;
+   int layers = wide ? 4 : 5;
+   const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+   unsigned int x = 0;
+   for (; block <= width - x; x += block) {
+      __m128i v[6], u[6];
+      for (int c = 0; c < 3; ++c) {
+         const uint8_t *plane = plane_row + c * plane_size
+                              + ((size_t)x << wide);
+         v[2 * c] = _mm_loadu_si128((const __m128i *)plane);
+         v[2 * c + 1] = _mm_loadu_si128((const __m128i *)(plane + 16));
+      }
+      for (int layer = 0; layer < layers; ++layer) {
+         for (int k = 0; k < 3; ++k) {
+            __m128i a = v[2 * k], b = v[2 * k + 1];
+            if (wide) {
+               u[k] = _mm_packs_epi32(
+                  _mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+                  _mm_srai_epi32(_mm_slli_epi32(b, 16), 16)
+               );
+               u[k + 3] = _mm_packs_epi32(
+                  _mm_srai_epi32(a, 16),
+                  _mm_srai_epi32(b, 16)
+               );
+            } else {
+               u[k] = _mm_packus_epi16(
+                  _mm_and_si128(a, low_bytes),
+                  _mm_and_si128(b, low_bytes)
+               );
+               u[k + 3] = _mm_packus_epi16(
+                  _mm_srli_epi16(a, 8),
+                  _mm_srli_epi16(b, 8)
+               );
+            }
+         }
+         for (int k = 0; k < 6; ++k) v[k] = u[k];
+      }
+      uint8_t *pixels = row + ((size_t)3 * x << wide);
+      for (int k = 0; k < 6; ++k) {
+         _mm_storeu_si128((__m128i *)(pixels + 16 * k), v[k]);
+      }
+   }
+   return x;
+}
+
+__attribute__((target("avx2")))
+static unsigned int deinterleave3_avx2(
+   const uint8_t *row,
+   uint8_t *plane_row,
+   size_t plane_size,
+   int wide,
+   unsigned int width
+) {
+   unsigned int block = wide ? 32 : 64;
+   int layers = wide ? 4 : 5;
+   unsigned int x = 0;
+   for (; block <= width - x; x += block) {
+      // Vector k holds the vectors k of the two blocks of 96 bytes.
+      const uint8_t *pixels = row + ((size_t)3 * x << wide);
+      __m256i v[6], u[6];
+      for (int k = 0; k < 3; ++k) {
+         __m256i first = _mm256_loadu_si256(
+            (const __m256i *)(pixels + 32 * k)
+         );
+         __m256i second = _mm256_loadu_si256(
+            (const __m256i *)(pixels + 96 + 32 * k)
+         );
+         v[2 * k] = _mm256_permute2x128_si256(first, second, 0x20);
+         v[2 * k + 1] = _mm256_permute2x128_si256(first, second, 0x31);
       }
-      if (fprintf(file, "\n") < 0) return -1;
+      for (int layer = 0; layer < layers; ++layer) {
+         for (int k = 0; k < 3; ++k) {
+            if (wide) {
+               u[2 * k] = _mm256_unpacklo_epi16(v[k], v[k + 3]);
+               u[2 * k + 1] = _mm256_unpackhi_epi16(v[k], v[k + 3]);
+            } else {
+               u[2 * k] = _mm256_unpacklo_epi8(v[k], v[k + 3]);
+               u[2 * k + 1] = _mm256_unpackhi_epi8(v[k], v[k + 3]);
+            }
+         }
+         for (int k = 0; k < 6; ++k) v[k] = u[k];
+      }
+      for (int c = 0; c < 3; ++c) {
+         uint8_t *plane = plane_row + c * plane_size + ((size_t)x << wide);
+         __m256i a = v[2 * c], b = v[2 * c + 1];
+         _mm256_storeu_si256(
+            (__m256i *)plane,
+            _mm256_permute2x128_si256(a, b, 0x20)
+         );
+         _mm256_storeu_si256(
+            (__m256i *)(plane + 32),
+            _mm256_permute2x128_si256(a, b, 0x31)
+         );
+      }
+   }
+   return x;
+}
+
+__attribute__((target("avx2")))
+static unsigned int interleave3_avx2(
+   const uint8_t *plane_row,
+   size_t plane_size,
+   uint8_t *row,
+   int wide,
+   unsigned int width
+) {
+   unsigned int block = wide ? 32 : 64;
+   int layers = wide ? 4 : 5;
+   const __m256i low_bytes = _mm256_set1_epi16(0x00FF);
+   const __m256i low_words = _mm256_set1_epi32(0xFFFF);
+   unsigned int x = 0;
+   for (; block <= width - x; x += block) {
+      __m256i v[6], u[6];
+      for (int c = 0; c < 3; ++c) {
+         const uint8_t *plane = plane_row + c * plane_size
+                              + ((size_t)x << wide);
+         __m256i first = _mm256_loadu_si256((const __m256i *)plane);
+         __m256i second = _mm256_loadu_si256((const __m256i *)(plane + 32));
+         v[2 * c] = _mm256_permute2x128_si256(first, second, 0x20);
+         v[2 * c + 1] = _mm256_permute2x128_si256(first, second, 0x31);
+      }
+      for (int layer = 0; layer < layers; ++layer) {
+         for (int k = 0; k < 3; ++k) {
+            __m256i a = v[2 * k], b = v[2 * k + 1];
+            if (wide) {
+               u[k] = _mm256_packus_epi32(
+                  _mm256_and_si256(a, low_words),
+                  _mm256_and_si256(b, low_words)
+               );
+               u[k + 3] = _mm256_packus_epi32(
+                  _mm256_srli_epi32(a, 16),
+                  _mm256_srli_epi32(b, 16)
+               );
+            } else {
+               u[k] = _mm256_packus_epi16(
+                  _mm256_and_si256(a, low_bytes),
+                  _mm256_and_si256(b, low_bytes)
+               );
+               u[k + 3] = _mm256_packus_epi16(
+                  _mm256_srli_epi16(a, 8),
+                  _mm256_srli_epi16(b, 8)
+               );
+            }
+         }
+         for (int k = 0; k < 6; ++k) v[k] = u[k];
+      }
+      uint8_t *pixels = row + ((size_t)3 * x << wide);
+      for (int k = 0; k < 3; ++k) {
+         _mm256_storeu_si256(
+            (__m256i *)(pixels + 32 * k),
+            _mm256_permute2x128_si256(v[2 * k], v[2 * k + 1], 0x20)
+         );
+         _mm256_storeu_si256(
+            (__m256i *)(pixels + 96 + 32 * k),
+            _mm256_permute2x128_si256(v[2 * k], v[2 * k + 1], 0x31)
+         );
+      }
+   }
+   return x;
+}
+#endif // PNM_X86
+
+static size_t row_sample_count(unsigned int channels, unsigned int width) {
+   return (size_t)width * channels;
+}
+
+static int check_image_size(
+   unsigned int channels,
+   unsigned int width,
+   unsigned int height
+) {
+   size_t limit = (SIZE_MAX - PNM_ALIGNMENT) / sizeof(uint16_t);
+   if (channels != 0 && limit / channels < width) return -1;
+   size_t stride = pnm_row_stride(row_sample_count(channels, width) * 2);
+   if (stride != 0 && SIZE_MAX / stride < height) return -1;
+   return 0;
+}
+
+static unsigned int format_channels(FormatPNM format) {
+   return (format == FORMAT_PPM) ? 3 : 1;
+}
+
+static const char *format_tuple_type(FormatPNM format) {
+   switch (format) {
+      case FORMAT_PBM:
+         return "BLACKANDWHITE";
+      case FORMAT_PGM:
+         return "GRAYSCALE";
+      case FORMAT_PPM:
+         return "RGB";
+      default:
+         return "";
    }
+}
+
+static int check_output_filename(const char *filename, FormatPNM format) {
+   if (check_invalid_characters(filename) != 0) return -1;
+
+   FormatPNM file_extension;
+   if (file_extension_to_format(filename, &file_extension) != 0) return -1;
+   if (format != file_extension) return -1;
    return 0;
 }
 
@@ -445,64 +5263,148 @@ static int file_extension_to_format(const char *filename, FormatPNM *format) {
       *format = FORMAT_PGM;
    } else if (!strcasecmp(extension_string, "ppm")) {
       *format = FORMAT_PPM;
+   } else if (!strcasecmp(extension_string, "pam")) {
+      *format = FORMAT_PAM;
    } else {
       return -2;
    }
    return 0;
 }
 
-static int magic_str_to_format(const char *magic_str, FormatPNM *format) {
-   if (!strcmp(magic_str, "P1")) {
-      *format = FORMAT_PBM;
-   } else if (!strcmp(magic_str, "P2")) {
-      *format = FORMAT_PGM;
-   } else if (!strcmp(magic_str, "P3")) {
-      *format = FORMAT_PPM;
-   } else {
-      return -1;
+static int magic_str_to_format(
+   const char *magic_str,
+   FormatPNM *format,
+   EncodingPNM *encoding
+) {
+   if (magic_str[0] != 'P') return -1;
+   switch (magic_str[1]) {
+      case '1':
+      case '4':
+         *format = FORMAT_PBM;
+         break;
+      case '2':
+      case '5':
+         *format = FORMAT_PGM;
+         break;
+      case '3':
+      case '6':
+         *format = FORMAT_PPM;
+         break;
+      case '7':
+         *format = FORMAT_PAM;
+         break;
+      default:
+         return -1;
    }
+   *encoding = (magic_str[1] <= '3') ? ENCODING_ASCII : ENCODING_RAW;
    return 0;
 }
 
-static int format_to_magic_str(FormatPNM format, const char **magic_str) {
+static int format_to_magic_str(
+   FormatPNM format,
+   EncodingPNM encoding,
+   const char **magic_str
+) {
+   int raw;
+   switch (encoding) {
+      case ENCODING_ASCII:
+         raw = 0;
+         break;
+      case ENCODING_RAW:
+         raw = 1;
+         break;
+      default:
+         return -1;
+   }
    switch (format) {
       case FORMAT_PBM:
-         *magic_str = "P1";
+         *magic_str = raw ? "P4" : "P1";
          return 0;
       case FORMAT_PGM:
-         *magic_str = "P2";
+         *magic_str = raw ? "P5" : "P2";
          return 0;
       case FORMAT_PPM:
-         *magic_str = "P3";
+         *magic_str = raw ? "P6" : "P3";
+         return 0;
+      case FORMAT_PAM:
+         *magic_str = "P7";
          return 0;
       default:
          return -1;
    }
 }
 
-static void skip_comments(FILE *file) {
-   char c;
-   while ((c = fgetc(file)) != EOF) {
-      if isspace(c) continue;
-      if (c == '#') {
-         while ((c = fgetc(file)) != EOF && c != '\n') {}
-      } else {
-         ungetc(c, file);
-         break;
+static void skip_comments(Scanner *scanner) {
+   for (;;) {
+      if (scanner->position == scanner->length && scanner_fill(scanner) == 0) {
+         return;
+      }
+      const unsigned char *buffer = scanner->buffer;
+      size_t position = scanner->position;
+      size_t length = scanner->length;
+      while (position < length && SPACE_TABLE[buffer[position]]) ++position;
+      scanner->position = position;
+      if (position == length) continue;
+      if (buffer[position] != '#') return;
+
+      const unsigned char *newline = NULL;
+      while (newline == NULL) {
+         newline = memchr(
+            scanner->buffer + scanner->position,
+            '\n',
+            scanner->length - scanner->position
+         );
+         if (newline == NULL && scanner_fill(scanner) == 0) return;
       }
+      scanner->position = newline - scanner->buffer + 1;
+   }
+}
+
+static int read_magic_str(Scanner *scanner, char *magic_str) {
+   int length = 0;
+   int c;
+   while (length < 2 && (c = scanner_peek(scanner)) != EOF && !isspace(c)) {
+      magic_str[length++] = c;
+      ++scanner->position;
    }
+   magic_str[length] = '\0';
+   if (length == 0) return -1;
+   return 0;
 }
 
-static int read_unsigned_int(FILE *file, unsigned int *value) {
-   skip_comments(file);
-   if (fscanf_unsigned_int(file, value) != 0) return -1;
+static int read_token(Scanner *scanner, char *token, size_t size) {
+   size_t length = 0;
+   int c;
+   while ((c = scanner_peek(scanner)) != EOF && !isspace(c)) {
+      if (size - 1 <= length) return -1;
+      token[length++] = c;
+      ++scanner->position;
+   }
+   token[length] = '\0';
+   if (length == 0) return -1;
    return 0;
 }
 
-static int fscanf_unsigned_int(FILE *file, unsigned int *value) {
-   long long_value;
-   if (fscanf(file, "%ld", &long_value) != 1) return -1;
-   if (long_value < 0 || UINT_MAX < long_value) return -2;
-   *value = long_value;
+static int read_unsigned_int(Scanner *scanner, unsigned int *value) {
+   skip_comments(scanner);
+
+   int c = scanner_peek(scanner);
+   int negative = 0;
+   if (c == '+' || c == '-') {
+      negative = (c == '-');
+      ++scanner->position;
+      c = scanner_peek(scanner);
+   }
+   if (!isdigit(c)) return -1;
+
+   uint64_t result = 0;
+   do {
+      if (result <= UINT_MAX) result = result * 10 + (c - '0');
+      ++scanner->position;
+      c = scanner_peek(scanner);
+   } while (isdigit(c));
+
+   if (UINT_MAX < result || (negative && result != 0)) return -1;
+   *value = result;
    return 0;
 }
@@ -3,9 +3,10 @@
  * @brief Header file for handling PNM images library.
  *
  * Supported formats:
- * - PBM (Portable Bitmap)
- * - PGM (Portable Graymap)
- * - PPM (Portable Pixmap)
+ * - PBM (Portable Bitmap), ASCII (P1) and raw (P4)
+ * - PGM (Portable Graymap), ASCII (P2) and raw (P5)
+ * - PPM (Portable Pixmap), ASCII (P3) and raw (P6)
+ * - PAM (Portable Arbitrary Map), raw (P7), with any depth and tuple type
  *
  * @author Pavlov Aleksandr (s2400691)
  * @date 24.03.2025
@@ -15,13 +16,19 @@
 #ifndef _PNM_H
 #define _PNM_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* ======= Constants ======= */
 
 #define PBM_MAX_VALUE 1
+// Maximum gray level computed by the filters; PGM files themselves may use
+// up to PPM_MAX_VALUE.
 #define PGM_MAX_VALUE 255
 #define PPM_MAX_VALUE 65535
+#define PAM_MAX_VALUE 65535
+
+#define PAM_TUPLE_TYPE_SIZE 64
 
 #define PNM_SUCCESS 0
 #define PNM_INVALID_FILENAME -1
@@ -31,6 +38,14 @@
 
 #define WRITE_PNM_FILE_MANIPULATION_ERROR -2
 
+#define PNM_END_OF_FRAMES 1
+#define PNM_DECODE_PENDING 2
+
+#define PNM_MAX_THREADS 64
+#define PNM_THREADS_VARIABLE "PNM_THREADS"
+
+#define PNM_ALIGNMENT 64
+
 /* ======= Enums ======= */
 
 /**
@@ -39,18 +54,320 @@
 typedef enum FormatPNM_t {
    FORMAT_PBM,
    FORMAT_PGM,
-   FORMAT_PPM
+   FORMAT_PPM,
+   FORMAT_PAM
 } FormatPNM;
 
+/**
+ * @brief Enum for PNM data encodings.
+ *
+ * Raw samples are stored on one byte when the maximum value is at most 255
+ * and on two big-endian bytes otherwise. Raw PBM rows are packed eight pixels
+ * per byte, most significant bit first. PAM images are always raw.
+ */
+typedef enum EncodingPNM_t {
+   ENCODING_ASCII,
+   ENCODING_RAW
+} EncodingPNM;
+
+/**
+ * @brief Enum for the in-memory layouts of PNM pixel data.
+ *
+ * Samples are stored row after row, and the samples of a pixel one after the
+ * other: one per pixel for PBM and PGM, three for PPM and the depth of the
+ * image for PAM. STORAGE_BIT packs the rows of a PBM image eight pixels per
+ * byte, most significant bit first, each row starting on a new byte; the
+ * padding bits at the end of a row are ignored. STORAGE_8 and STORAGE_16
+ * store each sample on a uint8_t or a uint16_t.
+ *
+ * Rows start get_stride bytes apart. Pixel data allocated by the library
+ * starts on a PNM_ALIGNMENT boundary and its rows are padded to a multiple of
+ * PNM_ALIGNMENT bytes, so that every row is aligned; the padding bytes are
+ * never written to files. get_data packs the rows again.
+ */
+typedef enum StoragePNM_t {
+   STORAGE_BIT,
+   STORAGE_8,
+   STORAGE_16
+} StoragePNM;
+
+/**
+ * @brief Enum for the order of the samples of PNM pixel data.
+ *
+ * LAYOUT_INTERLEAVED keeps the samples of a pixel together, as in files.
+ * LAYOUT_PLANAR keeps one plane per channel: the planes follow each other,
+ * each one the height of the image in rows of get_stride bytes, a row
+ * holding one sample per pixel. Only STORAGE_8 and STORAGE_16 pixel data
+ * can be planar; a plane walks along contiguous samples of one channel,
+ * which suits filters that treat channels independently.
+ */
+typedef enum LayoutPNM_t {
+   LAYOUT_INTERLEAVED,
+   LAYOUT_PLANAR
+} LayoutPNM;
+
 /* ======= Structures ======= */
 
+/**
+ * @brief Header of a PNM file, as reported by pnm_probe.
+ *
+ * data_offset is the offset in bytes of the first byte of raw pixel data.
+ * For ASCII files it is the offset of the byte that follows the last field
+ * of the header, which is usually whitespace. channels is the number of
+ * samples per pixel.
+ */
+typedef struct PNMInfo_t {
+   FormatPNM format;
+   EncodingPNM encoding;
+   unsigned int width;
+   unsigned int height;
+   uint16_t max_value;
+   unsigned int channels;
+   uint64_t data_offset;
+} PNMInfo;
+
 /**
  * @brief Structure representing a PNM image.
  */
 typedef struct PNM_t PNM;
 
+/**
+ * @brief Structure reading a PNM file a batch of rows at a time.
+ */
+typedef struct PNMReader_t PNMReader;
+
+/**
+ * @brief Structure writing a PNM file a batch of rows at a time.
+ */
+typedef struct PNMWriter_t PNMWriter;
+
+/**
+ * @brief Structure reading the images of a PNM stream one after the other.
+ */
+typedef struct PNMFrameReader_t PNMFrameReader;
+
+/**
+ * @brief Functions through which the library allocates its memory.
+ *
+ * allocate returns a block of at least size bytes, aligned on PNM_ALIGNMENT
+ * bytes, or NULL on failure. release frees a block returned by allocate and
+ * does nothing for NULL. Both receive context, and may be called by several
+ * threads of the library at the same time.
+ */
+typedef struct PNMAllocator_t {
+   void *(*allocate)(void *context, size_t size);
+   void (*release)(void *context, void *block);
+   void *context;
+} PNMAllocator;
+
+/**
+ * @brief Allocator keeping released blocks to serve later allocations of
+ * the same size.
+ */
+typedef struct PNMPool_t PNMPool;
+
+/**
+ * @brief Counters of a pool, as reported by pnm_pool_stats.
+ *
+ * hits is the number of allocations served by a kept block; the other
+ * allocations went to malloc. cached_blocks and cached_size are the number
+ * and total size in bytes of the blocks kept for reuse.
+ */
+typedef struct PNMPoolStats_t {
+   size_t allocations;
+   size_t hits;
+   size_t cached_blocks;
+   size_t cached_size;
+} PNMPoolStats;
+
+/**
+ * @brief Routine run by pnm_parallel_for on band number band, the items from
+ * first up to but excluding end. Returns 0 on success, a status code
+ * otherwise.
+ */
+typedef int (*PNMBandRoutine)(
+   void *context,
+   unsigned int band,
+   size_t first,
+   size_t end
+);
+
 /* ======= Function Prototypes ======= */
 
+/**
+ * @brief Sets the number of threads of the library.
+ *
+ * ASCII bodies of at least a mebibyte are split into ranges that are decoded
+ * concurrently; smaller bodies, and bodies with comments, are always decoded
+ * by the calling thread. Likewise, large ASCII bodies are written by
+ * formatting bands of rows concurrently, and pnm_parallel_bands gives the
+ * number of bands of other jobs. The result does not depend on the number
+ * of threads.
+ *
+ * @param count Number of threads, at most PNM_MAX_THREADS. 0 selects the
+ *              number in the PNM_THREADS_VARIABLE environment variable, or
+ *              one thread per online processor without it, which is the
+ *              default.
+ */
+void pnm_set_threads(unsigned int count);
+
+/**
+ * @brief Stops the threads that the library keeps between jobs, see
+ *        pnm_parallel_for, and waits for them to end.
+ *
+ * Nothing is done while a job runs on the threads. Later jobs start threads
+ * again. The threads are also stopped at exit, as by atexit, when no job
+ * runs then.
+ */
+void pnm_stop_threads(void);
+
+/**
+ * @brief Retrieves the number of threads of the library.
+ *
+ * @return
+ *     Number of threads, between 1 and PNM_MAX_THREADS
+ */
+unsigned int pnm_get_threads(void);
+
+/**
+ * @brief Computes the number of bands worth running concurrently.
+ *
+ * There is at most one band per thread and per item, and each band is worth
+ * at least 256 KiB of the size, so that small jobs do not wait for threads
+ * to wake up.
+ *
+ * @param count Number of items.
+ * @param size Number of bytes the items read or write.
+ *
+ * @return
+ *     Number of bands, between 1 and PNM_MAX_THREADS
+ */
+unsigned int pnm_parallel_bands(size_t count, size_t size);
+
+/**
+ * @brief Runs a routine on bands of items concurrently.
+ *
+ * The items are split into contiguous bands of nearly equal length, band b
+ * coming before band b + 1, which are run on a pool of threads that the
+ * library keeps between calls, see pnm_stop_threads. The pool runs one job
+ * at a time: a single band, and the bands of jobs posted while the pool is
+ * busy, whether from a routine or concurrently by other threads, run one
+ * after the other on the calling thread. Bands must not depend on each
+ * other.
+ *
+ * @param count Number of items.
+ * @param bands Number of bands, usually from pnm_parallel_bands, at most
+ *              count and PNM_MAX_THREADS.
+ * @param routine Routine to run on each band.
+ * @param context Pointer given to the routine.
+ *
+ * @return
+ *     0 if every band succeeds, the status of a failed band otherwise
+ *    -4: Invalid argument
+ */
+int pnm_parallel_for(
+   size_t count,
+   unsigned int bands,
+   PNMBandRoutine routine,
+   void *context
+);
+
+/**
+ * @brief Sets the allocator of the library.
+ *
+ * Images, their pixel data, readers, writers and the buffers of the library
+ * are allocated with pnm_alloc and released with pnm_free, which go through
+ * this allocator. An image records the allocator of its structure and the
+ * one of its pixel data, and releases them through those, so the allocator
+ * may change while images exist; an allocator must then outlive the images
+ * it allocated. Readers, writers and frame readers are released through the
+ * current allocator, so it is only changed while none of them exists.
+ *
+ * @param allocator Pointer to the allocator, copied. NULL selects malloc and
+ *                  free, which is the default.
+ */
+void pnm_set_allocator(const PNMAllocator *allocator);
+
+/**
+ * @brief Allocates a block of memory with the allocator of the library.
+ *
+ * Pixel data given to set_pnm, set_pnm_storage and set_pam is released
+ * through the allocator current when it is given, so it must come from this
+ * function with that allocator.
+ *
+ * @param size Size of the block in bytes.
+ *
+ * @return
+ *     Pointer to the block
+ *     NULL : Memory allocation failure
+ */
+void *pnm_alloc(size_t size);
+
+/**
+ * @brief Releases a block allocated with pnm_alloc.
+ *
+ * @param block Pointer to the block, or NULL.
+ */
+void pnm_free(void *block);
+
+/**
+ * @brief Creates a pool recycling the blocks it allocates.
+ *
+ * Released blocks are kept, up to capacity bytes in total, and handed back
+ * to allocations of exactly the same size; the least recently released
+ * blocks are freed first to make room. Repeated loads, filters and frees of
+ * images of the same dimensions then reuse the same buffers instead of going
+ * through malloc.
+ *
+ * @param pool Pointer to store the created pool.
+ * @param capacity Total size in bytes of the blocks kept for reuse.
+ *
+ * @pre pool != NULL
+ *
+ * @return
+ *     0: Success
+ *    -2: Memory allocation failure
+ *    -4: Invalid argument
+ */
+int pnm_pool_create(PNMPool **pool, size_t capacity);
+
+/**
+ * @brief Retrieves the allocator that allocates from a pool.
+ *
+ * The result is meant for pnm_set_allocator.
+ *
+ * @param pool Pointer to the pool.
+ * @param allocator Pointer to store the allocator.
+ *
+ * @pre pool != NULL, allocator != NULL
+ */
+void pnm_pool_allocator(PNMPool *pool, PNMAllocator *allocator);
+
+/**
+ * @brief Retrieves the counters of a pool.
+ *
+ * The hit rate of the pool is hits divided by allocations.
+ *
+ * @param pool Pointer to the pool.
+ * @param stats Pointer to store the counters.
+ *
+ * @pre pool != NULL, stats != NULL
+ */
+void pnm_pool_stats(PNMPool *pool, PNMPoolStats *stats);
+
+/**
+ * @brief Frees a pool and the blocks it keeps.
+ *
+ * Every block allocated from the pool must have been released, images
+ * allocated while it was the allocator of the library included, and the
+ * pool must no longer be the allocator of the library.
+ *
+ * @param pool Pointer to the pool to free.
+ *
+ * @pre pool != NULL, *pool != NULL
+ */
+void pnm_pool_destroy(PNMPool **pool);
+
 /**
  * @brief Retrieves the format of a PNM image.
  *
@@ -64,6 +381,19 @@ typedef struct PNM_t PNM;
  */
 FormatPNM get_format(PNM *image);
 
+/**
+ * @brief Retrieves the data encoding of a PNM image.
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     Encoding of the image
+ *    -1: image == NULL
+ */
+EncodingPNM get_encoding(PNM *image);
+
 /**
  * @brief Retrieves the width of a PNM image.
  *
@@ -104,78 +434,1039 @@ unsigned int get_height(PNM *image);
 uint16_t get_max_value(PNM *image);
 
 /**
- * @brief Retrieves the pixel data of a PNM image.
+ * @brief Retrieves the number of samples per pixel of a PNM image.
+ *
+ * 1 for PBM and PGM, 3 for PPM and the depth of the image for PAM.
  *
  * @param image Pointer to the PNM image.
  *
  * @pre image != NULL
  *
  * @return
- *     Pointer to the pixel data
- *     NULL : image == NULL
+ *     Number of channels
+ *     0: image == NULL
  */
-uint16_t *get_data(PNM *image);
+unsigned int get_channels(PNM *image);
 
 /**
- * @brief Sets the properties of a PNM image.
+ * @brief Retrieves the tuple type of a PNM image.
+ *
+ * PBM, PGM and PPM images report the tuple types of the equivalent PAM
+ * images: "BLACKANDWHITE", "GRAYSCALE" and "RGB". The tuple type of a PAM
+ * image is empty when its header has none.
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     Tuple type, valid until the image is modified
+ *     NULL: image == NULL
+ */
+const char *get_tuple_type(PNM *image);
+
+/**
+ * @brief Tells whether the last sample of each pixel is an alpha sample.
+ *
+ * Following the PAM conventions, this is the case when the tuple type ends
+ * with "_ALPHA", as in "GRAYSCALE_ALPHA" or "RGB_ALPHA".
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     1: The image has an alpha channel
+ *     0: The image has no alpha channel or image == NULL
+ */
+int has_alpha(PNM *image);
+
+/**
+ * @brief Retrieves the storage of the pixel data of a PNM image.
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     Storage of the image
+ *    -1: image == NULL
+ */
+StoragePNM get_storage(PNM *image);
+
+/**
+ * @brief Retrieves the decoding status of the pixel data of a PNM image.
+ *
+ * Only images loaded by load_pnm_lazy have a pending or failed decoding.
+ * A failed decoding leaves the image without pixel data: the data accessors
+ * return NULL and the image cannot be written.
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     PNM_SUCCESS: Pixel data decoded
+ *     PNM_DECODE_PENDING: Pixel data not decoded yet
+ *    -1: The file could not be opened again
+ *    -2: Memory allocation failure while decoding
+ *    -3: Decode error
+ *    -4: image == NULL
+ */
+int get_status(PNM *image);
+
+/**
+ * @brief Retrieves the layout of the pixel data of a PNM image.
  *
  * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     Layout of the image
+ *    -1: image == NULL
+ */
+LayoutPNM get_layout(PNM *image);
+
+/**
+ * @brief Retrieves the storage chosen for the pixel data of loaded images.
+ *
+ * PBM images are bit-packed, images whose maximum value is at most 255 use
+ * one byte per sample and other images two bytes per sample. PAM images are
+ * never bit-packed, even when their maximum value is 1.
+ *
  * @param format Format of the image.
- * @param width Width of the image.
- * @param height Height of the image.
  * @param max_value Maximum pixel value.
- * @param data Pointer to the pixel data.
+ *
+ * @return
+ *     Storage matching the format and the maximum value
+ */
+StoragePNM get_default_storage(FormatPNM format, uint16_t max_value);
+
+/**
+ * @brief Retrieves the size in bytes of one row of pixel data.
+ *
+ * @param image Pointer to the PNM image.
  *
  * @pre image != NULL
+ *
+ * @return
+ *     Size of one row in the storage of the image
+ *     0: image == NULL
  */
-void set_pnm(
-   PNM *image,
-   FormatPNM format,
-   unsigned int width,
-   unsigned int height,
-   uint16_t max_value,
-   uint16_t *data
-);
+size_t get_row_size(PNM *image);
 
 /**
- * @brief Frees the memory allocated for a PNM image.
+ * @brief Retrieves the number of samples of an image.
  *
- * @param image Pointer to the pointer of the PNM image to free.
+ * Images are only loaded or created when this number, times the size of a
+ * 16-bit sample, fits in a size_t, so that it is computed without overflow.
  *
- * @pre image != NULL, *image != NULL
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     Width times height times the number of channels
+ *     0: image == NULL
  */
-void free_pnm(PNM **image);
+size_t get_sample_count(PNM *image);
 
 /**
- * @brief Loads a PNM image from a file.
+ * @brief Retrieves the number of bytes from the start of a row of pixel
+ * data to the start of the next one.
  *
- * @param image Pointer to store the loaded PNM image.
- * @param filename Path to the file to load.
+ * The stride is at least the row size. Pixel data allocated by the library
+ * has padded rows, see pnm_row_stride. Pixel data given to set_pnm,
+ * set_pnm_storage and set_pam, and raw images mapped in place by
+ * load_pnm_mmap, have packed rows until set_stride is called, and so has
+ * pixel data returned by get_data.
  *
- * @pre image != NULL, filename != NULL
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
  *
  * @return
- *     0: Success
- *    -2: Invalid filename
- *    -1: Memory allocation failure
- *    -3: Decode error
- *    -4: Invalid argument
+ *     Stride of the pixel data
+ *     0: image == NULL
  */
-int load_pnm(PNM **image, const char *filename);
+size_t get_stride(PNM *image);
 
 /**
- * @brief Writes a PNM image to a file.
+ * @brief Computes the stride of rows allocated by the library.
  *
- * @param image Pointer to the PNM image to write.
- * @param filename Path to the file to write to.
+ * @param row_size Size of one row in bytes.
  *
- * @pre image != NULL, filename != NULL
+ * @return
+ *     row_size rounded up to a multiple of PNM_ALIGNMENT
+ */
+size_t pnm_row_stride(size_t row_size);
+
+/**
+ * @brief Retrieves a row of the pixel data of a PNM image.
+ *
+ * The row is in the storage of the image and is not converted. Rows of pixel
+ * data allocated by the library start on a PNM_ALIGNMENT boundary; rows of
+ * raw images mapped in place by load_pnm_mmap may start anywhere.
+ *
+ * @param image Pointer to the PNM image.
+ * @param y Index of the row.
+ *
+ * @pre image != NULL, y < height of the image
  *
  * @return
- *     0: Success
- *    -1: Invalid filename
- *    -2: Writing file error
+ *     Pointer to the row
+ *     NULL : image == NULL, y out of the image or no pixel data
  */
-int write_pnm(PNM *image, const char *filename);
+void *get_row(PNM *image, unsigned int y);
+
+/**
+ * @brief Retrieves the pixel data of a PNM image as 16-bit samples.
+ *
+ * The samples are packed row after row, so that channel c of pixel (x, y)
+ * is data[((size_t)y * width + x) * channels + c]. Pixel data held in
+ * another storage is converted to STORAGE_16 first, and padded rows are
+ * packed, which invalidates the pointers previously returned by the other
+ * accessors; get_stride then equals get_row_size. get_row, get_data8 and
+ * get_data16 give the rows where they are, padded or not.
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     Pointer to the first row
+ *     NULL : image == NULL, memory allocation failure or decoding failure,
+ *            see get_status
+ */
+uint16_t *get_data(PNM *image);
+
+/**
+ * @brief Retrieves the pixel data of a PNM image stored on 8-bit samples.
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     Pointer to the first row
+ *     NULL : image == NULL or storage is not STORAGE_8
+ */
+uint8_t *get_data8(PNM *image);
+
+/**
+ * @brief Retrieves the pixel data of a PNM image stored on 16-bit samples.
+ *
+ * Unlike get_data, the pixel data is never converted.
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     Pointer to the first row
+ *     NULL : image == NULL or storage is not STORAGE_16
+ */
+uint16_t *get_data16(PNM *image);
+
+/**
+ * @brief Retrieves the bit-packed rows of a PBM image.
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     Pointer to the first row
+ *     NULL : image == NULL or storage is not STORAGE_BIT
+ */
+uint8_t *get_bits(PNM *image);
+
+/**
+ * @brief Retrieves a plane of the pixel data of a PNM image.
+ *
+ * Interleaved pixel data is converted to LAYOUT_PLANAR first, which
+ * invalidates the pointers previously returned by the other accessors.
+ * The samples of the plane are uint8_t for STORAGE_8 and uint16_t for
+ * STORAGE_16, and its rows are get_stride bytes apart.
+ *
+ * @param image Pointer to the PNM image.
+ * @param channel Index of the channel of the plane.
+ *
+ * @pre image != NULL, channel < number of channels of the image
+ *
+ * @return
+ *     Pointer to the first row of the plane
+ *     NULL : image == NULL, channel out of the image, STORAGE_BIT, no pixel
+ *            data or conversion failure
+ */
+void *get_plane(PNM *image, unsigned int channel);
+
+/**
+ * @brief Sets the properties of a PNM image.
+ *
+ * The image takes ownership of data, which comes from pnm_alloc and holds
+ * packed rows, see set_stride. The previous pixel data of the image is
+ * released when it differs from data, and pixel data still to be decoded
+ * is dropped. The number of channels and the tuple
+ * type follow the format; a PAM image keeps its own, see set_pam.
+ *
+ * @param image Pointer to the PNM image.
+ * @param format Format of the image.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param max_value Maximum pixel value.
+ * @param data Pointer to the pixel data.
+ *
+ * @pre image != NULL
+ */
+void set_pnm(
+   PNM *image,
+   FormatPNM format,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   uint16_t *data
+);
+
+/**
+ * @brief Sets the properties of a PNM image whose data uses any storage.
+ *
+ * Same as set_pnm, with data laid out as described by storage.
+ *
+ * @param image Pointer to the PNM image.
+ * @param format Format of the image.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param max_value Maximum pixel value.
+ * @param storage Storage of the pixel data.
+ * @param data Pointer to the pixel data.
+ *
+ * @pre image != NULL
+ */
+void set_pnm_storage(
+   PNM *image,
+   FormatPNM format,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value,
+   StoragePNM storage,
+   void *data
+);
+
+/**
+ * @brief Sets the properties of a PAM image.
+ *
+ * Same as set_pnm_storage for a PAM image of the given depth and tuple type.
+ *
+ * @param image Pointer to the PNM image.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param depth Number of samples per pixel.
+ * @param max_value Maximum sample value.
+ * @param tuple_type Tuple type, shorter than PAM_TUPLE_TYPE_SIZE.
+ * @param storage Storage of the pixel data.
+ * @param data Pointer to the pixel data.
+ *
+ * @pre image != NULL, tuple_type != NULL
+ *
+ * @return
+ *     0: Success
+ *    -4: Invalid argument or image too large, the image is left unchanged
+ */
+int set_pam(
+   PNM *image,
+   unsigned int width,
+   unsigned int height,
+   unsigned int depth,
+   uint16_t max_value,
+   const char *tuple_type,
+   StoragePNM storage,
+   void *data
+);
+
+/**
+ * @brief Converts the pixel data of a PNM image to another storage.
+ *
+ * Samples that do not fit in the new storage are truncated. Converting to
+ * STORAGE_BIT keeps one bit per sample, set when the sample is not 0.
+ *
+ * @param image Pointer to the PNM image.
+ * @param storage New storage of the pixel data.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: The file of a lazily loaded image could not be opened again
+ *    -2: Memory allocation failure
+ *    -3: Decode error of a lazily loaded image
+ *    -4: Invalid argument
+ */
+int set_storage(PNM *image, StoragePNM storage);
+
+/**
+ * @brief Sets the stride of the pixel data of a PNM image.
+ *
+ * The set functions assume packed rows; this tells the image that the rows
+ * of its pixel data are padded, as those allocated with pnm_row_stride.
+ *
+ * @param image Pointer to the PNM image.
+ * @param stride Number of bytes from the start of a row to the next one.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     0: Success
+ *    -4: Invalid argument or stride smaller than the row size
+ */
+int set_stride(PNM *image, size_t stride);
+
+/**
+ * @brief Releases the memory past the pixel data of a PNM image.
+ *
+ * Pixel data written in place over larger pixel data, as by a set function
+ * given the current pixel data and then set_stride, leaves the end of its
+ * block unused. The pixel data is copied once into an aligned block of its
+ * own size, and the larger block released, when it belongs to the image
+ * alone; pixel data mapped from a file or shared with views is left as it
+ * is. The pointers previously returned by the accessors are invalidated.
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     0: Success
+ *    -2: Memory allocation failure, the pixel data keeps its samples
+ *    -4: Invalid argument
+ */
+int pnm_shrink_data(PNM *image);
+
+/**
+ * @brief Converts the pixel data of a PNM image to another layout.
+ *
+ * The converted rows are padded, see pnm_row_stride. Files always hold
+ * interleaved samples: planar images are written from an interleaved copy,
+ * and the accessors and functions that address whole pixels, such as
+ * get_row, get_data, set_storage or pnm_view, convert them back to
+ * LAYOUT_INTERLEAVED first. A sequence of planar operations thus converts
+ * the pixel data once. Images of one channel are the same in both layouts
+ * and are never copied. Each row is converted in one pass, with SSE2 or
+ * AVX2 for rows of three channels on x86 processors that have them.
+ *
+ * @param image Pointer to the PNM image.
+ * @param layout New layout of the pixel data.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: The file of a lazily loaded image could not be opened again
+ *    -2: Memory allocation failure
+ *    -3: Decode error of a lazily loaded image
+ *    -4: Invalid argument, STORAGE_BIT or no pixel data
+ */
+int set_layout(PNM *image, LayoutPNM layout);
+
+/**
+ * @brief Sets the data encoding used when writing a PNM image.
+ *
+ * PAM images are always written raw. A lazily loaded image is decoded
+ * first, see get_status.
+ *
+ * @param image Pointer to the PNM image.
+ * @param encoding Encoding of the image.
+ *
+ * @pre image != NULL
+ */
+void set_encoding(PNM *image, EncodingPNM encoding);
+
+/**
+ * @brief Creates a PNM image with uninitialized pixel data.
+ *
+ * The pixel data uses the storage given by get_default_storage. PAM images
+ * are created with create_pam.
+ *
+ * @param image Pointer to store the created PNM image.
+ * @param format Format of the image, other than FORMAT_PAM.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param max_value Maximum pixel value.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     0: Success
+ *    -2: Memory allocation failure or image too large
+ *    -4: Invalid argument
+ */
+int create_pnm(
+   PNM **image,
+   FormatPNM format,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value
+);
+
+/**
+ * @brief Creates a PAM image with uninitialized pixel data.
+ *
+ * The pixel data uses the storage given by get_default_storage.
+ *
+ * @param image Pointer to store the created image.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param depth Number of samples per pixel.
+ * @param max_value Maximum sample value.
+ * @param tuple_type Tuple type, shorter than PAM_TUPLE_TYPE_SIZE.
+ *
+ * @pre image != NULL, tuple_type != NULL
+ *
+ * @return
+ *     0: Success
+ *    -2: Memory allocation failure or image too large
+ *    -4: Invalid argument
+ */
+int create_pam(
+   PNM **image,
+   unsigned int width,
+   unsigned int height,
+   unsigned int depth,
+   uint16_t max_value,
+   const char *tuple_type
+);
+
+/**
+ * @brief Creates a view of a rectangle of a PNM image, without copying its
+ *        pixel data.
+ *
+ * The view has the properties of its parent and the size of the rectangle;
+ * its rows are those of the parent, get_stride bytes apart. Changes made
+ * through either image are seen by the other. A view holds a reference to
+ * the pixel data of its parent, so the two are freed with free_pnm in any
+ * order, and views of views are allowed.
+ *
+ * The sharing ends for an image that gets new pixel data, from set_storage,
+ * get_data, the set functions or a filter that changes its format; the
+ * other images keep the previous pixel data. Filters working in place, such
+ * as negative, change the parent through a view. A lazily loaded parent is
+ * decoded first.
+ *
+ * Views of one image are created by one thread at a time. They may then be
+ * used and freed by different threads.
+ *
+ * @param view Pointer to store the view.
+ * @param parent Pointer to the PNM image to view.
+ * @param x Column of the left edge of the rectangle, a multiple of 8 for
+ *          STORAGE_BIT.
+ * @param y Row of the top edge of the rectangle.
+ * @param width Width of the rectangle.
+ * @param height Height of the rectangle.
+ *
+ * @pre view != NULL, parent != NULL, 0 < width, 0 < height
+ *
+ * @return
+ *     0: Success
+ *    -1: The file of a lazily loaded parent could not be opened again
+ *    -2: Memory allocation failure
+ *    -3: Decode error of a lazily loaded parent
+ *    -4: Invalid argument, or rectangle not inside the image
+ */
+int pnm_view(
+   PNM **view,
+   PNM *parent,
+   unsigned int x,
+   unsigned int y,
+   unsigned int width,
+   unsigned int height
+);
+
+/**
+ * @brief Tells whether the pixel data of a PNM image is shared with views.
+ *
+ * @param image Pointer to the PNM image.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     1 if another image, a view or the parent of a view, refers to the
+ *     pixel data, 0 otherwise
+ */
+int pnm_is_shared(PNM *image);
+
+/**
+ * @brief Frees the memory allocated for a PNM image.
+ *
+ * @param image Pointer to the pointer of the PNM image to free.
+ *
+ * @pre image != NULL, *image != NULL
+ */
+void free_pnm(PNM **image);
+
+/**
+ * @brief Loads a PNM image from a file.
+ *
+ * The encoding of the image is taken from the magic number of the file.
+ * Headers whose samples could not be addressed in memory are decode errors.
+ *
+ * @param image Pointer to store the loaded PNM image.
+ * @param filename Path to the file to load.
+ *
+ * @pre image != NULL, filename != NULL
+ *
+ * @return
+ *     0: Success
+ *    -2: Invalid filename
+ *    -1: Memory allocation failure
+ *    -3: Decode error
+ *    -4: Invalid argument
+ */
+int load_pnm(PNM **image, const char *filename);
+
+/**
+ * @brief Loads a PNM image from a file, deferring the decoding of its
+ *        pixel data.
+ *
+ * Only the header is read and checked, as load_pnm does; the file is then
+ * closed and its path remembered. The pixel data is decoded the first time
+ * it is needed: by a data accessor, set_storage, set_encoding or a write.
+ * Decode errors are then reported by get_status. Images that are dropped
+ * or replaced before that point are never decoded.
+ *
+ * The file must stay in place and unchanged until the image is decoded; a
+ * relative filename is resolved against the working directory at that
+ * time. The first decoding modifies the image, so it must not race with
+ * other accesses to the same image.
+ *
+ * @param image Pointer to store the loaded PNM image.
+ * @param filename Path to the file to load.
+ *
+ * @pre image != NULL, filename != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: Invalid filename
+ *    -2: Memory allocation failure
+ *    -3: Decode error in the header
+ *    -4: Invalid argument
+ */
+int load_pnm_lazy(PNM **image, const char *filename);
+
+/**
+ * @brief Loads a PNM image from a block of memory.
+ *
+ * The format and encoding of the image are taken from its magic number.
+ *
+ * @param image Pointer to store the loaded PNM image.
+ * @param bytes Pointer to the encoded image.
+ * @param size Size of the encoded image in bytes.
+ *
+ * @pre image != NULL, bytes != NULL
+ *
+ * @return
+ *     0: Success
+ *    -2: Memory allocation failure
+ *    -3: Decode error
+ *    -4: Invalid argument
+ */
+int load_pnm_from_memory(PNM **image, const void *bytes, size_t size);
+
+/**
+ * @brief Loads a PNM image from an open file descriptor, such as a pipe.
+ *
+ * The format and encoding of the image are taken from its magic number.
+ * Reading starts at the current offset of fd, and bytes that follow the
+ * image may be consumed. fd is left open.
+ *
+ * @param image Pointer to store the loaded PNM image.
+ * @param fd File descriptor to read from.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: Invalid file descriptor
+ *    -2: Memory allocation failure
+ *    -3: Decode error
+ *    -4: Invalid argument
+ */
+int load_pnm_from_fd(PNM **image, int fd);
+
+/**
+ * @brief Loads a PNM image by mapping its file into memory.
+ *
+ * The file is mapped privately: changes made to the pixel data stay in
+ * memory and never reach the file. Raw images of bits or 8-bit samples use
+ * the mapping as their pixel data, without any read or copy of the whole
+ * body. Their rows are packed, get_stride being get_row_size, and start
+ * wherever the file puts them rather than on a PNM_ALIGNMENT boundary.
+ * Raw images of 16-bit samples, big-endian in the file, and ASCII images
+ * are decoded into padded rows like load_pnm.
+ *
+ * @param image Pointer to store the loaded PNM image.
+ * @param filename Path to the file to load.
+ *
+ * @pre image != NULL, filename != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: Invalid filename
+ *    -2: Memory allocation or mapping failure
+ *    -3: Decode error
+ *    -4: Invalid argument
+ */
+int load_pnm_mmap(PNM **image, const char *filename);
+
+/**
+ * @brief Loads a rectangular region of a PNM image from a file.
+ *
+ * Only the region is stored, so memory use depends on the size of the
+ * region and not on the size of the image. Rows and columns of raw images
+ * outside the region are skipped with seeks; samples of ASCII images
+ * outside the region are parsed and checked but not stored. Nothing is read
+ * after the last row of the region.
+ *
+ * @param image Pointer to store the loaded region, as a PNM image.
+ * @param filename Path to the file to load.
+ * @param x Column of the left edge of the region.
+ * @param y Row of the top edge of the region.
+ * @param width Width of the region.
+ * @param height Height of the region.
+ *
+ * @pre image != NULL, filename != NULL, 0 < width, 0 < height
+ *
+ * @return
+ *     0: Success
+ *    -1: Invalid filename
+ *    -2: Memory allocation failure
+ *    -3: Decode error
+ *    -4: Invalid argument, or region not inside the image
+ */
+int load_pnm_region(
+   PNM **image,
+   const char *filename,
+   unsigned int x,
+   unsigned int y,
+   unsigned int width,
+   unsigned int height
+);
+
+/**
+ * @brief Reads the header of a PNM file without decoding its pixel data.
+ *
+ * Reading stops at the end of the header, so the cost does not depend on
+ * the size of the image. The file extension is not checked.
+ *
+ * @param filename Path to the file to probe.
+ * @param info Pointer to store the header of the file.
+ *
+ * @pre filename != NULL, info != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: Invalid filename
+ *    -2: Memory allocation failure
+ *    -3: Decode error
+ *    -4: Invalid argument
+ */
+int pnm_probe(const char *filename, PNMInfo *info);
+
+/**
+ * @brief Reads the headers of several PNM files.
+ *
+ * The files are probed concurrently by a small pool of threads. The result
+ * of each probe is stored at the index of its file.
+ *
+ * @param filenames Array of paths to the files to probe.
+ * @param count Number of files.
+ * @param infos Array of count headers to fill.
+ * @param codes Array of count result codes of pnm_probe.
+ *
+ * @pre filenames != NULL, infos != NULL, codes != NULL
+ *
+ * @return
+ *     0: Success, the probe of each file may have failed
+ *    -4: Invalid argument
+ */
+int pnm_probe_batch(
+   const char *const *filenames,
+   size_t count,
+   PNMInfo *infos,
+   int *codes
+);
+
+/**
+ * @brief Writes a PNM image to a file.
+ *
+ * The data is written in the encoding of the image.
+ *
+ * @param image Pointer to the PNM image to write.
+ * @param filename Path to the file to write to.
+ *
+ * @pre image != NULL, filename != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: Invalid filename
+ *    -2: Writing file error, or pixel data that could not be decoded
+ */
+int write_pnm(PNM *image, const char *filename);
+
+/**
+ * @brief Writes a PNM image to a new block of memory.
+ *
+ * @param image Pointer to the PNM image to write.
+ * @param bytes Pointer to store the encoded image, to be freed with free.
+ * @param size Pointer to store the size of the encoded image in bytes.
+ *
+ * @pre image != NULL, bytes != NULL, size != NULL
+ *
+ * @return
+ *     0: Success
+ *    -2: Writing error, or pixel data that could not be decoded
+ *    -4: Invalid argument
+ */
+int write_pnm_to_memory(PNM *image, void **bytes, size_t *size);
+
+/**
+ * @brief Writes a PNM image to an open file descriptor, such as a pipe.
+ *
+ * Writing starts at the current offset of fd. fd is left open.
+ *
+ * @param image Pointer to the PNM image to write.
+ * @param fd File descriptor to write to.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: Invalid file descriptor
+ *    -2: Writing error, or pixel data that could not be decoded
+ *    -4: Invalid argument
+ */
+int write_pnm_to_fd(PNM *image, int fd);
+
+/**
+ * @brief Opens a PNM file for reading row by row.
+ *
+ * Only the header is read. The rows are then decoded on demand by
+ * pnm_read_rows, so memory use does not depend on the size of the image.
+ *
+ * @param reader Pointer to store the opened reader.
+ * @param filename Path to the file to read.
+ *
+ * @pre reader != NULL, filename != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: Invalid filename
+ *    -2: Memory allocation failure
+ *    -3: Decode error
+ *    -4: Invalid argument
+ */
+int pnm_reader_open(PNMReader **reader, const char *filename);
+
+/**
+ * @brief Retrieves the header of the file read by a reader.
+ *
+ * Any output pointer may be NULL.
+ *
+ * @param reader Pointer to the reader.
+ * @param format Pointer to store the format of the image.
+ * @param encoding Pointer to store the encoding of the image.
+ * @param width Pointer to store the width of the image.
+ * @param height Pointer to store the height of the image.
+ * @param max_value Pointer to store the maximum pixel value.
+ *
+ * @pre reader != NULL
+ */
+void pnm_reader_header(
+   PNMReader *reader,
+   FormatPNM *format,
+   EncodingPNM *encoding,
+   unsigned int *width,
+   unsigned int *height,
+   uint16_t *max_value
+);
+
+/**
+ * @brief Retrieves the number of samples per pixel of the file read by a
+ *        reader.
+ *
+ * @param reader Pointer to the reader.
+ *
+ * @pre reader != NULL
+ *
+ * @return
+ *     Number of channels
+ *     0: reader == NULL
+ */
+unsigned int pnm_reader_channels(PNMReader *reader);
+
+/**
+ * @brief Reads the next rows of a PNM file.
+ *
+ * Rows are stored like the data of a PNM image: one sample per pixel for
+ * PBM and PGM, three for PPM and pnm_reader_channels for PAM.
+ *
+ * @param reader Pointer to the reader.
+ * @param rows Buffer large enough to hold count rows.
+ * @param count Maximum number of rows to read.
+ * @param read_count Pointer to store the number of rows read, 0 once all
+ *                   the rows of the image have been read.
+ *
+ * @pre reader != NULL, rows != NULL, read_count != NULL
+ *
+ * @return
+ *     0: Success
+ *    -2: Memory allocation failure
+ *    -3: Decode error
+ *    -4: Invalid argument
+ */
+int pnm_read_rows(
+   PNMReader *reader,
+   uint16_t *rows,
+   unsigned int count,
+   unsigned int *read_count
+);
+
+/**
+ * @brief Closes a reader and frees its memory.
+ *
+ * @param reader Pointer to the pointer of the reader to close.
+ *
+ * @pre reader != NULL, *reader != NULL
+ */
+void pnm_reader_close(PNMReader **reader);
+
+/**
+ * @brief Opens a file holding a sequence of concatenated PNM images.
+ *
+ * The images may have different formats, encodings and sizes. Only the
+ * magic number of each image is checked, not the file extension.
+ *
+ * @param frames Pointer to store the opened frame reader.
+ * @param filename Path to the file to read.
+ *
+ * @pre frames != NULL, filename != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: Invalid filename
+ *    -2: Memory allocation failure
+ *    -4: Invalid argument
+ */
+int pnm_frames_open(PNMFrameReader **frames, const char *filename);
+
+/**
+ * @brief Opens a file descriptor holding a sequence of PNM images.
+ *
+ * Same as pnm_frames_open, for a stream such as a pipe. fd is left open.
+ *
+ * @param frames Pointer to store the opened frame reader.
+ * @param fd File descriptor to read from.
+ *
+ * @pre frames != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: Invalid file descriptor
+ *    -2: Memory allocation failure
+ *    -4: Invalid argument
+ */
+int pnm_frames_open_fd(PNMFrameReader **frames, int fd);
+
+/**
+ * @brief Decodes the next image of a sequence.
+ *
+ * The image belongs to the reader and stays valid until the next call or
+ * until the reader is closed. It may be modified, for instance by filters.
+ * Its pixel buffer is reused for the next image whenever it is large
+ * enough, so a sequence of images of the same size is decoded without any
+ * allocation. ASCII images are decoded by the calling thread.
+ *
+ * @param frames Pointer to the frame reader.
+ * @param image Pointer to store the decoded image, NULL once the sequence
+ *              has ended.
+ *
+ * @pre frames != NULL, image != NULL
+ *
+ * @return
+ *     0: Success
+ *     1: End of the sequence
+ *    -2: Memory allocation failure
+ *    -3: Decode error
+ *    -4: Invalid argument
+ */
+int pnm_frames_next(PNMFrameReader *frames, PNM **image);
+
+/**
+ * @brief Closes a frame reader and frees its memory, its image included.
+ *
+ * @param frames Pointer to the pointer of the frame reader to close.
+ *
+ * @pre frames != NULL, *frames != NULL
+ */
+void pnm_frames_close(PNMFrameReader **frames);
+
+/**
+ * @brief Opens a PNM file for writing row by row and writes its header.
+ *
+ * @param writer Pointer to store the opened writer.
+ * @param filename Path to the file to write to.
+ * @param format Format of the image, other than FORMAT_PAM.
+ * @param encoding Encoding of the image.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param max_value Maximum pixel value.
+ *
+ * @pre writer != NULL, filename != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: Invalid filename
+ *    -2: Writing file error
+ *    -4: Invalid argument or image too large
+ */
+int pnm_writer_open(
+   PNMWriter **writer,
+   const char *filename,
+   FormatPNM format,
+   EncodingPNM encoding,
+   unsigned int width,
+   unsigned int height,
+   uint16_t max_value
+);
+
+/**
+ * @brief Writes the next rows of a PNM file.
+ *
+ * @param writer Pointer to the writer.
+ * @param rows Rows to write, stored like the data of a PNM image.
+ * @param count Number of rows to write.
+ *
+ * @pre writer != NULL, rows != NULL
+ *
+ * @return
+ *     0: Success
+ *    -2: Writing file error or more rows than the height of the image
+ *    -4: Invalid argument
+ */
+int pnm_write_rows(PNMWriter *writer, const uint16_t *rows, unsigned int count);
+
+/**
+ * @brief Flushes and closes a writer and frees its memory.
+ *
+ * @param writer Pointer to the pointer of the writer to close.
+ *
+ * @pre writer != NULL, *writer != NULL
+ *
+ * @return
+ *     0: Success
+ *    -2: Writing file error or fewer rows written than the height
+ *    -4: Invalid argument
+ */
+int pnm_writer_close(PNMWriter **writer);
 
 #endif // _PNM_H
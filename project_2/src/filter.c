@@ -2,159 +2,1788 @@
  * @file filter.c
  * @brief Implementation of filter functions for PNM images.
  *
+ * Every filter but the geometric ones, which move pixels around, computes
+ * each pixel from itself alone. Such filters run as passes over the rows of
+ * the image; consecutive ones in a chain share a pass, so each row is read
+ * from memory once and only a row of intermediate samples is kept.
+ *
+ * Transposes and rotations by 90 degrees read the rows of the image and
+ * write its columns. They move the pixels by square tiles, so that the
+ * cache lines of a tile of the source and of its tile of the target stay in
+ * cache until they are all used.
+ *
  * @author Pavlov Aleksandr (s2400691)
  * @date 24.03.2025
 */
 
-#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 
 #include "pnm.h"
 #include "filter.h"
+#include "kernel.h"
+
+/* ======= Constants ======= */
+
+#define CHAIN_SEPARATOR ','
+#define PARAMETER_SEPARATOR ':'
+
+/**
+ * @brief Side of the tiles that transposes move at once, in pixels.
+ *
+ * A multiple of 8, so that PBM tiles start on a byte, and of the blocks of
+ * the transpose kernels.
+ */
+#define TRANSPOSE_TILE 64
+
+/* ======= Structures ======= */
+
+/**
+ * @brief Enum for the filters that can be chained, the geometric ones
+ *        first.
+ */
+typedef enum FilterKind_t {
+   FILTER_TURNAROUND,
+   FILTER_TRANSPOSE,
+   FILTER_ROTATE90,
+   FILTER_ROTATE270,
+   FILTER_FLIP_H,
+   FILTER_FLIP_V,
+   FILTER_MONOCHROME,
+   FILTER_NEGATIVE,
+   FILTER_GREY,
+   FILTER_BLACK_AND_WHITE
+} FilterKind;
+
+/**
+ * @brief Enum for the kinds of pixels the filters tell apart.
+ */
+typedef enum PixelKind_t {
+   PIXELS_RGB,
+   PIXELS_GREY,
+   PIXELS_OTHER
+} PixelKind;
+
+/**
+ * @brief Filter with its parsed parameter.
+ */
+typedef struct FilterStep_t {
+   FilterKind kind;
+   int value; // Color plane, grayscale method or threshold
+} FilterStep;
+
+struct FilterChain_t {
+   FilterStep *steps;
+   unsigned int count;
+};
+
+/**
+ * @brief Per-pixel filters applied in one pass over the rows of an image.
+ *
+ * Each row goes through the color filters in place, then has its gray
+ * levels computed when mode is not 0, then thresholded when threshold is
+ * not -1.
+ */
+typedef struct Pass_t {
+   const FilterStep *colors;
+   unsigned int color_count;
+   int mode;
+   int threshold;
+} Pass;
+
+/**
+ * @brief Samples of a row, with a pointer to the first sample of each
+ *        channel.
+ *
+ * Interleaved rows step over all the channels from a pixel to the next,
+ * rows of planar pixel data step over a single sample.
+ */
+typedef struct RowSamples_t {
+   void *channels[4];
+   size_t step;
+   int bytes;
+} RowSamples;
+
+/**
+ * @brief Image mirrored in place by bands of pairs of rows.
+ *
+ * Row y is paired with row height - 1 - y when the rows are mirrored, with
+ * itself otherwise, and the pixels of the pairs are swapped in reverse
+ * order when the columns are mirrored.
+ */
+typedef struct MirrorJob_t {
+   PNM *image;
+   uint8_t *bits; // PBM bits, NULL for samples
+   unsigned int width;
+   unsigned int height;
+   unsigned int channels;
+   int bytes;
+   int rows;
+   int columns;
+} MirrorJob;
+
+/**
+ * @brief Image transposed into new pixel data by bands of columns of tiles.
+ *
+ * Pixel (x, y) of the source lands on pixel (y, x) of the target. Either
+ * may be walked from its last row with a negative stride, which turns the
+ * transpose into a rotation.
+ */
+typedef struct TransposeJob_t {
+   const uint8_t *source; // First row read
+   ptrdiff_t source_stride;
+   uint8_t *target; // First row written
+   ptrdiff_t target_stride;
+   unsigned int width; // Width of the source
+   unsigned int height; // Height of the source
+   size_t pixel_size; // Bytes per pixel, 0 for PBM bits
+   int aligned; // 1 if the pixels can be moved as 16 or 32-bit values
+} TransposeJob;
+
+/**
+ * @brief Pass run by bands of rows of an image.
+ *
+ * Rows of a new image are stride bytes apart in out. In place, out is the
+ * pixel data of the image itself, whose rows are in_stride bytes apart: each
+ * band writes its rows one after the other from the start of its own first
+ * row, over rows it has already read, and the bands are joined once they
+ * are all done.
+ */
+typedef struct PassJob_t {
+   PNM *image;
+   const Pass *pass;
+   uint8_t *const *planes; // Planes of planar pixel data, NULL otherwise
+   uint8_t *out; // Rows of the new image, NULL for color filters alone
+   size_t stride;
+   size_t row_size; // Size of a row of the new image
+   size_t in_stride; // Stride of the rows written over, 0 for a new buffer
+   uint8_t *scratch; // scratch_size bytes for each band
+   size_t scratch_size;
+   size_t firsts[PNM_MAX_THREADS]; // First row of each band
+   int alpha;
+   int pam;
+} PassJob;
+
+/* ======= Variables ======= */
+
+/**
+ * @brief Names of the filters in chains, in the order of FilterKind.
+ */
+static const char *const FILTER_NAMES[] = {
+   "retournement",
+   "transposition",
+   "rotation90",
+   "rotation270",
+   "miroir_h",
+   "miroir_v",
+   "monochrome",
+   "negatif",
+   "gris",
+   "NB"
+};
+
+/**
+ * @brief Layouts preferred by the filters, in the order of FilterKind.
+ */
+static const LayoutPNM FILTER_LAYOUTS[] = {
+   TURNAROUND_LAYOUT,
+   TRANSPOSE_LAYOUT,
+   ROTATE90_LAYOUT,
+   ROTATE270_LAYOUT,
+   FLIP_H_LAYOUT,
+   FLIP_V_LAYOUT,
+   MONOCHROME_LAYOUT,
+   NEGATIVE_LAYOUT,
+   FIFTY_SHADES_OF_GREY_LAYOUT,
+   BLACK_AND_WHITE_LAYOUT
+};
+
+/**
+ * @brief Parameters of the monochrome filter, in the order of the color
+ *        planes.
+ */
+static const char *const CHANNEL_NAMES[] = {"r", "v", "b"};
+
+/* ======= Internal Function Prototypes ======= */
+
+/**
+ * @brief Checks the color samples that pixels of an image start with.
+ *
+ * PPM images match "RGB" and PGM images "GRAYSCALE". PAM images match when
+ * their tuple type is color_type, or color_type followed by "_ALPHA" for
+ * images whose pixels end with an alpha sample, which filters leave as it
+ * is.
+ *
+ * @param image Pointer to the PNM image structure.
+ * @param color_type Tuple type of the color samples.
+ * @param colors Number of color samples per pixel.
+ *
+ * @pre image != NULL, color_type != NULL
+ *
+ * @return
+ *     1 if the pixels match, 0 otherwise
+ */
+static int has_tuple_type(
+   PNM *image,
+   const char *color_type,
+   unsigned int colors
+);
+
+/**
+ * @brief Parses the parameter of a filter.
+ *
+ * @param step Pointer to the step to fill.
+ * @param kind Filter.
+ * @param parameter Parameter of the filter, ignored by filters without one.
+ *
+ * @pre step != NULL
+ *
+ * @return
+ *     0: Success
+ *    -2: Missing or invalid parameter
+ */
+static int parse_step(
+   FilterStep *step,
+   FilterKind kind,
+   const char *parameter
+);
+
+/**
+ * @brief Parses a filter of a chain, such as "gris:2".
+ *
+ * @param step Pointer to the step to fill.
+ * @param token Filter, up to the next CHAIN_SEPARATOR or the end.
+ * @param parameter Parameter of a filter given without one, may be NULL.
+ *
+ * @pre step != NULL, token != NULL
+ *
+ * @return
+ *     0: Success
+ *    -2: Missing or invalid parameter
+ *    -5: Unknown filter name
+ */
+static int parse_token(
+   FilterStep *step,
+   const char *token,
+   const char *parameter
+);
+
+/**
+ * @brief Retrieves the kind of the pixels of an image.
+ *
+ * @param image Pointer to the PNM image structure.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     Kind of the pixels
+ */
+static PixelKind pixel_kind(PNM *image);
+
+/**
+ * @brief Checks that filters can be applied one after the other to an
+ *        image, without applying them.
+ *
+ * @param image Pointer to the PNM image structure.
+ * @param steps Pointer to the filters.
+ * @param count Number of filters.
+ *
+ * @pre image != NULL, steps != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: A filter does not accept the pixels it would be given
+ */
+static int check_steps(
+   PNM *image,
+   const FilterStep *steps,
+   unsigned int count
+);
+
+/**
+ * @brief Applies filters one after the other to an image, consecutive
+ *        per-pixel filters in a single pass.
+ *
+ * @param image Pointer to the PNM image structure.
+ * @param steps Pointer to the filters.
+ * @param count Number of filters.
+ *
+ * @pre image != NULL, steps != NULL, check_steps succeeds
+ *
+ * @return
+ *     0: Success
+ *    -4: Memory allocation failure or undecodable pixel data
+ */
+static int apply_steps(
+   PNM *image,
+   const FilterStep *steps,
+   unsigned int count
+);
+
+/**
+ * @brief Tells whether a filter moves pixels around.
+ *
+ * @param kind Filter.
+ *
+ * @return
+ *     1 for the geometric filters, 0 for the per-pixel ones
+ */
+static int is_geometric(FilterKind kind);
+
+/**
+ * @brief Applies a geometric filter to an image.
+ *
+ * @param image Pointer to the PNM image structure.
+ * @param kind Geometric filter.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     See the filter
+ */
+static int apply_geometry(PNM *image, FilterKind kind);
+
+/**
+ * @brief Applies a single filter to an image.
+ *
+ * @param image Pointer to the PNM image structure.
+ * @param kind Filter.
+ * @param parameter Parameter of the filter, may be NULL.
+ *
+ * @return
+ *     See the filter
+ */
+static int apply_filter(PNM *image, FilterKind kind, const char *parameter);
+
+/**
+ * @brief Counts the per-pixel filters that start a sequence of filters.
+ *
+ * @param steps Pointer to the filters.
+ * @param count Number of filters.
+ *
+ * @pre steps != NULL
+ *
+ * @return
+ *     Number of filters before the first geometric one
+ */
+static unsigned int pass_length(const FilterStep *steps, unsigned int count);
+
+/**
+ * @brief Describes a pass of per-pixel filters.
+ *
+ * Color filters are the leading monochrome and negative filters. A black
+ * and white filter without a grayscale filter before it uses method 2 on
+ * color images.
+ *
+ * @param pass Pointer to the pass to fill.
+ * @param steps Pointer to the filters, as counted by pass_length.
+ * @param count Number of filters.
+ * @param kind Kind of the pixels the pass starts from.
+ *
+ * @pre pass != NULL, steps != NULL, check_steps succeeds
+ */
+static void plan_pass(
+   Pass *pass,
+   const FilterStep *steps,
+   unsigned int count,
+   PixelKind kind
+);
+
+/**
+ * @brief Applies a pass of per-pixel filters to an image, by bands of rows
+ *        run concurrently on large images.
+ *
+ * The smaller rows of gray levels or thresholds are written over the pixel
+ * data of the image, whose block they keep, unless views share it or its
+ * rows are too narrow; a new buffer is allocated otherwise.
+ *
+ * @param image Pointer to the PNM image structure.
+ * @param pass Pointer to the pass.
+ *
+ * @pre image != NULL, pass != NULL, image has RGB pixels, or gray pixels
+ *      when the pass only thresholds
+ * @post Gray levels give a PGM image, or a GRAYSCALE PAM image; thresholds
+ *       a PBM image, or a BLACKANDWHITE PAM image
+ *
+ * @return
+ *     0: Success
+ *    -4: Memory allocation failure or undecodable pixel data
+ */
+static int run_pass(PNM *image, const Pass *pass);
+
+/**
+ * @brief Applies a pass to a band of rows, as run by pnm_parallel_for.
+ *
+ * @param context Pointer to the PassJob.
+ * @param band Index of the band.
+ * @param first Index of the first row.
+ * @param end Index after the last row.
+ *
+ * @return
+ *     0
+ */
+static int run_pass_band(
+   void *context,
+   unsigned int band,
+   size_t first,
+   size_t end
+);
+
+/**
+ * @brief Moves the rows written in place by the bands of a pass after one
+ *        another.
+ *
+ * @param job Pointer to the PassJob, run in place.
+ * @param bands Number of bands.
+ * @param height Height of the image.
+ *
+ * @pre job != NULL
+ */
+static void join_bands(const PassJob *job, unsigned int bands, size_t height);
+
+/**
+ * @brief Locates the samples of a row of an image.
+ *
+ * @param row Pointer to the samples to fill.
+ * @param image Pointer to the PNM image structure.
+ * @param planes Pointers to the planes of planar pixel data, NULL for
+ *               interleaved pixel data.
+ * @param y Index of the row.
+ *
+ * @pre row != NULL, image != NULL, the pixel data is loaded
+ */
+static void locate_row(
+   RowSamples *row,
+   PNM *image,
+   uint8_t *const *planes,
+   unsigned int y
+);
+
+/**
+ * @brief Applies a color filter to a row of RGB pixels.
+ *
+ * @param step Pointer to the monochrome or negative filter.
+ * @param row Pointer to the samples of the row.
+ * @param width Number of pixels.
+ * @param max_value Maximum pixel value of the image.
+ *
+ * @pre step != NULL, row != NULL
+ */
+static void color_row(
+   const FilterStep *step,
+   const RowSamples *row,
+   unsigned int width,
+   uint16_t max_value
+);
+
+/**
+ * @brief Computes the gray levels of a row of RGB pixels.
+ *
+ * @param row Pointer to the samples of the row.
+ * @param grey Pointer to the gray levels, with an alpha sample after each
+ *             of them when alpha is set.
+ * @param width Number of pixels.
+ * @param max_value Maximum pixel value of the image.
+ * @param mode Grayscale method, 1 or 2.
+ * @param alpha 1 if the pixels have an alpha sample, 0 otherwise.
+ * @param scratch Pointer to 4 * width bytes for the kernel.
+ *
+ * @pre row != NULL, grey != NULL, scratch != NULL
+ */
+static void grey_row(
+   const RowSamples *row,
+   uint8_t *grey,
+   unsigned int width,
+   uint16_t max_value,
+   int mode,
+   int alpha,
+   uint8_t *scratch
+);
+
+/**
+ * @brief Thresholds a row of gray pixels.
+ *
+ * Gray levels are scaled to 255 from the maximum value, see scale_sample,
+ * before they are compared with the threshold.
+ *
+ * Gray levels at least the threshold become black: PBM bits are set, most
+ * significant bit first, and PAM samples become 0. Lower gray levels become
+ * white. PAM alpha samples become 1 above half the maximum value, 0
+ * otherwise.
+ *
+ * @param row Pointer to the samples of the row.
+ * @param out Pointer to the PBM bits, or the PAM samples when pam is set.
+ * @param width Number of pixels.
+ * @param max_value Maximum pixel value of the samples.
+ * @param threshold Lowest gray level turned white.
+ * @param alpha 1 if the pixels have an alpha sample, 0 otherwise.
+ * @param pam 1 to compute PAM samples, 0 for PBM bits.
+ *
+ * @pre row != NULL, out != NULL
+ */
+static void threshold_row(
+   const RowSamples *row,
+   uint8_t *out,
+   unsigned int width,
+   uint16_t max_value,
+   int threshold,
+   int alpha,
+   int pam
+);
+
+/**
+ * @brief Retrieves a sample of a row.
+ *
+ * @param samples Pointer to the samples.
+ * @param bytes 1 for 8-bit samples, 0 for 16-bit samples.
+ * @param i Index of the sample.
+ *
+ * @return
+ *     Sample
+ */
+static uint16_t sample_at(const void *samples, int bytes, size_t i);
+
+/**
+ * @brief Retrieves a gray level of a row, scaled to 255.
+ *
+ * @param samples Pointer to the samples.
+ * @param bytes 1 for 8-bit samples, 0 for 16-bit samples.
+ * @param i Index of the sample.
+ * @param max_value Maximum pixel value of the samples.
+ *
+ * @return
+ *     Gray level, between 0 and 255 for samples at most max_value
+ */
+static uint16_t level_at(
+   const void *samples,
+   int bytes,
+   size_t i,
+   uint16_t max_value
+);
+
+/**
+ * @brief Replaces a sample of a row.
+ *
+ * @param samples Pointer to the samples.
+ * @param bytes 1 for 8-bit samples, 0 for 16-bit samples.
+ * @param i Index of the sample.
+ * @param value New sample.
+ */
+static void set_sample_at(void *samples, int bytes, size_t i, uint16_t value);
+
+/**
+ * @brief Mirrors the rows, the columns or both of an image in place.
+ *
+ * @param image Pointer to the PNM image structure.
+ * @param rows 1 to swap the top and bottom rows, 0 otherwise.
+ * @param columns 1 to swap the left and right columns, 0 otherwise.
+ *
+ * @return
+ *     0: Success
+ *    -3: Image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
+ */
+static int mirror(PNM *image, int rows, int columns);
+
+/**
+ * @brief Mirrors a band of pairs of rows, as run by pnm_parallel_for.
+ *
+ * @param context Pointer to the MirrorJob.
+ * @param band Unused.
+ * @param first Index of the top row of the first pair.
+ * @param end Index after the top row of the last pair.
+ *
+ * @return
+ *     0
+ */
+static int mirror_band(
+   void *context,
+   unsigned int band,
+   size_t first,
+   size_t end
+);
+
+/**
+ * @brief Swaps two bit-packed PBM rows, bits in reverse order.
+ *
+ * @param top Pointer to the first row.
+ * @param bottom Pointer to the second row, which may be the first one.
+ * @param width Width of the image.
+ *
+ * @pre top != NULL, bottom != NULL
+ */
+static void mirror_bits(uint8_t *top, uint8_t *bottom, unsigned int width);
+
+/**
+ * @brief Swaps the bytes of two rows.
+ *
+ * @param top Pointer to the first row.
+ * @param bottom Pointer to the second row, distinct from the first one.
+ * @param size Number of bytes of a row.
+ *
+ * @pre top != NULL, bottom != NULL
+ */
+static void swap_rows(uint8_t *top, uint8_t *bottom, size_t size);
+
+/**
+ * @brief Transposes an image into new pixel data.
+ *
+ * @param image Pointer to the PNM image structure.
+ * @param last_row 1 to read the rows of the image from the last one, which
+ *                 rotates it clockwise, 0 otherwise.
+ * @param last_column 1 to write the rows of the new image from the last
+ *                    one, which rotates it counterclockwise, 0 otherwise.
+ *
+ * @return
+ *     0: Success
+ *    -3: Image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
+ */
+static int transpose_image(PNM *image, int last_row, int last_column);
+
+/**
+ * @brief Transposes a band of columns of tiles of an image, as run by
+ *        pnm_parallel_for.
+ *
+ * @param context Pointer to the TransposeJob.
+ * @param band Unused.
+ * @param first Index of the first column of tiles.
+ * @param end Index after the last column of tiles.
+ *
+ * @return
+ *     0
+ */
+static int transpose_band(
+   void *context,
+   unsigned int band,
+   size_t first,
+   size_t end
+);
+
+/**
+ * @brief Transposes a tile of an image.
+ *
+ * @param job Pointer to the transpose.
+ * @param x Column of the top left pixel of the tile in the source.
+ * @param y Row of the top left pixel of the tile in the source.
+ * @param columns Width of the tile.
+ * @param rows Height of the tile.
+ *
+ * @pre job != NULL, x and y multiples of 8 for PBM bits
+ */
+static void transpose_tile(
+   const TransposeJob *job,
+   unsigned int x,
+   unsigned int y,
+   unsigned int columns,
+   unsigned int rows
+);
+
+/**
+ * @brief Transposes a block of bit-packed PBM rows, 8 x 8 bits at a time.
+ *
+ * @param source Pointer to the first row of the source.
+ * @param source_stride Number of bytes from a row of the source to the next.
+ * @param target Pointer to the first row of the target.
+ * @param target_stride Number of bytes from a row of the target to the next.
+ * @param rows Number of rows of the source.
+ * @param columns Number of columns of the source.
+ *
+ * @pre source != NULL, target != NULL
+ */
+static void transpose_bits(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   unsigned int rows,
+   unsigned int columns
+);
 
 /* ======= External Functions ======= */
 
 int turnaround(PNM *image) {
-   if (image == NULL) return -3;
+   return mirror(image, 1, 1);
+}
 
-   FormatPNM format = get_format(image);
-   unsigned int width = get_width(image);
-   unsigned int height = get_height(image);
-   uint16_t *data = get_data(image);
+int transpose(PNM *image) {
+   return transpose_image(image, 0, 0);
+}
+
+int rotate90(PNM *image) {
+   return transpose_image(image, 1, 0);
+}
+
+int rotate270(PNM *image) {
+   return transpose_image(image, 0, 1);
+}
+
+int flip_h(PNM *image) {
+   return mirror(image, 0, 1);
+}
+
+int flip_v(PNM *image) {
+   return mirror(image, 1, 0);
+}
+
+int monochrome(PNM *image, const char *parameter) {
+   return apply_filter(image, FILTER_MONOCHROME, parameter);
+}
+
+int negative(PNM *image) {
+   return apply_filter(image, FILTER_NEGATIVE, NULL);
+}
+
+int fifty_shades_of_grey(PNM *image, const char *parameter) {
+   return apply_filter(image, FILTER_GREY, parameter);
+}
+
+int black_and_white(PNM *image, const char *parameter) {
+   return apply_filter(image, FILTER_BLACK_AND_WHITE, parameter);
+}
 
-   size_t data_size = width * height;
+int filter_chain_parse(
+   FilterChain **chain,
+   const char *filters,
+   const char *parameter
+) {
+   if (chain == NULL || filters == NULL) return -3;
 
-   for (size_t i = 0; i < data_size / 2; ++i) {
-      size_t j = data_size - 1 - i;
-      if (format == FORMAT_PPM) {
-         for (int a = 0; a < 3; ++a) {
-            uint16_t temp = data[3 * i + a];
-            data[3 * i + a] = data[3 * j + a];
-            data[3 * j + a] = temp;
+   unsigned int count = 1;
+   for (const char *c = filters; *c != '\0'; ++c) {
+      if (*c == CHAIN_SEPARATOR) ++count;
+   }
+
+   FilterChain *new_chain = malloc(sizeof(FilterChain));
+   if (new_chain == NULL) return -4;
+   new_chain->steps = malloc(count * sizeof(FilterStep));
+   if (new_chain->steps == NULL) {
+      free(new_chain);
+      return -4;
+   }
+   new_chain->count = count;
+
+   const char *token = filters;
+   for (unsigned int i = 0; i < count; ++i) {
+      int code = parse_token(&new_chain->steps[i], token, parameter);
+      if (code != 0) {
+         filter_chain_free(&new_chain);
+         return code;
+      }
+      token = strchr(token, CHAIN_SEPARATOR);
+      if (token != NULL) ++token;
+   }
+
+   *chain = new_chain;
+   return FILTER_SUCCESS;
+}
+
+int filter_chain_apply(FilterChain *chain, PNM *image) {
+   if (chain == NULL || image == NULL) return -3;
+   if (check_steps(image, chain->steps, chain->count) != 0) {
+      return FILTER_WRONG_IMAGE_FORMAT;
+   }
+   return apply_steps(image, chain->steps, chain->count);
+}
+
+int filter_chain_is_per_pixel(FilterChain *chain) {
+   return pass_length(chain->steps, chain->count) == chain->count;
+}
+
+void filter_chain_explain(FilterChain *chain, FILE *stream) {
+   unsigned int pass = 0;
+   unsigned int i = 0;
+   while (i < chain->count) {
+      unsigned int length = pass_length(chain->steps + i, chain->count - i);
+      fprintf(stream, "pass %u:", ++pass);
+      if (length == 0) {
+         // Mirrors swap pixels, transposes copy them by tiles.
+         FilterKind kind = chain->steps[i].kind;
+         int copy = kind == FILTER_TRANSPOSE || kind == FILTER_ROTATE90
+            || kind == FILTER_ROTATE270;
+         fprintf(
+            stream,
+            " %s, %s\n",
+            FILTER_NAMES[kind],
+            copy ? "by tiles into a new image" : "in place"
+         );
+         ++i;
+         continue;
+      }
+
+      for (unsigned int j = i; j < i + length; ++j) {
+         const FilterStep *step = &chain->steps[j];
+         fprintf(stream, "%s %s", j == i ? "" : " +", FILTER_NAMES[step->kind]);
+         if (step->kind == FILTER_MONOCHROME) {
+            fprintf(stream, " %s", CHANNEL_NAMES[step->value]);
+         } else if (step->kind != FILTER_NEGATIVE) {
+            fprintf(stream, " %d", step->value);
          }
+      }
+
+      // New rows are written over the rows they come from, see run_pass.
+      fprintf(stream, ", one loop over the rows in place\n");
+      i += length;
+   }
+}
+
+void filter_chain_free(FilterChain **chain) {
+   if (chain == NULL || *chain == NULL) return;
+   free((*chain)->steps);
+   free(*chain);
+   *chain = NULL;
+}
+
+/* ======= Internal functions ======= */
+
+static int has_tuple_type(
+   PNM *image,
+   const char *color_type,
+   unsigned int colors
+) {
+   const char *tuple_type = get_tuple_type(image);
+   size_t length = strlen(color_type);
+   if (strncmp(tuple_type, color_type, length) != 0) return 0;
+   if (tuple_type[length] == '\0') return get_channels(image) == colors;
+   return !strcmp(tuple_type + length, "_ALPHA")
+      && get_channels(image) == colors + 1;
+}
+
+
+static int parse_step(
+   FilterStep *step,
+   FilterKind kind,
+   const char *parameter
+) {
+   step->kind = kind;
+   step->value = 0;
+   if (is_geometric(kind) || kind == FILTER_NEGATIVE) return 0;
+   if (parameter == NULL) return FILTER_INVALID_PARAMETER;
+
+   if (kind == FILTER_MONOCHROME) {
+      for (int p = 0; p < 3; ++p) {
+         if (!strcasecmp(parameter, CHANNEL_NAMES[p])) {
+            step->value = p;
+            return 0;
+         }
+      }
+      return FILTER_INVALID_PARAMETER;
+   }
+
+   if (sscanf(parameter, "%d", &step->value) != 1) {
+      return FILTER_INVALID_PARAMETER;
+   }
+   if (kind == FILTER_GREY) {
+      if (step->value != 1 && step->value != 2) {
+         return FILTER_INVALID_PARAMETER;
+      }
+   } else if (step->value < 0 || 255 < step->value) {
+      return FILTER_INVALID_PARAMETER;
+   }
+   return 0;
+}
+
+static int parse_token(
+   FilterStep *step,
+   const char *token,
+   const char *parameter
+) {
+   const char separators[] = {CHAIN_SEPARATOR, PARAMETER_SEPARATOR, '\0'};
+   size_t length = strcspn(token, separators);
+   unsigned int count = sizeof(FILTER_NAMES) / sizeof(FILTER_NAMES[0]);
+   unsigned int kind = 0;
+   while (kind < count && (strlen(FILTER_NAMES[kind]) != length
+      || strncasecmp(token, FILTER_NAMES[kind], length))) {
+      ++kind;
+   }
+   if (kind == count) return FILTER_UNKNOWN;
+
+   // A parameter given with the filter replaces the common one.
+   char own[16];
+   if (token[length] == PARAMETER_SEPARATOR) {
+      const char *start = token + length + 1;
+      size_t size = strcspn(start, separators);
+      if (start[size] == PARAMETER_SEPARATOR) return FILTER_INVALID_PARAMETER;
+      if (sizeof(own) <= size) return FILTER_INVALID_PARAMETER;
+      memcpy(own, start, size);
+      own[size] = '\0';
+      parameter = own;
+   }
+   return parse_step(step, kind, parameter);
+}
+
+static PixelKind pixel_kind(PNM *image) {
+   if (has_tuple_type(image, "RGB", 3)) return PIXELS_RGB;
+   if (has_tuple_type(image, "GRAYSCALE", 1)) return PIXELS_GREY;
+   return PIXELS_OTHER;
+}
+
+static int check_steps(
+   PNM *image,
+   const FilterStep *steps,
+   unsigned int count
+) {
+   PixelKind kind = pixel_kind(image);
+   for (unsigned int i = 0; i < count; ++i) {
+      switch (steps[i].kind) {
+         case FILTER_TURNAROUND:
+         case FILTER_TRANSPOSE:
+         case FILTER_ROTATE90:
+         case FILTER_ROTATE270:
+         case FILTER_FLIP_H:
+         case FILTER_FLIP_V:
+            break;
+         case FILTER_MONOCHROME:
+         case FILTER_NEGATIVE:
+            if (kind != PIXELS_RGB) return FILTER_WRONG_IMAGE_FORMAT;
+            break;
+         case FILTER_GREY:
+            if (kind != PIXELS_RGB) return FILTER_WRONG_IMAGE_FORMAT;
+            kind = PIXELS_GREY;
+            break;
+         case FILTER_BLACK_AND_WHITE:
+            if (kind == PIXELS_OTHER) return FILTER_WRONG_IMAGE_FORMAT;
+            kind = PIXELS_OTHER;
+            break;
+      }
+   }
+   return 0;
+}
+
+static int apply_steps(
+   PNM *image,
+   const FilterStep *steps,
+   unsigned int count
+) {
+   unsigned int i = 0;
+   while (i < count) {
+      int code;
+      unsigned int length = pass_length(steps + i, count - i);
+      if (length == 0) {
+         // Geometric filters move whole pixels: pixel data in another
+         // layout is converted once, and stays converted for the rest of
+         // the chain. Passes of per-pixel filters work in place on either
+         // layout, and run on the one they find rather than copy it.
+         LayoutPNM layout = FILTER_LAYOUTS[steps[i].kind];
+         if (get_layout(image) != layout
+            && set_layout(image, layout) != PNM_SUCCESS) {
+            return -4;
+         }
+         code = apply_geometry(image, steps[i].kind);
+         length = 1;
       } else {
-         uint16_t temp = data[i];
-         data[i] = data[j];
-         data[j] = temp;
+         Pass pass;
+         plan_pass(&pass, steps + i, length, pixel_kind(image));
+         code = run_pass(image, &pass);
       }
+      if (code != 0) return code;
+      i += length;
    }
    return FILTER_SUCCESS;
 }
 
-int monochrome(PNM *image, const char *parameter) {
+static int is_geometric(FilterKind kind) {
+   return kind < FILTER_MONOCHROME;
+}
+
+static int apply_geometry(PNM *image, FilterKind kind) {
+   switch (kind) {
+      case FILTER_TRANSPOSE:
+         return transpose(image);
+      case FILTER_ROTATE90:
+         return rotate90(image);
+      case FILTER_ROTATE270:
+         return rotate270(image);
+      case FILTER_FLIP_H:
+         return flip_h(image);
+      case FILTER_FLIP_V:
+         return flip_v(image);
+      default:
+         return turnaround(image);
+   }
+}
+
+static int apply_filter(PNM *image, FilterKind kind, const char *parameter) {
    if (image == NULL) return -3;
-   if (parameter == NULL) return FILTER_INVALID_PARAMETER;
-   if (get_format(image) != FORMAT_PPM) return FILTER_WRONG_IMAGE_FORMAT;
-
-   unsigned int p;
-   if (!strcasecmp(parameter, "r")) {
-      p = 0;
-   } else if (!strcasecmp(parameter, "v")) {
-      p = 1;
-   } else if (!strcasecmp(parameter, "b")) {
-      p = 2;
-   } else {
+   FilterStep step;
+   if (parse_step(&step, kind, parameter) != 0) {
       return FILTER_INVALID_PARAMETER;
    }
+   if (check_steps(image, &step, 1) != 0) return FILTER_WRONG_IMAGE_FORMAT;
+   return apply_steps(image, &step, 1);
+}
+
+static unsigned int pass_length(const FilterStep *steps, unsigned int count) {
+   unsigned int length = 0;
+   while (length < count && !is_geometric(steps[length].kind)) {
+      ++length;
+   }
+   return length;
+}
+
+static void plan_pass(
+   Pass *pass,
+   const FilterStep *steps,
+   unsigned int count,
+   PixelKind kind
+) {
+   pass->colors = steps;
+   pass->color_count = 0;
+   pass->mode = 0;
+   pass->threshold = -1;
+   while (pass->color_count < count
+      && (steps[pass->color_count].kind == FILTER_MONOCHROME
+      || steps[pass->color_count].kind == FILTER_NEGATIVE)) {
+      ++pass->color_count;
+   }
+   for (unsigned int i = pass->color_count; i < count; ++i) {
+      if (steps[i].kind == FILTER_GREY) {
+         pass->mode = steps[i].value;
+      } else {
+         pass->threshold = steps[i].value;
+      }
+   }
+   if (pass->threshold != -1 && pass->mode == 0 && kind == PIXELS_RGB) {
+      pass->mode = 2;
+   }
+}
 
+static int run_pass(PNM *image, const Pass *pass) {
    unsigned int width = get_width(image);
    unsigned int height = get_height(image);
-   uint16_t *data = get_data(image);
+   unsigned int channels = get_channels(image);
+   int alpha = has_alpha(image);
+   int pam = get_format(image) == FORMAT_PAM;
+   unsigned int new_channels = alpha ? 2 : 1;
+
+   // Planar pixel data is read plane by plane rather than interleaved again.
+   uint8_t *planes[4];
+   uint8_t *const *plane_list = NULL;
+   if (get_layout(image) == LAYOUT_PLANAR) {
+      for (unsigned int a = 0; a < channels; ++a) {
+         planes[a] = get_plane(image, a);
+         if (planes[a] == NULL) return -4;
+      }
+      plane_list = planes;
+   } else if (get_storage(image) == STORAGE_8) {
+      if (get_data8(image) == NULL) return -4;
+   } else if (set_storage(image, STORAGE_16) != PNM_SUCCESS
+      || get_data16(image) == NULL) {
+      return -4;
+   }
+
+   size_t row_size = 0;
+   if (pass->threshold != -1 && !pam) {
+      row_size = ((size_t)width + 7) / 8;
+   } else if (pass->threshold != -1 || pass->mode != 0) {
+      row_size = (size_t)width * new_channels;
+   }
+   size_t stride = pnm_row_stride(row_size);
+
+   // The rows of the new image are no larger than the rows they come from,
+   // planes included, so they are written over them, padded as usual, when
+   // no view shares them. Only packed rows mapped from a file may lack the
+   // room or the alignment for padded rows. The new pixel data keeps the
+   // whole block of the old one, so that no pixel data is allocated.
+   PassJob job = {
+      .image = image,
+      .pass = pass,
+      .planes = plane_list,
+      .row_size = row_size,
+      .alpha = alpha,
+      .pam = pam
+   };
+   size_t in_stride = get_stride(image);
+   uint8_t *first_row = plane_list != NULL ? planes[0] : get_row(image, 0);
+   if (row_size != 0 && stride <= in_stride && !pnm_is_shared(image)
+      && (uintptr_t)first_row % PNM_ALIGNMENT == 0) {
+      job.in_stride = in_stride;
+      job.out = first_row;
+   } else if (row_size != 0) {
+      job.out = pnm_alloc(stride * height);
+      if (job.out == NULL) return -4;
+   }
+   job.stride = stride;
+
+   // Room for the kernel, then for gray levels that are thresholded, then
+   // for a row written in place, for each band.
+   size_t size = (size_t)width * channels * height;
+   if (get_storage(image) != STORAGE_8) size *= 2;
+   unsigned int bands = pnm_parallel_bands(height, size);
+   if (pass->mode != 0 || job.in_stride != 0) {
+      job.scratch_size = pnm_row_stride(
+         (job.in_stride != 0 ? 8 : 6) * (size_t)width
+      );
+      job.scratch = pnm_alloc(bands * job.scratch_size);
+      if (job.scratch == NULL) {
+         if (job.in_stride == 0) pnm_free(job.out);
+         return -4;
+      }
+   }
 
-   size_t data_size = width * height;
+   pnm_parallel_for(height, bands, run_pass_band, &job);
+   pnm_free(job.scratch);
+   if (job.in_stride != 0) join_bands(&job, bands, height);
+   uint8_t *out = job.out;
 
-   for (size_t i = 0; i < data_size; ++i) {
-      uint16_t temp = data[3 * i + p];
-      for (int a = 0; a < 3; ++a) data[3 * i + a] = 0;
-      data[3 * i + p] = temp;
+   if (pass->threshold != -1 && pam) {
+      set_pam(
+         image,
+         width,
+         height,
+         new_channels,
+         PBM_MAX_VALUE,
+         alpha ? "BLACKANDWHITE_ALPHA" : "BLACKANDWHITE",
+         STORAGE_8,
+         out
+      );
+   } else if (pass->threshold != -1) {
+      set_pnm_storage(
+         image,
+         FORMAT_PBM,
+         width,
+         height,
+         PBM_MAX_VALUE,
+         STORAGE_BIT,
+         out
+      );
+   } else if (pass->mode != 0 && pam) {
+      set_pam(
+         image,
+         width,
+         height,
+         new_channels,
+         PGM_MAX_VALUE,
+         alpha ? "GRAYSCALE_ALPHA" : "GRAYSCALE",
+         STORAGE_8,
+         out
+      );
+   } else if (pass->mode != 0) {
+      set_pnm_storage(
+         image,
+         FORMAT_PGM,
+         width,
+         height,
+         PGM_MAX_VALUE,
+         STORAGE_8,
+         out
+      );
    }
+   if (out != NULL) set_stride(image, stride);
    return FILTER_SUCCESS;
 }
 
-int negative(PNM *image) {
-   if (image == NULL) return -3;
-   if (get_format(image) != FORMAT_PPM) return FILTER_WRONG_IMAGE_FORMAT;
+static int run_pass_band(
+   void *context,
+   unsigned int band,
+   size_t first,
+   size_t end
+) {
+   PassJob *job = context;
+   const Pass *pass = job->pass;
+   unsigned int width = get_width(job->image);
+   uint16_t max_value = get_max_value(job->image);
+   unsigned int new_channels = job->alpha ? 2 : 1;
+   uint8_t *scratch = job->scratch;
+   if (scratch != NULL) scratch += band * job->scratch_size;
 
-   uint16_t max_value = get_max_value(image);
-   uint16_t *data = get_data(image);
+   job->firsts[band] = first;
+   size_t band_stride = job->in_stride != 0 ? job->in_stride : job->stride;
+   for (size_t y = first; y < end; ++y) {
+      RowSamples row;
+      locate_row(&row, job->image, job->planes, y);
+      for (unsigned int s = 0; s < pass->color_count; ++s) {
+         color_row(&pass->colors[s], &row, width, max_value);
+      }
+      if (job->out == NULL) continue;
 
-   size_t data_count = get_width(image) * get_height(image) * 3;
+      // In place, the row is read whole before it is written over.
+      uint8_t *out_row = job->out + first * band_stride
+                       + (y - first) * job->stride;
+      uint8_t *new_row = out_row;
+      if (job->in_stride != 0) new_row = scratch + 6 * (size_t)width;
 
-   for (size_t i = 0; i < data_count; ++i) {
-      data[i] = max_value - data[i];
+      uint16_t level_max = max_value;
+      if (pass->mode != 0) {
+         uint8_t *grey = new_row;
+         if (pass->threshold != -1) grey = scratch + 4 * (size_t)width;
+         grey_row(
+            &row,
+            grey,
+            width,
+            max_value,
+            pass->mode,
+            job->alpha,
+            scratch
+         );
+         row = (RowSamples){{grey, grey + 1, NULL, NULL}, new_channels, 1};
+         level_max = PGM_MAX_VALUE;
+      }
+      if (pass->threshold != -1) {
+         threshold_row(
+            &row,
+            new_row,
+            width,
+            level_max,
+            pass->threshold,
+            job->alpha,
+            job->pam
+         );
+      }
+      if (new_row != out_row) memcpy(out_row, new_row, job->row_size);
+      if (pass->threshold != -1 && !job->pam) {
+         memset(
+            out_row + job->row_size,
+            0,
+            job->stride - job->row_size
+         );
+      }
    }
    return FILTER_SUCCESS;
 }
 
-int fifty_shades_of_grey(PNM *image, const char *parameter) {
-   if (image == NULL) return -3;
-   if (parameter == NULL) return FILTER_INVALID_PARAMETER;
-   if (get_format(image) != FORMAT_PPM) return FILTER_WRONG_IMAGE_FORMAT;
+static void join_bands(const PassJob *job, unsigned int bands, size_t height) {
+   // Band 0 starts in place; each later band moves down over rows that the
+   // bands before it no longer need.
+   for (unsigned int band = 1; band < bands; ++band) {
+      size_t first = job->firsts[band];
+      size_t end = band + 1 < bands ? job->firsts[band + 1] : height;
+      memmove(
+         job->out + first * job->stride,
+         job->out + first * job->in_stride,
+         (end - first) * job->stride
+      );
+   }
+}
 
-   int mode;
-   if (sscanf(parameter, "%d", &mode) != 1) return FILTER_INVALID_PARAMETER;
-   if (mode != 1 && mode != 2) return FILTER_INVALID_PARAMETER;
+static void locate_row(
+   RowSamples *row,
+   PNM *image,
+   uint8_t *const *planes,
+   unsigned int y
+) {
+   unsigned int channels = get_channels(image);
+   row->bytes = get_storage(image) == STORAGE_8;
+   if (planes != NULL) {
+      size_t offset = y * get_stride(image);
+      for (unsigned int a = 0; a < channels; ++a) {
+         row->channels[a] = planes[a] + offset;
+      }
+      row->step = 1;
+   } else {
+      uint8_t *samples = get_row(image, y);
+      size_t size = row->bytes ? 1 : 2;
+      for (unsigned int a = 0; a < channels; ++a) {
+         row->channels[a] = samples + a * size;
+      }
+      row->step = channels;
+   }
+}
 
-   unsigned int width = get_width(image);
-   unsigned int height = get_height(image);
-   uint16_t max_value = get_max_value(image);
-   uint16_t *data = get_data(image);
+static void color_row(
+   const FilterStep *step,
+   const RowSamples *row,
+   unsigned int width,
+   uint16_t max_value
+) {
+   int bytes = row->bytes;
+   size_t size = bytes ? 1 : 2;
 
-   size_t data_size = width * height;
+   if (step->kind == FILTER_MONOCHROME) {
+      unsigned int p = step->value;
+      if (bytes && row->step == 3) {
+         kernel_keep_channel8(row->channels[0], width, p);
+         return;
+      }
+      for (unsigned int a = 0; a < 3; ++a) {
+         if (a == p) continue;
+         if (row->step == 1) {
+            memset(row->channels[a], 0, width * size);
+            continue;
+         }
+         for (unsigned int x = 0; x < width; ++x) {
+            set_sample_at(row->channels[a], bytes, x * row->step, 0);
+         }
+      }
+      return;
+   }
 
-   uint16_t *new_data = malloc(data_size * sizeof(uint16_t));
-   if (new_data == NULL) return -4;
+   if (bytes && row->step == 3) {
+      kernel_negate8(row->channels[0], 3 * (size_t)width, max_value);
+      return;
+   }
+   for (unsigned int a = 0; a < 3; ++a) {
+      if (bytes && row->step == 1) {
+         kernel_negate8(row->channels[a], width, max_value);
+         continue;
+      }
+      for (unsigned int x = 0; x < width; ++x) {
+         size_t i = x * row->step;
+         uint16_t value = sample_at(row->channels[a], bytes, i);
+         set_sample_at(row->channels[a], bytes, i, max_value - value);
+      }
+   }
+}
 
-   for (size_t i = 0; i < data_size; ++i) {
-      int r = data[3 * i];
-      int g = data[3 * i + 1];
-      int b = data[3 * i + 2];
-      switch (mode) {
-         case 1:
-            new_data[i] = (uint16_t)round((r + g + b) / 3);
-            break;
-         case 2:
-            new_data[i] = (uint16_t)round(0.299 * r + 0.587 * g + 0.114 * b);
-            break;
+static void grey_row(
+   const RowSamples *row,
+   uint8_t *grey,
+   unsigned int width,
+   uint16_t max_value,
+   int mode,
+   int alpha,
+   uint8_t *scratch
+) {
+   int bytes = row->bytes;
+   size_t step = row->step;
+
+   if (!bytes || UINT8_MAX < max_value) {
+      unsigned int new_channels = alpha ? 2 : 1;
+      for (unsigned int x = 0; x < width; ++x) {
+         size_t i = x * step;
+         grey[new_channels * x] = grey_sample(
+            sample_at(row->channels[0], bytes, i),
+            sample_at(row->channels[1], bytes, i),
+            sample_at(row->channels[2], bytes, i),
+            mode,
+            max_value
+         );
+         if (alpha) {
+            grey[2 * x + 1] = scale_sample(
+               sample_at(row->channels[3], bytes, i),
+               max_value
+            );
+         }
       }
-      new_data[i] *= PGM_MAX_VALUE / max_value;
+      return;
    }
 
-   set_pnm(image, FORMAT_PGM, width, height, PGM_MAX_VALUE, new_data);
-   free(data);
-   return FILTER_SUCCESS;
+   // Interleaved samples are split into planes for the kernel.
+   const uint8_t *colors[3] = {
+      row->channels[0],
+      row->channels[1],
+      row->channels[2]
+   };
+   if (step != 1) {
+      const uint8_t *pixel = colors[0];
+      for (unsigned int x = 0; x < width; ++x, pixel += step) {
+         scratch[x] = pixel[0];
+         scratch[width + x] = pixel[1];
+         scratch[2 * (size_t)width + x] = pixel[2];
+      }
+      for (unsigned int a = 0; a < 3; ++a) {
+         colors[a] = scratch + a * (size_t)width;
+      }
+   }
+
+   uint8_t *levels = scratch + 3 * (size_t)width;
+   kernel_grey8(
+      colors[0],
+      colors[1],
+      colors[2],
+      alpha ? levels : grey,
+      width,
+      mode,
+      max_value
+   );
+   if (!alpha) return;
+   const uint8_t *opacity = row->channels[3];
+   for (unsigned int x = 0; x < width; ++x) {
+      grey[2 * x] = levels[x];
+      grey[2 * x + 1] = scale_sample(opacity[x * step], max_value);
+   }
 }
 
-int black_and_white(PNM *image, const char *parameter) {
+static void threshold_row(
+   const RowSamples *row,
+   uint8_t *out,
+   unsigned int width,
+   uint16_t max_value,
+   int threshold,
+   int alpha,
+   int pam
+) {
+   const void *levels = row->channels[0];
+   int bytes = row->bytes;
+   size_t step = row->step;
+
+   if (!pam) {
+      if (bytes && step == 1 && max_value == PGM_MAX_VALUE) {
+         kernel_threshold8(levels, out, width, threshold);
+         return;
+      }
+      memset(out, 0, ((size_t)width + 7) / 8);
+      for (unsigned int x = 0; x < width; ++x) {
+         if (level_at(levels, bytes, x * step, max_value) >= threshold) {
+            out[x / 8] |= 0x80 >> (x % 8);
+         }
+      }
+      return;
+   }
+
+   unsigned int new_channels = alpha ? 2 : 1;
+   for (unsigned int x = 0; x < width; ++x) {
+      size_t i = x * step;
+      out[new_channels * x] = level_at(levels, bytes, i, max_value)
+                            < threshold;
+      if (alpha) {
+         uint16_t opacity = sample_at(row->channels[1], bytes, i);
+         out[2 * x + 1] = 2 * opacity > max_value;
+      }
+   }
+}
+
+static uint16_t sample_at(const void *samples, int bytes, size_t i) {
+   if (bytes) return ((const uint8_t *)samples)[i];
+   return ((const uint16_t *)samples)[i];
+}
+
+static uint16_t level_at(
+   const void *samples,
+   int bytes,
+   size_t i,
+   uint16_t max_value
+) {
+   uint16_t level = sample_at(samples, bytes, i);
+   if (max_value == PGM_MAX_VALUE) return level;
+   return scale_sample(level, max_value);
+}
+
+static void set_sample_at(void *samples, int bytes, size_t i, uint16_t value) {
+   if (bytes) {
+      ((uint8_t *)samples)[i] = value;
+   } else {
+      ((uint16_t *)samples)[i] = value;
+   }
+}
+
+static int mirror(PNM *image, int rows, int columns) {
    if (image == NULL) return -3;
-   if (parameter == NULL) return FILTER_INVALID_PARAMETER;
 
-   FormatPNM format = get_format(image);
-   if (format == FORMAT_PBM ) return FILTER_WRONG_IMAGE_FORMAT;
+   MirrorJob job = {
+      image,
+      NULL,
+      get_width(image),
+      get_height(image),
+      get_channels(image),
+      get_storage(image) == STORAGE_8,
+      rows,
+      columns
+   };
+   if (get_storage(image) == STORAGE_BIT) {
+      job.bits = get_bits(image);
+      if (job.bits == NULL) return -4;
+   } else if (job.bytes ? get_data8(image) == NULL
+      : get_data16(image) == NULL) {
+      return -4;
+   }
 
-   int threshold;
-   if (sscanf(parameter, "%d", &threshold) != 1) {
-      return FILTER_INVALID_PARAMETER;
+   size_t pairs = rows ? (job.height + 1) / 2 : job.height;
+   unsigned int bands = pnm_parallel_bands(
+      pairs,
+      get_stride(image) * job.height
+   );
+   pnm_parallel_for(pairs, bands, mirror_band, &job);
+   return FILTER_SUCCESS;
+}
+
+static int mirror_band(
+   void *context,
+   unsigned int band,
+   size_t first,
+   size_t end
+) {
+   (void)band;
+   MirrorJob *job = context;
+   unsigned int width = job->width;
+   unsigned int channels = job->channels;
+   size_t stride = get_stride(job->image);
+
+   for (size_t y = first; y < end; ++y) {
+      size_t mirror_y = job->rows ? job->height - 1 - y : y;
+      if (!job->columns) {
+         // The middle row of an odd height stays where it is.
+         if (mirror_y != y) {
+            swap_rows(
+               get_row(job->image, y),
+               get_row(job->image, mirror_y),
+               get_row_size(job->image)
+            );
+         }
+         continue;
+      }
+      if (job->bits != NULL) {
+         mirror_bits(
+            job->bits + y * stride,
+            job->bits + mirror_y * stride,
+            width
+         );
+         continue;
+      }
+
+      // Row y is swapped with row mirror_y, pixels in reverse order. A row
+      // swapped with itself, the middle row of an odd height when the rows
+      // are mirrored, only has its first half walked.
+      void *top = get_row(job->image, y);
+      void *bottom = get_row(job->image, mirror_y);
+      unsigned int end_x = (top == bottom) ? width / 2 : width;
+      for (unsigned int x = 0; x < end_x; ++x) {
+         size_t i = (size_t)x * channels;
+         size_t j = (size_t)(width - 1 - x) * channels;
+         for (unsigned int a = 0; a < channels; ++a) {
+            if (job->bytes) {
+               uint8_t temp = ((uint8_t *)top)[i + a];
+               ((uint8_t *)top)[i + a] = ((uint8_t *)bottom)[j + a];
+               ((uint8_t *)bottom)[j + a] = temp;
+            } else {
+               uint16_t temp = ((uint16_t *)top)[i + a];
+               ((uint16_t *)top)[i + a] = ((uint16_t *)bottom)[j + a];
+               ((uint16_t *)bottom)[j + a] = temp;
+            }
+         }
+      }
    }
-   if (threshold < 0 || 255 < threshold) return FILTER_INVALID_PARAMETER;
+   return FILTER_SUCCESS;
+}
+
+static void mirror_bits(uint8_t *top, uint8_t *bottom, unsigned int width) {
+   // A row swapped with itself only has its first half walked.
+   unsigned int end = (top == bottom) ? width / 2 : width;
+   for (unsigned int x = 0; x < end; ++x) {
+      unsigned int mirror = width - 1 - x;
+      uint8_t top_mask = 0x80 >> (x % 8);
+      uint8_t bottom_mask = 0x80 >> (mirror % 8);
+      int top_bit = (top[x / 8] & top_mask) != 0;
+      int bottom_bit = (bottom[mirror / 8] & bottom_mask) != 0;
+      if (top_bit != bottom_bit) {
+         top[x / 8] ^= top_mask;
+         bottom[mirror / 8] ^= bottom_mask;
+      }
+   }
+}
 
-   if (format == FORMAT_PPM) {
-      if (fifty_shades_of_grey(image, "2") != 0) return -4;
+static void swap_rows(uint8_t *top, uint8_t *bottom, size_t size) {
+   uint8_t buffer[256];
+   for (size_t i = 0; i < size; i += sizeof(buffer)) {
+      size_t chunk = size - i < sizeof(buffer) ? size - i : sizeof(buffer);
+      memcpy(buffer, top + i, chunk);
+      memcpy(top + i, bottom + i, chunk);
+      memcpy(bottom + i, buffer, chunk);
+   }
+}
+
+static int transpose_image(PNM *image, int last_row, int last_column) {
+   if (image == NULL) return -3;
+
+   StoragePNM storage = get_storage(image);
+   if (storage == STORAGE_BIT) {
+      if (get_bits(image) == NULL) return -4;
+   } else if (storage == STORAGE_8) {
+      if (get_data8(image) == NULL) return -4;
+   } else if (get_data16(image) == NULL) {
+      return -4;
    }
 
    unsigned int width = get_width(image);
    unsigned int height = get_height(image);
-   uint16_t *data = get_data(image);
+   unsigned int channels = get_channels(image);
+   size_t pixel_size = 0;
+   size_t row_size = ((size_t)height + 7) / 8;
+   if (storage != STORAGE_BIT) {
+      pixel_size = channels * (storage == STORAGE_8 ? 1 : 2);
+      row_size = height * pixel_size;
+   }
+   size_t stride = pnm_row_stride(row_size);
+   if (width == 0 || height == 0 || SIZE_MAX / width < stride) return -4;
+   uint8_t *data = pnm_alloc(stride * width);
+   if (data == NULL) return -4;
 
-   size_t data_size = width * height;
+   ptrdiff_t source_stride = get_stride(image);
+   TransposeJob job = {
+      get_row(image, last_row ? height - 1 : 0),
+      last_row ? -source_stride : source_stride,
+      last_column ? data + (width - 1) * stride : data,
+      last_column ? -(ptrdiff_t)stride : (ptrdiff_t)stride,
+      width,
+      height,
+      pixel_size,
+      0
+   };
+   // Rows mapped in place by load_pnm_mmap may start anywhere.
+   job.aligned = pixel_size == 1 || pixel_size == 2 || pixel_size == 4;
+   if (job.aligned && ((uintptr_t)job.source % pixel_size != 0
+      || source_stride % (ptrdiff_t)pixel_size != 0)) {
+      job.aligned = 0;
+   }
+
+   size_t tiles = (width + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+   unsigned int bands = pnm_parallel_bands(tiles, stride * width);
+   pnm_parallel_for(tiles, bands, transpose_band, &job);
 
-   for (size_t i = 0; i < data_size; ++i) {
-      data[i] = (data[i] >= threshold) ? PBM_MAX_VALUE : 0;
+   if (get_format(image) == FORMAT_PAM) {
+      char tuple_type[PAM_TUPLE_TYPE_SIZE];
+      snprintf(tuple_type, sizeof(tuple_type), "%s", get_tuple_type(image));
+      if (set_pam(
+         image,
+         height,
+         width,
+         channels,
+         get_max_value(image),
+         tuple_type,
+         storage,
+         data
+      ) != 0) {
+         pnm_free(data);
+         return -4;
+      }
+   } else {
+      set_pnm_storage(
+         image,
+         get_format(image),
+         height,
+         width,
+         get_max_value(image),
+         storage,
+         data
+      );
    }
+   set_stride(image, stride);
+   return FILTER_SUCCESS;
+}
 
-   set_pnm(image, FORMAT_PBM, width, height, PBM_MAX_VALUE, data);
+static int transpose_band(
+   void *context,
+   unsigned int band,
+   size_t first,
+   size_t end
+) {
+   (void)band;
+   const TransposeJob *job = context;
+
+   // A band writes the rows of the target its columns of tiles become, one
+   // tile after the other down the source.
+   for (size_t tile = first; tile < end; ++tile) {
+      unsigned int x = tile * TRANSPOSE_TILE;
+      unsigned int columns = job->width - x;
+      if (TRANSPOSE_TILE < columns) columns = TRANSPOSE_TILE;
+      for (unsigned int y = 0; y < job->height; y += TRANSPOSE_TILE) {
+         unsigned int rows = job->height - y;
+         if (TRANSPOSE_TILE < rows) rows = TRANSPOSE_TILE;
+         transpose_tile(job, x, y, columns, rows);
+      }
+   }
    return FILTER_SUCCESS;
 }
+
+static void transpose_tile(
+   const TransposeJob *job,
+   unsigned int x,
+   unsigned int y,
+   unsigned int columns,
+   unsigned int rows
+) {
+   const uint8_t *source = job->source + (ptrdiff_t)y * job->source_stride;
+   uint8_t *target = job->target + (ptrdiff_t)x * job->target_stride;
+   size_t pixel_size = job->pixel_size;
+   if (pixel_size == 0) {
+      transpose_bits(
+         source + x / 8,
+         job->source_stride,
+         target + y / 8,
+         job->target_stride,
+         rows,
+         columns
+      );
+      return;
+   }
+
+   source += x * pixel_size;
+   target += y * pixel_size;
+   if (job->aligned && pixel_size == 1) {
+      kernel_transpose8(
+         source,
+         job->source_stride,
+         target,
+         job->target_stride,
+         rows,
+         columns
+      );
+   } else if (job->aligned && pixel_size == 2) {
+      kernel_transpose16(
+         (const uint16_t *)source,
+         job->source_stride,
+         (uint16_t *)target,
+         job->target_stride,
+         rows,
+         columns
+      );
+   } else if (job->aligned) {
+      kernel_transpose32(
+         (const uint32_t *)source,
+         job->source_stride,
+         (uint32_t *)target,
+         job->target_stride,
+         rows,
+         columns
+      );
+   } else if (pixel_size == 3) {
+      kernel_transpose24(
+         source,
+         job->source_stride,
+         target,
+         job->target_stride,
+         rows,
+         columns
+      );
+   } else {
+      // Pixels of 6 or 8 bytes, and unaligned ones, are copied one by one.
+      for (unsigned int r = 0; r < rows; ++r) {
+         const uint8_t *row = source + (ptrdiff_t)r * job->source_stride;
+         for (unsigned int c = 0; c < columns; ++c) {
+            memcpy(
+               target + (ptrdiff_t)c * job->target_stride + r * pixel_size,
+               row + c * pixel_size,
+               pixel_size
+            );
+         }
+      }
+   }
+}
+
+static void transpose_bits(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   unsigned int rows,
+   unsigned int columns
+) {
+   for (unsigned int c = 0; c < columns; c += 8) {
+      for (unsigned int r = 0; r < rows; r += 8) {
+         // Row k of the 8 x 8 bits goes in byte 7 - k of a 64-bit word,
+         // rows past the source as 0, so that three exchanges of bits
+         // transpose the word.
+         uint64_t bits = 0;
+         for (unsigned int k = 0; k < 8; ++k) {
+            bits <<= 8;
+            if (r + k < rows) {
+               bits |= source[(ptrdiff_t)(r + k) * source_stride + c / 8];
+            }
+         }
+         uint64_t t = (bits ^ (bits >> 7)) & 0x00AA00AA00AA00AAULL;
+         bits ^= t ^ (t << 7);
+         t = (bits ^ (bits >> 14)) & 0x0000CCCC0000CCCCULL;
+         bits ^= t ^ (t << 14);
+         t = (bits ^ (bits >> 28)) & 0x00000000F0F0F0F0ULL;
+         bits ^= t ^ (t << 28);
+
+         for (unsigned int k = 0; k < 8 && c + k < columns; ++k) {
+            target[(ptrdiff_t)(c + k) * target_stride + r / 8] =
+               (uint8_t)(bits >> (56 - 8 * k));
+         }
+      }
+   }
+}
@@ -9,6 +9,8 @@
 #ifndef _FILTER_H
 #define _FILTER_H
 
+#include <stdio.h>
+
 #include "pnm.h"
 
 /* ======= Constants ======= */
@@ -16,12 +18,40 @@
 #define FILTER_SUCCESS 0
 #define FILTER_WRONG_IMAGE_FORMAT -1
 #define FILTER_INVALID_PARAMETER -2
+#define FILTER_UNKNOWN -5
+
+/*
+ * Layouts that the filters work fastest on, see set_layout. Every filter
+ * accepts both layouts. Geometric filters convert pixel data in another
+ * layout to theirs; per-pixel filters work in place on either layout and
+ * never convert it, so a chain converts the pixel data at most once.
+ */
+#define TURNAROUND_LAYOUT LAYOUT_INTERLEAVED
+#define TRANSPOSE_LAYOUT LAYOUT_INTERLEAVED
+#define ROTATE90_LAYOUT LAYOUT_INTERLEAVED
+#define ROTATE270_LAYOUT LAYOUT_INTERLEAVED
+#define FLIP_H_LAYOUT LAYOUT_INTERLEAVED
+#define FLIP_V_LAYOUT LAYOUT_INTERLEAVED
+#define MONOCHROME_LAYOUT LAYOUT_PLANAR
+#define NEGATIVE_LAYOUT LAYOUT_PLANAR
+#define FIFTY_SHADES_OF_GREY_LAYOUT LAYOUT_PLANAR
+#define BLACK_AND_WHITE_LAYOUT LAYOUT_PLANAR
+
+/* ======= Structures ======= */
+
+/**
+ * @brief Opaque structure for a chain of filters applied one after the
+ *        other.
+ */
+typedef struct FilterChain_t FilterChain;
 
 /* ======= Function Prototypes ======= */
 
 /**
  * @brief Rotates the image by 180 degrees.
  *
+ * Works on images of any format, PAM images of any depth included.
+ *
  * @param image Pointer to the PNM image structure.
  *
  * @pre image != NULL
@@ -29,23 +59,115 @@
  * @return
  *     0: Success
  *    -3: Image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
  */
 int turnaround(PNM *image);
 
+/**
+ * @brief Transposes the image, row y becoming column y.
+ *
+ * The pixels are copied into new pixel data by square tiles, which are
+ * split between threads for large images. Works on images of any format,
+ * PAM images of any depth included.
+ *
+ * @param image Pointer to the PNM image structure.
+ *
+ * @pre image != NULL
+ * @post The width and the height of the image are swapped
+ *
+ * @return
+ *     0: Success
+ *    -3: Image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
+ */
+int transpose(PNM *image);
+
+/**
+ * @brief Rotates the image by 90 degrees clockwise.
+ *
+ * Same as transpose, the rows of the image being read from the last one.
+ *
+ * @param image Pointer to the PNM image structure.
+ *
+ * @pre image != NULL
+ * @post The width and the height of the image are swapped
+ *
+ * @return
+ *     0: Success
+ *    -3: Image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
+ */
+int rotate90(PNM *image);
+
+/**
+ * @brief Rotates the image by 90 degrees counterclockwise.
+ *
+ * Same as transpose, the rows of the new image being written from the last
+ * one.
+ *
+ * @param image Pointer to the PNM image structure.
+ *
+ * @pre image != NULL
+ * @post The width and the height of the image are swapped
+ *
+ * @return
+ *     0: Success
+ *    -3: Image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
+ */
+int rotate270(PNM *image);
+
+/**
+ * @brief Mirrors the image horizontally, the left column becoming the right
+ *        one.
+ *
+ * Works in place on images of any format, PAM images of any depth included.
+ *
+ * @param image Pointer to the PNM image structure.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     0: Success
+ *    -3: Image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
+ */
+int flip_h(PNM *image);
+
+/**
+ * @brief Mirrors the image vertically, the top row becoming the bottom one.
+ *
+ * Works in place on images of any format, PAM images of any depth included.
+ *
+ * @param image Pointer to the PNM image structure.
+ *
+ * @pre image != NULL
+ *
+ * @return
+ *     0: Success
+ *    -3: Image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
+ */
+int flip_v(PNM *image);
+
 /**
  * @brief Converts the image to monochrome based on a specific color channel.
  *
+ * The two other color channels are set to 0. The alpha channel of a PAM
+ * image is left as it is.
+ *
  * @param image Pointer to the PNM image structure.
  * @param parameter A string indicating the color channel ("r", "v", "b").
  *
- * @pre image != NULL, parameter != NULL, image format is PPM
- * @post image format is PGM
+ * @pre image != NULL, parameter != NULL, image format is PPM, or PAM with
+ *      the RGB or RGB_ALPHA tuple type
  *
  * @return
  *     0: Success
- *    -1: Image is not in PPM format
+ *    -1: Image is not an RGB image
  *    -2: Invalid parameter
  *    -3: Image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
  */
 int monochrome(PNM *image, const char *parameter);
 
@@ -53,16 +175,19 @@ int monochrome(PNM *image, const char *parameter);
  * @brief Inverts the colors of the image.
  *
  * Creates a negative of the image by subtracting each pixel's value from the
- * maximum value of the image.
+ * maximum value of the image. The alpha channel of a PAM image is left as it
+ * is.
  *
  * @param image Pointer to the PNM image structure.
  *
- * @pre image != NULL, image format is PPM
+ * @pre image != NULL, image format is PPM, or PAM with the RGB or RGB_ALPHA
+ *      tuple type
  *
  * @return
  *     0: Success
- *    -1: Image is not in PPM format
+ *    -1: Image is not an RGB image
  *    -3: Image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
  */
 int negative(PNM *image);
 
@@ -73,17 +198,25 @@ int negative(PNM *image);
  * - Method 1: Averages the red, green, and blue channels.
  * - Method 2: Uses a weighted average (0.299 * R + 0.587 * G + 0.114 * B).
  *
+ * Gray levels are rounded half up, then scaled to 255 from the maximum
+ * value of the image with the same rounding, see grey_sample.
+ *
+ * PAM images become GRAYSCALE or GRAYSCALE_ALPHA PAM images, whose alpha
+ * channel is scaled like the gray levels.
+ *
  * @param image Pointer to the PNM image structure.
  * @param parameter A string indicating the method ("1" or "2").
  *
- * @pre image != NULL, parameter != NULL, image format is PPM
- * @post image format is PGM
+ * @pre image != NULL, parameter != NULL, image format is PPM, or PAM with
+ *      the RGB or RGB_ALPHA tuple type
+ * @post image format is PGM, or PAM for a PAM image
  *
  * @return
  *     0: Success
- *    -1: Image is not in PPM format
+ *    -1: Image is not an RGB image
  *    -2: Invalid parameter
  *    -3: Image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
  */
 int fifty_shades_of_grey(PNM *image, const char *parameter);
 
@@ -91,21 +224,117 @@ int fifty_shades_of_grey(PNM *image, const char *parameter);
  * @brief Converts the image to black and white.
  *
  * Thresholds the image to create a black-and-white (binary) image. Pixels with
- * a value above the threshold are set to white, and those below are set to
- * black.
+ * a gray level at least the threshold are set to black, and those below are
+ * set to white, in both containers: PBM images get bit 1 for black and 0 for
+ * white, PAM images sample 0 for black and 1 for white.
+ *
+ * PAM images become BLACKANDWHITE or BLACKANDWHITE_ALPHA PAM images, whose
+ * alpha channel is opaque where it was above half its maximum value.
+ *
+ * Color images are converted to grayscale with method 2 in the same pass
+ * over the rows, without an intermediate gray image. The gray levels of
+ * other images are scaled to 255 from their maximum value the same way, so
+ * that the threshold means the same level at any depth.
  *
  * @param image Pointer to the PNM image structure.
  * @param parameter A string representing the threshold value (0 to 255).
  *
- * @pre image != NULL, parameter != NULL, image format is PPM or PGM
- * @post image format is PBM
+ * @pre image != NULL, parameter != NULL, image format is PPM or PGM, or PAM
+ *      with the RGB, GRAYSCALE tuple types or their _ALPHA variants
+ * @post image format is PBM, or PAM for a PAM image
  *
  * @return
  *     0: Success
- *    -1: Image is not in PPM format
+ *    -1: Image is not an RGB or gray image
  *    -2: Invalid parameter
  *    -3: Image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
  */
 int black_and_white(PNM *image, const char *parameter);
 
+/**
+ * @brief Parses a chain of filters, such as "gris:2,NB:128".
+ *
+ * Filters are separated by commas and named as on the command line:
+ * retournement, transposition, rotation90, rotation270, miroir_h, miroir_v,
+ * monochrome, negatif, gris and NB, in any case. A filter may
+ * be followed by a colon and its parameter; filters without one take the
+ * common parameter.
+ *
+ * @param chain Pointer to the chain to create.
+ * @param filters Chain of filters.
+ * @param parameter Common parameter, may be NULL.
+ *
+ * @pre chain != NULL, filters != NULL
+ * @post *chain must be freed with filter_chain_free
+ *
+ * @return
+ *     0: Success
+ *    -2: Missing or invalid parameter
+ *    -3: chain or filters is NULL
+ *    -4: Memory allocation failure
+ *    -5: Unknown filter name
+ */
+int filter_chain_parse(
+   FilterChain **chain,
+   const char *filters,
+   const char *parameter
+);
+
+/**
+ * @brief Applies a chain of filters to an image.
+ *
+ * The whole chain is checked against the image before any filter is
+ * applied. Consecutive filters that compute each pixel from itself alone,
+ * all but the geometric ones, are fused into a single loop over the rows:
+ * each row is filtered by all of them while it is in cache, and only one
+ * row of intermediate gray levels is allocated.
+ *
+ * @param chain Pointer to the chain.
+ * @param image Pointer to the PNM image structure.
+ *
+ * @pre chain != NULL, image != NULL
+ *
+ * @return
+ *     0: Success
+ *    -1: A filter is not meant for the pixels it would be given
+ *    -3: chain or image is NULL
+ *    -4: Memory allocation failure or undecodable pixel data
+ */
+int filter_chain_apply(FilterChain *chain, PNM *image);
+
+/**
+ * @brief Tells whether every filter of a chain computes each pixel from
+ *        itself alone, so that it can be applied to batches of rows.
+ *
+ * @param chain Pointer to the chain.
+ *
+ * @pre chain != NULL
+ *
+ * @return
+ *     1 if the chain is per pixel, 0 otherwise
+ */
+int filter_chain_is_per_pixel(FilterChain *chain);
+
+/**
+ * @brief Prints the passes over the pixel data that a chain makes.
+ *
+ * Passes printed as working in place copy the pixel data instead when it is
+ * shared with views, or when it is made of packed rows mapped from a file
+ * and its new rows need more room.
+ *
+ * @param chain Pointer to the chain.
+ * @param stream Stream to print to.
+ *
+ * @pre chain != NULL, stream != NULL
+ */
+void filter_chain_explain(FilterChain *chain, FILE *stream);
+
+/**
+ * @brief Frees a chain of filters.
+ *
+ * @param chain Pointer to the chain, set to NULL.
+ */
+void filter_chain_free(FilterChain **chain);
+
 #endif // _FILTER_H
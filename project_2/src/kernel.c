@@ -0,0 +1,1508 @@
+/**
+ * @file kernel.c
+ * @brief Implementation of the sample kernels used by the filters.
+ *
+ * The SIMD versions are compiled with target attributes, so that the file
+ * builds without any instruction set flag and the processor is only asked
+ * for the instructions once they are known to be supported. Each version
+ * handles whole vectors and leaves the remaining samples to the scalar
+ * version.
+ *
+ * @author Pavlov Aleksandr (s2400691)
+ * @date 24.03.2025
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pnm.h"
+#include "kernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+/* ======= Constants ======= */
+
+/**
+ * @brief Weights of the luma of ITU-R BT.601, in thousandths.
+ */
+#define LUMA_RED 299
+#define LUMA_GREEN 587
+#define LUMA_BLUE 114
+#define LUMA_SCALE 1000
+
+/**
+ * @brief Multiplier that divides a sum of three 8-bit samples by 3, as
+ * (sum * DIVIDE_BY_3) >> 17.
+ */
+#define DIVIDE_BY_3 43691
+
+/**
+ * @brief Multiplier that divides a number below 2^15 by 125, as
+ * (x * DIVIDE_BY_125) >> 22.
+ *
+ * Dividing by 8, then by 125, divides by LUMA_SCALE on 16 bits: a weighted
+ * sum of 8-bit samples is below 2^18 and floor(floor(x / 8) / 125) equals
+ * floor(x / 1000).
+ */
+#define DIVIDE_BY_125 33555
+
+#define R2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
+#define R6(n) R4(n), R4(n + 2 * 4), R4(n + 1 * 4), R4(n + 3 * 4)
+
+/**
+ * @brief Bytes with their bits in reverse order, which turns the masks of
+ * compare instructions, least significant bit first, into PBM bits.
+ */
+static const uint8_t REVERSED_BITS[256] = {R6(0), R6(2), R6(1), R6(3)};
+
+/**
+ * @brief Address of row r of a block whose rows are stride bytes apart.
+ */
+#define BLOCK_ROW(type, block, stride, r) \
+   ((type *)((const char *)(block) + (ptrdiff_t)(r) * (stride)))
+
+/* ======= Structures ======= */
+
+/**
+ * @brief Versions of the kernels for one instruction set.
+ */
+typedef struct Kernels_t {
+   void (*negate8)(uint8_t *samples, size_t count, uint8_t max_value);
+   void (*keep_channel8)(uint8_t *samples, size_t count, unsigned int channel);
+   void (*grey8)(
+      const uint8_t *r,
+      const uint8_t *g,
+      const uint8_t *b,
+      uint8_t *grey,
+      size_t count,
+      int mode,
+      uint16_t max_value
+   );
+   void (*threshold8)(
+      const uint8_t *samples,
+      uint8_t *bits,
+      size_t count,
+      uint8_t threshold
+   );
+   void (*transpose8)(
+      const uint8_t *source,
+      ptrdiff_t source_stride,
+      uint8_t *target,
+      ptrdiff_t target_stride,
+      size_t rows,
+      size_t columns
+   );
+   void (*transpose16)(
+      const uint16_t *source,
+      ptrdiff_t source_stride,
+      uint16_t *target,
+      ptrdiff_t target_stride,
+      size_t rows,
+      size_t columns
+   );
+   void (*transpose24)(
+      const uint8_t *source,
+      ptrdiff_t source_stride,
+      uint8_t *target,
+      ptrdiff_t target_stride,
+      size_t rows,
+      size_t columns
+   );
+   void (*transpose32)(
+      const uint32_t *source,
+      ptrdiff_t source_stride,
+      uint32_t *target,
+      ptrdiff_t target_stride,
+      size_t rows,
+      size_t columns
+   );
+} Kernels;
+
+/* ======= Internal Function Prototypes ======= */
+
+/**
+ * @brief Selects the most capable kernel level, once.
+ */
+static void init_kernels(void);
+
+/**
+ * @brief Retrieves the kernels of the level in use.
+ *
+ * @return
+ *     Pointer to the kernels
+ */
+static const Kernels *current_kernels(void);
+
+/*
+ * The versions of the kernels below compute the external kernel of the same
+ * name, see kernel.h, with the instruction set of their suffix.
+ */
+
+static void negate8_scalar(uint8_t *samples, size_t count, uint8_t max_value);
+
+static void keep_channel8_scalar(
+   uint8_t *samples,
+   size_t count,
+   unsigned int channel
+);
+
+static void grey8_scalar(
+   const uint8_t *r,
+   const uint8_t *g,
+   const uint8_t *b,
+   uint8_t *grey,
+   size_t count,
+   int mode,
+   uint16_t max_value
+);
+
+static void threshold8_scalar(
+   const uint8_t *samples,
+   uint8_t *bits,
+   size_t count,
+   uint8_t threshold
+);
+
+static void transpose8_scalar(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+);
+
+static void transpose16_scalar(
+   const uint16_t *source,
+   ptrdiff_t source_stride,
+   uint16_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+);
+
+static void transpose24_scalar(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+);
+
+static void transpose32_scalar(
+   const uint32_t *source,
+   ptrdiff_t source_stride,
+   uint32_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+);
+
+#ifdef KERNEL_X86
+
+static void negate8_sse2(uint8_t *samples, size_t count, uint8_t max_value);
+
+static void keep_channel8_sse2(
+   uint8_t *samples,
+   size_t count,
+   unsigned int channel
+);
+
+static void grey8_sse2(
+   const uint8_t *r,
+   const uint8_t *g,
+   const uint8_t *b,
+   uint8_t *grey,
+   size_t count,
+   int mode,
+   uint16_t max_value
+);
+
+/**
+ * @brief Computes the gray levels of eight pixels, as grey_sample does.
+ *
+ * Mode 1 adds one to the sum of the samples and divides it by 3. Mode 2
+ * adds the weighted samples and half of LUMA_SCALE on 32 bits with
+ * multiply-add instructions, then divides by LUMA_SCALE, see DIVIDE_BY_125.
+ *
+ * @param r Red samples, on 16 bits.
+ * @param g Green samples, on 16 bits.
+ * @param b Blue samples, on 16 bits.
+ * @param mode Grayscale method, 1 or 2.
+ * @param max_value Maximum pixel value of the image, at most 255.
+ *
+ * @pre Samples at most max_value
+ *
+ * @return
+ *     Gray levels, on 16 bits
+ */
+static __m128i grey16_sse2(
+   __m128i r,
+   __m128i g,
+   __m128i b,
+   int mode,
+   uint16_t max_value
+);
+
+/**
+ * @brief Scales eight levels to the range of PGM images, as scale_sample
+ *        does.
+ *
+ * The quotient is computed in single precision: a quotient of integers
+ * below 2^16 by a divisor at most 255 that is not whole is at least 1/255
+ * away from the next integer, far more than the rounding error of a float,
+ * so its truncation is the integer quotient.
+ *
+ * @param value Levels, on 16 bits.
+ * @param max_value Maximum pixel value of the image, at most 255.
+ *
+ * @pre Levels at most max_value
+ *
+ * @return
+ *     Scaled levels, on 16 bits
+ */
+static __m128i scale16_sse2(__m128i value, uint16_t max_value);
+
+static void threshold8_sse2(
+   const uint8_t *samples,
+   uint8_t *bits,
+   size_t count,
+   uint8_t threshold
+);
+
+static void transpose8_sse2(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+);
+
+static void transpose16_sse2(
+   const uint16_t *source,
+   ptrdiff_t source_stride,
+   uint16_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+);
+
+static void transpose24_sse2(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+);
+
+static void transpose32_sse2(
+   const uint32_t *source,
+   ptrdiff_t source_stride,
+   uint32_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+);
+
+/**
+ * @brief Transposes a block of 16 x 16 bytes held in registers.
+ *
+ * @param block Rows of the block, replaced by its columns.
+ */
+static void transpose_block8_sse2(__m128i block[16]);
+
+/**
+ * @brief Sorts the samples of two rows of sixteen pixels of three 8-bit
+ *        samples by channel.
+ *
+ * @param v Two rows of 48 bytes, replaced by the red samples of each row,
+ *          then the green ones, then the blue ones.
+ */
+static void deinterleave48_sse2(__m128i v[6]);
+
+/**
+ * @brief Reverses deinterleave48_sse2.
+ *
+ * @param v Red, green and blue samples of two rows of sixteen pixels,
+ *          replaced by the two rows of 48 bytes.
+ */
+static void interleave48_sse2(__m128i v[6]);
+
+static void negate8_avx2(uint8_t *samples, size_t count, uint8_t max_value);
+
+static void keep_channel8_avx2(
+   uint8_t *samples,
+   size_t count,
+   unsigned int channel
+);
+
+static void grey8_avx2(
+   const uint8_t *r,
+   const uint8_t *g,
+   const uint8_t *b,
+   uint8_t *grey,
+   size_t count,
+   int mode,
+   uint16_t max_value
+);
+
+/**
+ * @brief Computes the gray levels of sixteen pixels, see grey16_sse2.
+ */
+static __m256i grey16_avx2(
+   __m256i r,
+   __m256i g,
+   __m256i b,
+   int mode,
+   uint16_t max_value
+);
+
+/**
+ * @brief Scales sixteen levels, see scale16_sse2.
+ */
+static __m256i scale16_avx2(__m256i value, uint16_t max_value);
+
+static void threshold8_avx2(
+   const uint8_t *samples,
+   uint8_t *bits,
+   size_t count,
+   uint8_t threshold
+);
+
+static void negate8_avx512(uint8_t *samples, size_t count, uint8_t max_value);
+
+static void keep_channel8_avx512(
+   uint8_t *samples,
+   size_t count,
+   unsigned int channel
+);
+
+static void grey8_avx512(
+   const uint8_t *r,
+   const uint8_t *g,
+   const uint8_t *b,
+   uint8_t *grey,
+   size_t count,
+   int mode,
+   uint16_t max_value
+);
+
+/**
+ * @brief Computes the gray levels of thirty-two pixels, see grey16_sse2.
+ */
+static __m512i grey16_avx512(
+   __m512i r,
+   __m512i g,
+   __m512i b,
+   int mode,
+   uint16_t max_value
+);
+
+/**
+ * @brief Scales thirty-two levels, see scale16_sse2.
+ */
+static __m512i scale16_avx512(__m512i value, uint16_t max_value);
+
+static void threshold8_avx512(
+   const uint8_t *samples,
+   uint8_t *bits,
+   size_t count,
+   uint8_t threshold
+);
+
+#endif // KERNEL_X86
+
+/* ======= Variables ======= */
+
+/**
+ * @brief Kernels of each level, in the order of KernelLevel.
+ */
+static const Kernels KERNELS[] = {
+   {
+      negate8_scalar,
+      keep_channel8_scalar,
+      grey8_scalar,
+      threshold8_scalar,
+      transpose8_scalar,
+      transpose16_scalar,
+      transpose24_scalar,
+      transpose32_scalar
+   },
+#ifdef KERNEL_X86
+   {
+      negate8_sse2,
+      keep_channel8_sse2,
+      grey8_sse2,
+      threshold8_sse2,
+      transpose8_sse2,
+      transpose16_sse2,
+      transpose24_sse2,
+      transpose32_sse2
+   },
+   {
+      negate8_avx2,
+      keep_channel8_avx2,
+      grey8_avx2,
+      threshold8_avx2,
+      transpose8_sse2,
+      transpose16_sse2,
+      transpose24_sse2,
+      transpose32_sse2
+   },
+   {
+      negate8_avx512,
+      keep_channel8_avx512,
+      grey8_avx512,
+      threshold8_avx512,
+      transpose8_sse2,
+      transpose16_sse2,
+      transpose24_sse2,
+      transpose32_sse2
+   }
+#endif
+};
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Kernel level in use.
+ */
+static KernelLevel kernel_level = KERNEL_SCALAR;
+
+/* ======= External Functions ======= */
+
+KernelLevel kernel_best_level(void) {
+#ifdef KERNEL_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx512f")
+      && __builtin_cpu_supports("avx512bw")) {
+      return KERNEL_AVX512;
+   }
+   if (__builtin_cpu_supports("avx2")) return KERNEL_AVX2;
+   if (__builtin_cpu_supports("sse2")) return KERNEL_SSE2;
+#endif
+   return KERNEL_SCALAR;
+}
+
+KernelLevel kernel_get_level(void) {
+   pthread_once(&kernels_once, init_kernels);
+   return kernel_level;
+}
+
+int kernel_set_level(KernelLevel level) {
+   pthread_once(&kernels_once, init_kernels);
+   if (level < KERNEL_SCALAR || kernel_best_level() < level) return -1;
+   kernel_level = level;
+   return 0;
+}
+
+const char *kernel_level_name(KernelLevel level) {
+   switch (level) {
+      case KERNEL_SCALAR:
+         return "scalar";
+      case KERNEL_SSE2:
+         return "sse2";
+      case KERNEL_AVX2:
+         return "avx2";
+      case KERNEL_AVX512:
+         return "avx512";
+      default:
+         return "unknown";
+   }
+}
+
+uint8_t grey_sample(int r, int g, int b, int mode, uint16_t max_value) {
+   uint32_t value;
+   if (mode == 1) {
+      // The mean of three integers is never halfway between two of them.
+      value = (uint32_t)(r + g + b + 1) / 3;
+   } else {
+      value = LUMA_RED * r + LUMA_GREEN * g + LUMA_BLUE * b;
+      value = (value + LUMA_SCALE / 2) / LUMA_SCALE;
+   }
+   return scale_sample(value, max_value);
+}
+
+uint8_t scale_sample(uint16_t value, uint16_t max_value) {
+   // Adding max_value / 2 also rounds halves up when max_value is odd.
+   uint32_t scaled = (uint32_t)value * PGM_MAX_VALUE + max_value / 2;
+   return (uint8_t)(scaled / max_value);
+}
+
+void kernel_negate8(uint8_t *samples, size_t count, uint8_t max_value) {
+   current_kernels()->negate8(samples, count, max_value);
+}
+
+void kernel_keep_channel8(
+   uint8_t *samples,
+   size_t count,
+   unsigned int channel
+) {
+   current_kernels()->keep_channel8(samples, count, channel);
+}
+
+void kernel_grey8(
+   const uint8_t *r,
+   const uint8_t *g,
+   const uint8_t *b,
+   uint8_t *grey,
+   size_t count,
+   int mode,
+   uint16_t max_value
+) {
+   current_kernels()->grey8(r, g, b, grey, count, mode, max_value);
+}
+
+void kernel_threshold8(
+   const uint8_t *samples,
+   uint8_t *bits,
+   size_t count,
+   uint8_t threshold
+) {
+   current_kernels()->threshold8(samples, bits, count, threshold);
+}
+
+void kernel_transpose8(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   current_kernels()->transpose8(
+      source,
+      source_stride,
+      target,
+      target_stride,
+      rows,
+      columns
+   );
+}
+
+void kernel_transpose16(
+   const uint16_t *source,
+   ptrdiff_t source_stride,
+   uint16_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   current_kernels()->transpose16(
+      source,
+      source_stride,
+      target,
+      target_stride,
+      rows,
+      columns
+   );
+}
+
+void kernel_transpose24(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   current_kernels()->transpose24(
+      source,
+      source_stride,
+      target,
+      target_stride,
+      rows,
+      columns
+   );
+}
+
+void kernel_transpose32(
+   const uint32_t *source,
+   ptrdiff_t source_stride,
+   uint32_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   current_kernels()->transpose32(
+      source,
+      source_stride,
+      target,
+      target_stride,
+      rows,
+      columns
+   );
+}
+
+/* ======= Internal functions ======= */
+
+static void init_kernels(void) {
+   kernel_level = kernel_best_level();
+}
+
+static const Kernels *current_kernels(void) {
+   pthread_once(&kernels_once, init_kernels);
+   return &KERNELS[kernel_level];
+}
+
+static void negate8_scalar(uint8_t *samples, size_t count, uint8_t max_value) {
+   for (size_t i = 0; i < count; ++i) samples[i] = max_value - samples[i];
+}
+
+static void keep_channel8_scalar(
+   uint8_t *samples,
+   size_t count,
+   unsigned int channel
+) {
+   for (size_t i = 0; i < 3 * count; i += 3) {
+      uint8_t kept = samples[i + channel];
+      for (int a = 0; a < 3; ++a) samples[i + a] = 0;
+      samples[i + channel] = kept;
+   }
+}
+
+static void grey8_scalar(
+   const uint8_t *r,
+   const uint8_t *g,
+   const uint8_t *b,
+   uint8_t *grey,
+   size_t count,
+   int mode,
+   uint16_t max_value
+) {
+   for (size_t i = 0; i < count; ++i) {
+      grey[i] = grey_sample(r[i], g[i], b[i], mode, max_value);
+   }
+}
+
+static void threshold8_scalar(
+   const uint8_t *samples,
+   uint8_t *bits,
+   size_t count,
+   uint8_t threshold
+) {
+   memset(bits, 0, (count + 7) / 8);
+   for (size_t i = 0; i < count; ++i) {
+      if (samples[i] >= threshold) bits[i / 8] |= 0x80 >> (i % 8);
+   }
+}
+
+static void transpose8_scalar(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   for (size_t r = 0; r < rows; ++r) {
+      const uint8_t *row = BLOCK_ROW(const uint8_t, source, source_stride, r);
+      for (size_t c = 0; c < columns; ++c) {
+         BLOCK_ROW(uint8_t, target, target_stride, c)[r] = row[c];
+      }
+   }
+}
+
+static void transpose16_scalar(
+   const uint16_t *source,
+   ptrdiff_t source_stride,
+   uint16_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   for (size_t r = 0; r < rows; ++r) {
+      const uint16_t *row = BLOCK_ROW(const uint16_t, source, source_stride, r);
+      for (size_t c = 0; c < columns; ++c) {
+         BLOCK_ROW(uint16_t, target, target_stride, c)[r] = row[c];
+      }
+   }
+}
+
+static void transpose24_scalar(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   for (size_t r = 0; r < rows; ++r) {
+      const uint8_t *row = BLOCK_ROW(const uint8_t, source, source_stride, r);
+      for (size_t c = 0; c < columns; ++c) {
+         uint8_t *pixel = BLOCK_ROW(uint8_t, target, target_stride, c) + 3 * r;
+         pixel[0] = row[3 * c];
+         pixel[1] = row[3 * c + 1];
+         pixel[2] = row[3 * c + 2];
+      }
+   }
+}
+
+static void transpose32_scalar(
+   const uint32_t *source,
+   ptrdiff_t source_stride,
+   uint32_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   for (size_t r = 0; r < rows; ++r) {
+      const uint32_t *row = BLOCK_ROW(const uint32_t, source, source_stride, r);
+      for (size_t c = 0; c < columns; ++c) {
+         BLOCK_ROW(uint32_t, target, target_stride, c)[r] = row[c];
+      }
+   }
+}
+
+#ifdef KERNEL_X86
+
+/* ======= SSE2 ======= */
+
+__attribute__((target("sse2")))
+static void negate8_sse2(uint8_t *samples, size_t count, uint8_t max_value) {
+   const __m128i max = _mm_set1_epi8((char)max_value);
+   size_t i = 0;
+   for (; i + 16 <= count; i += 16) {
+      __m128i *vector = (__m128i *)(samples + i);
+      _mm_storeu_si128(vector, _mm_sub_epi8(max, _mm_loadu_si128(vector)));
+   }
+   negate8_scalar(samples + i, count - i, max_value);
+}
+
+__attribute__((target("sse2")))
+static void keep_channel8_sse2(
+   uint8_t *samples,
+   size_t count,
+   unsigned int channel
+) {
+   // Three vectors hold sixteen pixels, so their masks repeat.
+   uint8_t pattern[3 * 16];
+   for (size_t j = 0; j < sizeof(pattern); ++j) {
+      pattern[j] = j % 3 == channel ? 0xFF : 0;
+   }
+   __m128i masks[3];
+   for (int k = 0; k < 3; ++k) {
+      masks[k] = _mm_loadu_si128((const __m128i *)(pattern + 16 * k));
+   }
+
+   size_t i = 0;
+   for (; i + 16 <= count; i += 16) {
+      __m128i *block = (__m128i *)(samples + 3 * i);
+      for (int k = 0; k < 3; ++k) {
+         __m128i vector = _mm_loadu_si128(block + k);
+         _mm_storeu_si128(block + k, _mm_and_si128(vector, masks[k]));
+      }
+   }
+   keep_channel8_scalar(samples + 3 * i, count - i, channel);
+}
+
+__attribute__((target("sse2")))
+static void grey8_sse2(
+   const uint8_t *r,
+   const uint8_t *g,
+   const uint8_t *b,
+   uint8_t *grey,
+   size_t count,
+   int mode,
+   uint16_t max_value
+) {
+   const __m128i zero = _mm_setzero_si128();
+   size_t i = 0;
+   for (; i + 16 <= count; i += 16) {
+      __m128i r8 = _mm_loadu_si128((const __m128i *)(r + i));
+      __m128i g8 = _mm_loadu_si128((const __m128i *)(g + i));
+      __m128i b8 = _mm_loadu_si128((const __m128i *)(b + i));
+      __m128i low = grey16_sse2(
+         _mm_unpacklo_epi8(r8, zero),
+         _mm_unpacklo_epi8(g8, zero),
+         _mm_unpacklo_epi8(b8, zero),
+         mode,
+         max_value
+      );
+      __m128i high = grey16_sse2(
+         _mm_unpackhi_epi8(r8, zero),
+         _mm_unpackhi_epi8(g8, zero),
+         _mm_unpackhi_epi8(b8, zero),
+         mode,
+         max_value
+      );
+      _mm_storeu_si128((__m128i *)(grey + i), _mm_packus_epi16(low, high));
+   }
+   grey8_scalar(r + i, g + i, b + i, grey + i, count - i, mode, max_value);
+}
+
+__attribute__((target("sse2")))
+static __m128i grey16_sse2(
+   __m128i r,
+   __m128i g,
+   __m128i b,
+   int mode,
+   uint16_t max_value
+) {
+   __m128i value;
+   if (mode == 1) {
+      __m128i sum = _mm_add_epi16(_mm_add_epi16(r, g), b);
+      sum = _mm_add_epi16(sum, _mm_set1_epi16(1));
+      value = _mm_mulhi_epu16(sum, _mm_set1_epi16((short)DIVIDE_BY_3));
+      value = _mm_srli_epi16(value, 1);
+   } else {
+      const __m128i red_green = _mm_set1_epi32(LUMA_GREEN << 16 | LUMA_RED);
+      const __m128i blue_half = _mm_set1_epi32(
+         LUMA_SCALE / 2 << 16 | LUMA_BLUE
+      );
+      const __m128i one = _mm_set1_epi16(1);
+      __m128i low = _mm_add_epi32(
+         _mm_madd_epi16(_mm_unpacklo_epi16(r, g), red_green),
+         _mm_madd_epi16(_mm_unpacklo_epi16(b, one), blue_half)
+      );
+      __m128i high = _mm_add_epi32(
+         _mm_madd_epi16(_mm_unpackhi_epi16(r, g), red_green),
+         _mm_madd_epi16(_mm_unpackhi_epi16(b, one), blue_half)
+      );
+      value = _mm_packs_epi32(_mm_srli_epi32(low, 3), _mm_srli_epi32(high, 3));
+      value = _mm_mulhi_epu16(value, _mm_set1_epi16((short)DIVIDE_BY_125));
+      value = _mm_srli_epi16(value, 6);
+   }
+   if (max_value == PGM_MAX_VALUE) return value;
+   return scale16_sse2(value, max_value);
+}
+
+__attribute__((target("sse2")))
+static __m128i scale16_sse2(__m128i value, uint16_t max_value) {
+   const __m128i zero = _mm_setzero_si128();
+   const __m128 divisor = _mm_set1_ps(max_value);
+   value = _mm_mullo_epi16(value, _mm_set1_epi16(PGM_MAX_VALUE));
+   value = _mm_add_epi16(value, _mm_set1_epi16(max_value / 2));
+   __m128 low = _mm_cvtepi32_ps(_mm_unpacklo_epi16(value, zero));
+   __m128 high = _mm_cvtepi32_ps(_mm_unpackhi_epi16(value, zero));
+   return _mm_packs_epi32(
+      _mm_cvttps_epi32(_mm_div_ps(low, divisor)),
+      _mm_cvttps_epi32(_mm_div_ps(high, divisor))
+   );
+}
+
+__attribute__((target("sse2")))
+static void threshold8_sse2(
+   const uint8_t *samples,
+   uint8_t *bits,
+   size_t count,
+   uint8_t threshold
+) {
+   const __m128i minimum = _mm_set1_epi8((char)threshold);
+   size_t i = 0;
+   for (; i + 16 <= count; i += 16) {
+      __m128i vector = _mm_loadu_si128((const __m128i *)(samples + i));
+      __m128i set = _mm_cmpeq_epi8(_mm_max_epu8(vector, minimum), vector);
+      unsigned int mask = (unsigned int)_mm_movemask_epi8(set);
+      bits[i / 8] = REVERSED_BITS[mask & 0xFF];
+      bits[i / 8 + 1] = REVERSED_BITS[mask >> 8];
+   }
+   threshold8_scalar(samples + i, bits + i / 8, count - i, threshold);
+}
+
+__attribute__((target("sse2")))
+static void transpose8_sse2(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   size_t r = 0;
+   for (; r + 16 <= rows; r += 16) {
+      const uint8_t *in = BLOCK_ROW(const uint8_t, source, source_stride, r);
+      uint8_t *out = target + r;
+      size_t c = 0;
+      for (; c + 16 <= columns; c += 16) {
+         __m128i block[16];
+         for (int i = 0; i < 16; ++i) {
+            block[i] = _mm_loadu_si128(
+               BLOCK_ROW(const __m128i, in + c, source_stride, i)
+            );
+         }
+         transpose_block8_sse2(block);
+         for (int i = 0; i < 16; ++i) {
+            _mm_storeu_si128(
+               BLOCK_ROW(__m128i, out, target_stride, c + i),
+               block[i]
+            );
+         }
+      }
+      transpose8_scalar(
+         in + c,
+         source_stride,
+         BLOCK_ROW(uint8_t, out, target_stride, c),
+         target_stride,
+         16,
+         columns - c
+      );
+   }
+   transpose8_scalar(
+      BLOCK_ROW(const uint8_t, source, source_stride, r),
+      source_stride,
+      target + r,
+      target_stride,
+      rows - r,
+      columns
+   );
+}
+
+__attribute__((target("sse2")))
+static void transpose16_sse2(
+   const uint16_t *source,
+   ptrdiff_t source_stride,
+   uint16_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   size_t r = 0;
+   for (; r + 8 <= rows; r += 8) {
+      const uint16_t *in = BLOCK_ROW(const uint16_t, source, source_stride, r);
+      uint16_t *out = target + r;
+      size_t c = 0;
+      for (; c + 8 <= columns; c += 8) {
+         __m128i block[8];
+         __m128i next[8];
+         for (int i = 0; i < 8; ++i) {
+            block[i] = _mm_loadu_si128(
+               BLOCK_ROW(const __m128i, in + c, source_stride, i)
+            );
+         }
+         for (int stage = 0; stage < 3; ++stage) {
+            for (int i = 0; i < 4; ++i) {
+               next[2 * i] = _mm_unpacklo_epi16(block[i], block[i + 4]);
+               next[2 * i + 1] = _mm_unpackhi_epi16(block[i], block[i + 4]);
+            }
+            memcpy(block, next, sizeof(block));
+         }
+         for (int i = 0; i < 8; ++i) {
+            _mm_storeu_si128(
+               BLOCK_ROW(__m128i, out, target_stride, c + i),
+               block[i]
+            );
+         }
+      }
+      transpose16_scalar(
+         in + c,
+         source_stride,
+         BLOCK_ROW(uint16_t, out, target_stride, c),
+         target_stride,
+         8,
+         columns - c
+      );
+   }
+   transpose16_scalar(
+      BLOCK_ROW(const uint16_t, source, source_stride, r),
+      source_stride,
+      target + r,
+      target_stride,
+      rows - r,
+      columns
+   );
+}
+
+__attribute__((target("sse2")))
+static void transpose24_sse2(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   // Blocks of 16 x 16 pixels are split into three planes of 16 x 16 bytes,
+   // two rows at a time, transposed as in transpose8_sse2, then merged back
+   // two target rows at a time.
+   size_t r = 0;
+   for (; r + 16 <= rows; r += 16) {
+      const uint8_t *in = BLOCK_ROW(const uint8_t, source, source_stride, r);
+      uint8_t *out = target + 3 * r;
+      size_t c = 0;
+      for (; c + 16 <= columns; c += 16) {
+         __m128i planes[3][16];
+         for (int i = 0; i < 16; i += 2) {
+            __m128i v[6];
+            for (int k = 0; k < 6; ++k) {
+               v[k] = _mm_loadu_si128(
+                  (const __m128i *)(BLOCK_ROW(
+                     const uint8_t,
+                     in + 3 * c,
+                     source_stride,
+                     i + k / 3
+                  ) + 16 * (k % 3))
+               );
+            }
+            deinterleave48_sse2(v);
+            for (int a = 0; a < 3; ++a) {
+               planes[a][i] = v[2 * a];
+               planes[a][i + 1] = v[2 * a + 1];
+            }
+         }
+         for (int a = 0; a < 3; ++a) transpose_block8_sse2(planes[a]);
+         for (int i = 0; i < 16; i += 2) {
+            __m128i v[6];
+            for (int a = 0; a < 3; ++a) {
+               v[2 * a] = planes[a][i];
+               v[2 * a + 1] = planes[a][i + 1];
+            }
+            interleave48_sse2(v);
+            for (int k = 0; k < 6; ++k) {
+               _mm_storeu_si128(
+                  (__m128i *)(BLOCK_ROW(
+                     uint8_t,
+                     out,
+                     target_stride,
+                     c + i + k / 3
+                  ) + 16 * (k % 3)),
+                  v[k]
+               );
+            }
+         }
+      }
+      transpose24_scalar(
+         in + 3 * c,
+         source_stride,
+         BLOCK_ROW(uint8_t, out, target_stride, c),
+         target_stride,
+         16,
+         columns - c
+      );
+   }
+   transpose24_scalar(
+      BLOCK_ROW(const uint8_t, source, source_stride, r),
+      source_stride,
+      target + 3 * r,
+      target_stride,
+      rows - r,
+      columns
+   );
+}
+
+__attribute__((target("sse2")))
+static void transpose_block8_sse2(__m128i block[16]) {
+   // Each stage interleaves rows i and i + 8, which rotates by one bit the
+   // index of each byte, row then column. After four stages, the row and the
+   // column are swapped.
+   __m128i next[16];
+   for (int stage = 0; stage < 4; ++stage) {
+      for (int i = 0; i < 8; ++i) {
+         next[2 * i] = _mm_unpacklo_epi8(block[i], block[i + 8]);
+         next[2 * i + 1] = _mm_unpackhi_epi8(block[i], block[i + 8]);
+      }
+      memcpy(block, next, sizeof(next));
+   }
+}
+
+__attribute__((target("sse2")))
+static void deinterleave48_sse2(__m128i v[6]) {
+   // Each layer interleaves vectors k and k + 3, which rotates by one step
+   // the index of each byte among the 96 bytes. After five layers, the
+   // bytes are sorted by channel, then by row, then by pixel.
+   __m128i next[6];
+   for (int layer = 0; layer < 5; ++layer) {
+      for (int k = 0; k < 3; ++k) {
+         next[2 * k] = _mm_unpacklo_epi8(v[k], v[k + 3]);
+         next[2 * k + 1] = _mm_unpackhi_epi8(v[k], v[k + 3]);
+      }
+      memcpy(v, next, sizeof(next));
+   }
+}
+
+__attribute__((target("sse2")))
+static void interleave48_sse2(__m128i v[6]) {
+   // Each layer gathers the even bytes of vectors 2k and 2k + 1 into vector
+   // k, and their odd bytes into vector k + 3, undoing a layer of
+   // deinterleave48_sse2.
+   const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+   __m128i next[6];
+   for (int layer = 0; layer < 5; ++layer) {
+      for (int k = 0; k < 3; ++k) {
+         next[k] = _mm_packus_epi16(
+            _mm_and_si128(v[2 * k], low_bytes),
+            _mm_and_si128(v[2 * k + 1], low_bytes)
+         );
+         next[k + 3] = _mm_packus_epi16(
+            _mm_srli_epi16(v[2 * k], 8),
+            _mm_srli_epi16(v[2 * k + 1], 8)
+         );
+      }
+      memcpy(v, next, sizeof(next));
+   }
+}
+
+__attribute__((target("sse2")))
+static void transpose32_sse2(
+   const uint32_t *source,
+   ptrdiff_t source_stride,
+   uint32_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   size_t r = 0;
+   for (; r + 4 <= rows; r += 4) {
+      const uint32_t *in = BLOCK_ROW(const uint32_t, source, source_stride, r);
+      uint32_t *out = target + r;
+      size_t c = 0;
+      for (; c + 4 <= columns; c += 4) {
+         __m128i block[4];
+         __m128i next[4];
+         for (int i = 0; i < 4; ++i) {
+            block[i] = _mm_loadu_si128(
+               BLOCK_ROW(const __m128i, in + c, source_stride, i)
+            );
+         }
+         for (int stage = 0; stage < 2; ++stage) {
+            for (int i = 0; i < 2; ++i) {
+               next[2 * i] = _mm_unpacklo_epi32(block[i], block[i + 2]);
+               next[2 * i + 1] = _mm_unpackhi_epi32(block[i], block[i + 2]);
+            }
+            memcpy(block, next, sizeof(block));
+         }
+         for (int i = 0; i < 4; ++i) {
+            _mm_storeu_si128(
+               BLOCK_ROW(__m128i, out, target_stride, c + i),
+               block[i]
+            );
+         }
+      }
+      transpose32_scalar(
+         in + c,
+         source_stride,
+         BLOCK_ROW(uint32_t, out, target_stride, c),
+         target_stride,
+         4,
+         columns - c
+      );
+   }
+   transpose32_scalar(
+      BLOCK_ROW(const uint32_t, source, source_stride, r),
+      source_stride,
+      target + r,
+      target_stride,
+      rows - r,
+      columns
+   );
+}
+
+/* ======= AVX2 ======= */
+
+__attribute__((target("avx2")))
+static void negate8_avx2(uint8_t *samples, size_t count, uint8_t max_value) {
+   const __m256i max = _mm256_set1_epi8((char)max_value);
+   size_t i = 0;
+   for (; i + 32 <= count; i += 32) {
+      __m256i *vector = (__m256i *)(samples + i);
+      _mm256_storeu_si256(
+         vector,
+         _mm256_sub_epi8(max, _mm256_loadu_si256(vector))
+      );
+   }
+   negate8_scalar(samples + i, count - i, max_value);
+}
+
+__attribute__((target("avx2")))
+static void keep_channel8_avx2(
+   uint8_t *samples,
+   size_t count,
+   unsigned int channel
+) {
+   uint8_t pattern[3 * 32];
+   for (size_t j = 0; j < sizeof(pattern); ++j) {
+      pattern[j] = j % 3 == channel ? 0xFF : 0;
+   }
+   __m256i masks[3];
+   for (int k = 0; k < 3; ++k) {
+      masks[k] = _mm256_loadu_si256((const __m256i *)(pattern + 32 * k));
+   }
+
+   size_t i = 0;
+   for (; i + 32 <= count; i += 32) {
+      __m256i *block = (__m256i *)(samples + 3 * i);
+      for (int k = 0; k < 3; ++k) {
+         __m256i vector = _mm256_loadu_si256(block + k);
+         _mm256_storeu_si256(block + k, _mm256_and_si256(vector, masks[k]));
+      }
+   }
+   keep_channel8_scalar(samples + 3 * i, count - i, channel);
+}
+
+__attribute__((target("avx2")))
+static void grey8_avx2(
+   const uint8_t *r,
+   const uint8_t *g,
+   const uint8_t *b,
+   uint8_t *grey,
+   size_t count,
+   int mode,
+   uint16_t max_value
+) {
+   const __m256i zero = _mm256_setzero_si256();
+   size_t i = 0;
+   for (; i + 32 <= count; i += 32) {
+      __m256i r8 = _mm256_loadu_si256((const __m256i *)(r + i));
+      __m256i g8 = _mm256_loadu_si256((const __m256i *)(g + i));
+      __m256i b8 = _mm256_loadu_si256((const __m256i *)(b + i));
+      __m256i low = grey16_avx2(
+         _mm256_unpacklo_epi8(r8, zero),
+         _mm256_unpacklo_epi8(g8, zero),
+         _mm256_unpacklo_epi8(b8, zero),
+         mode,
+         max_value
+      );
+      __m256i high = grey16_avx2(
+         _mm256_unpackhi_epi8(r8, zero),
+         _mm256_unpackhi_epi8(g8, zero),
+         _mm256_unpackhi_epi8(b8, zero),
+         mode,
+         max_value
+      );
+      _mm256_storeu_si256(
+         (__m256i *)(grey + i),
+         _mm256_packus_epi16(low, high)
+      );
+   }
+   grey8_scalar(r + i, g + i, b + i, grey + i, count - i, mode, max_value);
+}
+
+__attribute__((target("avx2")))
+static __m256i grey16_avx2(
+   __m256i r,
+   __m256i g,
+   __m256i b,
+   int mode,
+   uint16_t max_value
+) {
+   __m256i value;
+   if (mode == 1) {
+      __m256i sum = _mm256_add_epi16(_mm256_add_epi16(r, g), b);
+      sum = _mm256_add_epi16(sum, _mm256_set1_epi16(1));
+      value = _mm256_mulhi_epu16(sum, _mm256_set1_epi16((short)DIVIDE_BY_3));
+      value = _mm256_srli_epi16(value, 1);
+   } else {
+      const __m256i red_green = _mm256_set1_epi32(LUMA_GREEN << 16 | LUMA_RED);
+      const __m256i blue_half = _mm256_set1_epi32(
+         LUMA_SCALE / 2 << 16 | LUMA_BLUE
+      );
+      const __m256i one = _mm256_set1_epi16(1);
+      __m256i low = _mm256_add_epi32(
+         _mm256_madd_epi16(_mm256_unpacklo_epi16(r, g), red_green),
+         _mm256_madd_epi16(_mm256_unpacklo_epi16(b, one), blue_half)
+      );
+      __m256i high = _mm256_add_epi32(
+         _mm256_madd_epi16(_mm256_unpackhi_epi16(r, g), red_green),
+         _mm256_madd_epi16(_mm256_unpackhi_epi16(b, one), blue_half)
+      );
+      value = _mm256_packs_epi32(
+         _mm256_srli_epi32(low, 3),
+         _mm256_srli_epi32(high, 3)
+      );
+      value = _mm256_mulhi_epu16(
+         value,
+         _mm256_set1_epi16((short)DIVIDE_BY_125)
+      );
+      value = _mm256_srli_epi16(value, 6);
+   }
+   if (max_value == PGM_MAX_VALUE) return value;
+   return scale16_avx2(value, max_value);
+}
+
+__attribute__((target("avx2")))
+static __m256i scale16_avx2(__m256i value, uint16_t max_value) {
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256 divisor = _mm256_set1_ps(max_value);
+   value = _mm256_mullo_epi16(value, _mm256_set1_epi16(PGM_MAX_VALUE));
+   value = _mm256_add_epi16(value, _mm256_set1_epi16(max_value / 2));
+   __m256 low = _mm256_cvtepi32_ps(_mm256_unpacklo_epi16(value, zero));
+   __m256 high = _mm256_cvtepi32_ps(_mm256_unpackhi_epi16(value, zero));
+   return _mm256_packs_epi32(
+      _mm256_cvttps_epi32(_mm256_div_ps(low, divisor)),
+      _mm256_cvttps_epi32(_mm256_div_ps(high, divisor))
+   );
+}
+
+__attribute__((target("avx2")))
+static void threshold8_avx2(
+   const uint8_t *samples,
+   uint8_t *bits,
+   size_t count,
+   uint8_t threshold
+) {
+   const __m256i minimum = _mm256_set1_epi8((char)threshold);
+   size_t i = 0;
+   for (; i + 32 <= count; i += 32) {
+      __m256i vector = _mm256_loadu_si256((const __m256i *)(samples + i));
+      __m256i set = _mm256_cmpeq_epi8(
+         _mm256_max_epu8(vector, minimum),
+         vector
+      );
+      uint32_t mask = (uint32_t)_mm256_movemask_epi8(set);
+      for (int k = 0; k < 4; ++k) {
+         bits[i / 8 + k] = REVERSED_BITS[(mask >> (8 * k)) & 0xFF];
+      }
+   }
+   threshold8_scalar(samples + i, bits + i / 8, count - i, threshold);
+}
+
+/* ======= AVX-512 ======= */
+
+__attribute__((target("avx512f,avx512bw")))
+static void negate8_avx512(uint8_t *samples, size_t count, uint8_t max_value) {
+   const __m512i max = _mm512_set1_epi8((char)max_value);
+   size_t i = 0;
+   for (; i + 64 <= count; i += 64) {
+      void *vector = samples + i;
+      _mm512_storeu_si512(
+         vector,
+         _mm512_sub_epi8(max, _mm512_loadu_si512(vector))
+      );
+   }
+   negate8_scalar(samples + i, count - i, max_value);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void keep_channel8_avx512(
+   uint8_t *samples,
+   size_t count,
+   unsigned int channel
+) {
+   uint8_t pattern[3 * 64];
+   for (size_t j = 0; j < sizeof(pattern); ++j) {
+      pattern[j] = j % 3 == channel ? 0xFF : 0;
+   }
+   __m512i masks[3];
+   for (int k = 0; k < 3; ++k) masks[k] = _mm512_loadu_si512(pattern + 64 * k);
+
+   size_t i = 0;
+   for (; i + 64 <= count; i += 64) {
+      uint8_t *block = samples + 3 * i;
+      for (int k = 0; k < 3; ++k) {
+         __m512i vector = _mm512_loadu_si512(block + 64 * k);
+         vector = _mm512_and_si512(vector, masks[k]);
+         _mm512_storeu_si512(block + 64 * k, vector);
+      }
+   }
+   keep_channel8_scalar(samples + 3 * i, count - i, channel);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void grey8_avx512(
+   const uint8_t *r,
+   const uint8_t *g,
+   const uint8_t *b,
+   uint8_t *grey,
+   size_t count,
+   int mode,
+   uint16_t max_value
+) {
+   const __m512i zero = _mm512_setzero_si512();
+   size_t i = 0;
+   for (; i + 64 <= count; i += 64) {
+      __m512i r8 = _mm512_loadu_si512(r + i);
+      __m512i g8 = _mm512_loadu_si512(g + i);
+      __m512i b8 = _mm512_loadu_si512(b + i);
+      __m512i low = grey16_avx512(
+         _mm512_unpacklo_epi8(r8, zero),
+         _mm512_unpacklo_epi8(g8, zero),
+         _mm512_unpacklo_epi8(b8, zero),
+         mode,
+         max_value
+      );
+      __m512i high = grey16_avx512(
+         _mm512_unpackhi_epi8(r8, zero),
+         _mm512_unpackhi_epi8(g8, zero),
+         _mm512_unpackhi_epi8(b8, zero),
+         mode,
+         max_value
+      );
+      _mm512_storeu_si512(grey + i, _mm512_packus_epi16(low, high));
+   }
+   grey8_scalar(r + i, g + i, b + i, grey + i, count - i, mode, max_value);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static __m512i grey16_avx512(
+   __m512i r,
+   __m512i g,
+   __m512i b,
+   int mode,
+   uint16_t max_value
+) {
+   __m512i value;
+   if (mode == 1) {
+      __m512i sum = _mm512_add_epi16(_mm512_add_epi16(r, g), b);
+      sum = _mm512_add_epi16(sum, _mm512_set1_epi16(1));
+      value = _mm512_mulhi_epu16(sum, _mm512_set1_epi16((short)DIVIDE_BY_3));
+      value = _mm512_srli_epi16(value, 1);
+   } else {
+      const __m512i red_green = _mm512_set1_epi32(LUMA_GREEN << 16 | LUMA_RED);
+      const __m512i blue_half = _mm512_set1_epi32(
+         LUMA_SCALE / 2 << 16 | LUMA_BLUE
+      );
+      const __m512i one = _mm512_set1_epi16(1);
+      __m512i low = _mm512_add_epi32(
+         _mm512_madd_epi16(_mm512_unpacklo_epi16(r, g), red_green),
+         _mm512_madd_epi16(_mm512_unpacklo_epi16(b, one), blue_half)
+      );
+      __m512i high = _mm512_add_epi32(
+         _mm512_madd_epi16(_mm512_unpackhi_epi16(r, g), red_green),
+         _mm512_madd_epi16(_mm512_unpackhi_epi16(b, one), blue_half)
+      );
+      value = _mm512_packs_epi32(
+         _mm512_srli_epi32(low, 3),
+         _mm512_srli_epi32(high, 3)
+      );
+      value = _mm512_mulhi_epu16(
+         value,
+         _mm512_set1_epi16((short)DIVIDE_BY_125)
+      );
+      value = _mm512_srli_epi16(value, 6);
+   }
+   if (max_value == PGM_MAX_VALUE) return value;
+   return scale16_avx512(value, max_value);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static __m512i scale16_avx512(__m512i value, uint16_t max_value) {
+   const __m512i zero = _mm512_setzero_si512();
+   const __m512 divisor = _mm512_set1_ps(max_value);
+   value = _mm512_mullo_epi16(value, _mm512_set1_epi16(PGM_MAX_VALUE));
+   value = _mm512_add_epi16(value, _mm512_set1_epi16(max_value / 2));
+   __m512 low = _mm512_cvtepi32_ps(_mm512_unpacklo_epi16(value, zero));
+   __m512 high = _mm512_cvtepi32_ps(_mm512_unpackhi_epi16(value, zero));
+   return _mm512_packs_epi32(
+      _mm512_cvttps_epi32(_mm512_div_ps(low, divisor)),
+      _mm512_cvttps_epi32(_mm512_div_ps(high, divisor))
+   );
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void threshold8_avx512(
+   const uint8_t *samples,
+   uint8_t *bits,
+   size_t count,
+   uint8_t threshold
+) {
+   const __m512i minimum = _mm512_set1_epi8((char)threshold);
+   size_t i = 0;
+   for (; i + 64 <= count; i += 64) {
+      __m512i vector = _mm512_loadu_si512(samples + i);
+      uint64_t mask = _mm512_cmpge_epu8_mask(vector, minimum);
+      for (int k = 0; k < 8; ++k) {
+         bits[i / 8 + k] = REVERSED_BITS[(mask >> (8 * k)) & 0xFF];
+      }
+   }
+   threshold8_scalar(samples + i, bits + i / 8, count - i, threshold);
+}
+
+#endif // KERNEL_X86
@@ -0,0 +1,281 @@
+/**
+ * @file kernel.h
+ * @brief Header file for the sample kernels used by the filters.
+ *
+ * Each kernel works on a run of 8-bit samples, or on a block of samples for
+ * the transposes, and has a scalar version and SSE2, AVX2 and AVX-512
+ * versions on x86 processors. The most capable version supported by the
+ * processor is selected at runtime through CPUID. Every version gives the
+ * same bytes as the scalar one.
+ *
+ * The transposes move blocks of 16 x 16 bytes, 8 x 8 words or 4 x 4 double
+ * words through registers, and blocks of 16 x 16 pixels of three bytes as
+ * three planes of bytes; the AVX2 and AVX-512 levels use their SSE2
+ * version, whose blocks already fill the cache lines they are written to.
+ *
+ * @author Pavlov Aleksandr (s2400691)
+ * @date 24.03.2025
+*/
+
+#ifndef _KERNEL_H
+#define _KERNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ======= Enums ======= */
+
+/**
+ * @brief Enum for the instruction sets the kernels are written for, from
+ *        the least to the most capable.
+ */
+typedef enum KernelLevel_t {
+   KERNEL_SCALAR,
+   KERNEL_SSE2,
+   KERNEL_AVX2,
+   KERNEL_AVX512
+} KernelLevel;
+
+/* ======= Function Prototypes ======= */
+
+/**
+ * @brief Retrieves the most capable kernel level supported by the processor.
+ *
+ * @return
+ *     Kernel level, KERNEL_SCALAR on other processors than x86
+ */
+KernelLevel kernel_best_level(void);
+
+/**
+ * @brief Retrieves the kernel level in use.
+ *
+ * @return
+ *     Kernel level, kernel_best_level until kernel_set_level is called
+ */
+KernelLevel kernel_get_level(void);
+
+/**
+ * @brief Selects the kernel level to use.
+ *
+ * Used to compare the levels with each other. Must not be called while
+ * kernels are running.
+ *
+ * @param level Kernel level.
+ *
+ * @return
+ *     0: Success
+ *    -1: Level not supported by the processor
+ */
+int kernel_set_level(KernelLevel level);
+
+/**
+ * @brief Retrieves the name of a kernel level.
+ *
+ * @param level Kernel level.
+ *
+ * @return
+ *     Name of the level, such as "avx2"
+ */
+const char *kernel_level_name(KernelLevel level);
+
+/**
+ * @brief Computes the gray level of a pixel.
+ *
+ * This is the reference of the gray levels, computed with integers only.
+ * The level is, in exact arithmetic, rounded half up:
+ *    - mode 1: the mean (r + g + b) / 3;
+ *    - mode 2: the luma of ITU-R BT.601, 0.299 r + 0.587 g + 0.114 b;
+ * then scaled to the range of PGM images by scale_sample.
+ *
+ * @param r Red sample.
+ * @param g Green sample.
+ * @param b Blue sample.
+ * @param mode Grayscale method, 1 or 2.
+ * @param max_value Maximum pixel value of the image.
+ *
+ * @pre Samples at most max_value
+ *
+ * @return
+ *     Gray level between 0 and 255
+ */
+uint8_t grey_sample(int r, int g, int b, int mode, uint16_t max_value);
+
+/**
+ * @brief Scales a sample to the range of PGM images.
+ *
+ * The result is value * 255 / max_value in exact arithmetic, rounded half
+ * up, for any depth.
+ *
+ * @param value Sample.
+ * @param max_value Maximum pixel value of the image.
+ *
+ * @pre value <= max_value
+ *
+ * @return
+ *     Sample between 0 and 255
+ */
+uint8_t scale_sample(uint16_t value, uint16_t max_value);
+
+/**
+ * @brief Replaces samples by their difference with a maximum value.
+ *
+ * @param samples Pointer to the samples.
+ * @param count Number of samples.
+ * @param max_value Maximum value of the samples.
+ *
+ * @pre samples != NULL
+ */
+void kernel_negate8(uint8_t *samples, size_t count, uint8_t max_value);
+
+/**
+ * @brief Zeroes all the channels of RGB pixels but one.
+ *
+ * @param samples Pointer to the samples of the pixels, three per pixel.
+ * @param count Number of pixels.
+ * @param channel Index of the channel to keep, 0 to 2.
+ *
+ * @pre samples != NULL
+ */
+void kernel_keep_channel8(
+   uint8_t *samples,
+   size_t count,
+   unsigned int channel
+);
+
+/**
+ * @brief Computes the gray levels of pixels given as three planes.
+ *
+ * @param r Pointer to the red samples.
+ * @param g Pointer to the green samples.
+ * @param b Pointer to the blue samples.
+ * @param grey Pointer to store the gray levels, see grey_sample.
+ * @param count Number of pixels.
+ * @param mode Grayscale method, 1 or 2.
+ * @param max_value Maximum pixel value of the image, at most 255.
+ *
+ * @pre r != NULL, g != NULL, b != NULL, grey != NULL, samples at most
+ *      max_value
+ */
+void kernel_grey8(
+   const uint8_t *r,
+   const uint8_t *g,
+   const uint8_t *b,
+   uint8_t *grey,
+   size_t count,
+   int mode,
+   uint16_t max_value
+);
+
+/**
+ * @brief Packs samples into bits, set for the samples at least a threshold.
+ *
+ * Bits are packed eight per byte, most significant bit first; the padding
+ * bits of the last byte are cleared.
+ *
+ * @param samples Pointer to the samples.
+ * @param bits Pointer to store the (count + 7) / 8 bytes of bits.
+ * @param count Number of samples.
+ * @param threshold Lowest sample whose bit is set.
+ *
+ * @pre samples != NULL, bits != NULL
+ */
+void kernel_threshold8(
+   const uint8_t *samples,
+   uint8_t *bits,
+   size_t count,
+   uint8_t threshold
+);
+
+/**
+ * @brief Transposes a block of 8-bit samples.
+ *
+ * Row c of the target receives column c of the source. Strides are in bytes
+ * and may be negative, so that the rows of either block are walked from the
+ * last one.
+ *
+ * @param source Pointer to the first row of the source.
+ * @param source_stride Number of bytes from a row of the source to the next.
+ * @param target Pointer to the first row of the target.
+ * @param target_stride Number of bytes from a row of the target to the next.
+ * @param rows Number of rows of the source.
+ * @param columns Number of columns of the source.
+ *
+ * @pre source != NULL, target != NULL, the blocks do not overlap
+ */
+void kernel_transpose8(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+);
+
+/**
+ * @brief Transposes a block of 16-bit samples, see kernel_transpose8.
+ *
+ * @param source Pointer to the first row of the source.
+ * @param source_stride Number of bytes from a row of the source to the next.
+ * @param target Pointer to the first row of the target.
+ * @param target_stride Number of bytes from a row of the target to the next.
+ * @param rows Number of rows of the source.
+ * @param columns Number of columns of the source.
+ *
+ * @pre source != NULL, target != NULL, the blocks do not overlap, pointers
+ *      and strides aligned on 2 bytes
+ */
+void kernel_transpose16(
+   const uint16_t *source,
+   ptrdiff_t source_stride,
+   uint16_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+);
+
+/**
+ * @brief Transposes a block of pixels of three 8-bit samples, such as PPM
+ *        pixels, see kernel_transpose8.
+ *
+ * @param source Pointer to the first row of the source.
+ * @param source_stride Number of bytes from a row of the source to the next.
+ * @param target Pointer to the first row of the target.
+ * @param target_stride Number of bytes from a row of the target to the next.
+ * @param rows Number of rows of the source.
+ * @param columns Number of columns of the source.
+ *
+ * @pre source != NULL, target != NULL, the blocks do not overlap
+ */
+void kernel_transpose24(
+   const uint8_t *source,
+   ptrdiff_t source_stride,
+   uint8_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+);
+
+/**
+ * @brief Transposes a block of 32-bit values, such as pixels of four 8-bit
+ *        samples, see kernel_transpose8.
+ *
+ * @param source Pointer to the first row of the source.
+ * @param source_stride Number of bytes from a row of the source to the next.
+ * @param target Pointer to the first row of the target.
+ * @param target_stride Number of bytes from a row of the target to the next.
+ * @param rows Number of rows of the source.
+ * @param columns Number of columns of the source.
+ *
+ * @pre source != NULL, target != NULL, the blocks do not overlap, pointers
+ *      and strides aligned on 4 bytes
+ */
+void kernel_transpose32(
+   const uint32_t *source,
+   ptrdiff_t source_stride,
+   uint32_t *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+);
+
+#endif // _KERNEL_H
@@ -3,20 +3,24 @@
  * @brief A program to manipulate PNM format files by applying various filters.
  *
  * Supported formats:
- * - PBM (Portable Bitmap)
- * - PGM (Portable Graymap)
- * - PPM (Portable Pixmap)
+ * - PBM (Portable Bitmap), ASCII (P1) and raw (P4)
+ * - PGM (Portable Graymap), ASCII (P2) and raw (P5)
+ * - PPM (Portable Pixmap), ASCII (P3) and raw (P6)
+ * - PAM (Portable Arbitrary Map), raw (P7)
  *
  * @author Pavlov Aleksandr (s2400691)
  * @date 24.03.2025
  * @version 1.0.0
  */
 
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <strings.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "pnm.h"
 #include "filter.h"
@@ -25,17 +29,33 @@
 #define VERSION "1.0.0"
 #define AUTHORS "Pavlov Aleksandr (s2400691)"
 
+#define STREAM_BATCH_SAMPLES (1 << 20)
+
+#define STANDARD_STREAM "-"
+
 
 enum {
    GETOPT_HELP_CHAR = (CHAR_MIN - 2),
    GETOPT_VERSION_CHAR = (CHAR_MIN - 3),
+   GETOPT_MMAP_CHAR = (CHAR_MIN - 4),
+   GETOPT_FRAMES_CHAR = (CHAR_MIN - 5),
+   GETOPT_EXPLAIN_CHAR = (CHAR_MIN - 6),
 };
 
+static char const shortopts[] = "i:o:f:p:arst:";
+
 static struct option const longopts[] = {
    {"input", required_argument, NULL, 'i'},
    {"output", required_argument, NULL, 'o'},
    {"filtre", required_argument, NULL, 'f'},
    {"parametres", required_argument, NULL, 'p'},
+   {"ascii", no_argument, NULL, 'a'},
+   {"raw", no_argument, NULL, 'r'},
+   {"stream", no_argument, NULL, 's'},
+   {"threads", required_argument, NULL, 't'},
+   {"mmap", no_argument, NULL, GETOPT_MMAP_CHAR},
+   {"frames", no_argument, NULL, GETOPT_FRAMES_CHAR},
+   {"explain", no_argument, NULL, GETOPT_EXPLAIN_CHAR},
    {"help", no_argument, NULL, GETOPT_HELP_CHAR},
    {"version", no_argument, NULL, GETOPT_VERSION_CHAR},
    {NULL, no_argument, NULL, 0},
@@ -55,13 +75,130 @@ const char *program_name;
  */
 static void usage(int status);
 
+/**
+ * @brief Applies the filters named on the command line to an image.
+ *
+ * @param image Pointer to the PNM image.
+ * @param chain Pointer to the chain of filters, NULL for no filter.
+ *
+ * @return
+ *     Result code of the chain
+ */
+static int apply_filter(PNM *image, FilterChain *chain);
+
+/**
+ * @brief Tells whether filters only need one row at a time.
+ *
+ * @param chain Pointer to the chain of filters, NULL for no filter.
+ *
+ * @return
+ *     1 if the filters can be applied on batches of rows
+ *     0 otherwise
+ */
+static int is_row_filter(FilterChain *chain);
+
+/**
+ * @brief Reports an error in the filters named on the command line and
+ *        exits the program.
+ *
+ * Does nothing if the filters were parsed.
+ *
+ * @param parse_code Result code of filter_chain_parse.
+ * @param filter_string Filters.
+ * @param parameter_string Common parameter of the filters, may be NULL.
+ */
+static void check_filter_chain(
+   int parse_code,
+   const char *filter_string,
+   const char *parameter_string
+);
+
+/**
+ * @brief Reports a filter error and exits the program.
+ *
+ * Does nothing if the filter succeeded.
+ *
+ * @param result_code Result code of the filter.
+ */
+static void check_filter_result(int result_code);
+
+/**
+ * @brief Reports an error returned while loading an image.
+ *
+ * @param load_code Error code of the loading function.
+ * @param filename Name of the input file.
+ */
+static void report_load_error(int load_code, const char *filename);
+
+/**
+ * @brief Reports an error returned while writing an image.
+ *
+ * @param write_code Error code of the writing function.
+ * @param filename Name of the output file.
+ */
+static void report_write_error(int write_code, const char *filename);
+
+/**
+ * @brief Writes the rows of a batch as 16-bit samples.
+ *
+ * Packed rows are written at once; padded rows, as left by filters, one at
+ * a time.
+ *
+ * @param writer Pointer to the writer.
+ * @param batch Pointer to the batch of rows.
+ *
+ * @return
+ *     Result code of pnm_write_rows
+ */
+static int write_batch(PNMWriter *writer, PNM *batch);
+
+/**
+ * @brief Filters an image one batch of rows at a time.
+ *
+ * Memory use is bounded by STREAM_BATCH_SAMPLES, whatever the size of the
+ * image.
+ *
+ * @param input_filename Name of the input file.
+ * @param output_filename Name of the output file.
+ * @param chain Pointer to a chain of row filters, NULL for no filter.
+ * @param output_encoding Encoding of the output, -1 to keep the input one.
+ *
+ * @return int Exit status of the program.
+ */
+static int stream_image(
+   const char *input_filename,
+   const char *output_filename,
+   FilterChain *chain,
+   int output_encoding
+);
+
+/**
+ * @brief Filters every image of a sequence of concatenated images.
+ *
+ * The images are decoded, filtered and written one at a time, so memory use
+ * is bounded by the size of the largest image.
+ *
+ * @param input_filename Name of the input file, - for standard input.
+ * @param output_filename Name of the output file, - for standard output.
+ * @param chain Pointer to the chain of filters, NULL for no filter.
+ * @param output_encoding Encoding of the output, -1 to keep the input one.
+ *
+ * @return int Exit status of the program.
+ */
+static int filter_frames(
+   const char *input_filename,
+   const char *output_filename,
+   FilterChain *chain,
+   int output_encoding
+);
+
 /* ======= Functions ======= */
 
 /**
  * @brief Entry point of the program.
  *
  * Parses command-line arguments, loads the input PNM file, applies the
- * specified filter, and writes the result to the output file.
+ * specified filters, and writes the result to the output file.
  *
  * @param argc Number of command-line arguments.
  * @param argv Array of command-line arguments.
@@ -75,9 +212,14 @@ int main(int argc, char **argv) {
    const char *output_filename = NULL;
    const char *filter_string = NULL;
    const char *parameter_string = NULL;
+   int output_encoding = -1;
+   int use_mmap = 0;
+   int use_stream = 0;
+   int use_frames = 0;
+   int explain = 0;
 
    int optc;
-   while ((optc = getopt_long(argc, argv, "i:o:f:p:", longopts, NULL)) != -1) {
+   while ((optc = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1) {
       switch (optc) {
          case 'i':
             input_filename = optarg;
@@ -91,6 +233,36 @@ int main(int argc, char **argv) {
          case 'p':
             parameter_string = optarg;
             break;
+         case 'a':
+            output_encoding = ENCODING_ASCII;
+            break;
+         case 'r':
+            output_encoding = ENCODING_RAW;
+            break;
+         case 's':
+            use_stream = 1;
+            break;
+         case 't': {
+            char *end;
+            unsigned long threads = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *optarg == '-' || *end != '\0'
+               || PNM_MAX_THREADS < threads) {
+               fprintf(stderr, "%s: '%s': invalid number of threads\n",
+                  program_name, optarg);
+               usage(EXIT_FAILURE);
+            }
+            pnm_set_threads(threads);
+            break;
+         }
+         case GETOPT_MMAP_CHAR:
+            use_mmap = 1;
+            break;
+         case GETOPT_FRAMES_CHAR:
+            use_frames = 1;
+            break;
+         case GETOPT_EXPLAIN_CHAR:
+            explain = 1;
+            break;
          case GETOPT_HELP_CHAR:
             usage(EXIT_SUCCESS);
             break;
@@ -104,6 +276,25 @@ int main(int argc, char **argv) {
       }
    }
 
+   FilterChain *chain = NULL;
+   if (filter_string != NULL) {
+      check_filter_chain(
+         filter_chain_parse(&chain, filter_string, parameter_string),
+         filter_string,
+         parameter_string
+      );
+   }
+
+   if (explain) {
+      if (chain == NULL) {
+         fprintf(stderr, "%s: missing '-f' argument\n", program_name);
+         usage(EXIT_FAILURE);
+      }
+      filter_chain_explain(chain, stdout);
+      filter_chain_free(&chain);
+      return EXIT_SUCCESS;
+   }
+
    if (input_filename == NULL) {
       fprintf(stderr, "%s: missing '-i' argument\n", program_name);
       usage(EXIT_FAILURE);
@@ -112,99 +303,345 @@ int main(int argc, char **argv) {
       usage(EXIT_FAILURE);
    }
 
+   if (use_frames) {
+      int status = filter_frames(
+         input_filename,
+         output_filename,
+         chain,
+         output_encoding
+      );
+      filter_chain_free(&chain);
+      return status;
+   }
+
+   int use_stdin = !strcmp(input_filename, STANDARD_STREAM);
+   int use_stdout = !strcmp(output_filename, STANDARD_STREAM);
+
+   // Rows are streamed through the P1 to P6 row API only.
+   PNMInfo info;
+   if (use_stream && is_row_filter(chain) && !use_stdin
+      && !use_stdout && pnm_probe(input_filename, &info) == PNM_SUCCESS
+      && info.format != FORMAT_PAM) {
+      int status = stream_image(
+         input_filename,
+         output_filename,
+         chain,
+         output_encoding
+      );
+      filter_chain_free(&chain);
+      return status;
+   }
+
    PNM *image = NULL;
 
-   switch (load_pnm(&image, input_filename)) {
-      case PNM_SUCCESS:
-         break;
-      case PNM_INVALID_FILENAME:
-         fprintf(stderr, "%s: invalid filename '%s': ",
-            program_name, input_filename);
-         perror("");
-         return EXIT_FAILURE;
-      case LOAD_PNM_MEMORY_ERROR:
-         fprintf(stderr, "%s: ", program_name);
-         perror("");
-         return EXIT_FAILURE;
-      case LOAD_PNM_DECODE_ERROR:
-         fprintf(stderr, "%s: '%s': decode error\n",
-            program_name, input_filename);
-         return EXIT_FAILURE;
-      default:
-         fprintf(stderr, "%s: error:", program_name);
-         perror("");
-         return EXIT_FAILURE;
+   int load_code;
+   if (use_stdin) {
+      load_code = load_pnm_from_fd(&image, STDIN_FILENO);
+   } else if (use_mmap) {
+      load_code = load_pnm_mmap(&image, input_filename);
+   } else {
+      load_code = load_pnm(&image, input_filename);
+   }
+   if (load_code != PNM_SUCCESS) {
+      report_load_error(load_code, input_filename);
+      filter_chain_free(&chain);
+      return EXIT_FAILURE;
    }
 
-   int result_code;
-   if (filter_string == NULL) {
-      result_code = FILTER_SUCCESS;
-   } else if (!strcasecmp(filter_string, "retournement")) {
-      result_code = turnaround(image);
-   } else if (!strcasecmp(filter_string, "monochrome")) {
-      result_code = monochrome(image, parameter_string);
-   } else if (!strcasecmp(filter_string, "negatif")) {
-      result_code = negative(image);
-   } else if (!strcasecmp(filter_string, "gris")) {
-      result_code = fifty_shades_of_grey(image, parameter_string);
-   } else if (!strcasecmp(filter_string, "NB")) {
-      result_code = black_and_white(image, parameter_string);
+   int result_code = apply_filter(image, chain);
+   filter_chain_free(&chain);
+   if (result_code != FILTER_SUCCESS) free_pnm(&image);
+   check_filter_result(result_code);
+
+   if (output_encoding != -1) set_encoding(image, output_encoding);
+
+   int write_code;
+   if (use_stdout) {
+      write_code = write_pnm_to_fd(image, STDOUT_FILENO);
    } else {
-      fprintf(stderr, "%s: invalid filter name '%s'\n",
-         program_name, filter_string);
-      free_pnm(&image);
-      usage(EXIT_FAILURE);
+      write_code = write_pnm(image, output_filename);
+   }
+   if (write_code != PNM_SUCCESS) {
+      report_write_error(write_code, output_filename);
    }
 
-   switch(result_code) {
+   free_pnm(&image);
+
+   return (write_code == PNM_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int apply_filter(PNM *image, FilterChain *chain) {
+   if (chain == NULL) return FILTER_SUCCESS;
+   return filter_chain_apply(chain, image);
+}
+
+static int is_row_filter(FilterChain *chain) {
+   return chain == NULL || filter_chain_is_per_pixel(chain);
+}
+
+static void check_filter_chain(
+   int parse_code,
+   const char *filter_string,
+   const char *parameter_string
+) {
+   switch (parse_code) {
       case FILTER_SUCCESS:
-         break;
-      case FILTER_WRONG_IMAGE_FORMAT:
-         fprintf(stderr, "%s: incompatible filter and image format\n",
-            program_name);
-         free_pnm(&image);
+         return;
+      case FILTER_UNKNOWN:
+         fprintf(stderr, "%s: invalid filter name in '%s'\n",
+            program_name, filter_string);
          usage(EXIT_FAILURE);
          break;
       case FILTER_INVALID_PARAMETER:
-         if (parameter_string == NULL) {
+         if (strchr(filter_string, ':') != NULL) {
+            fprintf(stderr, "%s: '%s': invalid argument\n",
+               program_name, filter_string);
+         } else if (parameter_string == NULL) {
             fprintf(stderr, "%s: missing '-p' argument\n", program_name);
          } else {
             fprintf(stderr, "%s: '%s': invalid argument\n",
                program_name, parameter_string);
          }
-         free_pnm(&image);
          usage(EXIT_FAILURE);
          break;
       default:
          fprintf(stderr, "%s: error: ", program_name);
          perror("");
-         free_pnm(&image);
-         return EXIT_FAILURE;
+         exit(EXIT_FAILURE);
    }
+}
 
-   int ok = 1;
-   switch (write_pnm(image, output_filename)) {
-      case PNM_SUCCESS:
+static void check_filter_result(int result_code) {
+   switch(result_code) {
+      case FILTER_SUCCESS:
+         return;
+      case FILTER_WRONG_IMAGE_FORMAT:
+         fprintf(stderr, "%s: incompatible filter and image format\n",
+            program_name);
+         usage(EXIT_FAILURE);
          break;
+      default:
+         fprintf(stderr, "%s: error: ", program_name);
+         perror("");
+         exit(EXIT_FAILURE);
+   }
+}
+
+static void report_load_error(int load_code, const char *filename) {
+   switch (load_code) {
       case PNM_INVALID_FILENAME:
          fprintf(stderr, "%s: invalid filename '%s': ",
-            program_name, output_filename);
+            program_name, filename);
+         perror("");
+         break;
+      case LOAD_PNM_MEMORY_ERROR:
+         fprintf(stderr, "%s: ", program_name);
+         perror("");
+         break;
+      case LOAD_PNM_DECODE_ERROR:
+         fprintf(stderr, "%s: '%s': decode error\n",
+            program_name, filename);
+         break;
+      default:
+         fprintf(stderr, "%s: error:", program_name);
+         perror("");
+   }
+}
+
+static void report_write_error(int write_code, const char *filename) {
+   switch (write_code) {
+      case PNM_INVALID_FILENAME:
+         fprintf(stderr, "%s: invalid filename '%s': ",
+            program_name, filename);
          perror("");
-         ok = 0;
          break;
       case WRITE_PNM_FILE_MANIPULATION_ERROR:
          fprintf(stderr, "%s: '%s': file manipulation error: ",
-            program_name, output_filename);
+            program_name, filename);
          perror("");
-         ok = 0;
          break;
       default:
          fprintf(stderr, "%s: error: ", program_name);
          perror("");
+   }
+}
+
+static int stream_image(
+   const char *input_filename,
+   const char *output_filename,
+   FilterChain *chain,
+   int output_encoding
+) {
+   PNMReader *reader = NULL;
+   int load_code = pnm_reader_open(&reader, input_filename);
+   if (load_code != PNM_SUCCESS) {
+      report_load_error(load_code, input_filename);
+      return EXIT_FAILURE;
+   }
+
+   FormatPNM format;
+   EncodingPNM encoding;
+   unsigned int width;
+   unsigned int height;
+   uint16_t max_value;
+   pnm_reader_header(reader, &format, &encoding, &width, &height, &max_value);
+   if (output_encoding != -1) encoding = output_encoding;
+
+   size_t row_samples = (format == FORMAT_PPM) ? 3 * (size_t)width : width;
+   unsigned int batch_height = 1;
+   if (row_samples < STREAM_BATCH_SAMPLES) {
+      batch_height = STREAM_BATCH_SAMPLES / row_samples;
+   }
+   if (height < batch_height) batch_height = height;
+
+   PNM *batch = NULL;
+   if (create_pnm(&batch, format, width, batch_height, max_value) != 0) {
+      report_load_error(LOAD_PNM_MEMORY_ERROR, input_filename);
+      pnm_reader_close(&reader);
+      return EXIT_FAILURE;
+   }
+
+   PNMWriter *writer = NULL;
+   int ok = 1;
+   while (ok) {
+      // Rows are read as 16-bit samples. Filters that change the format
+      // replace the buffer of the batch with a smaller one, so a buffer for
+      // input rows is allocated again.
+      if (get_format(batch) != format || get_storage(batch) != STORAGE_16) {
+         uint16_t *rows = pnm_alloc(
+            row_samples * batch_height * sizeof(uint16_t)
+         );
+         if (rows == NULL) {
+            report_load_error(LOAD_PNM_MEMORY_ERROR, input_filename);
+            ok = 0;
+            break;
+         }
+         set_pnm(batch, format, width, batch_height, max_value, rows);
+      }
+
+      uint16_t *rows = get_data16(batch);
+      unsigned int count;
+      load_code = pnm_read_rows(reader, rows, batch_height, &count);
+      if (load_code != PNM_SUCCESS) {
+         report_load_error(load_code, input_filename);
          ok = 0;
+         break;
+      }
+      if (count == 0) break;
+      set_pnm(batch, format, width, count, max_value, rows);
+
+      check_filter_result(apply_filter(batch, chain));
+
+      int write_code = PNM_SUCCESS;
+      if (writer == NULL) {
+         write_code = pnm_writer_open(
+            &writer,
+            output_filename,
+            get_format(batch),
+            encoding,
+            width,
+            height,
+            get_max_value(batch)
+         );
+      }
+      if (write_code == PNM_SUCCESS) {
+         write_code = write_batch(writer, batch);
+      }
+      if (write_code != PNM_SUCCESS) {
+         report_write_error(write_code, output_filename);
+         ok = 0;
+      }
    }
 
-   free_pnm(&image);
+   if (writer != NULL) {
+      int write_code = pnm_writer_close(&writer);
+      if (ok && write_code != PNM_SUCCESS) {
+         report_write_error(write_code, output_filename);
+         ok = 0;
+      }
+   }
+   pnm_reader_close(&reader);
+   free_pnm(&batch);
+
+   return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int write_batch(PNMWriter *writer, PNM *batch) {
+   const uint16_t *rows = NULL;
+   if (set_storage(batch, STORAGE_16) == PNM_SUCCESS) {
+      rows = get_data16(batch);
+   }
+   unsigned int height = get_height(batch);
+   if (rows == NULL || get_stride(batch) == get_row_size(batch)) {
+      return pnm_write_rows(writer, rows, height);
+   }
+   for (unsigned int y = 0; y < height; ++y) {
+      int write_code = pnm_write_rows(writer, get_row(batch, y), 1);
+      if (write_code != PNM_SUCCESS) return write_code;
+   }
+   return PNM_SUCCESS;
+}
+
+static int filter_frames(
+   const char *input_filename,
+   const char *output_filename,
+   FilterChain *chain,
+   int output_encoding
+) {
+   PNMFrameReader *frames = NULL;
+   int load_code;
+   if (!strcmp(input_filename, STANDARD_STREAM)) {
+      load_code = pnm_frames_open_fd(&frames, STDIN_FILENO);
+   } else {
+      load_code = pnm_frames_open(&frames, input_filename);
+   }
+   if (load_code != PNM_SUCCESS) {
+      report_load_error(load_code, input_filename);
+      return EXIT_FAILURE;
+   }
+
+   int output_fd = STDOUT_FILENO;
+   if (strcmp(output_filename, STANDARD_STREAM)) {
+      output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (output_fd == -1) {
+         pnm_frames_close(&frames);
+         report_write_error(PNM_INVALID_FILENAME, output_filename);
+         return EXIT_FAILURE;
+      }
+   }
+
+   int ok = 1;
+   unsigned long frame_count = 0;
+   PNM *image;
+   while ((load_code = pnm_frames_next(frames, &image)) == PNM_SUCCESS) {
+      int result_code = apply_filter(image, chain);
+      if (result_code != FILTER_SUCCESS) {
+         pnm_frames_close(&frames);
+         if (output_fd != STDOUT_FILENO) close(output_fd);
+      }
+      check_filter_result(result_code);
+
+      if (output_encoding != -1) set_encoding(image, output_encoding);
+
+      int write_code = write_pnm_to_fd(image, output_fd);
+      if (write_code != PNM_SUCCESS) {
+         report_write_error(write_code, output_filename);
+         ok = 0;
+         break;
+      }
+      frame_count++;
+   }
+   if (ok && (load_code != PNM_END_OF_FRAMES || frame_count == 0)) {
+      if (load_code == PNM_END_OF_FRAMES) load_code = LOAD_PNM_DECODE_ERROR;
+      report_load_error(load_code, input_filename);
+      ok = 0;
+   }
+
+   pnm_frames_close(&frames);
+   if (output_fd != STDOUT_FILENO && close(output_fd) != 0) {
+      report_write_error(WRITE_PNM_FILE_MANIPULATION_ERROR, output_filename);
+      ok = 0;
+   }
 
    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -214,21 +651,50 @@ static void usage(int status) {
       fprintf(stderr, "Try '%s --help' for more information.\n",
          program_name);
    } else {
-      printf("Usage: %s -i SOURCE [-f FILTER] [-p PARAM] -o DEST\n",
-         program_name);
+      printf("Usage: %s -i SOURCE [-f FILTER[,FILTER]...] [-p PARAM] "
+         "[OPTION]... -o DEST\n", program_name);
       fputs("\
 Manipulates PNM format files.\n\
 \n\
 Mandatory arguments to long options are mandatory for short options too.\n\
-  -i, --input=FILE             specify input file (.ppm, .pbm, .pgm)\n\
-  -o, --output=FILE            specify output file (.ppm, .pbm, .pgm)\n\
-  -f, --filter=FILTER          specify filter to apply:\n\
+  -i, --input=FILE             specify input file (.ppm, .pbm, .pgm, .pam),\n\
+                                 - for standard input\n\
+  -o, --output=FILE            specify output file (.ppm, .pbm, .pgm, .pam),\n\
+                                 - for standard output\n\
+  -f, --filter=FILTER[,FILTER]...\n\
+                               specify filters to apply, in order, each\n\
+                                 as NAME or NAME:PARAM:\n\
                                  retournement  (NO PARAM)\n\
+                                 transposition (NO PARAM)\n\
+                                 rotation90    (NO PARAM, clockwise)\n\
+                                 rotation270   (NO PARAM)\n\
+                                 miroir_h      (NO PARAM, left to right)\n\
+                                 miroir_v      (NO PARAM, top to bottom)\n\
                                  monochrome    (PARAM: r, v, b)\n\
                                  negatif       (NO PARAM)\n\
                                  gris          (PARAM: 1, 2)\n\
                                  NB            (PARAM: 0 - 255)\n\
-  -p, --parameter=PARAM        specify parameter for the filter (if required)\n\
+                                 consecutive filters from monochrome to\n\
+                                 NB share one pass over the rows\n\
+  -p, --parameter=PARAM        specify parameter for the filters given\n\
+                                 without one (if required)\n\
+  -a, --ascii                  write the output in ASCII (P1, P2, P3)\n\
+  -r, --raw                    write the output in raw binary (P4, P5, P6)\n\
+                                 (default: same encoding as the input,\n\
+                                 PAM files are always raw)\n\
+  -s, --stream                 filter the image a batch of rows at a time\n\
+                                 (monochrome, negatif, gris, NB), unless\n\
+                                 the input or the output is - or the\n\
+                                 input is a PAM file\n\
+  -t, --threads=N              use N threads for large images and large\n\
+                                 ASCII files (default: 0, the value of\n\
+                                 PNM_THREADS, or one per processor)\n\
+      --mmap                   map the input file into memory instead of\n\
+                                 reading it\n\
+      --frames                 filter every image of a file holding a\n\
+                                 sequence of concatenated images\n\
+      --explain                print the passes made by the filters and\n\
+                                 exit\n\
       --help                   display this help and exit\n\
       --version                output version information and exit\n\
 ", stdout);
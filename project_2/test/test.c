@@ -1,6 +1,17 @@
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include "seatest.h"
 #include "pnm.h"
 #include "filter.h"
+#include "kernel.h"
 
 /* ======= Constants ======= */
 
@@ -16,12 +27,110 @@ const char *invalid_size = "test_image/invalid_size.ppm";
 const char *invalid_max_value = "test_image/invalid_max_value.ppm";
 const char *invalid_data = "test_image/invalid_data.ppm";
 
+const char *valid_raw_pbm = "test_image/valid_image_raw.pbm";
+const char *valid_raw_pgm = "test_image/valid_image_raw.pgm";
+const char *valid_raw_ppm = "test_image/valid_image_raw.ppm";
+
+const char *invalid_raw_data = "test_image/invalid_raw_data.ppm";
+
+const char *valid_pam = "test_image/valid_image.pam";
+
 const char *result_pbm_path = "test_image/result.pbm";
 const char *result_pgm_path = "test_image/result.pgm";
 const char *result_ppm_path = "test_image/result.ppm";
+const char *result_pam_path = "test_image/result.pam";
 
 /* ======= Functions ======= */
 
+// Samples are counted row after row, skipping the padding of the rows.
+// sample_at and set_sample convert the image to packed 16-bit samples first.
+
+static uint16_t sample_at(PNM *image, size_t i) {
+   size_t row_count = (size_t)get_width(image) * get_channels(image);
+   if (get_data(image) == NULL) return 0;
+   return ((uint16_t *)get_row(image, i / row_count))[i % row_count];
+}
+
+static uint8_t sample8_at(PNM *image, size_t i) {
+   size_t row_count = (size_t)get_width(image) * get_channels(image);
+   if (get_data8(image) == NULL) return 0;
+   return ((uint8_t *)get_row(image, i / row_count))[i % row_count];
+}
+
+static void set_sample(PNM *image, size_t i, uint16_t value) {
+   size_t row_count = (size_t)get_width(image) * get_channels(image);
+   if (get_data(image) == NULL) return;
+   ((uint16_t *)get_row(image, i / row_count))[i % row_count] = value;
+}
+
+static void *counting_allocate(void *context, size_t size) {
+   ++((size_t *)context)[0];
+   void *block;
+   if (posix_memalign(&block, PNM_ALIGNMENT, size) != 0) return NULL;
+   return block;
+}
+
+static void counting_release(void *context, void *block) {
+   if (block != NULL) ++((size_t *)context)[1];
+   free(block);
+}
+
+// Threads of the process, as listed by Linux.
+static size_t count_threads(void) {
+   DIR *tasks = opendir("/proc/self/task");
+   if (tasks == NULL) return 0;
+   size_t count = 0;
+   for (struct dirent *entry = readdir(tasks); entry != NULL;
+      entry = readdir(tasks)) {
+      if (entry->d_name[0] != '.') ++count;
+   }
+   closedir(tasks);
+   return count;
+}
+
+// Each band marks its items and records its first item. Bands starting at
+// item 1 fail, and bands may post a job of two bands themselves.
+
+typedef struct BandMarks_t {
+   unsigned char *items;
+   size_t firsts[PNM_MAX_THREADS];
+   int nested;
+} BandMarks;
+
+static int mark_band(void *context, unsigned int band, size_t first,
+   size_t end) {
+   BandMarks *marks = context;
+   marks->firsts[band] = first;
+   for (size_t i = first; i < end; ++i) ++marks->items[i];
+   if (marks->nested) {
+      BandMarks inner = {marks->items + first, {0}, 0};
+      return pnm_parallel_for(end - first, 2, mark_band, &inner);
+   }
+   return first == 1 ? -7 : 0;
+}
+
+static size_t count_marks(const unsigned char *marks, size_t count) {
+   size_t total = 0;
+   for (size_t i = 0; i < count; ++i) total += marks[i];
+   return total;
+}
+
+static PNM *create_pattern_ppm(unsigned int width, unsigned int height) {
+   PNM *image = NULL;
+   if (create_pnm(&image, FORMAT_PPM, width, height, PPM_MAX_VALUE) != 0
+      || set_storage(image, STORAGE_8) != 0 || get_data8(image) == NULL) {
+      free_pnm(&image);
+      return NULL;
+   }
+   for (unsigned int y = 0; y < height; ++y) {
+      uint8_t *row = get_row(image, y);
+      for (size_t i = 0; i < (size_t)width * 3; ++i) {
+         row[i] = (uint8_t)((y * 7919 + i * 104729) >> 3);
+      }
+   }
+   return image;
+}
+
 static void test_load_pnm() {
    PNM *image = NULL;
 
@@ -132,6 +241,1417 @@ static void test_write_pnm() {
    remove(result_ppm_path);
 }
 
+static void test_raw_pnm() {
+   const char *valid_paths[] = {valid_raw_pbm, valid_raw_pgm, valid_raw_ppm};
+   const char *ascii_paths[] = {valid_pbm, valid_pgm, valid_ppm};
+   const char *result_paths[] = {
+      result_pbm_path,
+      result_pgm_path,
+      result_ppm_path
+   };
+   const FormatPNM formats[] = {FORMAT_PBM, FORMAT_PGM, FORMAT_PPM};
+   const uint16_t max_values[] = {PBM_MAX_VALUE, PGM_MAX_VALUE, PPM_MAX_VALUE};
+
+   for (int f = 0; f < 3; ++f) {
+      PNM *image = NULL;
+      assert_int_equal(load_pnm(&image, valid_paths[f]), PNM_SUCCESS);
+      assert_int_equal(get_format(image), formats[f]);
+      assert_int_equal(get_encoding(image), ENCODING_RAW);
+      assert_int_equal(get_width(image), 3);
+      assert_int_equal(get_height(image), 3);
+      assert_int_equal(get_max_value(image), max_values[f]);
+
+      size_t data_count = get_width(image) * get_height(image);
+      if (formats[f] == FORMAT_PPM) data_count *= 3;
+      for (size_t i = 0; i < data_count; ++i) {
+         assert_int_equal(get_data(image)[i], max_values[f]);
+      }
+      free_pnm(&image);
+
+      PNM *ascii = NULL;
+      assert_int_equal(load_pnm(&ascii, ascii_paths[f]), PNM_SUCCESS);
+      assert_int_equal(get_encoding(ascii), ENCODING_ASCII);
+      set_encoding(ascii, ENCODING_RAW);
+      assert_int_equal(write_pnm(ascii, result_paths[f]), PNM_SUCCESS);
+
+      PNM *result = NULL;
+      assert_int_equal(load_pnm(&result, result_paths[f]), PNM_SUCCESS);
+      assert_int_equal(get_encoding(result), ENCODING_RAW);
+      assert_int_equal(get_format(ascii), get_format(result));
+      assert_int_equal(get_max_value(ascii), get_max_value(result));
+      for (size_t i = 0; i < data_count; ++i) {
+         assert_int_equal(get_data(ascii)[i], get_data(result)[i]);
+      }
+      free_pnm(&ascii);
+      free_pnm(&result);
+      remove(result_paths[f]);
+   }
+
+   PNM *image = NULL;
+   assert_int_equal(load_pnm(&image, invalid_raw_data), LOAD_PNM_DECODE_ERROR);
+}
+
+static void test_pgm16() {
+   // Big-endian 16-bit samples, written back byte for byte.
+   enum {WIDTH = 37, HEIGHT = 23};
+   const char header[] = "P5\n37 23\n65535\n";
+   static uint8_t raw[sizeof(header) - 1 + 2 * WIDTH * HEIGHT];
+   static char ascii[16 + 6 * WIDTH * HEIGHT];
+   memcpy(raw, header, sizeof(header) - 1);
+   size_t length = sprintf(ascii, "P2\n%d %d\n65535\n", WIDTH, HEIGHT);
+   uint16_t samples[WIDTH * HEIGHT];
+   for (size_t i = 0; i < WIDTH * HEIGHT; ++i) {
+      samples[i] = (uint16_t)(i * 2654435761u >> 7);
+      raw[sizeof(header) - 1 + 2 * i] = samples[i] >> 8;
+      raw[sizeof(header) + 2 * i] = samples[i] & 0xFF;
+      length += sprintf(ascii + length, "%u\n", (unsigned int)samples[i]);
+   }
+
+   PNM *images[2] = {NULL, NULL};
+   assert_int_equal(load_pnm_from_memory(&images[0], raw, sizeof(raw)),
+      PNM_SUCCESS);
+   assert_int_equal(load_pnm_from_memory(&images[1], ascii, length),
+      PNM_SUCCESS);
+   for (int i = 0; i < 2; ++i) {
+      assert_int_equal(get_format(images[i]), FORMAT_PGM);
+      assert_int_equal(get_max_value(images[i]), 65535);
+      assert_int_equal(get_storage(images[i]), STORAGE_16);
+      int same = 1;
+      for (size_t s = 0; s < WIDTH * HEIGHT; ++s) {
+         same &= sample_at(images[i], s) == samples[s];
+      }
+      assert_true(same);
+
+      void *bytes = NULL;
+      size_t size = 0;
+      set_encoding(images[i], ENCODING_RAW);
+      assert_int_equal(write_pnm_to_memory(images[i], &bytes, &size),
+         PNM_SUCCESS);
+      assert_ulong_equal(sizeof(raw), size);
+      if (size == sizeof(raw)) assert_int_equal(memcmp(bytes, raw, size), 0);
+      free(bytes);
+      free_pnm(&images[i]);
+   }
+
+   // A maximum value of 0 leaves no room for samples.
+   const char *zero_max[] = {
+      "P2 1 1 0\n0\n",
+      "P3 2 1 0\n0 0 0 0 0 0\n",
+      "P5 1 1 0\n\0",
+      "P6 1 1 0\n\0\0\0"
+   };
+   for (size_t i = 0; i < sizeof(zero_max) / sizeof(zero_max[0]); ++i) {
+      PNM *image = NULL;
+      assert_int_equal(
+         load_pnm_from_memory(&image, zero_max[i], strlen(zero_max[i]) + 1),
+         LOAD_PNM_DECODE_ERROR
+      );
+   }
+}
+
+static void test_write_ascii() {
+   // The rows are long enough for the bodies to cross the 64 KiB buffer of
+   // the writer many times, and to be encoded in bands by several threads.
+   const FormatPNM formats[] = { FORMAT_PBM, FORMAT_PGM, FORMAT_PPM };
+   const uint16_t max_values[] = { 1, 65535, 1000 };
+   const char *magics[] = { "P1", "P2", "P3" };
+   const unsigned int width = 1000;
+   const unsigned int height = 600;
+   const unsigned int thread_counts[] = { 1, 4 };
+
+   for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+      PNM *image = NULL;
+      assert_int_equal(create_pnm(&image, formats[f], width, height,
+         max_values[f]), PNM_SUCCESS);
+      set_encoding(image, ENCODING_ASCII);
+      size_t row_count = (size_t)width * get_channels(image);
+      uint16_t *data = get_data(image);
+      for (size_t i = 0; i < row_count * height; ++i) {
+         data[i] = (i * 7919) % (max_values[f] + 1);
+      }
+
+      size_t expected_size = 32 + row_count * height * 6 + height;
+      char *expected = malloc(expected_size);
+      assert_true(expected != NULL);
+      size_t length = sprintf(expected, "%s\n%u %u\n", magics[f], width,
+         height);
+      if (formats[f] != FORMAT_PBM) {
+         length += sprintf(expected + length, "%u\n", max_values[f]);
+      }
+      for (size_t y = 0; y < height; ++y) {
+         for (size_t x = 0; x < row_count; ++x) {
+            length += sprintf(expected + length, "%u ",
+               data[y * row_count + x]);
+         }
+         expected[length++] = '\n';
+      }
+
+      for (size_t t = 0; t < 2; ++t) {
+         pnm_set_threads(thread_counts[t]);
+         void *bytes = NULL;
+         size_t size = 0;
+         assert_int_equal(write_pnm_to_memory(image, &bytes, &size),
+            PNM_SUCCESS);
+         assert_true(65536 < size);
+         assert_int_equal(length, size);
+         assert_true(size == length && memcmp(bytes, expected, size) == 0);
+         free(bytes);
+      }
+      pnm_set_threads(0);
+      free(expected);
+      free_pnm(&image);
+   }
+
+   // Samples above the maximum value take more digits than it, in 8-bit and
+   // 16-bit storage alike, and are written the same by any thread count.
+   for (int wide = 0; wide < 2; ++wide) {
+      PNM *image = NULL;
+      assert_int_equal(create_pnm(&image, FORMAT_PGM, width, width, 9),
+         PNM_SUCCESS);
+      set_encoding(image, ENCODING_ASCII);
+      assert_int_equal(set_storage(image, wide ? STORAGE_16 : STORAGE_8),
+         PNM_SUCCESS);
+      assert_true(wide ? get_data16(image) != NULL : get_data8(image) != NULL);
+      for (unsigned int y = 0; y < width; ++y) {
+         for (unsigned int x = 0; x < width; ++x) {
+            if (wide) {
+               ((uint16_t *)get_row(image, y))[x] = 60000;
+            } else {
+               ((uint8_t *)get_row(image, y))[x] = 200;
+            }
+         }
+      }
+
+      void *serial = NULL, *parallel = NULL;
+      size_t serial_size = 0, parallel_size = 0;
+      pnm_set_threads(1);
+      assert_int_equal(write_pnm_to_memory(image, &serial, &serial_size),
+         PNM_SUCCESS);
+      pnm_set_threads(4);
+      assert_int_equal(write_pnm_to_memory(image, &parallel, &parallel_size),
+         PNM_SUCCESS);
+      pnm_set_threads(0);
+      assert_int_equal(serial_size, 15 + (size_t)width * width * (wide ? 6 : 4)
+         + width);
+      assert_true(serial_size == parallel_size
+         && memcmp(serial, parallel, serial_size) == 0);
+      free(serial);
+      free(parallel);
+      free_pnm(&image);
+   }
+
+   // Sizes of ten digits only fit in a header, written here before the
+   // writer fails for the missing rows.
+   PNMWriter *writer = NULL;
+   assert_int_equal(pnm_writer_open(&writer, result_pgm_path, FORMAT_PGM,
+      ENCODING_ASCII, 4294967295u, 1000000000u, 65535), PNM_SUCCESS);
+   assert_int_equal(pnm_writer_close(&writer),
+      WRITE_PNM_FILE_MANIPULATION_ERROR);
+   const char *header = "P2\n4294967295 1000000000\n65535\n";
+   char read[64] = { 0 };
+   FILE *file = fopen(result_pgm_path, "rb");
+   assert_true(file != NULL);
+   assert_int_equal(strlen(header), fread(read, 1, sizeof(read) - 1, file));
+   fclose(file);
+   assert_string_equal(header, read);
+   remove(result_pgm_path);
+}
+
+static void test_scanner() {
+   // Comments come between samples, one of them across the 64 KiB buffer of
+   // the scanner and another longer than the buffer; samples cross it too.
+   const unsigned int width = 300;
+   const unsigned int height = 100;
+   const size_t count = (size_t)width * height;
+   FILE *file = fopen(result_pgm_path, "w");
+   assert_true(file != NULL);
+   fprintf(file, "P2\n# size\n%u %u\n# maximum\n255\n", width, height);
+   int across = 0;
+   for (size_t i = 0; i < count; ++i) {
+      fprintf(file, "%u ", (unsigned int)(i % 256));
+      long position = ftell(file);
+      if (!across && 65536 - 20 < position) {
+         fputs("# across the buffer 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15\n",
+            file);
+         across = 1;
+      } else if (i == count / 2) {
+         fputc('#', file);
+         for (int c = 0; c < 70000; ++c) fputc(c % 10 + '0', file);
+         fputc('\n', file);
+      } else if (i % 997 == 0) {
+         fputs("#7 8 9\n", file);
+      }
+   }
+   fclose(file);
+
+   PNM *image = NULL;
+   assert_int_equal(load_pnm(&image, result_pgm_path), PNM_SUCCESS);
+   uint16_t *data = get_data(image);
+   int same = 1;
+   for (size_t i = 0; i < count; ++i) same &= data[i] == i % 256;
+   assert_true(same);
+   free_pnm(&image);
+
+   // A raw body cut short within the second buffer.
+   file = fopen(result_pgm_path, "wb");
+   assert_true(file != NULL);
+   fprintf(file, "P5\n%u %u\n255\n", width, height);
+   for (size_t i = 0; i < count - 1; ++i) fputc(i % 256, file);
+   fclose(file);
+   assert_int_equal(load_pnm(&image, result_pgm_path), LOAD_PNM_DECODE_ERROR);
+   remove(result_pgm_path);
+
+   // Samples above the maximum value, past the range of an unsigned int,
+   // missing or cut short are decode errors.
+   const char *invalid[] = {
+      "P1\n2 1\n0 2\n",
+      "P2\n2 1\n255\n0 256\n",
+      "P3\n1 1\n100\n1 2 101\n",
+      "P2\n2 1\n65535\n0 99999999999\n",
+      "P2\n2 2\n255\n1 2 3",
+      "P2\n2 2\n255\n1 2 3 # 4\n",
+      "P5\n2 2\n255\n\1\2\3",
+      "P2\n2 2\n25",
+      "P2\n2"
+   };
+   for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+      assert_int_equal(
+         load_pnm_from_memory(&image, invalid[i], strlen(invalid[i])),
+         LOAD_PNM_DECODE_ERROR
+      );
+   }
+}
+
+static void test_load_pnm_mmap() {
+   PNM *image = NULL;
+
+   assert_true(load_pnm_mmap(NULL, valid_raw_ppm) < 0);
+   assert_true(load_pnm_mmap(&image, NULL) < 0);
+   assert_int_equal(load_pnm_mmap(&image, invalid_filename),
+      PNM_INVALID_FILENAME);
+   assert_int_equal(load_pnm_mmap(&image, invalid_raw_data),
+      LOAD_PNM_DECODE_ERROR);
+   assert_int_equal(load_pnm_mmap(&image, invalid_data),
+      LOAD_PNM_DECODE_ERROR);
+
+   // 16-bit samples are decoded into padded rows, 8-bit ones used in place.
+   assert_int_equal(load_pnm_mmap(&image, valid_raw_ppm), PNM_SUCCESS);
+   assert_int_equal(get_format(image), FORMAT_PPM);
+   assert_int_equal(get_encoding(image), ENCODING_RAW);
+   assert_int_equal(get_max_value(image), PPM_MAX_VALUE);
+   assert_ulong_equal(get_stride(image), pnm_row_stride(get_row_size(image)));
+   assert_int_equal((uintptr_t)get_row(image, 0) % PNM_ALIGNMENT, 0);
+   size_t data_count = get_width(image) * get_height(image) * 3;
+   for (size_t i = 0; i < data_count; ++i) {
+      assert_int_equal(get_data(image)[i], PPM_MAX_VALUE);
+   }
+   assert_int_equal(negative(image), FILTER_SUCCESS);
+   for (size_t i = 0; i < data_count; ++i) {
+      assert_int_equal(get_data(image)[i], 0);
+   }
+   assert_int_equal(fifty_shades_of_grey(image, "1"), FILTER_SUCCESS);
+   assert_int_equal(get_format(image), FORMAT_PGM);
+   free_pnm(&image);
+
+   PNM *reloaded = NULL;
+   assert_int_equal(load_pnm(&reloaded, valid_raw_ppm), PNM_SUCCESS);
+   assert_int_equal(get_data(reloaded)[0], PPM_MAX_VALUE);
+   free_pnm(&reloaded);
+
+   assert_int_equal(load_pnm_mmap(&image, valid_raw_pgm), PNM_SUCCESS);
+   assert_int_equal(get_format(image), FORMAT_PGM);
+   assert_ulong_equal(get_stride(image), get_row_size(image));
+   assert_int_equal(get_data(image)[0], PGM_MAX_VALUE);
+   free_pnm(&image);
+
+   assert_int_equal(load_pnm_mmap(&image, valid_pbm), PNM_SUCCESS);
+   assert_int_equal(get_format(image), FORMAT_PBM);
+   assert_int_equal(get_encoding(image), ENCODING_ASCII);
+   assert_int_equal(get_data(image)[0], PBM_MAX_VALUE);
+   free_pnm(&image);
+}
+
+static void test_load_pnm_lazy() {
+   PNM *image = NULL;
+
+   assert_true(load_pnm_lazy(NULL, valid_ppm) < 0);
+   assert_true(load_pnm_lazy(&image, NULL) < 0);
+   assert_int_equal(load_pnm_lazy(&image, invalid_filename),
+      PNM_INVALID_FILENAME);
+   assert_int_equal(load_pnm_lazy(&image, invalid_size),
+      LOAD_PNM_DECODE_ERROR);
+   assert_int_equal(get_status(NULL), -4);
+
+   // The header is read at once, the pixel data on its first access.
+   PNM *eager = NULL;
+   assert_int_equal(load_pnm(&eager, valid_ppm), PNM_SUCCESS);
+   assert_int_equal(load_pnm_lazy(&image, valid_ppm), PNM_SUCCESS);
+   assert_int_equal(get_status(image), PNM_DECODE_PENDING);
+   assert_int_equal(get_format(image), FORMAT_PPM);
+   assert_int_equal(get_width(image), get_width(eager));
+   assert_int_equal(get_height(image), get_height(eager));
+   assert_int_equal(get_storage(image), get_storage(eager));
+   assert_true(get_row(image, 0) != NULL);
+   assert_int_equal(get_status(image), PNM_SUCCESS);
+   for (size_t i = 0; i < get_sample_count(eager); ++i) {
+      assert_int_equal(sample_at(image, i), sample_at(eager, i));
+   }
+   free_pnm(&eager);
+   free_pnm(&image);
+
+   // Decode errors are reported when the pixel data is first needed.
+   assert_int_equal(load_pnm_lazy(&image, invalid_data), PNM_SUCCESS);
+   assert_true(get_data(image) == NULL);
+   assert_int_equal(get_status(image), LOAD_PNM_DECODE_ERROR);
+   assert_int_equal(negative(image), -4);
+   assert_int_equal(write_pnm(image, result_ppm_path),
+      WRITE_PNM_FILE_MANIPULATION_ERROR);
+   free_pnm(&image);
+
+   assert_int_equal(load_pnm(&eager, valid_raw_ppm), PNM_SUCCESS);
+   assert_int_equal(write_pnm(eager, result_ppm_path), PNM_SUCCESS);
+   free_pnm(&eager);
+
+   // An image that is never accessed is never decoded.
+   assert_int_equal(load_pnm_lazy(&image, result_ppm_path), PNM_SUCCESS);
+   set_pnm_storage(image, FORMAT_PGM, 1, 1, PGM_MAX_VALUE, STORAGE_8, NULL);
+   assert_int_equal(get_status(image), PNM_SUCCESS);
+   free_pnm(&image);
+
+   // A lazily loaded image can be filtered and written over its own file.
+   assert_int_equal(load_pnm_lazy(&image, result_ppm_path), PNM_SUCCESS);
+   assert_int_equal(negative(image), FILTER_SUCCESS);
+   assert_int_equal(write_pnm(image, result_ppm_path), PNM_SUCCESS);
+   free_pnm(&image);
+   assert_int_equal(load_pnm(&eager, result_ppm_path), PNM_SUCCESS);
+   for (size_t i = 0; i < get_sample_count(eager); ++i) {
+      assert_int_equal(sample_at(eager, i), 0);
+   }
+   free_pnm(&eager);
+
+   assert_int_equal(load_pnm_lazy(&image, result_ppm_path), PNM_SUCCESS);
+   remove(result_ppm_path);
+   assert_true(get_data16(image) == NULL);
+   assert_int_equal(get_status(image), PNM_INVALID_FILENAME);
+   free_pnm(&image);
+}
+
+static void test_stream_pnm() {
+   PNMReader *reader = NULL;
+   assert_true(pnm_reader_open(NULL, valid_ppm) < 0);
+   assert_true(pnm_reader_open(&reader, NULL) < 0);
+   assert_int_equal(pnm_reader_open(&reader, invalid_filename),
+      PNM_INVALID_FILENAME);
+   assert_int_equal(pnm_reader_open(&reader, invalid_size),
+      LOAD_PNM_DECODE_ERROR);
+
+   PNM *image = NULL;
+   assert_int_equal(load_pnm(&image, valid_ppm), PNM_SUCCESS);
+
+   assert_int_equal(pnm_reader_open(&reader, valid_ppm), PNM_SUCCESS);
+   FormatPNM format;
+   EncodingPNM encoding;
+   unsigned int width;
+   unsigned int height;
+   uint16_t max_value;
+   pnm_reader_header(reader, &format, &encoding, &width, &height, &max_value);
+   assert_int_equal(format, FORMAT_PPM);
+   assert_int_equal(encoding, ENCODING_ASCII);
+   assert_int_equal(width, 3);
+   assert_int_equal(height, 3);
+   assert_int_equal(max_value, PPM_MAX_VALUE);
+
+   PNMWriter *writer = NULL;
+   assert_int_equal(pnm_writer_open(&writer, invalid_char, format,
+      ENCODING_RAW, width, height, max_value), PNM_INVALID_FILENAME);
+   assert_int_equal(pnm_writer_open(&writer, result_ppm_path, format,
+      ENCODING_RAW, width, height, max_value), PNM_SUCCESS);
+
+   uint16_t rows[2 * 3 * 3];
+   unsigned int read_count;
+   unsigned int total = 0;
+   do {
+      assert_int_equal(pnm_read_rows(reader, rows, 2, &read_count),
+         PNM_SUCCESS);
+      for (size_t i = 0; i < read_count * width * 3; ++i) {
+         assert_int_equal(rows[i], get_data(image)[total * width * 3 + i]);
+      }
+      assert_int_equal(pnm_write_rows(writer, rows, read_count), PNM_SUCCESS);
+      total += read_count;
+   } while (read_count != 0);
+   assert_int_equal(total, height);
+   assert_int_equal(pnm_write_rows(writer, rows, 1),
+      WRITE_PNM_FILE_MANIPULATION_ERROR);
+   pnm_reader_close(&reader);
+   assert_true(reader == NULL);
+   assert_int_equal(pnm_writer_close(&writer), PNM_SUCCESS);
+   assert_true(writer == NULL);
+
+   PNM *result = NULL;
+   assert_int_equal(load_pnm(&result, result_ppm_path), PNM_SUCCESS);
+   assert_int_equal(get_encoding(result), ENCODING_RAW);
+   for (size_t i = 0; i < width * height * 3; ++i) {
+      assert_int_equal(get_data(result)[i], get_data(image)[i]);
+   }
+   free_pnm(&result);
+   free_pnm(&image);
+
+   assert_int_equal(pnm_writer_open(&writer, result_ppm_path, FORMAT_PPM,
+      ENCODING_ASCII, 3, 3, PPM_MAX_VALUE), PNM_SUCCESS);
+   assert_int_equal(pnm_writer_close(&writer),
+      WRITE_PNM_FILE_MANIPULATION_ERROR);
+   remove(result_ppm_path);
+}
+
+static void test_create_pnm() {
+   PNM *image = NULL;
+   assert_true(create_pnm(NULL, FORMAT_PGM, 3, 2, PGM_MAX_VALUE) < 0);
+   assert_int_equal(create_pnm(&image, FORMAT_PPM, 3, 2, 100), PNM_SUCCESS);
+   assert_int_equal(get_format(image), FORMAT_PPM);
+   assert_int_equal(get_width(image), 3);
+   assert_int_equal(get_height(image), 2);
+   assert_int_equal(get_max_value(image), 100);
+   assert_true(get_data(image) != NULL);
+   free_pnm(&image);
+}
+
+static void test_storage() {
+   assert_int_equal(get_default_storage(FORMAT_PBM, PBM_MAX_VALUE),
+      STORAGE_BIT);
+   assert_int_equal(get_default_storage(FORMAT_PPM, PGM_MAX_VALUE),
+      STORAGE_8);
+   assert_int_equal(get_default_storage(FORMAT_PPM, PPM_MAX_VALUE),
+      STORAGE_16);
+
+   PNM *image = NULL;
+   assert_int_equal(load_pnm(&image, valid_pgm), PNM_SUCCESS);
+   assert_int_equal(get_storage(image), STORAGE_8);
+   assert_int_equal(get_row_size(image), 3);
+   assert_true(get_data16(image) == NULL);
+   assert_true(get_bits(image) == NULL);
+   assert_int_equal(sample8_at(image, 4), PGM_MAX_VALUE);
+   assert_int_equal(get_data(image)[4], PGM_MAX_VALUE);
+   assert_int_equal(get_storage(image), STORAGE_16);
+   assert_true(get_data8(image) == NULL);
+   free_pnm(&image);
+
+   assert_int_equal(load_pnm(&image, valid_raw_ppm), PNM_SUCCESS);
+   assert_int_equal(get_storage(image), STORAGE_16);
+   assert_int_equal(get_row_size(image), 3 * 3 * sizeof(uint16_t));
+   assert_int_equal(get_data16(image)[8], PPM_MAX_VALUE);
+   free_pnm(&image);
+
+   // A 3x2 PBM image whose rows are 101 and 001 turns into 100 and 101.
+   assert_int_equal(create_pnm(&image, FORMAT_PBM, 3, 2, PBM_MAX_VALUE),
+      PNM_SUCCESS);
+   assert_int_equal(get_storage(image), STORAGE_BIT);
+   assert_int_equal(get_row_size(image), 1);
+   uint8_t *rows[] = {get_row(image, 0), get_row(image, 1)};
+   rows[0][0] = 0xA0;
+   rows[1][0] = 0x3F;
+   assert_int_equal(turnaround(image), FILTER_SUCCESS);
+   const uint16_t expected[] = {1, 0, 0, 1, 0, 1};
+   for (size_t i = 0; i < 6; ++i) {
+      assert_int_equal(get_data(image)[i], expected[i]);
+   }
+   assert_int_equal(set_storage(image, STORAGE_BIT), PNM_SUCCESS);
+   rows[0] = get_row(image, 0);
+   rows[1] = get_row(image, 1);
+   assert_int_equal(rows[0][0] & 0xE0, 0x80);
+   assert_int_equal(rows[1][0] & 0xE0, 0xA0);
+   free_pnm(&image);
+}
+
+static void test_row_layout() {
+   PNM *image = NULL;
+   void *bytes;
+   size_t size;
+
+   // Rows allocated by the library are aligned and padded.
+   assert_int_equal(create_pnm(&image, FORMAT_PGM, 3, 2, PGM_MAX_VALUE),
+      PNM_SUCCESS);
+   assert_int_equal(get_row_size(image), 3);
+   assert_int_equal(get_stride(image), PNM_ALIGNMENT);
+   assert_int_equal(pnm_row_stride(PNM_ALIGNMENT + 1), 2 * PNM_ALIGNMENT);
+   assert_true(get_row(image, 2) == NULL);
+   for (unsigned int y = 0; y < 2; ++y) {
+      uint8_t *row = get_row(image, y);
+      assert_int_equal((uintptr_t)row % PNM_ALIGNMENT, 0);
+      for (unsigned int x = 0; x < 3; ++x) row[x] = y * 3 + x;
+   }
+   assert_true(set_stride(image, 2) < 0);
+
+   // The padding never reaches files.
+   const char ascii[] = "P2\n3 2\n255\n0 1 2 \n3 4 5 \n";
+   assert_int_equal(write_pnm_to_memory(image, &bytes, &size), PNM_SUCCESS);
+   assert_int_equal(size, sizeof(ascii) - 1);
+   assert_true(memcmp(bytes, ascii, size) == 0);
+   free(bytes);
+   set_encoding(image, ENCODING_RAW);
+   assert_int_equal(write_pnm_to_memory(image, &bytes, &size), PNM_SUCCESS);
+   assert_int_equal(size, 11 + 6);
+   assert_true(memcmp((char *)bytes + 11, "\0\1\2\3\4\5", 6) == 0);
+   free(bytes);
+
+   // Conversions and filters keep the rows aligned.
+   assert_int_equal(set_storage(image, STORAGE_16), PNM_SUCCESS);
+   assert_int_equal(get_stride(image), PNM_ALIGNMENT);
+   assert_int_equal(((uint16_t *)get_row(image, 1))[2], 5);
+   assert_int_equal(black_and_white(image, "3"), FILTER_SUCCESS);
+   assert_int_equal(get_stride(image), PNM_ALIGNMENT);
+   for (unsigned int y = 0; y < 2; ++y) {
+      uint8_t *row = get_row(image, y);
+      assert_int_equal((uintptr_t)row % PNM_ALIGNMENT, 0);
+      assert_int_equal(row[0] & 0xE0, y ? 0xE0 : 0);
+   }
+
+   // get_data packs the rows as it converts them.
+   uint16_t *samples = get_data(image);
+   assert_true(samples != NULL);
+   assert_int_equal(get_stride(image), 3 * sizeof(uint16_t));
+   for (size_t i = 0; i < 6; ++i) assert_int_equal(samples[i], i / 3);
+   free_pnm(&image);
+
+   // It packs 16-bit rows in place, and copies those of a view, leaving the
+   // parent as it is.
+   PNM *view = NULL;
+   assert_int_equal(create_pnm(&image, FORMAT_PGM, 3, 2, PPM_MAX_VALUE),
+      PNM_SUCCESS);
+   for (unsigned int y = 0; y < 2; ++y) {
+      uint16_t *row = get_row(image, y);
+      for (unsigned int x = 0; x < 3; ++x) row[x] = 1000 * (y * 3 + x);
+   }
+   assert_int_equal(pnm_view(&view, image, 1, 0, 2, 2), PNM_SUCCESS);
+   samples = get_data(view);
+   assert_true(samples != NULL);
+   assert_int_equal(get_stride(view), 2 * sizeof(uint16_t));
+   assert_int_equal(samples[1], 2000);
+   assert_int_equal(samples[2], 4000);
+   assert_int_equal(get_stride(image), PNM_ALIGNMENT);
+   assert_int_equal(((uint16_t *)get_row(image, 1))[1], 4000);
+   free_pnm(&view);
+   void *first_row = get_row(image, 0);
+   samples = get_data(image);
+   assert_true(samples == first_row);
+   assert_int_equal(get_stride(image), 3 * sizeof(uint16_t));
+   for (size_t i = 0; i < 6; ++i) assert_int_equal(samples[i], 1000 * i);
+   free_pnm(&image);
+
+   // Pixel data given to set_pnm has packed rows.
+   assert_int_equal(create_pnm(&image, FORMAT_PGM, 1, 1, PGM_MAX_VALUE),
+      PNM_SUCCESS);
+   uint16_t *data = pnm_alloc(6 * sizeof(uint16_t));
+   assert_true(data != NULL);
+   set_pnm(image, FORMAT_PGM, 3, 2, PGM_MAX_VALUE, data);
+   assert_int_equal(get_stride(image), 3 * sizeof(uint16_t));
+   assert_true(get_row(image, 1) == data + 3);
+   free_pnm(&image);
+}
+
+static void test_layout() {
+   // A 5x3 PPM image whose samples hold their own index.
+   PNM *image = NULL;
+   assert_int_equal(create_pnm(&image, FORMAT_PPM, 5, 3, PGM_MAX_VALUE),
+      PNM_SUCCESS);
+   for (size_t i = 0; i < 45; ++i) {
+      ((uint8_t *)get_row(image, i / 15))[i % 15] = i;
+   }
+
+   assert_true(set_layout(NULL, LAYOUT_PLANAR) < 0);
+   assert_int_equal(get_layout(image), LAYOUT_INTERLEAVED);
+   assert_int_equal(set_layout(image, LAYOUT_PLANAR), PNM_SUCCESS);
+   assert_int_equal(get_layout(image), LAYOUT_PLANAR);
+   assert_true(get_plane(image, 3) == NULL);
+   size_t stride = get_stride(image);
+   for (unsigned int a = 0; a < 3; ++a) {
+      const uint8_t *plane = get_plane(image, a);
+      for (unsigned int y = 0; y < 3; ++y) {
+         for (unsigned int x = 0; x < 5; ++x) {
+            assert_int_equal(plane[y * stride + x], 15 * y + 3 * x + a);
+         }
+      }
+   }
+
+   // Planar images are written interleaved, and stay planar.
+   assert_int_equal(write_pnm(image, result_ppm_path), PNM_SUCCESS);
+   assert_int_equal(get_layout(image), LAYOUT_PLANAR);
+   PNM *result = NULL;
+   assert_int_equal(load_pnm(&result, result_ppm_path), PNM_SUCCESS);
+   for (size_t i = 0; i < 45; ++i) assert_int_equal(sample8_at(result, i), i);
+   free_pnm(&result);
+   remove(result_ppm_path);
+
+   assert_int_equal(negative(image), FILTER_SUCCESS);
+   assert_int_equal(monochrome(image, "v"), FILTER_SUCCESS);
+   assert_int_equal(get_layout(image), LAYOUT_PLANAR);
+   for (size_t i = 0; i < 45; ++i) {
+      assert_int_equal(sample8_at(image, i), i % 3 == 1 ? 255 - i : 0);
+   }
+   assert_int_equal(get_layout(image), LAYOUT_INTERLEAVED);
+   free_pnm(&image);
+
+   // Both layouts give the same gray levels.
+   PNM *planar = NULL;
+   assert_int_equal(load_pnm(&image, valid_ppm), PNM_SUCCESS);
+   assert_int_equal(load_pnm(&planar, valid_ppm), PNM_SUCCESS);
+   assert_int_equal(set_layout(planar, LAYOUT_PLANAR), PNM_SUCCESS);
+   assert_int_equal(fifty_shades_of_grey(image, "2"), FILTER_SUCCESS);
+   assert_int_equal(fifty_shades_of_grey(planar, "2"), FILTER_SUCCESS);
+   assert_int_equal(get_sample_count(planar), get_sample_count(image));
+   for (size_t i = 0; i < get_sample_count(image); ++i) {
+      assert_int_equal(sample8_at(planar, i), sample8_at(image, i));
+   }
+   free_pnm(&planar);
+
+   // Chains keep planar pixel data through per-pixel filters, and convert
+   // it once for the first geometric filter.
+   FilterChain *chain = NULL;
+   assert_int_equal(load_pnm(&planar, valid_ppm), PNM_SUCCESS);
+   assert_int_equal(set_layout(planar, LAYOUT_PLANAR), PNM_SUCCESS);
+   assert_int_equal(filter_chain_parse(&chain, "negatif,monochrome:r", NULL),
+      FILTER_SUCCESS);
+   assert_int_equal(filter_chain_apply(chain, planar), FILTER_SUCCESS);
+   assert_int_equal(get_layout(planar), LAYOUT_PLANAR);
+   filter_chain_free(&chain);
+   assert_int_equal(filter_chain_parse(&chain, "miroir_h,negatif", NULL),
+      FILTER_SUCCESS);
+   assert_int_equal(filter_chain_apply(chain, planar), FILTER_SUCCESS);
+   assert_int_equal(get_layout(planar), FLIP_H_LAYOUT);
+   filter_chain_free(&chain);
+   free_pnm(&planar);
+
+   // One channel is laid out the same way in both layouts.
+   uint8_t *data = get_data8(image);
+   assert_int_equal(set_layout(image, LAYOUT_PLANAR), PNM_SUCCESS);
+   assert_true(get_plane(image, 0) == data);
+   free_pnm(&image);
+
+   assert_int_equal(load_pnm(&image, valid_pbm), PNM_SUCCESS);
+   assert_true(set_layout(image, LAYOUT_PLANAR) < 0);
+   assert_true(get_plane(image, 0) == NULL);
+   free_pnm(&image);
+
+   // Rows of 8-bit and 16-bit samples are converted by blocks of pixels,
+   // then pixel by pixel past the last whole block.
+   const unsigned int width = 64 * 3 + 11;
+   for (int wide = 0; wide < 2; ++wide) {
+      assert_int_equal(create_pnm(&image, FORMAT_PPM, width, 3,
+         wide ? 65535 : PGM_MAX_VALUE), PNM_SUCCESS);
+      size_t count = (size_t)width * 3 * 3;
+      for (size_t i = 0; i < count; ++i) {
+         set_sample(image, i, (i * 7919) % (wide ? 65536 : 256));
+      }
+      assert_int_equal(set_storage(image, wide ? STORAGE_16 : STORAGE_8),
+         PNM_SUCCESS);
+      assert_int_equal(set_layout(image, LAYOUT_PLANAR), PNM_SUCCESS);
+      size_t stride = get_stride(image);
+      int same = 1;
+      for (unsigned int a = 0; a < 3; ++a) {
+         const uint8_t *plane = get_plane(image, a);
+         for (size_t i = 0; i < (size_t)width * 3; ++i) {
+            size_t y = i / width, x = i % width;
+            uint16_t expected = ((3 * i + a) * 7919) % (wide ? 65536 : 256);
+            same &= (wide ? ((const uint16_t *)(plane + y * stride))[x]
+               : plane[y * stride + x]) == expected;
+         }
+      }
+      assert_true(same);
+      assert_int_equal(set_layout(image, LAYOUT_INTERLEAVED), PNM_SUCCESS);
+      for (size_t i = 0; i < count; ++i) {
+         same &= sample_at(image, i) == (i * 7919) % (wide ? 65536 : 256);
+      }
+      assert_true(same);
+      free_pnm(&image);
+   }
+}
+
+static void test_view() {
+   // A 6x4 PPM image whose samples hold their own index.
+   PNM *image = NULL;
+   assert_int_equal(create_pnm(&image, FORMAT_PPM, 6, 4, PGM_MAX_VALUE),
+      PNM_SUCCESS);
+   for (unsigned int y = 0; y < 4; ++y) {
+      uint8_t *row = get_row(image, y);
+      for (unsigned int i = 0; i < 18; ++i) row[i] = 18 * y + i;
+   }
+
+   PNM *view = NULL;
+   assert_true(pnm_view(NULL, image, 0, 0, 1, 1) < 0);
+   assert_true(pnm_view(&view, NULL, 0, 0, 1, 1) < 0);
+   assert_true(pnm_view(&view, image, 0, 0, 0, 1) < 0);
+   assert_true(pnm_view(&view, image, 4, 0, 3, 1) < 0);
+   assert_true(pnm_view(&view, image, 0, 1, 1, UINT_MAX) < 0);
+
+   assert_int_equal(pnm_view(&view, image, 2, 1, 3, 2), PNM_SUCCESS);
+   assert_int_equal(get_format(view), FORMAT_PPM);
+   assert_int_equal(get_width(view), 3);
+   assert_int_equal(get_height(view), 2);
+   assert_int_equal(get_stride(view), get_stride(image));
+   for (size_t i = 0; i < 18; ++i) {
+      assert_int_equal(sample8_at(view, i), 18 * (i / 9 + 1) + 6 + i % 9);
+   }
+
+   // Filters working in place change the parent through the view.
+   assert_int_equal(negative(view), FILTER_SUCCESS);
+   for (size_t i = 0; i < 72; ++i) {
+      unsigned int x = i % 18 / 3;
+      unsigned int y = i / 18;
+      int inside = 2 <= x && x < 5 && 1 <= y && y < 3;
+      assert_int_equal(sample8_at(image, i), inside ? 255 - i : i);
+   }
+
+   assert_int_equal(write_pnm(view, result_ppm_path), PNM_SUCCESS);
+   PNM *result = NULL;
+   assert_int_equal(load_pnm(&result, result_ppm_path), PNM_SUCCESS);
+   assert_int_equal(get_width(result), 3);
+   assert_int_equal(get_height(result), 2);
+   for (size_t i = 0; i < 18; ++i) {
+      assert_int_equal(sample8_at(result, i), sample8_at(view, i));
+   }
+   free_pnm(&result);
+   remove(result_ppm_path);
+
+   // Views outlive their parent, and can be viewed in turn.
+   PNM *inner = NULL;
+   assert_int_equal(pnm_view(&inner, view, 1, 1, 2, 1), PNM_SUCCESS);
+   free_pnm(&image);
+   assert_int_equal(sample8_at(inner, 0), 255 - (18 * 2 + 9));
+
+   // A filter that changes the format gives the view pixel data of its own.
+   assert_int_equal(fifty_shades_of_grey(view, "1"), FILTER_SUCCESS);
+   assert_int_equal(get_format(inner), FORMAT_PPM);
+   assert_int_equal(sample8_at(inner, 0), 255 - (18 * 2 + 9));
+   free_pnm(&view);
+   free_pnm(&inner);
+
+   // Bit-packed rows are viewed from a byte boundary.
+   assert_int_equal(create_pnm(&image, FORMAT_PBM, 20, 2, PBM_MAX_VALUE),
+      PNM_SUCCESS);
+   assert_true(pnm_view(&view, image, 3, 0, 8, 2) < 0);
+   assert_int_equal(pnm_view(&view, image, 8, 1, 12, 1), PNM_SUCCESS);
+   assert_true(get_bits(view) == (uint8_t *)get_row(image, 1) + 1);
+   free_pnm(&view);
+   free_pnm(&image);
+}
+
+static void test_parallel_decode() {
+   const char *paths[] = {result_pbm_path, result_pgm_path};
+   const FormatPNM formats[] = {FORMAT_PBM, FORMAT_PGM};
+   const uint16_t max_values[] = {PBM_MAX_VALUE, 200};
+
+   // Large enough for the ASCII bodies to be split between threads.
+   const unsigned int width = 1001;
+   const unsigned int height = 700;
+
+   for (int f = 0; f < 2; ++f) {
+      PNM *image = NULL;
+      assert_int_equal(create_pnm(&image, formats[f], width, height,
+         max_values[f]), PNM_SUCCESS);
+      uint16_t *data = get_data(image);
+      for (size_t i = 0; i < (size_t)width * height; ++i) {
+         data[i] = (i * 7919) % (max_values[f] + 1);
+      }
+      assert_int_equal(write_pnm(image, paths[f]), PNM_SUCCESS);
+
+      PNM *serial = NULL;
+      pnm_set_threads(1);
+      assert_int_equal(pnm_get_threads(), 1);
+      assert_int_equal(load_pnm(&serial, paths[f]), PNM_SUCCESS);
+
+      PNM *parallel = NULL;
+      pnm_set_threads(4);
+      assert_int_equal(pnm_get_threads(), 4);
+      assert_int_equal(load_pnm(&parallel, paths[f]), PNM_SUCCESS);
+      pnm_set_threads(0);
+
+      for (size_t i = 0; i < (size_t)width * height; ++i) {
+         assert_int_equal(get_data(serial)[i], data[i]);
+         assert_int_equal(get_data(parallel)[i], data[i]);
+      }
+      free_pnm(&image);
+      free_pnm(&serial);
+      free_pnm(&parallel);
+      remove(paths[f]);
+   }
+   assert_true(1 <= pnm_get_threads());
+
+   // Bodies read from files are decoded in chunks, comments included, and
+   // a missing sample is still found.
+   const unsigned int long_width = 2000;
+   const unsigned int long_height = 1000;
+   const size_t sample_count = (size_t)long_width * long_height;
+   for (int missing = 0; missing < 2; ++missing) {
+      FILE *file = fopen(result_pgm_path, "w");
+      assert_true(file != NULL);
+      fprintf(file, "P2\n%u %u\n65535\n", long_width, long_height);
+      for (size_t i = 0; i < sample_count - missing; ++i) {
+         fprintf(file, "%u", (unsigned int)(i * 7919 % 65536));
+         if (i % 1000 == 999) {
+            fputs(" # 1 2 3\n", file);
+         } else {
+            fputc(i % 10 == 9 ? '\n' : ' ', file);
+         }
+      }
+      fclose(file);
+
+      PNM *chunked = NULL;
+      pnm_set_threads(4);
+      int code = load_pnm(&chunked, result_pgm_path);
+      pnm_set_threads(0);
+      if (missing) {
+         assert_int_equal(code, LOAD_PNM_DECODE_ERROR);
+      } else {
+         assert_int_equal(code, PNM_SUCCESS);
+         uint16_t *samples = get_data(chunked);
+         int same = 1;
+         for (size_t i = 0; i < sample_count; ++i) {
+            same &= samples[i] == i * 7919 % 65536;
+         }
+         assert_true(same);
+         free_pnm(&chunked);
+      }
+      remove(result_pgm_path);
+   }
+}
+
+static void test_parallel_encode() {
+   const char *serial_path = "test_image/result_serial.ppm";
+   const unsigned int width = 500;
+   const unsigned int height = 400;
+
+   PNM *image = NULL;
+   assert_int_equal(create_pnm(&image, FORMAT_PPM, width, height,
+      PPM_MAX_VALUE), PNM_SUCCESS);
+   uint16_t *data = get_data(image);
+   for (size_t i = 0; i < (size_t)width * height * 3; ++i) {
+      data[i] = (i * 7919) % (PPM_MAX_VALUE + 1);
+   }
+
+   pnm_set_threads(1);
+   assert_int_equal(write_pnm(image, serial_path), PNM_SUCCESS);
+   pnm_set_threads(4);
+   assert_int_equal(write_pnm(image, result_ppm_path), PNM_SUCCESS);
+   pnm_set_threads(0);
+   free_pnm(&image);
+
+   FILE *serial = fopen(serial_path, "rb");
+   FILE *parallel = fopen(result_ppm_path, "rb");
+   assert_true(serial != NULL && parallel != NULL);
+   int c;
+   do {
+      c = fgetc(serial);
+      assert_int_equal(fgetc(parallel), c);
+   } while (c != EOF);
+   fclose(serial);
+   fclose(parallel);
+   remove(serial_path);
+   remove(result_ppm_path);
+}
+
+static void test_parallel_for() {
+   const size_t count = 1000;
+   unsigned char items[1000];
+   BandMarks marks = {items, {0}, 0};
+
+   // Small jobs have a single band, large ones one band per thread.
+   pnm_set_threads(4);
+   assert_int_equal(pnm_parallel_bands(count, 1000), 1);
+   assert_int_equal(pnm_parallel_bands(count, SIZE_MAX), 4);
+   assert_int_equal(pnm_parallel_bands(3, SIZE_MAX), 3);
+   assert_int_equal(pnm_parallel_bands(0, SIZE_MAX), 1);
+   assert_true(pnm_parallel_for(count, 0, mark_band, &marks) < 0);
+   assert_true(pnm_parallel_for(3, 4, mark_band, &marks) < 0);
+   assert_int_equal(pnm_parallel_for(0, 4, mark_band, &marks), 0);
+
+   // Each item is in exactly one band, band b before band b + 1.
+   memset(items, 0, count);
+   assert_int_equal(pnm_parallel_for(count, 4, mark_band, &marks), 0);
+   for (size_t i = 0; i < count; ++i) assert_int_equal(items[i], 1);
+   assert_ulong_equal(marks.firsts[0], 0);
+   for (unsigned int b = 1; b < 4; ++b) {
+      assert_true(marks.firsts[b - 1] < marks.firsts[b]);
+   }
+
+   // A job of three items in three bands, the second of which fails.
+   memset(items, 0, count);
+   assert_int_equal(pnm_parallel_for(3, 3, mark_band, &marks), -7);
+   assert_ulong_equal(count_marks(items, 3), 3);
+
+   // Jobs posted by bands run on their calling thread.
+   memset(items, 0, count);
+   marks.nested = 1;
+   assert_int_equal(pnm_parallel_for(count, 4, mark_band, &marks), 0);
+   for (size_t i = 0; i < count; ++i) assert_int_equal(items[i], 2);
+
+   // Stopped threads are joined, and the next job starts them again.
+   marks.nested = 0;
+   pnm_stop_threads();
+   size_t thread_count = count_threads();
+   memset(items, 0, count);
+   assert_int_equal(pnm_parallel_for(count, 4, mark_band, &marks), 0);
+   for (size_t i = 0; i < count; ++i) assert_int_equal(items[i], 1);
+   assert_ulong_equal(count_threads(), thread_count + 3);
+   pnm_stop_threads();
+   assert_ulong_equal(count_threads(), thread_count);
+   pnm_set_threads(1);
+   assert_int_equal(pnm_parallel_bands(count, SIZE_MAX), 1);
+   pnm_set_threads(0);
+
+   setenv(PNM_THREADS_VARIABLE, "3", 1);
+   assert_int_equal(pnm_get_threads(), 3);
+   pnm_set_threads(5);
+   assert_int_equal(pnm_get_threads(), 5);
+   pnm_set_threads(0);
+   setenv(PNM_THREADS_VARIABLE, "0", 1);
+   assert_true(1 <= pnm_get_threads());
+   unsetenv(PNM_THREADS_VARIABLE);
+}
+
+static void test_probe() {
+   PNMInfo info;
+   assert_true(pnm_probe(NULL, &info) < 0);
+   assert_true(pnm_probe(valid_ppm, NULL) < 0);
+   assert_int_equal(pnm_probe(invalid_filename, &info), PNM_INVALID_FILENAME);
+   assert_int_equal(pnm_probe(invalid_size, &info), LOAD_PNM_DECODE_ERROR);
+
+   assert_int_equal(pnm_probe(valid_ppm, &info), PNM_SUCCESS);
+   assert_int_equal(info.format, FORMAT_PPM);
+   assert_int_equal(info.encoding, ENCODING_ASCII);
+   assert_int_equal(info.width, 3);
+   assert_int_equal(info.height, 3);
+   assert_int_equal(info.max_value, PPM_MAX_VALUE);
+   assert_int_equal(info.channels, 3);
+   assert_int_equal(info.data_offset, 59);
+
+   assert_int_equal(pnm_probe(valid_pam, &info), PNM_SUCCESS);
+   assert_int_equal(info.format, FORMAT_PAM);
+   assert_int_equal(info.encoding, ENCODING_RAW);
+   assert_int_equal(info.channels, 4);
+   assert_int_equal(info.data_offset, 65);
+
+   const char *filenames[] = {
+      valid_raw_pbm,
+      invalid_filename,
+      valid_raw_pgm,
+      invalid_format,
+      valid_raw_ppm
+   };
+   PNMInfo infos[5];
+   int codes[5];
+   assert_true(pnm_probe_batch(NULL, 5, infos, codes) < 0);
+   assert_int_equal(pnm_probe_batch(filenames, 5, infos, codes), PNM_SUCCESS);
+   assert_int_equal(codes[0], PNM_SUCCESS);
+   assert_int_equal(codes[1], PNM_INVALID_FILENAME);
+   assert_int_equal(codes[2], PNM_SUCCESS);
+   assert_int_equal(codes[3], LOAD_PNM_DECODE_ERROR);
+   assert_int_equal(codes[4], PNM_SUCCESS);
+
+   assert_int_equal(infos[0].format, FORMAT_PBM);
+   assert_int_equal(infos[0].encoding, ENCODING_RAW);
+   assert_int_equal(infos[0].max_value, PBM_MAX_VALUE);
+   assert_int_equal(infos[0].data_offset, 22);
+   assert_int_equal(infos[2].format, FORMAT_PGM);
+   assert_int_equal(infos[2].data_offset, 23);
+   assert_int_equal(infos[4].format, FORMAT_PPM);
+   assert_int_equal(infos[4].max_value, PPM_MAX_VALUE);
+   assert_int_equal(infos[4].data_offset, 13);
+}
+
+static void test_load_pnm_region() {
+   const char *paths[] = {result_pbm_path, result_pgm_path, result_ppm_path};
+   const FormatPNM formats[] = {FORMAT_PBM, FORMAT_PGM, FORMAT_PPM};
+   const uint16_t max_values[] = {PBM_MAX_VALUE, 200, PPM_MAX_VALUE};
+   const EncodingPNM encodings[] = {ENCODING_ASCII, ENCODING_RAW};
+   const unsigned int width = 21;
+   const unsigned int height = 9;
+
+   PNM *region = NULL;
+   assert_true(load_pnm_region(NULL, valid_ppm, 0, 0, 1, 1) < 0);
+   assert_true(load_pnm_region(&region, NULL, 0, 0, 1, 1) < 0);
+   assert_true(load_pnm_region(&region, valid_ppm, 0, 0, 0, 1) < 0);
+   assert_true(load_pnm_region(&region, valid_ppm, 1, 0, 3, 1) < 0);
+   assert_int_equal(load_pnm_region(&region, invalid_filename, 0, 0, 1, 1),
+      PNM_INVALID_FILENAME);
+   assert_int_equal(load_pnm_region(&region, invalid_raw_data, 0, 2, 3, 1),
+      LOAD_PNM_DECODE_ERROR);
+
+   for (int f = 0; f < 3; ++f) {
+      for (int e = 0; e < 2; ++e) {
+         PNM *image = NULL;
+         assert_int_equal(create_pnm(&image, formats[f], width, height,
+            max_values[f]), PNM_SUCCESS);
+         size_t channels = (formats[f] == FORMAT_PPM) ? 3 : 1;
+         uint16_t *data = get_data(image);
+         for (size_t i = 0; i < width * height * channels; ++i) {
+            data[i] = (i * 7919) % (max_values[f] + 1);
+         }
+         set_encoding(image, encodings[e]);
+         assert_int_equal(write_pnm(image, paths[f]), PNM_SUCCESS);
+
+         // Regions on the left edge, inside, and on the right edge.
+         const unsigned int xs[] = {0, 3, 11};
+         const unsigned int widths[] = {21, 9, 10};
+         for (int r = 0; r < 3; ++r) {
+            assert_int_equal(load_pnm_region(&region, paths[f], xs[r], 2,
+               widths[r], 5), PNM_SUCCESS);
+            assert_int_equal(get_format(region), formats[f]);
+            assert_int_equal(get_encoding(region), encodings[e]);
+            assert_int_equal(get_width(region), widths[r]);
+            assert_int_equal(get_height(region), 5);
+            assert_int_equal(get_max_value(region), max_values[f]);
+            for (unsigned int y = 0; y < 5; ++y) {
+               for (size_t x = 0; x < widths[r] * channels; ++x) {
+                  size_t i = ((y + 2) * width + xs[r]) * channels + x;
+                  assert_int_equal(get_data(region)[y * widths[r] * channels
+                     + x], data[i]);
+               }
+            }
+            free_pnm(&region);
+         }
+         free_pnm(&image);
+         remove(paths[f]);
+      }
+   }
+}
+
+static void test_large_image() {
+   // A sparse raw PGM file of ten billion samples, whose size and offsets do
+   // not fit in 32 bits, with its last sample set.
+   const unsigned int size = 100000;
+   const char header[] = "P5\n100000 100000\n255\n";
+   const off_t header_size = sizeof(header) - 1;
+   int fd = open(result_pgm_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   assert_true(fd >= 0);
+   assert_int_equal(write(fd, header, header_size), header_size);
+   assert_int_equal(pwrite(fd, "M", 1, header_size + (off_t)size * size - 1),
+      1);
+   assert_int_equal(close(fd), 0);
+
+   PNMInfo info;
+   assert_int_equal(pnm_probe(result_pgm_path, &info), PNM_SUCCESS);
+   assert_int_equal(info.width, size);
+   assert_int_equal(info.height, size);
+
+   PNM *region = NULL;
+   assert_int_equal(load_pnm_region(&region, result_pgm_path, size - 4,
+      size - 2, 4, 2), PNM_SUCCESS);
+   assert_int_equal(get_sample_count(region), 8);
+   for (size_t i = 0; i < 7; ++i) assert_int_equal(get_data(region)[i], 0);
+   assert_int_equal(get_data(region)[7], 'M');
+   free_pnm(&region);
+   remove(result_pgm_path);
+
+   // Images whose samples cannot be addressed are rejected before any
+   // allocation.
+   const char ppm[] = "P6\n4294967295 4294967295\n65535\n";
+   const char pam[] = "P7\nWIDTH 4294967295\nHEIGHT 4294967295\n"
+      "DEPTH 4294967295\nMAXVAL 255\nENDHDR\n";
+   PNM *image = NULL;
+   assert_int_equal(load_pnm_from_memory(&image, ppm, sizeof(ppm) - 1),
+      LOAD_PNM_DECODE_ERROR);
+   assert_int_equal(load_pnm_from_memory(&image, pam, sizeof(pam) - 1),
+      LOAD_PNM_DECODE_ERROR);
+   assert_int_equal(create_pnm(&image, FORMAT_PPM, UINT_MAX, UINT_MAX,
+      PPM_MAX_VALUE), LOAD_PNM_MEMORY_ERROR);
+   assert_int_equal(create_pam(&image, UINT_MAX, UINT_MAX, UINT_MAX,
+      PAM_MAX_VALUE, "RGB"), LOAD_PNM_MEMORY_ERROR);
+
+   PNMWriter *writer = NULL;
+   assert_true(pnm_writer_open(&writer, result_ppm_path, FORMAT_PPM,
+      ENCODING_RAW, UINT_MAX, UINT_MAX, PPM_MAX_VALUE) < 0);
+   assert_true(access(result_ppm_path, F_OK) != 0);
+}
+
+static void test_memory_and_fd_pnm() {
+   PNM *image = NULL;
+   PNM *result = NULL;
+   void *bytes = NULL;
+   size_t size = 0;
+
+   assert_true(load_pnm_from_memory(NULL, "P1 1 1 1", 8) < 0);
+   assert_true(load_pnm_from_memory(&image, NULL, 8) < 0);
+   assert_int_equal(load_pnm_from_memory(&image, "P1 2 1 1", 8),
+      LOAD_PNM_DECODE_ERROR);
+   assert_int_equal(load_pnm_from_memory(&image, "P2 2 1 3 0 3", 12),
+      PNM_SUCCESS);
+   assert_int_equal(get_format(image), FORMAT_PGM);
+   assert_int_equal(get_data(image)[1], 3);
+   free_pnm(&image);
+
+   assert_true(write_pnm_to_memory(NULL, &bytes, &size) < 0);
+   assert_int_equal(load_pnm(&image, valid_raw_ppm), PNM_SUCCESS);
+   assert_int_equal(write_pnm_to_memory(image, &bytes, &size), PNM_SUCCESS);
+   assert_int_equal(size, 13 + 3 * 3 * 3 * 2);
+   assert_int_equal(load_pnm_from_memory(&result, bytes, size), PNM_SUCCESS);
+   assert_int_equal(get_format(result), FORMAT_PPM);
+   assert_int_equal(get_encoding(result), ENCODING_RAW);
+   for (size_t i = 0; i < 3 * 3 * 3; ++i) {
+      assert_int_equal(get_data(result)[i], get_data(image)[i]);
+   }
+   free(bytes);
+   free_pnm(&result);
+
+   assert_int_equal(load_pnm_from_fd(&result, -1), PNM_INVALID_FILENAME);
+   assert_int_equal(write_pnm_to_fd(image, -1), PNM_INVALID_FILENAME);
+
+   // A file without a PNM extension, read and written through descriptors.
+   const char *path = "test_image/result.bin";
+   int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   assert_true(fd != -1);
+   assert_int_equal(write_pnm_to_fd(image, fd), PNM_SUCCESS);
+   assert_int_equal(close(fd), 0);
+
+   fd = open(path, O_RDONLY);
+   assert_true(fd != -1);
+   assert_int_equal(load_pnm_from_fd(&result, fd), PNM_SUCCESS);
+   assert_int_equal(close(fd), 0);
+   assert_int_equal(get_format(result), FORMAT_PPM);
+   for (size_t i = 0; i < 3 * 3 * 3; ++i) {
+      assert_int_equal(get_data(result)[i], get_data(image)[i]);
+   }
+   free_pnm(&result);
+   free_pnm(&image);
+   remove(path);
+}
+
+static void test_frames() {
+   PNMFrameReader *frames = NULL;
+   PNM *image = NULL;
+   PNM *frame = NULL;
+
+   assert_true(pnm_frames_open(NULL, valid_ppm) < 0);
+   assert_int_equal(pnm_frames_open(&frames, "test_image/missing.ppm"),
+      PNM_INVALID_FILENAME);
+   assert_int_equal(pnm_frames_open_fd(&frames, -1), PNM_INVALID_FILENAME);
+
+   // Two raw images of the same size followed by an ASCII one.
+   const char *path = "test_image/result.bin";
+   int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   assert_true(fd != -1);
+   assert_int_equal(load_pnm(&image, valid_raw_ppm), PNM_SUCCESS);
+   assert_int_equal(write_pnm_to_fd(image, fd), PNM_SUCCESS);
+   assert_int_equal(negative(image), FILTER_SUCCESS);
+   assert_int_equal(write_pnm_to_fd(image, fd), PNM_SUCCESS);
+   free_pnm(&image);
+   assert_int_equal(load_pnm(&image, valid_pgm), PNM_SUCCESS);
+   assert_int_equal(write_pnm_to_fd(image, fd), PNM_SUCCESS);
+   assert_int_equal(close(fd), 0);
+
+   assert_int_equal(pnm_frames_open(&frames, path), PNM_SUCCESS);
+   assert_int_equal(pnm_frames_next(frames, &frame), PNM_SUCCESS);
+   assert_int_equal(get_format(frame), FORMAT_PPM);
+   assert_int_equal(get_encoding(frame), ENCODING_RAW);
+   const void *first_data = get_data8(frame);
+   uint16_t first_sample = get_data(frame)[0];
+   uint16_t max_value = get_max_value(frame);
+
+   assert_int_equal(pnm_frames_next(frames, &frame), PNM_SUCCESS);
+   assert_true(get_data8(frame) == first_data);
+   assert_int_equal(get_data(frame)[0], max_value - first_sample);
+
+   assert_int_equal(pnm_frames_next(frames, &frame), PNM_SUCCESS);
+   assert_int_equal(get_format(frame), FORMAT_PGM);
+   assert_int_equal(get_encoding(frame), ENCODING_ASCII);
+   assert_int_equal(get_width(frame), get_width(image));
+   assert_int_equal(get_height(frame), get_height(image));
+   size_t size = get_width(image) * get_height(image);
+   for (size_t i = 0; i < size; ++i) {
+      assert_int_equal(get_data(frame)[i], get_data(image)[i]);
+   }
+
+   assert_int_equal(pnm_frames_next(frames, &frame), PNM_END_OF_FRAMES);
+   assert_true(frame == NULL);
+   pnm_frames_close(&frames);
+   assert_true(frames == NULL);
+
+   // A sequence whose last image is cut short.
+   fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   assert_true(fd != -1);
+   assert_int_equal(write_pnm_to_fd(image, fd), PNM_SUCCESS);
+   assert_int_equal(write(fd, "P2 2 2 255 0", 12), 12);
+   assert_int_equal(close(fd), 0);
+
+   fd = open(path, O_RDONLY);
+   assert_true(fd != -1);
+   assert_int_equal(pnm_frames_open_fd(&frames, fd), PNM_SUCCESS);
+   assert_int_equal(close(fd), 0);
+   assert_int_equal(pnm_frames_next(frames, &frame), PNM_SUCCESS);
+   assert_int_equal(pnm_frames_next(frames, &frame), LOAD_PNM_DECODE_ERROR);
+   pnm_frames_close(&frames);
+
+   free_pnm(&image);
+   remove(path);
+}
+
+static void test_allocator() {
+   PNM *image = NULL;
+
+   // Allocations and releases of a load, a filter and a free balance.
+   size_t counts[2] = {0, 0};
+   PNMAllocator counting = {counting_allocate, counting_release, counts};
+   pnm_set_allocator(&counting);
+   assert_int_equal(load_pnm(&image, valid_ppm), PNM_SUCCESS);
+   assert_int_equal(fifty_shades_of_grey(image, "1"), FILTER_SUCCESS);
+   free_pnm(&image);
+   pnm_set_allocator(NULL);
+   assert_true(3 <= counts[0]);
+   assert_int_equal(counts[0], counts[1]);
+
+   // Once a first cycle has released its blocks, the next cycles only reuse
+   // them.
+   PNMPool *pool = NULL;
+   PNMAllocator pooled;
+   PNMPoolStats stats;
+   assert_true(pnm_pool_create(NULL, 0) < 0);
+   assert_int_equal(pnm_pool_create(&pool, 1 << 20), PNM_SUCCESS);
+   pnm_pool_allocator(pool, &pooled);
+   pnm_set_allocator(&pooled);
+   size_t cycle_count = 0;
+   for (int i = 0; i < 3; ++i) {
+      assert_int_equal(load_pnm(&image, valid_raw_ppm), PNM_SUCCESS);
+      assert_int_equal(fifty_shades_of_grey(image, "1"), FILTER_SUCCESS);
+      free_pnm(&image);
+      if (i == 0) {
+         pnm_pool_stats(pool, &stats);
+         cycle_count = stats.allocations;
+      }
+   }
+   pnm_set_allocator(NULL);
+   pnm_pool_stats(pool, &stats);
+   assert_int_equal(stats.allocations, 3 * cycle_count);
+   assert_true(2 * cycle_count <= stats.hits);
+   assert_true(0 < stats.cached_blocks);
+   assert_true(stats.cached_size <= 1 << 20);
+   pnm_pool_destroy(&pool);
+   assert_true(pool == NULL);
+
+   // A pool without capacity keeps nothing.
+   assert_int_equal(pnm_pool_create(&pool, 0), PNM_SUCCESS);
+   pnm_pool_allocator(pool, &pooled);
+   pnm_set_allocator(&pooled);
+   for (int i = 0; i < 2; ++i) {
+      assert_int_equal(load_pnm(&image, valid_raw_ppm), PNM_SUCCESS);
+      free_pnm(&image);
+   }
+   pnm_set_allocator(NULL);
+   pnm_pool_stats(pool, &stats);
+   assert_int_equal(stats.hits, 0);
+   assert_int_equal(stats.cached_blocks, 0);
+   pnm_pool_destroy(&pool);
+
+   // Images allocated before the allocator changes are released by the
+   // allocator that allocated them, views and lazily loaded images included.
+   PNM *images[4] = {NULL, NULL, NULL, NULL};
+   counts[0] = 0;
+   counts[1] = 0;
+   assert_int_equal(load_pnm(&images[0], valid_raw_ppm), PNM_SUCCESS);
+   assert_int_equal(pnm_pool_create(&pool, 1 << 20), PNM_SUCCESS);
+   pnm_pool_allocator(pool, &pooled);
+   pnm_set_allocator(&pooled);
+   assert_int_equal(load_pnm(&images[1], valid_raw_ppm), PNM_SUCCESS);
+   assert_int_equal(load_pnm_lazy(&images[2], valid_raw_pgm), PNM_SUCCESS);
+   assert_int_equal(pnm_view(&images[3], images[0], 0, 0, 1, 1), PNM_SUCCESS);
+   pnm_set_allocator(&counting);
+   assert_int_equal(negative(images[0]), FILTER_SUCCESS);
+   for (int i = 3; 0 <= i; --i) free_pnm(&images[i]);
+   assert_int_equal(counts[1], 0);
+   pnm_set_allocator(NULL);
+   assert_int_equal(counts[0], 0);
+
+   // Every block of the pool came back to it.
+   pnm_pool_stats(pool, &stats);
+   assert_int_equal(stats.cached_blocks, stats.allocations - stats.hits);
+   pnm_pool_destroy(&pool);
+}
+
+static void test_pam() {
+   PNM *image = NULL;
+   PNM *result = NULL;
+
+   assert_int_equal(load_pnm(&image, valid_pam), PNM_SUCCESS);
+   assert_int_equal(get_format(image), FORMAT_PAM);
+   assert_int_equal(get_encoding(image), ENCODING_RAW);
+   assert_int_equal(get_width(image), 2);
+   assert_int_equal(get_height(image), 1);
+   assert_int_equal(get_channels(image), 4);
+   assert_int_equal(get_max_value(image), 255);
+   assert_string_equal(get_tuple_type(image), "RGB_ALPHA");
+   assert_true(has_alpha(image));
+   assert_int_equal(get_storage(image), STORAGE_8);
+   const uint8_t samples[] = {10, 20, 30, 128, 255, 0, 16, 32};
+   for (size_t i = 0; i < 8; ++i) {
+      assert_int_equal(sample8_at(image, i), samples[i]);
+   }
+
+   set_encoding(image, ENCODING_ASCII);
+   assert_int_equal(get_encoding(image), ENCODING_RAW);
+   assert_int_equal(write_pnm(image, result_ppm_path), PNM_INVALID_FILENAME);
+   assert_int_equal(write_pnm(image, result_pam_path), PNM_SUCCESS);
+   assert_int_equal(load_pnm(&result, result_pam_path), PNM_SUCCESS);
+   assert_int_equal(get_channels(result), 4);
+   assert_string_equal(get_tuple_type(result), "RGB_ALPHA");
+   for (size_t i = 0; i < 8; ++i) {
+      assert_int_equal(get_data(result)[i], samples[i]);
+   }
+   free_pnm(&result);
+   free_pnm(&image);
+   remove(result_pam_path);
+
+   // Fields in any order, comments, a tuple type over two lines and 16-bit
+   // samples.
+   const char pam[] =
+      "P7\n# comment\nMAXVAL 1000\nDEPTH 2\nTUPLTYPE GRAYSCALE\n"
+      "HEIGHT 1\nWIDTH 1\nTUPLTYPE  EXTRA \nENDHDR\n\x03\xE8\x00\x0A";
+   assert_int_equal(load_pnm_from_memory(&image, pam, sizeof(pam) - 1),
+      PNM_SUCCESS);
+   assert_int_equal(get_channels(image), 2);
+   assert_int_equal(get_max_value(image), 1000);
+   assert_string_equal(get_tuple_type(image), "GRAYSCALE EXTRA");
+   assert_false(has_alpha(image));
+   assert_int_equal(get_data(image)[0], 1000);
+   assert_int_equal(get_data(image)[1], 10);
+
+   void *bytes = NULL;
+   size_t size = 0;
+   assert_int_equal(write_pnm_to_memory(image, &bytes, &size), PNM_SUCCESS);
+   const char header[] = "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 2\nMAXVAL 1000\n"
+      "TUPLTYPE GRAYSCALE EXTRA\nENDHDR\n";
+   assert_int_equal(size, sizeof(header) - 1 + 4);
+   assert_true(memcmp(bytes, header, sizeof(header) - 1) == 0);
+   free(bytes);
+   free_pnm(&image);
+
+   const char *invalid_pams[] = {
+      "P7\nWIDTH 1\nHEIGHT 1\nMAXVAL 255\nENDHDR\n\x00",
+      "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 1\nMAXVAL 0\nENDHDR\n\x00",
+      "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 1\nMAXVAL 255\nSIZE 1\nENDHDR\n\x00",
+      "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 1\nMAXVAL 255\n\x00",
+      "P7\nWIDTH 2\nHEIGHT 1\nDEPTH 1\nMAXVAL 255\nENDHDR\n\x00",
+      "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 1\nMAXVAL 9\nENDHDR\n\x0A"
+   };
+   for (size_t i = 0; i < sizeof(invalid_pams) / sizeof(char *); ++i) {
+      assert_int_equal(load_pnm_from_memory(
+         &image,
+         invalid_pams[i],
+         strlen(invalid_pams[i]) + 1
+      ), LOAD_PNM_DECODE_ERROR);
+   }
+
+   assert_true(create_pam(&image, 2, 2, 0, 255, "GRAYSCALE") < 0);
+   assert_true(create_pnm(&image, FORMAT_PAM, 2, 2, 255) < 0);
+   assert_int_equal(create_pam(&image, 2, 3, 2, 255, "GRAYSCALE_ALPHA"),
+      PNM_SUCCESS);
+   assert_int_equal(get_row_size(image), 4);
+   assert_true(has_alpha(image));
+   free_pnm(&image);
+
+   assert_int_equal(create_pnm(&image, FORMAT_PPM, 1, 1, 255), PNM_SUCCESS);
+   assert_int_equal(get_channels(image), 3);
+   assert_string_equal(get_tuple_type(image), "RGB");
+   assert_false(has_alpha(image));
+   free_pnm(&image);
+}
+
 static void test_turnaround() {
    assert_true(turnaround(NULL) < 0);
 
@@ -152,6 +1672,14 @@ static void test_turnaround() {
    }
    free_pnm(&image_orig);
    free_pnm(&image_modif);
+
+   assert_int_equal(load_pnm(&image_modif, valid_pam), PNM_SUCCESS);
+   assert_int_equal(turnaround(image_modif), FILTER_SUCCESS);
+   const uint8_t samples[] = {255, 0, 16, 32, 10, 20, 30, 128};
+   for (size_t i = 0; i < 8; ++i) {
+      assert_int_equal(sample8_at(image_modif, i), samples[i]);
+   }
+   free_pnm(&image_modif);
 }
 
 static void test_monochrome() {
@@ -172,6 +1700,14 @@ static void test_monochrome() {
 
    assert_int_equal(monochrome(image, "r"), FILTER_SUCCESS);
    free_pnm(&image);
+
+   assert_int_equal(load_pnm(&image, valid_pam), PNM_SUCCESS);
+   assert_int_equal(monochrome(image, "v"), FILTER_SUCCESS);
+   const uint8_t samples[] = {0, 20, 0, 128, 0, 0, 0, 32};
+   for (size_t i = 0; i < 8; ++i) {
+      assert_int_equal(sample8_at(image, i), samples[i]);
+   }
+   free_pnm(&image);
 }
 
 static void test_negative() {
@@ -189,6 +1725,14 @@ static void test_negative() {
    assert_int_equal(load_pnm(&image, valid_ppm), PNM_SUCCESS);
    assert_int_equal(negative(image), FILTER_SUCCESS);
    free_pnm(&image);
+
+   assert_int_equal(load_pnm(&image, valid_pam), PNM_SUCCESS);
+   assert_int_equal(negative(image), FILTER_SUCCESS);
+   const uint8_t samples[] = {245, 235, 225, 128, 0, 255, 239, 32};
+   for (size_t i = 0; i < 8; ++i) {
+      assert_int_equal(sample8_at(image, i), samples[i]);
+   }
+   free_pnm(&image);
 }
 
 static void test_fifty_shades_of_grey() {
@@ -219,6 +1763,19 @@ static void test_fifty_shades_of_grey() {
    assert_int_equal(fifty_shades_of_grey(image, "2"), FILTER_SUCCESS);
    assert_int_equal(get_format(image), FORMAT_PGM);
    free_pnm(&image);
+
+   assert_int_equal(load_pnm(&image, valid_pam), PNM_SUCCESS);
+   assert_int_equal(fifty_shades_of_grey(image, "1"), FILTER_SUCCESS);
+   assert_int_equal(get_format(image), FORMAT_PAM);
+   assert_int_equal(get_channels(image), 2);
+   assert_string_equal(get_tuple_type(image), "GRAYSCALE_ALPHA");
+   const uint8_t samples[] = {20, 128, 90, 32};
+   for (size_t i = 0; i < 4; ++i) {
+      assert_int_equal(sample8_at(image, i), samples[i]);
+   }
+   assert_int_equal(fifty_shades_of_grey(image, "1"),
+      FILTER_WRONG_IMAGE_FORMAT);
+   free_pnm(&image);
 }
 
 static void test_black_and_white() {
@@ -241,17 +1798,601 @@ static void test_black_and_white() {
    assert_int_equal(black_and_white(image, "128"), FILTER_SUCCESS);
    assert_int_equal(get_format(image), FORMAT_PBM);
    free_pnm(&image);
+
+   // Gray levels are scaled to 255 from the maximum value before they are
+   // thresholded, for gray images as for color ones.
+   const char *scaled[] = {
+      "P2\n2 1\n65535\n1000 60000\n",
+      "P3\n2 1\n65535\n1000 1000 1000 60000 60000 60000\n",
+      "P2\n2 1\n15\n7 8\n",
+      "P7\nWIDTH 2\nHEIGHT 1\nDEPTH 1\nMAXVAL 65535\nTUPLTYPE GRAYSCALE\n"
+      "ENDHDR\n\x03\xE8\xEA\x60"
+   };
+   for (size_t i = 0; i < sizeof(scaled) / sizeof(scaled[0]); ++i) {
+      size_t size = strlen(scaled[i]);
+      assert_int_equal(load_pnm_from_memory(&image, scaled[i], size),
+         PNM_SUCCESS);
+      assert_int_equal(black_and_white(image, "128"), FILTER_SUCCESS);
+      if (i == 3) {
+         assert_int_equal(sample8_at(image, 0), 1);
+         assert_int_equal(sample8_at(image, 1), 0);
+      } else {
+         assert_int_equal(get_bits(image)[0], 0x40);
+      }
+      free_pnm(&image);
+   }
+
+   // The same RGB pixels give the same picture in both containers: PBM bit
+   // 1 and PAM sample 0 for black.
+   const char ppm[] = "P3\n2 1\n255\n10 10 10 200 200 200\n";
+   const char pam[] = "P7\nWIDTH 2\nHEIGHT 1\nDEPTH 3\nMAXVAL 255\n"
+      "TUPLTYPE RGB\nENDHDR\n\x0A\x0A\x0A\xC8\xC8\xC8";
+   PNM *pam_image = NULL;
+   assert_int_equal(load_pnm_from_memory(&image, ppm, strlen(ppm)),
+      PNM_SUCCESS);
+   assert_int_equal(load_pnm_from_memory(&pam_image, pam, sizeof(pam) - 1),
+      PNM_SUCCESS);
+   assert_int_equal(black_and_white(image, "128"), FILTER_SUCCESS);
+   assert_int_equal(black_and_white(pam_image, "128"), FILTER_SUCCESS);
+   assert_int_equal(get_bits(image)[0] & 0xC0, 0x40);
+   assert_int_equal(sample8_at(pam_image, 0), 1);
+   assert_int_equal(sample8_at(pam_image, 1), 0);
+   free_pnm(&pam_image);
+   free_pnm(&image);
+
+   assert_int_equal(load_pnm(&image, valid_pam), PNM_SUCCESS);
+   assert_int_equal(black_and_white(image, "50"), FILTER_SUCCESS);
+   assert_int_equal(get_format(image), FORMAT_PAM);
+   assert_int_equal(get_max_value(image), 1);
+   assert_string_equal(get_tuple_type(image), "BLACKANDWHITE_ALPHA");
+   const uint8_t samples[] = {1, 1, 0, 0};
+   for (size_t i = 0; i < 4; ++i) {
+      assert_int_equal(sample8_at(image, i), samples[i]);
+   }
+   assert_int_equal(black_and_white(image, "50"), FILTER_WRONG_IMAGE_FORMAT);
+   free_pnm(&image);
+}
+
+/**
+ * @brief Checks that two images encode to the same bytes.
+ */
+static void assert_same_image(PNM *expected, PNM *actual) {
+   void *expected_bytes = NULL, *actual_bytes = NULL;
+   size_t expected_size = 0, actual_size = 0;
+   assert_int_equal(
+      write_pnm_to_memory(expected, &expected_bytes, &expected_size),
+      PNM_SUCCESS
+   );
+   assert_int_equal(
+      write_pnm_to_memory(actual, &actual_bytes, &actual_size),
+      PNM_SUCCESS
+   );
+   assert_ulong_equal(expected_size, actual_size);
+   if (expected_size == actual_size) {
+      assert_int_equal(memcmp(expected_bytes, actual_bytes, actual_size), 0);
+   }
+   free(expected_bytes);
+   free(actual_bytes);
+}
+
+static void test_filter_chain() {
+   FilterChain *chain = NULL;
+   assert_true(filter_chain_parse(NULL, "negatif", NULL) < 0);
+   assert_true(filter_chain_parse(&chain, NULL, NULL) < 0);
+   assert_int_equal(filter_chain_parse(&chain, "foo", NULL), FILTER_UNKNOWN);
+   assert_int_equal(filter_chain_parse(&chain, "gris,,NB", "1"),
+      FILTER_UNKNOWN);
+   assert_int_equal(filter_chain_parse(&chain, "gris", NULL),
+      FILTER_INVALID_PARAMETER);
+   assert_int_equal(filter_chain_parse(&chain, "gris:3", "1"),
+      FILTER_INVALID_PARAMETER);
+   assert_int_equal(filter_chain_parse(&chain, "NB:1:2", NULL),
+      FILTER_INVALID_PARAMETER);
+   assert_true(chain == NULL);
+
+   // The whole chain is checked before the image is touched.
+   PNM *image = NULL;
+   assert_int_equal(load_pnm(&image, valid_ppm), PNM_SUCCESS);
+   assert_int_equal(filter_chain_parse(&chain, "negatif,gris:1,negatif", NULL),
+      FILTER_SUCCESS);
+   assert_int_equal(filter_chain_is_per_pixel(chain), 1);
+   assert_int_equal(filter_chain_apply(chain, image),
+      FILTER_WRONG_IMAGE_FORMAT);
+   assert_int_equal(get_format(image), FORMAT_PPM);
+   filter_chain_free(&chain);
+   assert_true(chain == NULL);
+   free_pnm(&image);
+
+   // Chains give the images of their filters applied one at a time, in
+   // both layouts.
+   const char *chains[] = {
+      "monochrome:v,negatif,gris:1,NB:100",
+      "negatif,NB:60",
+      "retournement,GRIS,NB:128",
+      "negatif,monochrome:b,retournement,negatif",
+      "rotation90,negatif,miroir_h,gris:1,transposition,NB:100,rotation270,"
+         "miroir_v"
+   };
+   const char *filenames[] = {valid_ppm, valid_pam};
+   for (size_t f = 0; f < 2; ++f) {
+      for (size_t c = 0; c < sizeof(chains) / sizeof(chains[0]); ++c) {
+         for (int layout = LAYOUT_INTERLEAVED; layout <= LAYOUT_PLANAR;
+            ++layout) {
+            PNM *fused = NULL;
+            PNM *steps = NULL;
+            assert_int_equal(load_pnm(&fused, filenames[f]), PNM_SUCCESS);
+            assert_int_equal(load_pnm(&steps, filenames[f]), PNM_SUCCESS);
+            assert_int_equal(set_layout(fused, layout), PNM_SUCCESS);
+
+            assert_int_equal(filter_chain_parse(&chain, chains[c], "2"),
+               FILTER_SUCCESS);
+            assert_int_equal(filter_chain_apply(chain, fused),
+               FILTER_SUCCESS);
+            filter_chain_free(&chain);
+
+            const char *token = chains[c];
+            while (token != NULL) {
+               char name[64];
+               size_t length = strcspn(token, ",");
+               memcpy(name, token, length);
+               name[length] = '\0';
+               assert_int_equal(filter_chain_parse(&chain, name, "2"),
+                  FILTER_SUCCESS);
+               assert_int_equal(filter_chain_apply(chain, steps),
+                  FILTER_SUCCESS);
+               filter_chain_free(&chain);
+               token = token[length] != '\0' ? token + length + 1 : NULL;
+            }
+
+            assert_same_image(steps, fused);
+            free_pnm(&fused);
+            free_pnm(&steps);
+         }
+      }
+   }
+
+   // Explanations name one pass per run of per-pixel filters.
+   assert_int_equal(filter_chain_parse(&chain, chains[3], NULL),
+      FILTER_SUCCESS);
+   assert_int_equal(filter_chain_is_per_pixel(chain), 0);
+   char *text = NULL;
+   size_t text_size = 0;
+   FILE *stream = open_memstream(&text, &text_size);
+   assert_true(stream != NULL);
+   filter_chain_explain(chain, stream);
+   fclose(stream);
+   assert_string_starts_with("pass 1: negatif + monochrome b,", text);
+   assert_string_contains("pass 2: retournement", text);
+   assert_string_contains("pass 3: negatif,", text);
+   free(text);
+   filter_chain_free(&chain);
+
+   assert_int_equal(filter_chain_parse(&chain, chains[4], NULL),
+      FILTER_SUCCESS);
+   stream = open_memstream(&text, &text_size);
+   assert_true(stream != NULL);
+   filter_chain_explain(chain, stream);
+   fclose(stream);
+   assert_string_starts_with(
+      "pass 1: rotation90, by tiles into a new image\n", text);
+   assert_string_contains("pass 3: miroir_h, in place\n", text);
+   assert_string_contains(
+      "pass 4: gris 1, one loop over the rows in place\n", text);
+   free(text);
+   filter_chain_free(&chain);
+}
+
+/**
+ * @brief Finds the pixel of an image that a geometric filter moves to
+ *        (x, y), filters being numbered as in test_geometry.
+ */
+static void geometry_source(
+   int filter,
+   unsigned int width,
+   unsigned int height,
+   unsigned int *x,
+   unsigned int *y
+) {
+   unsigned int new_x = *x, new_y = *y;
+   switch (filter) {
+      case 0:
+         *x = new_y;
+         *y = new_x;
+         break;
+      case 1:
+         *x = new_y;
+         *y = height - 1 - new_x;
+         break;
+      case 2:
+         *x = width - 1 - new_y;
+         *y = new_x;
+         break;
+      case 3:
+         *x = width - 1 - new_x;
+         break;
+      default:
+         *y = height - 1 - new_y;
+         break;
+   }
+}
+
+static void test_geometry() {
+   int (*const filters[])(PNM *) = {
+      transpose,
+      rotate90,
+      rotate270,
+      flip_h,
+      flip_v
+   };
+   const struct {
+      FormatPNM format;
+      unsigned int depth;
+      uint16_t max_value;
+      const char *tuple_type;
+      StoragePNM storage;
+   } formats[] = {
+      {FORMAT_PBM, 1, PBM_MAX_VALUE, NULL, STORAGE_BIT},
+      {FORMAT_PGM, 1, PGM_MAX_VALUE, NULL, STORAGE_8},
+      {FORMAT_PGM, 1, 1000, NULL, STORAGE_16},
+      {FORMAT_PPM, 3, PPM_MAX_VALUE, NULL, STORAGE_8},
+      {FORMAT_PAM, 2, 255, "GRAYSCALE_ALPHA", STORAGE_8},
+      {FORMAT_PAM, 4, 255, "RGB_ALPHA", STORAGE_8},
+      {FORMAT_PAM, 4, 65535, "RGB_ALPHA", STORAGE_16}
+   };
+   for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); ++f) {
+      assert_true(filters[f](NULL) < 0);
+   }
+
+   // Sizes that end with partial tiles and partial register blocks.
+   const unsigned int width = 75, height = 130;
+   for (size_t k = 0; k < sizeof(formats) / sizeof(formats[0]); ++k) {
+      for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); ++f) {
+         PNM *images[2] = {NULL, NULL};
+         for (int i = 0; i < 2; ++i) {
+            int code = formats[k].format == FORMAT_PAM
+               ? create_pam(&images[i], width, height, formats[k].depth,
+                  formats[k].max_value, formats[k].tuple_type)
+               : create_pnm(&images[i], formats[k].format, width, height,
+                  formats[k].max_value);
+            assert_int_equal(code, PNM_SUCCESS);
+            size_t count = get_sample_count(images[i]);
+            for (size_t s = 0; s < count; ++s) {
+               set_sample(images[i], s,
+                  (s * 2654435761u >> 7) % (formats[k].max_value + 1u));
+            }
+            assert_int_equal(set_storage(images[i], formats[k].storage), 0);
+         }
+         PNM *original = images[0], *image = images[1];
+
+         assert_int_equal(filters[f](image), FILTER_SUCCESS);
+         int swapped = f < 3;
+         assert_int_equal(get_width(image), swapped ? height : width);
+         assert_int_equal(get_height(image), swapped ? width : height);
+         assert_int_equal(get_format(image), formats[k].format);
+         assert_int_equal(get_storage(image), formats[k].storage);
+         assert_string_equal(get_tuple_type(image),
+            get_tuple_type(original));
+
+         unsigned int depth = formats[k].depth;
+         int same = 1;
+         for (unsigned int y = 0; y < get_height(image); ++y) {
+            for (unsigned int x = 0; x < get_width(image); ++x) {
+               unsigned int source_x = x, source_y = y;
+               geometry_source(f, width, height, &source_x, &source_y);
+               size_t i = ((size_t)y * get_width(image) + x) * depth;
+               size_t j = ((size_t)source_y * width + source_x) * depth;
+               for (unsigned int a = 0; a < depth; ++a) {
+                  same &= sample_at(image, i + a) == sample_at(original,
+                     j + a);
+               }
+            }
+         }
+         assert_true(same);
+         free_pnm(&original);
+         free_pnm(&image);
+      }
+   }
+}
+
+/**
+ * @brief Rounds a quotient half up, in the way of the definitions of
+ *        grey_sample and scale_sample.
+ */
+static unsigned int round_quotient(uint64_t numerator, uint64_t divisor) {
+   uint64_t remainder = numerator % divisor;
+   return numerator / divisor + (2 * remainder >= divisor);
+}
+
+static void test_parallel_filters() {
+   const char *chains[] = {
+      "retournement",
+      "negatif",
+      "monochrome:v",
+      "gris:1",
+      "gris:2",
+      "NB:100",
+      "negatif,NB:128,retournement",
+      "transposition",
+      "rotation90",
+      "NB:100,rotation270",
+      "miroir_h",
+      "NB:100,miroir_v"
+   };
+
+   // Large enough for every pass, even over PBM bits, to be split between
+   // threads; the odd height leaves a middle row to turn around.
+   for (size_t c = 0; c < sizeof(chains) / sizeof(chains[0]); ++c) {
+      PNM *serial = create_pattern_ppm(4099, 1001);
+      PNM *parallel = create_pattern_ppm(4099, 1001);
+      assert_true(serial != NULL && parallel != NULL);
+
+      FilterChain *chain = NULL;
+      assert_int_equal(filter_chain_parse(&chain, chains[c], NULL),
+         FILTER_SUCCESS);
+      pnm_set_threads(1);
+      assert_int_equal(filter_chain_apply(chain, serial), FILTER_SUCCESS);
+      pnm_set_threads(4);
+      assert_int_equal(filter_chain_apply(chain, parallel), FILTER_SUCCESS);
+      pnm_set_threads(0);
+      assert_same_image(serial, parallel);
+
+      filter_chain_free(&chain);
+      free_pnm(&serial);
+      free_pnm(&parallel);
+   }
+}
+
+static void test_in_place_filters() {
+   const char *chains[] = {"gris:1", "gris:2", "NB:100", "negatif,gris:2,NB:60"};
+
+   // Filtering an image allocates its scratch rows alone, and the new pixel
+   // data takes the place of the old one.
+   PNM *image = NULL;
+   size_t counts[2] = {0, 0};
+   PNMAllocator counting = {counting_allocate, counting_release, counts};
+   assert_int_equal(load_pnm(&image, valid_raw_ppm), PNM_SUCCESS);
+   void *data = get_row(image, 0);
+   pnm_set_allocator(&counting);
+   assert_int_equal(fifty_shades_of_grey(image, "2"), FILTER_SUCCESS);
+   assert_int_equal(black_and_white(image, "128"), FILTER_SUCCESS);
+   pnm_set_allocator(NULL);
+   assert_int_equal(counts[0], 2);
+   assert_int_equal(counts[1], 2);
+   assert_true(data != NULL && (void *)get_bits(image) == data);
+   free_pnm(&image);
+
+   // Pixel data shared with a view is left to the view, the image gets new
+   // pixel data with the same samples as in place. The rows of planar pixel
+   // data are written over as well, and so are those of concurrent bands.
+   for (size_t c = 0; c < sizeof(chains) / sizeof(chains[0]); ++c) {
+      for (int variant = 0; variant < 4; ++variant) {
+         PNM *in_place = create_pattern_ppm(4099, 1001);
+         PNM *shared = create_pattern_ppm(4099, 1001);
+         PNM *view = NULL;
+         assert_true(in_place != NULL && shared != NULL);
+         assert_int_equal(pnm_view(&view, shared, 0, 0, 4099, 1001),
+            PNM_SUCCESS);
+         if (variant % 2 == 1) {
+            assert_int_equal(set_layout(in_place, LAYOUT_PLANAR), PNM_SUCCESS);
+         }
+         pnm_set_threads(variant < 2 ? 1 : 4);
+
+         FilterChain *chain = NULL;
+         assert_int_equal(filter_chain_parse(&chain, chains[c], NULL),
+            FILTER_SUCCESS);
+         assert_int_equal(filter_chain_apply(chain, in_place),
+            FILTER_SUCCESS);
+         assert_int_equal(filter_chain_apply(chain, shared), FILTER_SUCCESS);
+         assert_same_image(shared, in_place);
+         assert_int_equal(get_format(view), FORMAT_PPM);
+         filter_chain_free(&chain);
+
+         free_pnm(&view);
+         free_pnm(&shared);
+         free_pnm(&in_place);
+      }
+   }
+   pnm_set_threads(0);
+}
+
+static void test_grey_sample() {
+   const uint16_t max_values[] = {1, 7, 100, 254, 255, 256, 1023, 65535};
+   uint32_t seed = 54321;
+   for (size_t m = 0; m < sizeof(max_values) / sizeof(max_values[0]); ++m) {
+      uint16_t max = max_values[m];
+      for (uint32_t value = 0; value <= max; ++value) {
+         assert_int_equal(
+            scale_sample(value, max),
+            round_quotient(value * 255, max)
+         );
+      }
+      for (int i = 0; i < 100000; ++i) {
+         int rgb[3];
+         for (int c = 0; c < 3; ++c) {
+            seed = seed * 1103515245 + 12345;
+            rgb[c] = (seed >> 8) % (max + 1);
+         }
+         unsigned int mean = round_quotient(rgb[0] + rgb[1] + rgb[2], 3);
+         unsigned int luma = round_quotient(
+            299 * rgb[0] + 587 * rgb[1] + 114 * rgb[2],
+            1000
+         );
+         assert_int_equal(
+            grey_sample(rgb[0], rgb[1], rgb[2], 1, max),
+            round_quotient(mean * 255, max)
+         );
+         assert_int_equal(
+            grey_sample(rgb[0], rgb[1], rgb[2], 2, max),
+            round_quotient(luma * 255, max)
+         );
+      }
+   }
+   // Halves are rounded up, where a double-precision luma may not be.
+   assert_int_equal(grey_sample(0, 36, 12, 2, 255), 23);
+   assert_int_equal(grey_sample(1, 1, 0, 1, 255), 1);
+   assert_int_equal(grey_sample(255, 255, 255, 2, 255), 255);
+   assert_int_equal(grey_sample(65535, 65535, 65535, 2, 65535), 255);
+   assert_int_equal(grey_sample(257, 257, 257, 1, 65535), 1);
+}
+
+/**
+ * @brief Transposes a block of samples of 1, 2 or 4 bytes, or pixels of 3
+ *        bytes, with the kernels.
+ */
+static void transpose_block(
+   unsigned int bytes,
+   const void *source,
+   ptrdiff_t source_stride,
+   void *target,
+   ptrdiff_t target_stride,
+   size_t rows,
+   size_t columns
+) {
+   if (bytes == 1) {
+      kernel_transpose8(source, source_stride, target, target_stride, rows,
+         columns);
+   } else if (bytes == 2) {
+      kernel_transpose16(source, source_stride, target, target_stride, rows,
+         columns);
+   } else if (bytes == 3) {
+      kernel_transpose24(source, source_stride, target, target_stride, rows,
+         columns);
+   } else {
+      kernel_transpose32(source, source_stride, target, target_stride, rows,
+         columns);
+   }
+}
+
+static void test_kernels() {
+   // Odd length so that every level also runs its scalar tail.
+   enum {COUNT = 1000 + 13};
+   static uint8_t input[3 * COUNT];
+   static uint8_t expected[3 * COUNT];
+   static uint8_t result[3 * COUNT];
+   uint32_t seed = 12345;
+   for (size_t i = 0; i < sizeof(input); ++i) {
+      seed = seed * 1103515245 + 12345;
+      input[i] = seed >> 24;
+   }
+   KernelLevel best = kernel_best_level();
+   assert_int_equal(kernel_get_level(), best);
+   assert_true(kernel_set_level(KERNEL_AVX512 + 1) < 0);
+
+   for (int level = KERNEL_SSE2; level <= (int)best; ++level) {
+      for (unsigned int max = 1; max <= UINT8_MAX; ++max) {
+         uint8_t clipped[3 * COUNT];
+         for (size_t i = 0; i < sizeof(clipped); ++i) {
+            clipped[i] = input[i] % (max + 1);
+         }
+         const uint8_t *r = clipped;
+         const uint8_t *g = clipped + COUNT;
+         const uint8_t *b = clipped + 2 * COUNT;
+
+         memcpy(expected, clipped, COUNT);
+         memcpy(result, clipped, COUNT);
+         assert_int_equal(kernel_set_level(KERNEL_SCALAR), 0);
+         kernel_negate8(expected, COUNT, max);
+         assert_int_equal(kernel_set_level(level), 0);
+         kernel_negate8(result, COUNT, max);
+         assert_int_equal(memcmp(expected, result, COUNT), 0);
+
+         for (int mode = 1; mode <= 2; ++mode) {
+            assert_int_equal(kernel_set_level(KERNEL_SCALAR), 0);
+            kernel_grey8(r, g, b, expected, COUNT, mode, max);
+            assert_int_equal(kernel_set_level(level), 0);
+            kernel_grey8(r, g, b, result, COUNT, mode, max);
+            assert_int_equal(memcmp(expected, result, COUNT), 0);
+         }
+
+         assert_int_equal(kernel_set_level(KERNEL_SCALAR), 0);
+         kernel_threshold8(input, expected, COUNT, max);
+         assert_int_equal(kernel_set_level(level), 0);
+         kernel_threshold8(input, result, COUNT, max);
+         assert_int_equal(memcmp(expected, result, (COUNT + 7) / 8), 0);
+      }
+
+      for (unsigned int channel = 0; channel < 3; ++channel) {
+         memcpy(expected, input, sizeof(input));
+         memcpy(result, input, sizeof(input));
+         assert_int_equal(kernel_set_level(KERNEL_SCALAR), 0);
+         kernel_keep_channel8(expected, COUNT, channel);
+         assert_int_equal(kernel_set_level(level), 0);
+         kernel_keep_channel8(result, COUNT, channel);
+         assert_int_equal(memcmp(expected, result, sizeof(input)), 0);
+      }
+
+      // Blocks larger than a register block but not a multiple of it, the
+      // source walked from its last row.
+      enum {ROWS = 29, COLUMNS = 21};
+      static uint32_t block[ROWS * COLUMNS];
+      static uint32_t expected_block[ROWS * COLUMNS];
+      static uint32_t result_block[ROWS * COLUMNS];
+      memcpy(block, input, sizeof(block));
+      for (unsigned int bytes = 1; bytes <= 4; ++bytes) {
+         ptrdiff_t in_stride = COLUMNS * bytes;
+         ptrdiff_t out_stride = ROWS * bytes;
+         const uint8_t *last = (uint8_t *)block + (ROWS - 1) * in_stride;
+         assert_int_equal(kernel_set_level(KERNEL_SCALAR), 0);
+         transpose_block(bytes, last, -in_stride, expected_block, out_stride,
+            ROWS, COLUMNS);
+         assert_int_equal(kernel_set_level(level), 0);
+         transpose_block(bytes, last, -in_stride, result_block, out_stride,
+            ROWS, COLUMNS);
+         assert_int_equal(
+            memcmp(expected_block, result_block, ROWS * COLUMNS * bytes),
+            0
+         );
+         for (size_t i = 0; i < ROWS * COLUMNS; ++i) {
+            size_t r = i % ROWS, c = i / ROWS;
+            const uint8_t *pixel = last - r * in_stride + c * bytes;
+            assert_int_equal(
+               memcmp((uint8_t *)expected_block + i * bytes, pixel, bytes),
+               0
+            );
+         }
+      }
+   }
+
+   assert_int_equal(kernel_set_level(best), 0);
 }
 
 static void test_fixture() {
    test_fixture_start();
    run_test(test_load_pnm);
    run_test(test_write_pnm);
+   run_test(test_write_ascii);
+   run_test(test_raw_pnm);
+   run_test(test_pgm16);
+   run_test(test_scanner);
+   run_test(test_load_pnm_mmap);
+   run_test(test_load_pnm_lazy);
+   run_test(test_stream_pnm);
+   run_test(test_create_pnm);
+   run_test(test_storage);
+   run_test(test_row_layout);
+   run_test(test_view);
+   run_test(test_layout);
+   run_test(test_parallel_decode);
+   run_test(test_parallel_encode);
+   run_test(test_parallel_for);
+   run_test(test_probe);
+   run_test(test_load_pnm_region);
+   run_test(test_large_image);
+   run_test(test_memory_and_fd_pnm);
+   run_test(test_frames);
+   run_test(test_pam);
+   run_test(test_allocator);
    run_test(test_turnaround);
    run_test(test_monochrome);
    run_test(test_negative);
    run_test(test_fifty_shades_of_grey);
    run_test(test_black_and_white);
+   run_test(test_filter_chain);
+   run_test(test_geometry);
+   run_test(test_parallel_filters);
+   run_test(test_in_place_filters);
+   run_test(test_grey_sample);
+   run_test(test_kernels);
    test_fixture_end();
 }
 